@@ -41,11 +41,22 @@ def processCloud(input, debug, process):
     for file in input["file"]:
         files.append(f'../{file}')
 
+    # outlier removal runs inside the importer, the remaining filters need the resolution
+    filter = dict(process["filter"]) if "filter" in process else {}
+    outlier = filter.pop("outlier", None)
+    compress = process["compress"] if "compress" in process else None
+
     response = runTask("cloud/importer", 
     {
         "file": files,
         "coords": input["coords"] if "coords" in input else "right-z",
-        "transform": input["transform"] if "transform" in input else None
+        "transform": input["transform"] if "transform" in input else None,
+        "outlier": outlier,
+        "dedup": process["dedup"] if "dedup" in process else None,
+        "sort": process["sort"] if "sort" in process else None,
+        "resolution": process["resolution"] if 'resolution' in process and process['resolution'] != 'auto' else None,
+        "compress": compress,
+        "debug": debug
     })
     
     dataset = response["file"]
@@ -56,23 +67,47 @@ def processCloud(input, debug, process):
     else:
         resolution = process["resolution"]
     
-    if "filter" in process:
+    if filter:
         runTask("cloud/filter",
             { 
-                "filter": process["filter"],
+                "filter": filter,
                 "resolution": resolution,
+                "compress": compress,
                 "file": f'./{dataset}'
             })
 
-    runTask("cloud/packetizer", {  "file": f'./{dataset}' })
+    runTask("cloud/packetizer", 
+    {
+        "file": f'./{dataset}',
+        "scanners": response["scanners"] if "scanners" in response else None,
+        "orient": process["orient"] if "orient" in process else None,
+        "compress": compress
+    })
     
-    os.remove(f'./{dataset}.ply')
+    os.remove(f'./{dataset}.vxc')
 
     if not "ply" in debug:
-        for file in glob.glob('./*.ply'):
+        for file in glob.glob('./*.vxc') + glob.glob('./*.ply'):
             os.remove(file)
 
 
+def processMap(input, output):
+
+    update = output["update"] if "update" in output else None
+
+    response = runTask("map/tiler", { 
+                "color": f'../{input["color"]}' if "color" in input else None,
+                "elevation": f'../{input["elevation"]}' if "elevation" in input else None,
+                "overview": input["overview"] if "overview" in input else None,
+                "archive": output["archive"] if "archive" in output else None,
+                "precision": output["precision"] if "precision" in output else None,
+                "hashes": output["hashes"] if "hashes" in output else None,
+                "update": update
+                }, bool(update))
+
+    return response
+
+
 #load config file
 os.chdir(sys.argv[1])
 with open("process.yaml", "r") as file:
@@ -96,15 +131,18 @@ with open("process.yaml", "r") as file:
 
         elif config['type'] == 'map':
 
-            runTask("map/tiler", { 
-                        "color": f'../{input["color"]}',
-                        "elevation": f'../{input["elevation"]}',
-                        }, False)
+            result = processMap(input, output)
+
+            # the tiles an update changed or removed, for uploads of just those
+            if result:
+                with open("update.json", "w") as changes:
+                    json.dump(result, changes)
 
         elif config['type'] == 'panorama': 
     
             runTask("panorama/cuber", { 
                         "file": f'../{input["file"]}',
+                        "archive": output["archive"] if "archive" in output else None
                         })
 
         elif config['type'] == 'model':
@@ -6,6 +6,7 @@
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/thread.hpp>
 
 #include "json_spirit/json_spirit_reader_template.h"
 #include "json_spirit/json_spirit_writer_template.h"
@@ -28,6 +29,9 @@
 
 #include "jpeglib.h"
 
+#include "tileSink.h"
+#include "tileArchive.h"
+
 #include "cuber.h"
 
 struct jpeg_error
@@ -63,37 +67,37 @@ class Level
 
 		static const uint16_t TILE_SIZE = 256;
 
-		Level(uint8_t iZ)
-		: mParent(0)
+		Level(TileSink& iSink, uint8_t iZ, uint32_t iThreads)
+		: mSink(iSink)
+		, mParent(0)
 		, mZ(iZ)
 		, mEdge((uint32_t)(pow(2, iZ)*TILE_SIZE))
+		, mDirectory(std::to_string((boost::int64_t)iZ) + "/")
+		, mThreads(std::max<uint32_t>(1, iThreads))
 		{
 			if (iZ)
 			{
-				mParent = new Level(iZ - 1);
+				mParent = new Level(iSink, iZ - 1, iThreads);
 			}
 		}
 
 		void process(uint32_t iImageHeight, unsigned char* iBuffer)
 		{
-			std::string lDir(std::to_string((boost::int64_t)mZ));
-
-			boost::filesystem::create_directory(boost::filesystem::path(lDir.c_str()));
-			chdir(lDir.c_str());
+			mSink.createDirectory(mDirectory);
 
-			uint16_t lEdge = (uint16_t)pow(2, mZ);
-			for (int f = 0; f < 6; f++)
+			if (mThreads > 1)
 			{
-				for (int ty = 0; ty < lEdge; ty++)
+				boost::thread_group lGroup;
+				for (uint32_t t = 0; t < mThreads; t++)
 				{
-					for (int tx = 0; tx < lEdge; tx++)
-					{
-						createTile(tx, ty, iImageHeight, iBuffer, FACES[f]);
-					}
+					lGroup.add_thread(new boost::thread(&Level::processTiles, this, t, iImageHeight, iBuffer));
 				}
-			};
-
-			chdir("..");
+				lGroup.join_all();
+			}
+			else
+			{
+				processTiles(0, iImageHeight, iBuffer);
+			}
 
 			if (mParent)
 			{
@@ -143,6 +147,16 @@ class Level
 
 	private:
 
+		// tiles only read the source image, thread iThread takes every mThreads-th tile of the level
+		void processTiles(uint32_t iThread, uint32_t iImageHeight, unsigned char* iBuffer)
+		{
+			uint16_t lEdge = (uint16_t)pow(2, mZ);
+			for (uint32_t i = iThread; i < 6u * lEdge * lEdge; i += mThreads)
+			{
+				createTile(i % lEdge, (i / lEdge) % lEdge, iImageHeight, iBuffer, FACES[i / (lEdge * lEdge)]);
+			}
+		}
+
 		void createTile(uint32_t iTx, uint32_t iTy, uint32_t iImageHeight, unsigned char* iBuffer, const char* iFace)
 		{
 			unsigned char lImagePixels[TILE_SIZE * TILE_SIZE * 3];
@@ -232,7 +246,7 @@ class Level
 				lImageRows[i] = iImagePixels + i * TILE_SIZE * 3;
 			}
 
-			FILE* lFile = fopen(lName.c_str(), "wb");
+			std::vector<unsigned char> lBuffer;
 
 			png_structp lPointer = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 			png_infop lInfo = png_create_info_struct(lPointer);
@@ -241,13 +255,23 @@ class Level
 				BOOST_LOG_TRIVIAL(info) << "png_jmpbuf (lPointer) failed ";
 				exit(-1);
 			}
-			png_init_io(lPointer, lFile);
+			png_set_write_fn(lPointer, &lBuffer, pngAppend, pngFlush);
 			png_set_IHDR(lPointer, lInfo, TILE_SIZE, TILE_SIZE, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 			png_set_rows(lPointer, lInfo, lImageRows);
 			png_write_png(lPointer, lInfo, PNG_TRANSFORM_IDENTITY, NULL);
 			png_destroy_write_struct(&lPointer, &lInfo);
-			fclose(lFile);
 
+			mSink.write(mDirectory + lName, lBuffer.data(), lBuffer.size());
+		}
+
+		static void pngAppend(png_structp iPointer, png_bytep iData, png_size_t iSize)
+		{
+			std::vector<unsigned char>* lBuffer = (std::vector<unsigned char>*)png_get_io_ptr(iPointer);
+			lBuffer->insert(lBuffer->end(), iData, iData + iSize);
+		}
+
+		static void pngFlush(png_structp)
+		{
 		}
 
 		void saveJpg(std::string iName, unsigned char* iImagePixels)
@@ -259,8 +283,9 @@ class Level
 			struct jpeg_compress_struct lInfo;
 			jpeg_create_compress(&lInfo);
 
-			FILE* lFile = fopen(lName.c_str(), "wb");
-			jpeg_stdio_dest(&lInfo, lFile);
+			unsigned char* lBuffer = NULL;
+			unsigned long lSize = 0;
+			jpeg_mem_dest(&lInfo, &lBuffer, &lSize);
 			struct jpeg_error lError;
 			lInfo.err = jpeg_std_error(&lError.pub);
 			lInfo.image_width = TILE_SIZE;
@@ -279,13 +304,18 @@ class Level
 			jpeg_write_scanlines(&lInfo, lImageRows, TILE_SIZE);
 
 			jpeg_finish_compress(&lInfo);
-			fclose(lFile);
 			jpeg_destroy_compress(&lInfo);
+
+			mSink.write(mDirectory + lName, lBuffer, lSize);
+			free(lBuffer);
 		}
 
+		TileSink& mSink;
 		Level* mParent;
 		uint8_t mZ;
 		uint32_t mEdge;
+		std::string mDirectory;
+		uint32_t mThreads;
 };
 
 const char* Level::FRONT = "f";
@@ -304,7 +334,9 @@ float Level::sKernel[5][5] = { { 1 / 273.0,4 / 273.0,7 / 273.0,4 / 273.0,1 / 273
 						 	 { 1 / 273.0,4 / 273.0,7 / 273.0,4 / 273.0,1 / 273.0 } };
 
 
-Cuber::Cuber()
+Cuber::Cuber(uint32_t iThreads, bool iArchive)
+: mThreads(iThreads)
+, mArchive(iArchive)
 {
 };
 
@@ -419,19 +451,28 @@ void Cuber::process(std::string iFile)
 		*/
 	}
 
-	boost::filesystem::create_directory(boost::filesystem::path("root"));
-	chdir("root");
+	TileSink* lSink;
+	if (mArchive)
+	{
+		mRoot["archive"] = "cube.tiles";
+		lSink = new TileArchive("root/cube.tiles");
+	}
+	else
+	{
+		lSink = new TileSink("root");
+	}
 
 	uint32_t lw = log(lWidth/4 - 1) / log(2.) + 1.;
 	uint32_t lt = log(Level::TILE_SIZE) / log(2.);
 	uint16_t lMaxZ = std::max<long>(0, lw-lt);
-	Level lLevel(lMaxZ);
+	Level lLevel(*lSink, lMaxZ, mThreads);
 
 	lLevel.process(lHeight, lImage);
 
+	lSink->close();
+	delete lSink;
+
 	mRoot["maxZoom"] = lMaxZ;
 	mRoot["tileSize"] = Level::TILE_SIZE;
 	mRoot["format"] = "png";
-
-	chdir("..");
 };
@@ -5,7 +5,8 @@ class Cuber
 {
 public:
 
-	Cuber();
+	// tiles of a level are encoded by iThreads threads, with iArchive they go into one tile archive
+	Cuber(uint32_t iThreads, bool iArchive);
 
 	void process(std::string iFile);
 
@@ -13,5 +14,7 @@ public:
 
 protected:
 
+	uint32_t mThreads;
+	bool mArchive;
 };
 
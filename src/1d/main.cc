@@ -8,6 +8,7 @@
 #include <fstream>
 #include <map>
 #include <string>
+#include <thread>
 
 #include <boost/log/core.hpp>
 #include <boost/log/trivial.hpp>
@@ -17,7 +18,15 @@
 
 bool processFile(json_spirit::mObject& iObject)
 {
-	Cuber lCuber;
+	uint32_t lThreads = std::thread::hardware_concurrency();
+	if (iObject.find("threads") != iObject.end() && !iObject["threads"].is_null())
+	{
+		lThreads = iObject["threads"].get_int();
+	}
+
+	bool lArchive = iObject.find("archive") != iObject.end() && !iObject["archive"].is_null() && iObject["archive"].get_bool();
+
+	Cuber lCuber(lThreads, lArchive);
 	lCuber.process(iObject["file"].get_str());
 
 	// write root
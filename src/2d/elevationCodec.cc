@@ -0,0 +1,356 @@
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <vector>
+
+#include "elevationCodec.h"
+
+const uint32_t ElevationCodec::GROUP_SIZE;
+
+static const char MAGIC[4] = { 'V', 'X', 'E', 'L' };
+
+// residuals are kept below 2^30 so their zigzag codes fit 32 bits, wider tiles are stored raw
+static const double MAX_LEVELS = 1 << 30;
+
+// fields are little endian, a step of 0 means the heights follow as raw floats
+struct ElevationHeader
+{
+	char mMagic[4];
+	uint16_t mWidth;
+	uint16_t mHeight;
+	float mMin;
+	float mStep;
+	uint32_t mMask;
+	uint32_t mReserved;
+};
+
+// the decoded height of a level, the encoder checks its levels with the same arithmetic
+static inline float height(float iMin, float iStep, int32_t iLevel)
+{
+	return (float)(iMin + (double)iLevel * iStep);
+}
+
+//
+// Bit packing
+//
+
+static inline uint32_t width(uint32_t iValue)
+{
+	uint32_t lWidth = 0;
+	while (lWidth < 32 && (iValue >> lWidth))
+	{
+		lWidth++;
+	}
+	return lWidth;
+}
+
+static inline uint8_t* pack(const uint32_t* iValues, uint32_t iCount, uint8_t* iCode)
+{
+	uint32_t lOr = 0;
+	for (uint32_t i = 0; i < iCount; i++)
+	{
+		lOr |= iValues[i];
+	}
+	uint32_t lWidth = width(lOr);
+	*iCode++ = (uint8_t)lWidth;
+
+	uint64_t lBuffer = 0;
+	uint32_t lBits = 0;
+	for (uint32_t i = 0; i < iCount; i++)
+	{
+		lBuffer |= (uint64_t)iValues[i] << lBits;
+		lBits += lWidth;
+		while (lBits >= 8)
+		{
+			*iCode++ = (uint8_t)lBuffer;
+			lBuffer >>= 8;
+			lBits -= 8;
+		}
+	}
+	if (lBits)
+	{
+		*iCode++ = (uint8_t)lBuffer;
+	}
+	return iCode;
+}
+
+// 0 if the group is wider than 32 bits or does not end before iEnd
+static inline const uint8_t* unpack(const uint8_t* iCode, const uint8_t* iEnd, uint32_t iCount, uint32_t* iValues)
+{
+	if (iCode >= iEnd)
+	{
+		return 0;
+	}
+	uint32_t lWidth = *iCode++;
+	if (lWidth > 32 || ((uint64_t)iCount * lWidth + 7) / 8 > (uint64_t)(iEnd - iCode))
+	{
+		return 0;
+	}
+	if (!lWidth)
+	{
+		memset(iValues, 0, iCount * sizeof(uint32_t));
+		return iCode;
+	}
+
+	uint64_t lMask = (1ull << lWidth) - 1;
+	for (uint32_t i = 0; i < iCount; i++)
+	{
+		uint64_t lBit = (uint64_t)i * lWidth;
+		uint64_t lWord;
+		memcpy(&lWord, iCode + (lBit >> 3), sizeof(lWord));
+		iValues[i] = (uint32_t)((lWord >> (lBit & 7)) & lMask);
+	}
+	return iCode + ((uint64_t)iCount * lWidth + 7) / 8;
+}
+
+static inline uint8_t* putRun(uint32_t iValue, uint8_t* iCode)
+{
+	while (iValue >= 0x80)
+	{
+		*iCode++ = (uint8_t)(iValue | 0x80);
+		iValue >>= 7;
+	}
+	*iCode++ = (uint8_t)iValue;
+	return iCode;
+}
+
+// 0 if the run does not end before iEnd or does not fit 32 bits
+static inline const uint8_t* getRun(const uint8_t* iCode, const uint8_t* iEnd, uint32_t& iValue)
+{
+	iValue = 0;
+	for (uint32_t lShift = 0; ; lShift += 7)
+	{
+		if (iCode >= iEnd || lShift > 28)
+		{
+			return 0;
+		}
+		uint8_t lByte = *iCode++;
+		iValue |= (uint32_t)(lByte & 0x7f) << lShift;
+		if (!(lByte & 0x80))
+		{
+			return iCode;
+		}
+	}
+}
+
+//
+// Tiles
+//
+
+size_t ElevationCodec::maxEncodedSize(uint32_t iWidth, uint32_t iHeight)
+{
+	size_t lCount = (size_t)iWidth * iHeight;
+	size_t lGroups = (lCount + GROUP_SIZE - 1) / GROUP_SIZE;
+	return sizeof(ElevationHeader) + 3 * (lCount + 1) + std::max(lGroups + 4 * lCount, 4 * lCount) + 8;
+}
+
+size_t ElevationCodec::encode(const float* iValues, uint32_t iWidth, uint32_t iHeight, float iPrecision, float iNoValue, uint8_t* iCode)
+{
+	uint32_t lCount = iWidth * iHeight;
+
+	ElevationHeader lHeader;
+	memset(&lHeader, 0, sizeof(lHeader));
+	memcpy(lHeader.mMagic, MAGIC, sizeof(lHeader.mMagic));
+	lHeader.mWidth = (uint16_t)iWidth;
+	lHeader.mHeight = (uint16_t)iHeight;
+
+	float lMin = 0;
+	float lMax = 0;
+	bool lFound = false;
+	for (uint32_t i = 0; i < lCount; i++)
+	{
+		if (iValues[i] != iNoValue)
+		{
+			lMin = lFound ? std::min(lMin, iValues[i]) : iValues[i];
+			lMax = lFound ? std::max(lMax, iValues[i]) : iValues[i];
+			lFound = true;
+		}
+	}
+	lHeader.mMin = lMin;
+
+	// decoded heights are rounded to floats, the step leaves room for that and is rounded down
+	double lUlp = std::max(fabs(lMin), fabs(lMax)) * FLT_EPSILON;
+	double lStep = 2.0 * (iPrecision - lUlp);
+	lHeader.mStep = (float)lStep;
+	if (lHeader.mStep > lStep)
+	{
+		lHeader.mStep = nextafterf(lHeader.mStep, 0.0f);
+	}
+	if (!(lStep > 0) || !(lHeader.mStep > 0) || (lMax - (double)lMin) / lHeader.mStep >= MAX_LEVELS)
+	{
+		lHeader.mStep = 0;
+	}
+	// decoding uses the step as stored
+	lStep = lHeader.mStep;
+
+	// every level is checked as it decodes, a height no level keeps within the precision stores the tile raw
+	std::vector<uint32_t> lResiduals;
+	if (lHeader.mStep != 0)
+	{
+		// nodata repeats the prediction so its residual is 0
+		lResiduals.resize(lCount);
+		int32_t lAbove = 0;
+		for (uint32_t y = 0; y < iHeight && lHeader.mStep != 0; y++)
+		{
+			int32_t lLeft = lAbove;
+			for (uint32_t x = 0; x < iWidth; x++)
+			{
+				float lValue = iValues[y * iWidth + x];
+				int32_t lLevel = lLeft;
+				if (lValue != iNoValue)
+				{
+					// rounding the decoded height to a float may push it out, a neighbouring level may not
+					int32_t lNearest = (int32_t)llround((lValue - (double)lMin) / lStep);
+					int32_t lTries[3] = { lNearest, lNearest - 1, lNearest + 1 };
+					int t = 0;
+					while (t < 3 && fabs((double)height(lMin, lHeader.mStep, lTries[t]) - lValue) > iPrecision)
+					{
+						t++;
+					}
+					if (t == 3)
+					{
+						lHeader.mStep = 0;
+						break;
+					}
+					lLevel = lTries[t];
+				}
+				int32_t lDelta = lLevel - lLeft;
+				lResiduals[y * iWidth + x] = ((uint32_t)lDelta << 1) ^ (uint32_t)(lDelta >> 31);
+				lLeft = lLevel;
+				if (x == 0)
+				{
+					lAbove = lLevel;
+				}
+			}
+		}
+	}
+
+	uint8_t* lCode = iCode + sizeof(lHeader);
+
+	// runs of valid and nodata heights, starting with valid ones
+	uint8_t* lMask = lCode;
+	if (lFound)
+	{
+		bool lValid = true;
+		uint32_t lRun = 0;
+		for (uint32_t i = 0; i < lCount; i++)
+		{
+			if ((iValues[i] != iNoValue) != lValid)
+			{
+				lCode = putRun(lRun, lCode);
+				lValid = !lValid;
+				lRun = 0;
+			}
+			lRun++;
+		}
+		if (lCode != lMask)
+		{
+			lCode = putRun(lRun, lCode);
+		}
+	}
+	else
+	{
+		lCode = putRun(0, lCode);
+		lCode = putRun(lCount, lCode);
+	}
+	lHeader.mMask = (uint32_t)(lCode - lMask);
+
+	if (lHeader.mStep == 0)
+	{
+		memcpy(lCode, iValues, lCount * sizeof(float));
+		lCode += lCount * sizeof(float);
+	}
+	else
+	{
+		for (uint32_t i = 0; i < lCount; i += GROUP_SIZE)
+		{
+			lCode = pack(&lResiduals[i], std::min(GROUP_SIZE, lCount - i), lCode);
+		}
+	}
+
+	memcpy(iCode, &lHeader, sizeof(lHeader));
+	return lCode - iCode;
+}
+
+bool ElevationCodec::decode(const uint8_t* iCode, size_t iSize, uint32_t iWidth, uint32_t iHeight, float iNoValue, float* iValues)
+{
+	ElevationHeader lHeader;
+	if (iSize < sizeof(lHeader))
+	{
+		return false;
+	}
+	memcpy(&lHeader, iCode, sizeof(lHeader));
+	if (memcmp(lHeader.mMagic, MAGIC, sizeof(lHeader.mMagic)) || lHeader.mWidth != iWidth || lHeader.mHeight != iHeight)
+	{
+		return false;
+	}
+
+	uint32_t lCount = iWidth * iHeight;
+	const uint8_t* lCode = iCode + sizeof(lHeader);
+	const uint8_t* lEnd = iCode + iSize;
+	if (lHeader.mMask > iSize - sizeof(lHeader))
+	{
+		return false;
+	}
+	const uint8_t* lMaskEnd = lCode + lHeader.mMask;
+
+	if (lHeader.mStep == 0)
+	{
+		if ((uint64_t)(lEnd - lMaskEnd) < (uint64_t)lCount * sizeof(float))
+		{
+			return false;
+		}
+		memcpy(iValues, lMaskEnd, lCount * sizeof(float));
+	}
+	else
+	{
+		std::vector<uint32_t> lResiduals(lCount);
+		const uint8_t* lGroups = lMaskEnd;
+		for (uint32_t i = 0; i < lCount; i += GROUP_SIZE)
+		{
+			lGroups = unpack(lGroups, lEnd, std::min(GROUP_SIZE, lCount - i), &lResiduals[i]);
+			if (!lGroups)
+			{
+				return false;
+			}
+		}
+
+		int32_t lAbove = 0;
+		for (uint32_t y = 0; y < iHeight; y++)
+		{
+			int32_t lLeft = lAbove;
+			for (uint32_t x = 0; x < iWidth; x++)
+			{
+				uint32_t lResidual = lResiduals[y * iWidth + x];
+				int32_t lLevel = (int32_t)((uint32_t)lLeft + ((lResidual >> 1) ^ (0 - (lResidual & 1))));
+				iValues[y * iWidth + x] = height(lHeader.mMin, lHeader.mStep, lLevel);
+				lLeft = lLevel;
+				if (x == 0)
+				{
+					lAbove = lLevel;
+				}
+			}
+		}
+	}
+
+	// nodata runs overwrite the heights they cover, if there are any they cover the whole tile
+	bool lValid = true;
+	uint64_t lIndex = 0;
+	while (lCode < lMaskEnd)
+	{
+		uint32_t lRun;
+		lCode = getRun(lCode, lMaskEnd, lRun);
+		if (!lCode || lIndex + lRun > lCount)
+		{
+			return false;
+		}
+		if (!lValid)
+		{
+			std::fill(iValues + lIndex, iValues + lIndex + lRun, iNoValue);
+		}
+		lIndex += lRun;
+		lValid = !lValid;
+	}
+	return lHeader.mMask == 0 || lIndex == lCount;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+//
+// Lossy codec for elevation tiles. Heights are quantized to a step of twice the precision above
+// the smallest height of the tile, so no decoded height is further than the precision from the
+// original. Quantized heights are predicted from their left neighbour and the residuals are bit
+// packed in groups. Nodata is stored apart as run lengths of valid and nodata heights.
+//
+//    header | mask runs | groups of residuals
+//
+
+class ElevationCodec
+{
+	public:
+
+		static const uint32_t GROUP_SIZE = 130;
+
+		static size_t maxEncodedSize(uint32_t iWidth, uint32_t iHeight);
+
+		// heights equal to iNoValue are nodata
+		static size_t encode(const float* iValues, uint32_t iWidth, uint32_t iHeight, float iPrecision, float iNoValue, uint8_t* iCode);
+
+		// iCode must be readable 8 bytes past its end, false if it is not an elevation tile of that size or
+		// any of its parts does not fit into iSize
+		static bool decode(const uint8_t* iCode, size_t iSize, uint32_t iWidth, uint32_t iHeight, float iNoValue, float* iValues);
+};
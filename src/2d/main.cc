@@ -12,10 +12,12 @@
 	#define CROSS_DUP2(fd, newfd) dup2(fd, newfd)
 #endif
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <map>
 #include <string>
+#include <thread>
 
 #include <boost/log/core.hpp>
 #include <boost/log/trivial.hpp>
@@ -26,32 +28,112 @@
 
 
 
+// merges the inputs into the tile tree of an earlier run in the working directory
+bool updateFiles(json_spirit::mObject& iObject, uint32_t iThreads)
+{
+	json_spirit::mValue lValue;
+	std::ifstream lIstream("root.json");
+	if (!lIstream || !json_spirit::read_stream(lIstream, lValue) || lValue.type() != json_spirit::obj_type)
+	{
+		BOOST_LOG_TRIVIAL(error) << "No tile tree to update";
+		return false;
+	}
+	lIstream.close();
+	json_spirit::mObject& lRoot = lValue.get_obj();
+
+	TmsUpdater lUpdater(iThreads);
+	const char* lNames[] = { "color", "elevation" };
+	for (int i=0; i<2; i++)
+	{
+		std::string lName = lNames[i];
+		if (iObject.find(lName) == iObject.end() || iObject[lName].is_null())
+		{
+			continue;
+		}
+		if (lRoot.find(lName) == lRoot.end() || !lUpdater.process(iObject[lName].get_str(), lRoot[lName].get_obj()))
+		{
+			BOOST_LOG_TRIVIAL(error) << "Could not update " << lName;
+		}
+	}
+
+	std::ofstream lOstream("root.json");
+	json_spirit::write_stream(lValue, lOstream);
+	lOstream.close();
+
+	json_spirit::mObject lResult;
+	lResult["changed"] = lUpdater.mChanged;
+	lResult["removed"] = lUpdater.mRemoved;
+	json_spirit::write_stream(json_spirit::mValue(lResult), std::cout);
+
+	return true;
+}
+
 bool processFile(json_spirit::mObject& iObject)
 {
 	json_spirit::mObject lRoot;
 
-	// color
-	if (iObject.find("color") != iObject.end())
+	uint32_t lThreads = std::thread::hardware_concurrency();
+	if (iObject.find("threads") != iObject.end() && !iObject["threads"].is_null())
 	{
-		TmsTiler lTiler;
+		lThreads = iObject["threads"].get_int();
+	}
+
+	if (iObject.find("update") != iObject.end() && !iObject["update"].is_null() && iObject["update"].get_bool())
+	{
+		return updateFiles(iObject, lThreads);
+	}
 
+	// tile a reduced resolution image of the inputs
+	uint32_t lOverview = 0;
+	if (iObject.find("overview") != iObject.end() && !iObject["overview"].is_null())
+	{
+		lOverview = iObject["overview"].get_int();
+	}
+
+	bool lArchive = iObject.find("archive") != iObject.end() && !iObject["archive"].is_null() && iObject["archive"].get_bool();
+
+	// content hashes of the tiles for uploads which skip unchanged ones
+	bool lHashes = iObject.find("hashes") != iObject.end() && !iObject["hashes"].is_null() && iObject["hashes"].get_bool();
+
+	// largest error of quantized elevation tiles, floats are written without it
+	float lPrecision = 0;
+	if (iObject.find("precision") != iObject.end() && !iObject["precision"].is_null())
+	{
+		lPrecision = (float)iObject["precision"].get_real();
+	}
+
+	bool lColor = iObject.find("color") != iObject.end() && !iObject["color"].is_null();
+	bool lElevation = iObject.find("elevation") != iObject.end() && !iObject["elevation"].is_null();
+
+	// color and elevation are tiled at the same time and split the threads
+	if (lColor && lElevation)
+	{
+		TmsTiler lColorTiler((lThreads+1)/2, lOverview, lArchive, lPrecision, lHashes);
+		TmsTiler lElevationTiler(std::max<uint32_t>(1, lThreads/2), lOverview, lArchive, lPrecision, lHashes);
+
+		TmsTiler::process(lColorTiler, iObject["color"].get_str(), lElevationTiler, iObject["elevation"].get_str());
+		lRoot["color"] = lColorTiler.mRoot;
+		lRoot["elevation"] = lElevationTiler.mRoot;
+	}
+	else if (lColor)
+	{
+		BOOST_LOG_TRIVIAL(info) << "NO ELEVATION";
+
+		TmsTiler lTiler(lThreads, lOverview, lArchive, lPrecision, lHashes);
 		lTiler.process(iObject["color"].get_str());
 		lRoot["color"] = lTiler.mRoot;
 	}
-	else
+	else if (lElevation)
 	{
 		BOOST_LOG_TRIVIAL(info) << "NO COLOR";
-	}
 
-	// elevation if exists
-	if (iObject.find("elevation") != iObject.end())
-	{
-		TmsTiler lTiler;
+		TmsTiler lTiler(lThreads, lOverview, lArchive, lPrecision, lHashes);
 		lTiler.process(iObject["elevation"].get_str());
 		lRoot["elevation"] = lTiler.mRoot;
 	}
 	else
 	{
+		BOOST_LOG_TRIVIAL(info) << "NO COLOR";
 		BOOST_LOG_TRIVIAL(info) << "NO ELEVATION";
 	}
 
@@ -1,10 +1,12 @@
 #include <iostream>
 #include <fstream>
+#include <exception>
 
 #include <boost/log/core.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/path.hpp>
+#include <boost/thread.hpp>
 
 #include "json_spirit/json_spirit_reader_template.h"
 #include "json_spirit/json_spirit_writer_template.h"
@@ -25,6 +27,7 @@
 //#include "half.h"
 
 #include "tiler.h"
+#include "elevationCodec.h"
 
 PngImage::PngImage(std::string iFile, uint32_t iWidth, uint32_t iHeight)
 : mWidth(iWidth)
@@ -121,10 +124,19 @@ PngWriter::~PngWriter()
 	delete [] mImageRows;
 }
 
-void PngWriter::write(std::string iName)
+static void pngAppend(png_structp iPointer, png_bytep iData, png_size_t iSize)
 {
-	std::string lName = iName + ".png";
-	FILE* lFile = fopen(lName.c_str(), "wb");
+	std::vector<unsigned char>* lBuffer = (std::vector<unsigned char>*)png_get_io_ptr(iPointer);
+	lBuffer->insert(lBuffer->end(), iData, iData + iSize);
+}
+
+static void pngFlush(png_structp)
+{
+}
+
+void PngWriter::write(TileSink& iSink, std::string iName)
+{
+	std::vector<unsigned char> lBuffer;
 
 	png_structp lPointer = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 	png_infop lInfo = png_create_info_struct(lPointer);
@@ -133,46 +145,85 @@ void PngWriter::write(std::string iName)
 		BOOST_LOG_TRIVIAL(info) << "png_jmpbuf (lPointer) failed ";			
 		exit(-1);
 	}
-	png_init_io(lPointer, lFile);
+	png_set_write_fn(lPointer, &lBuffer, pngAppend, pngFlush);
 	png_set_IHDR(lPointer, lInfo, 256, 256, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 	png_set_rows (lPointer, lInfo, mImageRows);
 	png_write_png (lPointer, lInfo, PNG_TRANSFORM_IDENTITY, NULL);
 	png_destroy_write_struct(&lPointer, &lInfo);
 
+	iSink.write(iName + ".png", lBuffer.data(), lBuffer.size());
+}
+
+
+PngReader::PngReader(unsigned char iValues[256*256*3])
+: mImageRows(new png_bytep[256])
+{
+	for (int i=0; i<256; i++)
+	{
+		mImageRows[i] = iValues + i*256*3;
+	}
+}
+
+PngReader::~PngReader()
+{
+	delete [] mImageRows;
+}
+
+bool PngReader::read(std::string iFile)
+{
+	FILE* lFile = fopen(iFile.c_str(), "rb");
+	if (lFile == NULL)
+	{
+		return false;
+	}
+
+	png_structp lPointer = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop lInfo = png_create_info_struct(lPointer);
+	if (setjmp (png_jmpbuf (lPointer))) 
+	{
+		BOOST_LOG_TRIVIAL(error) << "Could not read tile " << iFile;
+		png_destroy_read_struct(&lPointer, &lInfo, NULL);
+		fclose(lFile);
+		return false;
+	}
+	png_init_io(lPointer, lFile);
+	png_read_info(lPointer, lInfo);
+
+	bool lTile = png_get_image_width(lPointer, lInfo) == 256 && png_get_image_height(lPointer, lInfo) == 256 && png_get_color_type(lPointer, lInfo) == PNG_COLOR_TYPE_RGB && png_get_bit_depth(lPointer, lInfo) == 8;
+	if (lTile)
+	{
+		png_read_image(lPointer, mImageRows);
+	}
+	png_destroy_read_struct(&lPointer, &lInfo, NULL);
 	fclose(lFile);
+
+	return lTile;
 }
 
 
 #define UTM_HEIGHT 10000000
 
 
-TifFile::TifFile(std::string iFile)
+TifFile::TifFile(std::string iFile, uint32 iThreads, uint32 iOverview)
 : mFile(XTIFFOpen(iFile.c_str(), "r"))
+, mName(iFile)
+, mDirectory(0)
+, mNext(0)
 {
 	TIFFGetField(mFile, TIFFTAG_IMAGEWIDTH, &mImageW);
 	TIFFGetField(mFile, TIFFTAG_IMAGELENGTH, &mImageH);
-	TIFFGetField(mFile, TIFFTAG_SAMPLESPERPIXEL, &mSamplesPerPixel);
-	TIFFGetField(mFile, TIFFTAG_PLANARCONFIG, &mConfig);
-	TIFFGetField(mFile, TIFFTAG_BITSPERSAMPLE, &mBitsPerSample);
-	TIFFGetField(mFile, TIFFTAG_SAMPLEFORMAT, &mFormat);
 
-	mBytesPerPixel = mSamplesPerPixel*mBitsPerSample/8;
+	BOOST_LOG_TRIVIAL(info)  << "File " << iFile << " (" << mImageW << "," << mImageH << ")" << (TIFFIsBigTIFF(mFile) ? " BigTIFF" : "");
 
-	BOOST_LOG_TRIVIAL(info)  << "File " << iFile << " (" << mImageW << "," << mImageH << ") channels " << mSamplesPerPixel << " bits " << mBitsPerSample;
-	
-	if (TIFFIsTiled(mFile))
-	{
-		mReader = new TifTiledFormat(*this);
- 	}
-	else
-	{
-		mReader = new TifStripedFormat(*this);
-	}
+	// the geo keys belong to the full resolution image
+	uint32 lImageW = mImageW;
+	uint32 lImageH = mImageH;
 
 	GTIF* lGTiff = GTIFNew(mFile);
 //	GTIFPrint(lGTiff, 0, 0);
 	GTIFDefn lDefinition;
-	if (GTIFGetDefn(lGTiff, &lDefinition))
+	bool lGeo = GTIFGetDefn(lGTiff, &lDefinition);
+	if (lGeo)
 	{
 		GTIFPrintDefn(&lDefinition, stdout);
 			
@@ -190,13 +241,44 @@ TifFile::TifFile(std::string iFile)
 		  
 		// lower right
 		Point& lP1 = mInfo.p1;
-		lP1.utmX = mImageW;
-		lP1.utmY = mImageH;
+		lP1.utmX = lImageW;
+		lP1.utmY = lImageH;
 		GTIFImageToPCS(lGTiff, &lP1.utmX, &lP1.utmY);
 		lP1.lon = lP1.utmX;
 		lP1.lat = lP1.utmY;
 		GTIFProj4ToLatLong(&lDefinition, 1, &lP1.lon, &lP1.lat);
+	}
+
+	selectOverview(iOverview);
+
+	TIFFGetField(mFile, TIFFTAG_SAMPLESPERPIXEL, &mSamplesPerPixel);
+	TIFFGetField(mFile, TIFFTAG_PLANARCONFIG, &mConfig);
+	TIFFGetField(mFile, TIFFTAG_BITSPERSAMPLE, &mBitsPerSample);
+	TIFFGetField(mFile, TIFFTAG_SAMPLEFORMAT, &mFormat);
+
+	mBytesPerPixel = mSamplesPerPixel*mBitsPerSample/8;
+	mRowSize = (size_t)mImageW*mBytesPerPixel;
+
+	BOOST_LOG_TRIVIAL(info)  << "Image (" << mImageW << "," << mImageH << ") channels " << mSamplesPerPixel << " bits " << mBitsPerSample;
 	
+	if (TIFFIsTiled(mFile))
+	{
+		mReader = new TifTiledFormat(*this, iThreads);
+ 	}
+	else
+	{
+		mReader = new TifStripedFormat(*this, iThreads);
+	}
+
+	// bands of at least 256 rows made of whole blocks
+	mBandH = mReader->mRows*std::max<uint32>(1, (256 + mReader->mRows - 1)/mReader->mRows);
+	cache(1);
+
+	if (lGeo)
+	{
+		Point& lP0 = mInfo.p0;
+		Point& lP1 = mInfo.p1;
+
 		mInfo.worldPixelW = (lP1.utmX - lP0.utmX)/mImageW;
 		mInfo.worldPixelH = (lP0.utmY - lP1.utmY)/mImageH;
 
@@ -249,64 +331,178 @@ TifFile::TifFile(std::string iFile)
 
 TifFile::~TifFile()
 {
+	delete mReader;
+	for (size_t i = 0; i < mBands.size(); i++)
+	{
+		delete [] mBands[i].mData;
+	}
 	TIFFClose(mFile);
 }
 
+void TifFile::selectOverview(uint32 iOverview)
+{
+	// reduced resolution images follow the full image in the chain of directories
+	std::vector<tdir_t> lOverviews;
+	tdir_t lCount = TIFFNumberOfDirectories(mFile);
+	for (tdir_t d = 1; d < lCount; d++)
+	{
+		uint32 lType = 0;
+		TIFFSetDirectory(mFile, d);
+		TIFFGetField(mFile, TIFFTAG_SUBFILETYPE, &lType);
+		if ((lType & FILETYPE_REDUCEDIMAGE) && !(lType & FILETYPE_MASK))
+		{
+			uint32 lWidth;
+			uint32 lHeight;
+			TIFFGetField(mFile, TIFFTAG_IMAGEWIDTH, &lWidth);
+			TIFFGetField(mFile, TIFFTAG_IMAGELENGTH, &lHeight);
+			BOOST_LOG_TRIVIAL(info) << "   overview " << (lOverviews.size()+1) << " (" << lWidth << "," << lHeight << ")";
+			lOverviews.push_back(d);
+		}
+	}
+
+	if (iOverview > lOverviews.size())
+	{
+		BOOST_LOG_TRIVIAL(warning) << "File has no overview " << iOverview << ", using " << lOverviews.size();
+		iOverview = lOverviews.size();
+	}
+
+	mDirectory = iOverview ? lOverviews[iOverview-1] : 0;
+	TIFFSetDirectory(mFile, mDirectory);
+	TIFFGetField(mFile, TIFFTAG_IMAGEWIDTH, &mImageW);
+	TIFFGetField(mFile, TIFFTAG_IMAGELENGTH, &mImageH);
+}
+
+void TifFile::cache(uint32 iRows)
+{
+	uint32 lCount = 1 + (iRows + mBandH - 2)/mBandH;
+	while (mBands.size() < lCount)
+	{
+		Band lBand;
+		lBand.mBegin = -1;
+		lBand.mData = new uint8[mBandH*mRowSize];
+		mBands.push_back(lBand);
+	}
+}
 
-void TifFile::readLine(uint32_t iLine, uint8* iBuffer)
+uint8* TifFile::getLine(uint32_t iLine)
 {
-	mReader->readLine(iLine, iBuffer);
+	uint32_t lBegin = iLine/mBandH*mBandH;
+	for (size_t i = 0; i < mBands.size(); i++)
+	{
+		if (mBands[i].mBegin == lBegin)
+		{
+			return mBands[i].mData + (iLine - lBegin)*mRowSize;
+		}
+	}
+
+	// rows are read top down, the band replaced is the oldest one
+	Band& lBand = mBands[mNext];
+	mNext = (mNext + 1)%mBands.size();
+
+	lBand.mBegin = lBegin;
+	mReader->readBand(lBegin, std::min(lBegin + mBandH, mImageH), lBand.mData);
+	return lBand.mData + (iLine - lBegin)*mRowSize;
 };
 
 
 
-TifTiledFormat::TifTiledFormat(TifFile& iFile)
+TifFormat::TifFormat(TifFile& iFile, uint32 iThreads)
 : mFile(iFile)
-, mTileY(-1)
+, mRows(1)
 {
-	TIFFGetField(iFile.mFile, TIFFTAG_TILEWIDTH, &mTileW);
-	TIFFGetField(iFile.mFile, TIFFTAG_TILELENGTH, &mTileH);
-	
-	mBuffer = new tdata_t[iFile.mImageW/mTileW+1];
-	for (uint32_t i = 0; i < iFile.mImageW/mTileW+1; i++)
+	// libtiff handles can not be shared between threads
+	mHandles.push_back(iFile.mFile);
+	for (uint32 i = 1; i < iThreads; i++)
 	{
-		mBuffer[i] = _TIFFmalloc(TIFFTileSize(iFile.mFile));
+		TIFF* lHandle = XTIFFOpen(iFile.mName.c_str(), "r");
+		if (lHandle == NULL)
+		{
+			break;
+		}
+		TIFFSetDirectory(lHandle, iFile.mDirectory);
+		mHandles.push_back(lHandle);
 	}
 }
 
-TifTiledFormat::~TifTiledFormat()
+TifFormat::~TifFormat()
 {
-	for (uint32_t i = 0; i < mFile.mImageW/mTileW+1; i++)
+	for (size_t i = 1; i < mHandles.size(); i++)
 	{
-		_TIFFfree(mBuffer[i]);
+		TIFFClose(mHandles[i]);
 	}
-	delete [] mBuffer;
 }
 
-void TifTiledFormat::readLine(uint32_t iLine, uint8* iBuffer)
+void TifFormat::readBand(uint32_t iBegin, uint32_t iEnd, uint8* iBand)
 {
-	if (mTileY != iLine/mTileH)
+	uint32 lCount = countBlocks(iBegin, iEnd);
+	uint32 lThreads = std::min<uint32>(mHandles.size(), lCount);
+	if (lThreads > 1)
 	{
-		mTileY = iLine/mTileH;
-		// read tile row
-  		for (uint32_t x = 0; x < mFile.mImageW; x += mTileW)
+		boost::thread_group lGroup;
+		for (uint32 t = 0; t < lThreads; t++)
 		{
-			//BOOST_LOG_TRIVIAL(info) << x/lTileW << "," << y/lTileH;
-	  		TIFFReadTile(mFile.mFile, mBuffer[x/mTileW], x, mTileY*mTileH, 0, 0);
+			lGroup.add_thread(new boost::thread(&TifFormat::readBlocks, this, t, lThreads, lCount, iBegin, iEnd, iBand));
 		}
+		lGroup.join_all();
+	}
+	else
+	{
+		readBlocks(0, 1, lCount, iBegin, iEnd, iBand);
+	}
+}
+
+void TifFormat::readBlocks(uint32 iThread, uint32 iThreads, uint32 iCount, uint32_t iBegin, uint32_t iEnd, uint8* iBand)
+{
+	for (uint32 i = iThread; i < iCount; i += iThreads)
+	{
+		readBlock(iThread, i, iBegin, iEnd, iBand);
 	}
+}
 
-	uint32_t lTileI = iLine%mTileH;
 
-	for (int x=0; x<mFile.mImageW; x++)
+
+TifTiledFormat::TifTiledFormat(TifFile& iFile, uint32 iThreads)
+: TifFormat(iFile, iThreads)
+{
+	TIFFGetField(iFile.mFile, TIFFTAG_TILEWIDTH, &mTileW);
+	TIFFGetField(iFile.mFile, TIFFTAG_TILELENGTH, &mTileH);
+
+	mRows = mTileH;
+	mTilesX = (iFile.mImageW + mTileW - 1)/mTileW;
+
+	for (size_t i = 0; i < mHandles.size(); i++)
 	{
-		tdata_t lTile = mBuffer[x/mTileW];
-		int lPx = x%mTileW;
+		mBuffer.push_back(_TIFFmalloc(TIFFTileSize(iFile.mFile)));
+	}
+}
 
-		for (int i=0; i<mFile.mBytesPerPixel; i++)
-		{
-			iBuffer[x*mFile.mBytesPerPixel + i] = ((uint8*)lTile)[(lTileI*mTileW+lPx)*mFile.mBytesPerPixel+i];
-		}
+TifTiledFormat::~TifTiledFormat()
+{
+	for (size_t i = 0; i < mBuffer.size(); i++)
+	{
+		_TIFFfree(mBuffer[i]);
+	}
+}
+
+uint32 TifTiledFormat::countBlocks(uint32_t iBegin, uint32_t iEnd)
+{
+	return mTilesX*((iEnd - iBegin + mTileH - 1)/mTileH);
+}
+
+void TifTiledFormat::readBlock(uint32 iThread, uint32 iBlock, uint32_t iBegin, uint32_t iEnd, uint8* iBand)
+{
+	uint32 lX = (iBlock%mTilesX)*mTileW;
+	uint32 lY = iBegin + (iBlock/mTilesX)*mTileH;
+
+	uint8* lTile = (uint8*)mBuffer[iThread];
+	TIFFReadTile(mHandles[iThread], lTile, lX, lY, 0, 0);
+
+	// tiles on the right and bottom edge are cropped
+	size_t lSize = (size_t)std::min(mTileW, mFile.mImageW - lX)*mFile.mBytesPerPixel;
+	uint32 lRows = std::min(mTileH, iEnd - lY);
+	for (uint32 y = 0; y < lRows; y++)
+	{
+		memcpy(iBand + ((size_t)(lY - iBegin + y)*mFile.mImageW + lX)*mFile.mBytesPerPixel, lTile + (size_t)y*mTileW*mFile.mBytesPerPixel, lSize);
 	}
 }
 
@@ -314,28 +510,37 @@ void TifTiledFormat::readLine(uint32_t iLine, uint8* iBuffer)
 
 
 
-TifStripedFormat::TifStripedFormat(TifFile& iFile)
-: mFile(iFile)
+TifStripedFormat::TifStripedFormat(TifFile& iFile, uint32 iThreads)
+: TifFormat(iFile, iThreads)
 {
-	mBuffer = _TIFFmalloc(mFile.mImageW*mFile.mBytesPerPixel);
+	uint32 lRows = iFile.mImageH;
+	TIFFGetFieldDefaulted(iFile.mFile, TIFFTAG_ROWSPERSTRIP, &lRows);
+
+	// a file of a few very tall strips is decoded sequentially
+	mScanlines = lRows > MAX_STRIP;
+	mRows = mScanlines ? 1 : lRows;
 }
 
-TifStripedFormat::~TifStripedFormat()
+uint32 TifStripedFormat::countBlocks(uint32_t iBegin, uint32_t iEnd)
 {
-	_TIFFfree(mBuffer);
+	return mScanlines ? 1 : (iEnd - iBegin + mRows - 1)/mRows;
 }
 
-void TifStripedFormat::readLine(uint32_t iLine, uint8* iBuffer)
+void TifStripedFormat::readBlock(uint32 iThread, uint32 iBlock, uint32_t iBegin, uint32_t iEnd, uint8* iBand)
 {
-	TIFFReadScanline (mFile.mFile, mBuffer, iLine);
-
-	for (int x=0; x<mFile.mImageW; x++)
+	if (mScanlines)
 	{
-		for (int i=0; i<mFile.mBytesPerPixel; i++)
+		for (uint32_t y = iBegin; y < iEnd; y++)
 		{
-			iBuffer[x*mFile.mBytesPerPixel + i] = ((uint8*)mBuffer)[x*mFile.mBytesPerPixel+i];
+			TIFFReadScanline(mHandles[0], iBand + (y - iBegin)*mFile.mImageW*(size_t)mFile.mBytesPerPixel, y);
 		}
+		return;
 	}
+
+	// strips are decoded in place
+	uint32_t lY = iBegin + iBlock*mRows;
+	size_t lRowSize = (size_t)mFile.mImageW*mFile.mBytesPerPixel;
+	TIFFReadEncodedStrip(mHandles[iThread], TIFFComputeStrip(mHandles[iThread], lY, 0), iBand + (lY - iBegin)*lRowSize, std::min(mRows, iEnd - lY)*lRowSize);
 }
 
 
@@ -349,28 +554,44 @@ void TifStripedFormat::readLine(uint32_t iLine, uint8* iBuffer)
 template <typename T, int S> class ImageWindow
 {
 	static const int KERNEL = 5;
-	static float sKernel[KERNEL][KERNEL];
 
 	public: 
 
+		// a 5 tap gaussian convolved with the 2 tap box of the decimation, applied along rows and columns
+		static const int TAPS = KERNEL + 1;
+		static float sWeights[TAPS];
+
+		static bool isValid(const T* iPixel);
+		static T toValue(float iValue);
+
+		// the filter shared by the pyramid and its updates. Weighted sums of the valid pixels around
+		// every second one of the 2*iCount+TAPS-2 pixels of a row, one plane of iCount per channel
+		static void filterRow(const T* iPixels, uint32_t iCount, float* iValues, float* iWeights, float* iScratch);
+
+		// the TAPS filtered rows of a reduced row summed with the same weights
+		static void filterColumn(float** iValues, float** iWeights, uint32_t iCount, float* iValue, float* iWeight);
+
+		// a reduced pixel holds data if one of the four pixels at its center in iRow0 and iRow1 does
+		static void reduceRow(const T* iRow0, const T* iRow1, const float* iValue, const float* iWeight, uint32_t iCount, T iInit, T* iLine);
+
+		// rows are collected into bands which are reduced concurrently
+		static const uint32_t BAND = 256;
+
 		ImageWindow(uint32_t iImageWidth, uint32_t iImageHeight, T iInit)
 		: mWidth(iImageWidth)
-		, mInputLine(new T[iImageWidth*S])
+		, mRowWidth((iImageWidth+KERNEL-1)*S)
+		, mRows(new T[(BAND+KERNEL-1)*(iImageWidth+KERNEL-1)*S])
+		, mReduced(new T[(BAND/2)*(iImageWidth/2)*S])
+		, mCount(0)
 		, mInit(iInit)
 		, mPngImage(0)
 		{
-			for (int i=0; i<KERNEL; i++)
+			// the rows above the image are blank
+			for (int i=0; i<(BAND+KERNEL-1)*mRowWidth; i++)
 			{
-				uint32_t lWidth = (mWidth+KERNEL)*S;
-				mWindow[i] = new T[lWidth];
-				for (int x=0; x<lWidth; x++)
-				{
-					mWindow[i][x] = mInit;
-				}
+				mRows[i] = mInit;
 			}
-			// smooth lines
-			mSmoothedLine[0] = new T[mWidth*S];
-			mSmoothedLine[1] = new T[mWidth*S];
+			mInputLine = inputRow(0);
 
 			clearLine();
 
@@ -381,13 +602,8 @@ template <typename T, int S> class ImageWindow
 
 		~ImageWindow()
 		{
-			delete [] mSmoothedLine[0];
-			delete [] mSmoothedLine[1];
-			delete [] mInputLine;
-			for (int i=0; i<KERNEL; i++)
-			{
-				delete mWindow[i];
-			}
+			delete [] mRows;
+			delete [] mReduced;
 
 			if (mPngImage)
 			{
@@ -395,47 +611,54 @@ template <typename T, int S> class ImageWindow
 			}
 		}
 
-		void processLine(uint32_t iLineIndex)
+		// completes the row at mInputLine, true once the band is full
+		bool processLine()
 		{
-			// rotate scan line buffer
-			T* lWindow = mWindow[KERNEL-1];
-			for (int i=KERNEL-1; i>0; i--)
-			{
-				mWindow[i] = mWindow[i-1];
-			}
-			mWindow[0] = lWindow;
-
-			// read scanline into window 0
-			memcpy(lWindow+(KERNEL/2)*S,  mInputLine, mWidth*S*sizeof(T));
 			// extend edges
+			T* lRow = mInputLine - (KERNEL/2)*S;
 			for (int i=0; i<KERNEL/2; i++)
 			{
 				uint32_t lIndex = KERNEL/2;
 				for (int s=0; s<S; s++)
 				{
-					lWindow[i*S+s] = lWindow[lIndex*S+s];
+					lRow[i*S+s] = lRow[lIndex*S+s];
 				}
 				lIndex += mWidth -1;
 				for (int s=0; s<S; s++)
 				{
-					lWindow[(lIndex+i+1)*S+s] = lWindow[lIndex*S+s];
+					lRow[(lIndex+i+1)*S+s] = lRow[lIndex*S+s];
 				}
 			}
 
-			// smooth window into Line
-			T* lLine = mSmoothedLine[iLineIndex%2];
-			for (int i=0; i<mWidth; i++)
+			mCount++;
+			if (mCount < BAND)
 			{
-				smoothWindow(lLine, i);
+				mInputLine = inputRow(mCount);
 			}
+			return mCount == BAND;
+		}
 
+		// smooths and halves the row pairs [iBegin, iEnd) of the band into reduced rows
+		void reduceBand(uint32_t iBegin, uint32_t iEnd);
+
+		// keeps the last rows of the band above the next one
+		void nextBand()
+		{
 			if (mPngImage)
 			{
-				mPngImage->writeRow((png_bytep)lLine);
+				for (uint32_t i=0; i<mCount; i++)
+				{
+					mPngImage->writeRow((png_bytep)inputRow(i));
+				}
+			}
+
+			for (int i=0; i<KERNEL-1; i++)
+			{
+				memmove(paddedRow(i-KERNEL+1), paddedRow(mCount+i-KERNEL+1), mRowWidth*sizeof(T));
 			}
+			mCount = 0;
+			mInputLine = inputRow(0);
 		}
-		
-		void sampleLine(ImageWindow<T,S>& iWindow);
 
 		void clearLine()
 		{
@@ -445,192 +668,178 @@ template <typename T, int S> class ImageWindow
 			}
 		}
 
+		T* inputRow(int32_t iRow)
+		{
+			return paddedRow(iRow) + (KERNEL/2)*S;
+		}
+
+		// row of the next lower zoom level made from rows 2*iRow and 2*iRow+1 of the band
+		T* reducedRow(uint32_t iRow)
+		{
+			return mReduced + iRow*(mWidth/2)*S;
+		}
 
 		T* mInputLine;
 		T mInit;
 		uint32_t mWidth;
+		uint32_t mCount;
 
 	private:
 
-		void smoothWindow(T* iLine, uint32_t iY);
-		bool isValid(T* iPixel);
+		T* paddedRow(int32_t iRow)
+		{
+			return mRows + (iRow+KERNEL-1)*mRowWidth;
+		}
 
 		PngImage* mPngImage;
 
-
-		T* mSmoothedLine[2];
-		T* mWindow[KERNEL];
-		float mChannel[S];
+		uint32_t mRowWidth;
+		T* mRows;
+		T* mReduced;
 };
 
 template <typename T, int S>
-float ImageWindow<T,S>::sKernel[5][5] = {{1/273.0,4/273.0,7/273.0,4/273.0,1/273.0},
-										{4/273.0,16/273.0,26/273.0,16/273.0,4/273.0},
-										{7/273.0,26/273.0,41/273.0,26/273.0,7/273.0},
-										{4/273.0,16/273.0,26/273.0,16/273.0,4/273.0},
-										{1/273.0,4/273.0,7/273.0,4/273.0,1/273.0}};
+float ImageWindow<T,S>::sWeights[6] = { 1/34.0f, 5/34.0f, 11/34.0f, 11/34.0f, 5/34.0f, 1/34.0f };
 
-template <> bool ImageWindow<unsigned char, 3>::isValid(unsigned char* iPixel)
+template <> bool ImageWindow<unsigned char, 3>::isValid(const unsigned char* iPixel)
 {
 	return iPixel[0] != 255 || iPixel[1] != 255 || iPixel[2] != 255;
 }
 
-template <> void ImageWindow<unsigned char, 3>::sampleLine(ImageWindow<unsigned char, 3>& iWindow)
+template <> unsigned char ImageWindow<unsigned char, 3>::toValue(float iValue)
 {
-	for (int i=0; i<mWidth; i++)
-	{
-		uint8 lCount = 0;
-		float lR = 0;
-		float lG = 0;
-		float lB = 0;
+	return (unsigned char)std::min(255.0f, iValue + 0.5f);
+}
 
-		if (isValid(&iWindow.mSmoothedLine[0][(i*2+0)*3]))
-		{
-			lR += iWindow.mSmoothedLine[0][(i*2+0)*3+0];
-			lG += iWindow.mSmoothedLine[0][(i*2+0)*3+1];
-			lB += iWindow.mSmoothedLine[0][(i*2+0)*3+2];
-			lCount++;
-		}
-		if (isValid(&iWindow.mSmoothedLine[0][(i*2+1)*3]))
-		{
-			lR += iWindow.mSmoothedLine[0][(i*2+1)*3+0];
-			lG += iWindow.mSmoothedLine[0][(i*2+1)*3+1];
-			lB += iWindow.mSmoothedLine[0][(i*2+1)*3+2];
-			lCount++;
-		}
+template <> bool ImageWindow<float, 1>::isValid(const float* iPixel)
+{
+	return iPixel[0] != ImageYDepth::NOVALUE_VOXXLR;
+}
 
-		if (isValid(&iWindow.mSmoothedLine[1][(i*2+0)*3]))
-		{
-			lR += iWindow.mSmoothedLine[1][(i*2+0)*3+0];
-			lG += iWindow.mSmoothedLine[1][(i*2+0)*3+1];
-			lB += iWindow.mSmoothedLine[1][(i*2+0)*3+2];
-			lCount++;
-		}
-		if (isValid(&iWindow.mSmoothedLine[1][(i*2+1)*3]))
+template <> float ImageWindow<float, 1>::toValue(float iValue)
+{
+	return iValue;
+}
+
+template <typename T, int S> void ImageWindow<T, S>::filterRow(const T* iPixels, uint32_t iCount, float* iValues, float* iWeights, float* iScratch)
+{
+	uint32_t lSpan = 2*iCount + TAPS - 2;
+
+	float* lMask = iScratch;
+	float* lPlanes = iScratch + lSpan;
+	for (uint32_t x=0; x<lSpan; x++)
+	{
+		lMask[x] = isValid(&iPixels[x*S]) ? 1.0f : 0.0f;
+		for (int s=0; s<S; s++)
 		{
-			lR += iWindow.mSmoothedLine[1][(i*2+1)*3+0];
-			lG += iWindow.mSmoothedLine[1][(i*2+1)*3+1];
-			lB += iWindow.mSmoothedLine[1][(i*2+1)*3+2];
-			lCount++;
+			lPlanes[s*lSpan+x] = lMask[x]*iPixels[x*S+s];
 		}
+	}
 
-		if (lCount)
+	// plain loops over the columns so they vectorize
+	for (uint32_t i=0; i<iCount; i++)
+	{
+		float lWeight = 0;
+		for (int k=0; k<TAPS; k++)
 		{
-			mInputLine[i*3+0] = lR/lCount;
-			mInputLine[i*3+1] = lG/lCount;
-			mInputLine[i*3+2] = lB/lCount;
+			lWeight += sWeights[k]*lMask[2*i+k];
 		}
-		else
+		iWeights[i] = lWeight;
+	}
+	for (int s=0; s<S; s++)
+	{
+		float* lPlane = lPlanes + s*lSpan;
+		float* lValues = iValues + s*iCount;
+		for (uint32_t i=0; i<iCount; i++)
 		{
-			mInputLine[i*3+0] = 255;
-			mInputLine[i*3+1] = 255;
-			mInputLine[i*3+2] = 255;
+			float lValue = 0;
+			for (int k=0; k<TAPS; k++)
+			{
+				lValue += sWeights[k]*lPlane[2*i+k];
+			}
+			lValues[i] = lValue;
 		}
 	}
 }
 
-
-template <> bool ImageWindow<float, 1>::isValid(float* iPixel)
-{
-	return iPixel[0] != ImageYDepth::NOVALUE_VOXXLR;
-}
-
-template <> void ImageWindow<float, 1>::sampleLine(ImageWindow<float, 1>& iWindow)
+template <typename T, int S> void ImageWindow<T, S>::filterColumn(float** iValues, float** iWeights, uint32_t iCount, float* iValue, float* iWeight)
 {
-	for (int i=0; i<mWidth; i++)
+	std::fill(iValue, iValue + S*iCount, 0.0f);
+	std::fill(iWeight, iWeight + iCount, 0.0f);
+	for (int j=0; j<TAPS; j++)
 	{
-		uint8 lCount = 0;
-		float lValue = 0;
-
-		if (isValid(&iWindow.mSmoothedLine[0][i*2]))
-		{
-			lValue += iWindow.mSmoothedLine[0][i*2];
-			lCount++;
-		}
-		if (isValid(&iWindow.mSmoothedLine[0][i*2+1]))
-		{
-			lValue += iWindow.mSmoothedLine[0][i*2+1];
-			lCount++;
-		}
+		float lTap = sWeights[j];
 
-		if (isValid(&iWindow.mSmoothedLine[1][i*2]))
+		float* lRowWeights = iWeights[j];
+		for (uint32_t i=0; i<iCount; i++)
 		{
-			lValue += iWindow.mSmoothedLine[1][i*2];
-			lCount++;
+			iWeight[i] += lTap*lRowWeights[i];
 		}
-		if (isValid(&iWindow.mSmoothedLine[1][i*2+1]))
+		float* lRowValues = iValues[j];
+		for (uint32_t i=0; i<S*iCount; i++)
 		{
-			lValue += iWindow.mSmoothedLine[1][i*2+1];
-			lCount++;
+			iValue[i] += lTap*lRowValues[i];
 		}
+	}
+}
 
-		if (lCount)
+template <typename T, int S> void ImageWindow<T, S>::reduceRow(const T* iRow0, const T* iRow1, const float* iValue, const float* iWeight, uint32_t iCount, T iInit, T* iLine)
+{
+	for (uint32_t i=0; i<iCount; i++)
+	{
+		if (isValid(&iRow0[2*i*S]) || isValid(&iRow0[(2*i+1)*S]) || isValid(&iRow1[2*i*S]) || isValid(&iRow1[(2*i+1)*S]))
 		{
-			mInputLine[i] = lValue/lCount;
+			for (int s=0; s<S; s++)
+			{
+				iLine[i*S+s] = toValue(iValue[s*iCount+i]/iWeight[i]);
+			}
 		}
 		else
 		{
-			mInputLine[i] = ImageYDepth::NOVALUE_VOXXLR;
+			for (int s=0; s<S; s++)
+			{
+				iLine[i*S+s] = iInit;
+			}
 		}
 	}
 }
 
-
-template <typename T, int S> void ImageWindow<T, S>::smoothWindow(T* iLine, uint32_t iX)
+template <typename T, int S> void ImageWindow<T, S>::reduceBand(uint32_t iBegin, uint32_t iEnd)
 {
-	// center pixel
-	T lCenter[S];
-	for (int s=0; s<S; s++)
-	{
-		lCenter[s] = mWindow[2][(iX+2)*S+s];
-	}
-	
-	if (isValid(lCenter))
-	{
-		memset(mChannel, 0, sizeof(mChannel));
-
-		for (int y=0; y<5; y++)
-		{
-			for (int x=0; x<5; x++)
-			{
-				int kx = iX+x;
+	uint32_t lWidth = mWidth/2;
 
-				T lPixel[S];
-				for (int s=0; s<S; s++)
-				{
-					lPixel[s] = mWindow[y][kx*S+s];
-				}
+	// reduced row r covers rows 2r-4 to 2r+1 like the smoothing window it replaces, consecutive 
+	// reduced rows share four filtered rows which are kept in a ring
+	std::vector<float> lScratch((S+1)*(mWidth + KERNEL - 1));
+	std::vector<float> lValues(TAPS*S*lWidth);
+	std::vector<float> lWeights(TAPS*lWidth);
+	std::vector<float> lValue(S*lWidth);
+	std::vector<float> lWeight(lWidth);
 
-				if (isValid(lPixel))
-				{
-					for (int s=0; s<S; s++)
-					{
-						mChannel[s] += sKernel[y][x]*lPixel[s];
-					}
-				}
-				else
-				{
-					for (int s=0; s<S; s++)
-					{
-						mChannel[s] += sKernel[y][x]*lCenter[s];
-					}
-				}
-			}
-		}
+	float* lRowValues[TAPS];
+	float* lRowWeights[TAPS];
 
-		for (int s=0; s<S; s++)
+	int32_t lNext = 2*(int32_t)iBegin - TAPS + 2;
+	for (uint32_t r=iBegin; r<iEnd; r++)
+	{
+		int32_t lFirst = 2*(int32_t)r - TAPS + 2;
+		for (; lNext<lFirst+TAPS; lNext++)
 		{
-			iLine[iX*S+s] = (T)mChannel[s];
+			uint32_t lSlot = (lNext + TAPS) % TAPS;
+			filterRow(paddedRow(lNext), lWidth, &lValues[lSlot*S*lWidth], &lWeights[lSlot*lWidth], lScratch.data());
 		}
-	}
-	else
-	{
-		for (int s=0; s<S; s++)
+
+		for (int j=0; j<TAPS; j++)
 		{
-			iLine[iX*S+s] = lCenter[s];
+			uint32_t lSlot = (lFirst + j + TAPS) % TAPS;
+			lRowValues[j] = &lValues[lSlot*S*lWidth];
+			lRowWeights[j] = &lWeights[lSlot*lWidth];
 		}
+		filterColumn(lRowValues, lRowWeights, lWidth, lValue.data(), lWeight.data());
+
+		reduceRow(inputRow(2*r-2), inputRow(2*r-1), lValue.data(), lWeight.data(), lWidth, mInit, reducedRow(r));
 	}
-};
+}
 
 
 
@@ -660,127 +869,162 @@ UpSampler::UpSampler(TifFile& iFile)
 	mImageW = iFile.mImageW/mScalarX;
 	mImageH = iFile.mImageH/mScalarY;
 
-	mCache[0].buffer = new uint8[iFile.mBytesPerPixel*iFile.mImageW];
-	mCache[0].y = -1;
-	mCache[1].buffer = new uint8[iFile.mBytesPerPixel*iFile.mImageW];
-	mCache[1].y = -1;
+	// bilinear samples read two neighbouring rows
+	iFile.cache(2);
+
+	mX0.resize(mImageW);
+	mX1.resize(mImageW);
+	mFractX.resize(mImageW);
+	for (uint32 x=0; x<mImageW; x++)
+	{
+		double fX = x*mScalarX;
+		int32 lX0 = fX;
+		mX0[x] = lX0;
+		mX1[x] = std::min<int32>(lX0+1, iFile.mImageW-1);
+		mFractX[x] = fX - lX0;
+	}
+
+	mRows[0].y = -1;
+	mRows[1].y = -1;
 
 	//mPngImage = new PngFloatImage("UpSampler", mImageW, mImageH);
 };
 
 UpSampler::~UpSampler()
 {
-	delete [] mCache[0].buffer;
-	delete [] mCache[1].buffer;
-
 	if (mPngImage)
 	{
 		delete mPngImage;
 	}
 }
 
-uint8* UpSampler::getLine(int32 iY)
+UpSampler::Row& UpSampler::getRow(int32 iY)
 {
 	for (int i=0; i<2; i++)
 	{
-		if (mCache[i].y == iY)
+		if (mRows[i].y == iY)
 		{
-			return mCache[i].buffer;
+			return mRows[i];
 		}
 	}
 
-	mCache[0].y = mCache[1].y;
-	std::swap(mCache[0].buffer, mCache[1].buffer);
+	std::swap(mRows[0], mRows[1]);
 
-	mFile.readLine(iY, mCache[1].buffer);
-	mCache[1].y = iY;
-	return mCache[1].buffer;
+	Row& lRow = mRows[1];
+	lRow.y = iY;
+	if (mFile.mFormat == SAMPLEFORMAT_IEEEFP)
+	{
+		lerpDepth(mFile.getLine(iY), lRow);
+	}
+	else
+	{
+		lerpColor(mFile.getLine(iY), lRow);
+	}
+	return lRow;
 }
 
-// for Colors
-void UpSampler::readLine(ImageWindow<unsigned char, 3>& iWindow, int32 iY)
+// first three channels of every output column, iScale brings them to 8 bits
+template <typename V> static void lerpChannels(uint8* iLine, uint32 iStride, const uint32* iX0, const uint32* iX1, const float* iFractX, uint32 iWidth, float iScale, float* iValues)
 {
-	double fY = iY*mScalarY;
-	int32 lY0 = fY;
-	int32 lY1 = std::min<int32>(lY0+1, mFile.mImageH-1);
-	double lFractY = fY - lY0;
-
-	uint8* lLine0 = getLine(lY0);
-	uint8* lLine1 = getLine(lY1);
-
-	#define LERP(s,e,t)  (s+(e-s)*t)
-
-	#define CHANNEL(type, c) LERP(LERP((type&)(lLine0[lX0*mFile.mBytesPerPixel+c]), (type&)(lLine0[lX1*mFile.mBytesPerPixel+c]), lFractX), LERP((type&)(lLine1[lX0*mFile.mBytesPerPixel+c]), (type&)(lLine1[lX1*mFile.mBytesPerPixel+c]), lFractX), lFractY)
-//	#define CHANNEL(type, c) (unsigned short&)&(lLine0[lX0*mFile.mBytesPerPixel+c])
-
- 	for (int x=0; x<mImageW; x++)
+	for (uint32 x=0; x<iWidth; x++)
 	{
-		double fX = x*mScalarX;
-		int32 lX0 = fX;
-		int32 lX1 = std::min<int32>(lX0+1, mFile.mImageW-1);
-		double lFractX = fX - lX0;
+		const V* lPixel0 = (const V*)(iLine + (size_t)iX0[x]*iStride);
+		const V* lPixel1 = (const V*)(iLine + (size_t)iX1[x]*iStride);
+		float lFract = iFractX[x];
+		for (int s=0; s<3; s++)
+		{
+			float lValue0 = lPixel0[s];
+			float lValue1 = lPixel1[s];
+			iValues[x*3+s] = iScale*(lValue0 + (lValue1 - lValue0)*lFract);
+		}
+	}
+}
 
-		unsigned char r = 0;
-		unsigned char g = 0;
-		unsigned char b = 0;
+void UpSampler::lerpColor(uint8* iLine, Row& iRow)
+{
+	iRow.values.resize(mImageW*3);
 
-		switch (mFile.mBitsPerSample)
-		{
+	// rgb and rgba differ in their stride only
+	switch (mFile.mBitsPerSample)
+	{
 		case 8:
-			r = CHANNEL(unsigned char, 0);//LERP(LERP(lLine0[lX0*mFile.mBytesPerPixel+0], lLine0[lX1*mFile.mBytesPerPixel+0], lFractX), LERP(lLine1[lX0*mFile.mBytesPerPixel+0], lLine1[lX1*mFile.mBytesPerPixel+0], lFractX), lFractY);
-			g = CHANNEL(unsigned char, 1);//LERP(LERP(lLine0[lX0*mFile.mBytesPerPixel+1], lLine0[lX1*mFile.mBytesPerPixel+1], lFractX), LERP(lLine1[lX0*mFile.mBytesPerPixel+1], lLine1[lX1*mFile.mBytesPerPixel+1], lFractX), lFractY);
-			b = CHANNEL(unsigned char, 2);//LERP(LERP(lLine0[lX0*mFile.mBytesPerPixel+2], lLine0[lX1*mFile.mBytesPerPixel+2], lFractX), LERP(lLine1[lX0*mFile.mBytesPerPixel+2], lLine1[lX1*mFile.mBytesPerPixel+2], lFractX), lFractY);
+			lerpChannels<uint8>(iLine, mFile.mBytesPerPixel, mX0.data(), mX1.data(), mFractX.data(), mImageW, 1.0f, iRow.values.data());
 			break;
 
 		case 16:
-			unsigned short rs = CHANNEL(unsigned short, 0);
-			unsigned short gs = CHANNEL(unsigned short, 2);
-			unsigned short bs = CHANNEL(unsigned short, 4);
-
-			r = rs/255;
-			g = gs/255;
-			b = bs/255;
+			lerpChannels<uint16>(iLine, mFile.mBytesPerPixel, mX0.data(), mX1.data(), mFractX.data(), mImageW, 1.0f/257, iRow.values.data());
+			break;
 
+		default:
+			std::fill(iRow.values.begin(), iRow.values.end(), 0.0f);
 			break;
-		}
+	}
+}
 
+void UpSampler::lerpDepth(uint8* iLine, Row& iRow)
+{
+	iRow.values.resize(mImageW);
+	iRow.valid.resize(mImageW);
 
-		if (r == 0 && g == 0 && b == 0)
-		{
-			r = 255;
-			g = 255;
-			b = 255;
-		}
+	float lMin = ImageYDepth::sMin;
+	float lMax = ImageYDepth::sMax;
 
-		iWindow.mInputLine[x*3+0] = r;
-		iWindow.mInputLine[x*3+1] = g;
-		iWindow.mInputLine[x*3+2] = b;
+	// nodata is masked out instead of branched over
+	uint32 lStride = mFile.mBytesPerPixel;
+	for (uint32 x=0; x<mImageW; x++)
+	{
+		float c0 = *(float*)(iLine + (size_t)mX0[x]*lStride);
+		float c1 = *(float*)(iLine + (size_t)mX1[x]*lStride);
 
+		bool lValid0 = c0 != ImageYDepth::NOVALUE_AGISOFT && c0 > ImageYDepth::NOVALUE_PIX4D;
+		bool lValid1 = c1 != ImageYDepth::NOVALUE_AGISOFT && c1 > ImageYDepth::NOVALUE_PIX4D;
 
-		/*
-		unsigned char r = LERP(LERP(lLine0[lX0*mFile.mBytesPerPixel+0], lLine0[lX1*mFile.mBytesPerPixel+0], lFractX), LERP(lLine1[lX0*mFile.mBytesPerPixel+0], lLine1[lX1*mFile.mBytesPerPixel+0], lFractX), lFractY);
-		unsigned char g = LERP(LERP(lLine0[lX0*mFile.mBytesPerPixel+1], lLine0[lX1*mFile.mBytesPerPixel+1], lFractX), LERP(lLine1[lX0*mFile.mBytesPerPixel+1], lLine1[lX1*mFile.mBytesPerPixel+1], lFractX), lFractY);
-		unsigned char b = LERP(LERP(lLine0[lX0*mFile.mBytesPerPixel+2], lLine0[lX1*mFile.mBytesPerPixel+2], lFractX), LERP(lLine1[lX0*mFile.mBytesPerPixel+2], lLine1[lX1*mFile.mBytesPerPixel+2], lFractX), lFractY);
+		lMin = std::min(lMin, lValid0 ? c0 : lMin);
+		lMin = std::min(lMin, lValid1 ? c1 : lMin);
+		lMax = std::max(lMax, lValid0 ? c0 : lMax);
+		lMax = std::max(lMax, lValid1 ? c1 : lMax);
 
-		if (r == 0 && g == 0 && b == 0)
-		{
-			r = 255;
-			g = 255;
-			b = 255;
-		}
+		iRow.values[x] = c0 + (c1 - c0)*mFractX[x];
+		iRow.valid[x] = (lValid0 && lValid1) ? 1.0f : 0.0f;
+	}
 
-		iWindow.mInputLine[x*3+0] = r;
-		iWindow.mInputLine[x*3+1] = g;
-		iWindow.mInputLine[x*3+2] = b;
-		*/
+	ImageYDepth::sMin = lMin;
+	ImageYDepth::sMax = lMax;
+}
+
+// for Colors
+void UpSampler::readLine(ImageWindow<unsigned char, 3>& iWindow, int32 iY)
+{
+	double fY = iY*mScalarY;
+	int32 lY0 = fY;
+	int32 lY1 = std::min<int32>(lY0+1, mFile.mImageH-1);
+	float lFractY = fY - lY0;
+
+	// rows move between the slots of the cache but keep their buffers
+	float* lRow0 = getRow(lY0).values.data();
+	float* lRow1 = getRow(lY1).values.data();
+
+	unsigned char* lLine = iWindow.mInputLine;
+	for (uint32 i=0; i<mImageW*3; i++)
+	{
+		lLine[i] = (unsigned char)(lRow0[i] + (lRow1[i] - lRow0[i])*lFractY);
 	}
 
+	// black is no data
+	for (uint32 x=0; x<mImageW; x++)
+	{
+		if (lLine[x*3+0] == 0 && lLine[x*3+1] == 0 && lLine[x*3+2] == 0)
+		{
+			lLine[x*3+0] = 255;
+			lLine[x*3+1] = 255;
+			lLine[x*3+2] = 255;
+		}
+	}
 
 	if (mPngImage)
 	{
 		mPngImage->writeRow(iWindow.mInputLine);
 	}
-	#undef LERP
 }
 
 // for Depth
@@ -789,36 +1033,22 @@ void UpSampler::readLine(ImageWindow<float, 1>& iWindow, int32 iY)
 	double fY = iY*mScalarY;
 	int32 lY0 = fY;
 	int32 lY1 = std::min<int32>(lY0+1, mFile.mImageH-1);
-	double lFractY = fY - lY0;
+	float lFractY = fY - lY0;
 
-	uint8* lLine0 = getLine(lY0);
-	uint8* lLine1 = getLine(lY1);
+	// rows move between the slots of the cache but keep their buffers
+	Row& lRow0 = getRow(lY0);
+	const float* lValues0 = lRow0.values.data();
+	const float* lValid0 = lRow0.valid.data();
 
-	#define LERP(s,e,t)  (s+(e-s)*t)
+	Row& lRow1 = getRow(lY1);
+	const float* lValues1 = lRow1.values.data();
+	const float* lValid1 = lRow1.valid.data();
 
- 	for (int x=0; x<mImageW; x++)
+	float* lLine = iWindow.mInputLine;
+	for (uint32 x=0; x<mImageW; x++)
 	{
-		double fX = x*mScalarX;
-		int32 lX0 = fX;
-		int32 lX1 = std::min<int32>(lX0+1, mFile.mImageW-1);
-		double lFractX = fX - lX0;
-
-        float c00 = depthFilter(*((float*)&lLine0[lX0*mFile.mBytesPerPixel]));
-        float c10 = depthFilter(*((float*)&lLine0[lX1*mFile.mBytesPerPixel]));
-        float c01 = depthFilter(*((float*)&lLine1[lX0*mFile.mBytesPerPixel]));
-        float c11 = depthFilter(*((float*)&lLine1[lX1*mFile.mBytesPerPixel]));
-				
-		if (c00 == ImageYDepth::NOVALUE_VOXXLR ||
-			c10 == ImageYDepth::NOVALUE_VOXXLR ||
-			c01 == ImageYDepth::NOVALUE_VOXXLR ||
-			c11 == ImageYDepth::NOVALUE_VOXXLR )
-		{
-			iWindow.mInputLine[x] = ImageYDepth::NOVALUE_VOXXLR;
-		}
-		else
-		{
-			iWindow.mInputLine[x] = LERP(LERP(c00, c10, lFractX), LERP(c01, c11, lFractX), lFractY);
-		}
+		float lValue = lValues0[x] + (lValues1[x] - lValues0[x])*lFractY;
+		lLine[x] = lValid0[x]*lValid1[x] > 0 ? lValue : ImageYDepth::NOVALUE_VOXXLR;
 	}
 
 	//	std::cout << ImageYDepth::sMin << "," << ImageYDepth::sMax << "\n";
@@ -827,7 +1057,6 @@ void UpSampler::readLine(ImageWindow<float, 1>& iWindow, int32 iY)
 	{
 		mPngImage->writeRow((png_bytep)iWindow.mInputLine);
 	}
-	#undef LERP
 }
 
 
@@ -840,28 +1069,22 @@ NoSampler::NoSampler(TifFile& iFile)
 {
 	mImageW = iFile.mImageW;
 	mImageH = iFile.mImageH;
-
-	mBuffer = new uint8[iFile.mBytesPerPixel*iFile.mImageW];
 };
 
 NoSampler::~NoSampler()
 {
-	if (mBuffer)
-	{
-		delete [] mBuffer;
-	}
 }
 
 // for Colors
 void NoSampler::readLine(ImageWindow<unsigned char, 3>& iWindow, int32 iY)
 {
-	mFile.readLine(iY, mBuffer);
+	uint8* lBuffer = mFile.getLine(iY);
 
 	for (int x=0; x<mImageW; x++)
 	{
-		unsigned char r = mBuffer[x*mFile.mBytesPerPixel+0];
-		unsigned char g = mBuffer[x*mFile.mBytesPerPixel+1];
-		unsigned char b = mBuffer[x*mFile.mBytesPerPixel+2];
+		unsigned char r = lBuffer[x*mFile.mBytesPerPixel+0];
+		unsigned char g = lBuffer[x*mFile.mBytesPerPixel+1];
+		unsigned char b = lBuffer[x*mFile.mBytesPerPixel+2];
 
 		if (r == 0 && g == 0 && b == 0)
 		{
@@ -880,11 +1103,11 @@ void NoSampler::readLine(ImageWindow<unsigned char, 3>& iWindow, int32 iY)
 // for Depth
 void NoSampler::readLine(ImageWindow<float, 1>& iWindow, int32 iY)
 {
-	mFile.readLine(iY, mBuffer);
+	uint8* lBuffer = mFile.getLine(iY);
 
 	for (int x=0; x<mImageW; x++)
 	{
-		iWindow.mInputLine[x] = depthFilter(*(float*)&mBuffer[x*mFile.mBytesPerPixel]);
+		iWindow.mInputLine[x] = depthFilter(*(float*)&lBuffer[x*mFile.mBytesPerPixel]);
 	}
 }
 
@@ -892,44 +1115,68 @@ void NoSampler::readLine(ImageWindow<float, 1>& iWindow, int32 iY)
 
 
 
-ImageY::ImageY(uint32_t iZ, uint32_t iX, uint32_t iTileX, uint32_t iCount)
-: mDirectoryX(std::to_string((boost::int64_t)iX))
+ImageY::ImageY(TileSink& iSink, uint32_t iZ, uint32_t iX, uint32_t iTileX, uint32_t iCount)
+: mSink(iSink)
+, mX(iX)
+, mDirectoryX(std::to_string((boost::int64_t)iX))
 , mDirectoryZ(std::to_string((boost::int64_t)iZ))
+, mPath(mDirectoryZ + "/" + mDirectoryX + "/")
 , mTileX(iTileX)
 , mCount(iCount)
 {
-	boost::filesystem::create_directory(boost::filesystem::path(mDirectoryX.c_str()));
+	mSink.createDirectory(mDirectoryZ + "/" + mDirectoryX);
 }
 
 
 
-ImageYColor::ImageYColor(uint32_t iZ, uint32_t iX, uint32_t iTileX, uint32_t iLineX, uint32_t iCount, ImageWindow<unsigned char, 3>& iWindow)
-: ImageY(iZ, iX, iTileX, iCount)
+ImageYColor::ImageYColor(TileSink& iSink, uint32_t iZ, uint32_t iX, uint32_t iTileX, uint32_t iLineX, uint32_t iCount, ImageWindow<unsigned char, 3>& iWindow)
+: ImageY(iSink, iZ, iX, iTileX, iCount)
 , mWindow(iWindow)
-, mLine(&iWindow.mInputLine[iLineX*3])
+, mLineX(iLineX)
 , mWriter(mValues)
 {
 	clearImage();
 }
 
-void ImageYColor::processLine(uint32_t iLineY, uint32_t iTileY)
+void ImageYColor::processLine(uint32_t iLineY, uint32_t iTileY, unsigned char* iLine)
 {
 	if (iLineY > 0 && iLineY % 256 == 0)
 	{
 		uint32_t lTileY = iTileY + iLineY/256-1;
-				
-		chdir(mDirectoryZ.c_str());
-		chdir(mDirectoryX.c_str());
 
-		std::string lName = std::to_string((boost::int64_t)(lTileY));
-		mWriter.write(lName);
+		bool lUniform = isUniform();
+		bool lEmpty = lUniform && mValues[0] == mWindow.mInit && mValues[1] == mWindow.mInit && mValues[2] == mWindow.mInit;
+		if (!lUniform)
+		{
+			std::string lName = std::to_string((boost::int64_t)(lTileY));
+			mWriter.write(mSink, mPath + lName);
+		}
+		else if (lEmpty)
+		{
+			json_spirit::mArray lTile = { (int)mX, (int)lTileY };
+			mEmpty.push_back(lTile);
+		}
+		else
+		{
+			json_spirit::mArray lTile = { (int)mX, (int)lTileY, (int)mValues[0], (int)mValues[1], (int)mValues[2] };
+			mUniform.push_back(lTile);
+		}
 		clearImage();
-
-		chdir("..");
-		chdir("..");
 	}
 
-	memcpy(&mValues[((iLineY%256)*256+mTileX)*3], mLine, mCount*3*sizeof(unsigned char));
+	memcpy(&mValues[((iLineY%256)*256+mTileX)*3], &iLine[mLineX*3], mCount*3*sizeof(unsigned char));
+}
+
+bool ImageYColor::isUniform()
+{
+	for (int i=3; i<256*256*3; i+=3)
+	{
+		if (mValues[i] != mValues[0] || mValues[i+1] != mValues[1] || mValues[i+2] != mValues[2])
+		{
+			return false;
+		}
+	}
+	return true;
 }
 
 void ImageYColor::clearImage()
@@ -991,8 +1238,8 @@ float ImageYDepth::NOVALUE_VOXXLR = -10000.00;
 */
 
 
-ImageYDepth::ImageYDepth(uint32_t iZ, uint32_t iX, uint32_t iTileX, int32 iLineX, uint32_t iCount, ImageWindow<float, 1>& iWindow)
-: ImageY(iZ, iX, iTileX, iCount)
+ImageYDepth::ImageYDepth(TileSink& iSink, uint32_t iZ, uint32_t iX, uint32_t iTileX, int32 iLineX, uint32_t iCount, ImageWindow<float, 1>& iWindow)
+: ImageY(iSink, iZ, iX, iTileX, iCount)
 , mWindow(iWindow)
 , mLineX(iLineX)
 {
@@ -1000,21 +1247,40 @@ ImageYDepth::ImageYDepth(uint32_t iZ, uint32_t iX, uint32_t iTileX, int32 iLineX
 	{
 		mValues[i] = NOVALUE_VOXXLR;
 	}
+	if (sPrecision > 0)
+	{
+		mCode.resize(ElevationCodec::maxEncodedSize(260, 260));
+	}
 }
 
-void ImageYDepth::processLine(uint32_t iLineY, uint32_t iTileY)
+void ImageYDepth::processLine(uint32_t iLineY, uint32_t iTileY, float* iLine)
 {
 	if (iLineY > 2 && (iLineY-2)%256 == 0)
 	{
 		uint32_t lTileY = iTileY + iLineY/256-1;
-				
-		chdir(mDirectoryZ.c_str());
-		chdir(mDirectoryX.c_str());
 		
-		std::string lName = std::to_string((boost::int64_t)(lTileY)) + ".bin";
-		FILE* lFile = fopen(lName.c_str(), "wb");
-		fwrite(mValues, sizeof(float), 260*260, lFile);
-		fclose(lFile);
+		if (!isUniform())
+		{
+			if (sPrecision > 0)
+			{
+				size_t lSize = ElevationCodec::encode(mValues, 260, 260, sPrecision, NOVALUE_VOXXLR, mCode.data());
+				mSink.write(mPath + std::to_string((boost::int64_t)(lTileY)) + ".elv", mCode.data(), lSize);
+			}
+			else
+			{
+				mSink.write(mPath + std::to_string((boost::int64_t)(lTileY)) + ".bin", mValues, sizeof(float)*260*260);
+			}
+		}
+		else if (mValues[0] == NOVALUE_VOXXLR)
+		{
+			json_spirit::mArray lTile = { (int)mX, (int)lTileY };
+			mEmpty.push_back(lTile);
+		}
+		else
+		{
+			json_spirit::mArray lTile = { (int)mX, (int)lTileY, (double)mValues[0] };
+			mUniform.push_back(lTile);
+		}
 		/*
 		PngFloatImage lImage(std::to_string((boost::int64_t)(lTileY))+".png", 260, 260, 498.392, 664.311);
 		for (int i=0; i<260; i++)
@@ -1033,18 +1299,27 @@ void ImageYDepth::processLine(uint32_t iLineY, uint32_t iTileY)
 		{
 			mValues[i] = NOVALUE_VOXXLR;
 		}
-
-		chdir("..");
-		chdir("..");
 	}
 
 	//memcpy(&mValues[(lPixelY%256+2)*260+mTileX+2], mLine, mCount*sizeof(float));
 	float* lLine = &mValues[((iLineY-2)%256+4)*260+mTileX+2];
-	*(lLine-2) = mWindow.mInputLine[std::max(0, mLineX-2)];
-	*(lLine-1) = mWindow.mInputLine[std::max(0, mLineX-1)];
-	memcpy(lLine, &mWindow.mInputLine[mLineX], mCount*sizeof(float));
-	lLine[mCount] = mWindow.mInputLine[std::min(mWindow.mWidth-1, mLineX+mCount)];
-	lLine[mCount+1] = mWindow.mInputLine[std::min(mWindow.mWidth-1, mLineX+mCount+1)];
+	*(lLine-2) = iLine[std::max(0, mLineX-2)];
+	*(lLine-1) = iLine[std::max(0, mLineX-1)];
+	memcpy(lLine, &iLine[mLineX], mCount*sizeof(float));
+	lLine[mCount] = iLine[std::min(mWindow.mWidth-1, mLineX+mCount)];
+	lLine[mCount+1] = iLine[std::min(mWindow.mWidth-1, mLineX+mCount+1)];
+}
+
+bool ImageYDepth::isUniform()
+{
+	for (int i=1; i<260*260; i++)
+	{
+		if (mValues[i] != mValues[0])
+		{
+			return false;
+		}
+	}
+	return true;
 }
 
 float ImageYDepth::sMin;
@@ -1054,6 +1329,8 @@ float ImageYDepth::NOVALUE_AGISOFT = -32767;
 float ImageYDepth::NOVALUE_PIX4D = -10000.00;
 float ImageYDepth::NOVALUE_VOXXLR = -10000.00;
 
+float ImageYDepth::sPrecision = 0;
+
 
 
 template <typename T, int S, class C> class ImageXY
@@ -1066,20 +1343,71 @@ template <typename T, int S, class C> class ImageXY
 		uint32_t mLineY;
 		uint32_t mPixelY;
 		uint32_t mTileY;
+		uint32_t mThreads;
 
 		ImageXY<T,S,C>* mParent;
 
+		// tile columns and row ranges of a band are independent of each other
+		void processBand(uint32_t iThread)
+		{
+			for (uint32_t i=iThread; i<mColumn.size(); i+=mThreads) 
+			{
+				for (uint32_t y=0; y<mLineWindow.mCount; y++)
+				{
+					mColumn[i]->processLine(mLineY + y + mPixelY, mTileY, mLineWindow.inputRow(y));
+				}
+			}
+
+			if (mParent)
+			{
+				uint32_t lPairs = mLineWindow.mCount/2;
+				uint32_t lRows = (lPairs + mThreads - 1)/mThreads;
+				mLineWindow.reduceBand(std::min(lPairs, iThread*lRows), std::min(lPairs, (iThread+1)*lRows));
+			}
+		}
+
+		void processBand()
+		{
+			if (mThreads > 1)
+			{
+				boost::thread_group lGroup;
+				for (uint32_t t=0; t<mThreads; t++)
+				{
+					lGroup.add_thread(new boost::thread(static_cast<void (ImageXY::*)(uint32_t)>(&ImageXY::processBand), this, t));
+				}
+				lGroup.join_all();
+			}
+			else
+			{
+				processBand(0);
+			}
+			
+			// every pair of rows makes one row of the lower zoom level
+			if (mParent)
+			{
+				for (uint32_t r=0; r<mLineWindow.mCount/2; r++)
+				{
+					memcpy(mParent->mLineWindow.mInputLine, mLineWindow.reducedRow(r), mParent->mLineWindow.mWidth*S*sizeof(T));
+					mParent->processLine();
+				}
+			}
+
+			mLineY += mLineWindow.mCount;
+			mLineWindow.nextBand();
+		}
+
 	public:
 	
 		ImageWindow<T,S> mLineWindow;
 
-		ImageXY(uint32_t iImageWidth, uint32_t iImageHeight, uint32_t iZoom, uint32_t iMinZoom, double iWorldX, double iWorldY, T iInitial)
+		ImageXY(TileSink& iSink, uint32_t iImageWidth, uint32_t iImageHeight, uint32_t iZoom, uint32_t iMinZoom, double iWorldX, double iWorldY, T iInitial, uint32_t iThreads)
 		: mLineWindow(iImageWidth, iImageHeight, iInitial)
 		, mDirectory(std::to_string((boost::int64_t)iZoom))
 		, mParent(0)
 		, mLineY(0)
 		, mTileY((uint64)(iWorldY*pow(2, iZoom))/256)
 		, mPixelY((uint64)(iWorldY*pow(2, iZoom))%256)
+		, mThreads(std::max<uint32_t>(1, iThreads))
 		{
 			uint64 lLevelX = iWorldX*pow(2, iZoom);
 			uint64 lTileX = lLevelX/256;
@@ -1087,23 +1415,24 @@ template <typename T, int S, class C> class ImageXY
 
 			uint16 lGridWidth = ceil((iImageWidth+lPixelX)/256.0);
 		
-			// columns
-			boost::filesystem::create_directory(boost::filesystem::path(mDirectory.c_str()));
-			chdir(mDirectory.c_str());
-			uint32_t lLineX = 256-lPixelX;
-			mColumn.push_back(new C(iZoom, lTileX++, lPixelX, 0, lLineX, mLineWindow));
+			// columns, an image narrower than a tile may lie in one
+			iSink.createDirectory(mDirectory);
+			uint32_t lLineX = std::min<uint32_t>(256-lPixelX, iImageWidth);
+			mColumn.push_back(new C(iSink, iZoom, lTileX++, lPixelX, 0, lLineX, mLineWindow));
 			for (int x=1; x<lGridWidth-1; x++)
 			{
-				mColumn.push_back(new C(iZoom, lTileX++, 0, lLineX, 256, mLineWindow));
+				mColumn.push_back(new C(iSink, iZoom, lTileX++, 0, lLineX, 256, mLineWindow));
 				lLineX += 256;
 			}
-			mColumn.push_back(new C(iZoom, lTileX++, 0, lLineX, iImageWidth - lLineX, mLineWindow));
-			chdir("..");
+			if (lGridWidth > 1)
+			{
+				mColumn.push_back(new C(iSink, iZoom, lTileX++, 0, lLineX, iImageWidth - lLineX, mLineWindow));
+			}
 
 			// lower zoom levels
 			if (iZoom > iMinZoom)
 			{
-				mParent = new ImageXY(iImageWidth/2, iImageHeight/2, iZoom-1, iMinZoom, iWorldX, iWorldY, iInitial);
+				mParent = new ImageXY(iSink, iImageWidth/2, iImageHeight/2, iZoom-1, iMinZoom, iWorldX, iWorldY, iInitial, iThreads);
 			}
 
 			BOOST_LOG_TRIVIAL(info) << "level " << iZoom << "  pixels (" << iImageWidth << "," << iImageHeight << ")   files - " << (iImageWidth/256) << "," << (iImageHeight/256);
@@ -1121,83 +1450,235 @@ template <typename T, int S, class C> class ImageXY
 			}
 		}
 
+		// the line at mLineWindow.mInputLine is complete
 		void processLine()
 		{
-			for (int i=0; i<mColumn.size(); i++) 
-			{
-				mColumn[i]->processLine(mLineY + mPixelY, mTileY);
-			}
-			
-			mLineWindow.processLine(mLineY);
-			mLineY++;
-			
-			if (mParent)
+			if (mLineWindow.processLine())
 			{
-				if (mLineY%2==0)
-				{
-					mParent->mLineWindow.sampleLine(mLineWindow);
-					mParent->processLine();
-				}
+				processBand();
 			}
 		}
 
 		void close()
 		{
 			// fill in remaing strips
-			mLineWindow.clearLine();
+			uint32_t lLineY = mLineY + mLineWindow.mCount;
 
-			BOOST_LOG_TRIVIAL(info)  << "filling in from " << mLineY << " to " << (mLineY/256+1)*256;
-			uint32_t lUpper = ((mLineY+mPixelY)/256+1)*256+2;
-			for (uint32_t i=mLineY+mPixelY; i<=lUpper; i++)
+			BOOST_LOG_TRIVIAL(info)  << "filling in from " << lLineY << " to " << (lLineY/256+1)*256;
+			uint32_t lUpper = ((lLineY+mPixelY)/256+1)*256+2;
+			for (uint32_t i=lLineY+mPixelY; i<=lUpper; i++)
 			{
+				mLineWindow.clearLine();
 				processLine();
 			}
+			if (mLineWindow.mCount)
+			{
+				processBand();
+			}
 
 			if (mParent)
 			{
 				mParent->close();
 			}
 		}
+
+		// the tiles of every level which were not written
+		void manifest(json_spirit::mObject& iManifest)
+		{
+			json_spirit::mArray lEmpty;
+			json_spirit::mArray lUniform;
+			for (size_t i=0; i<mColumn.size(); i++)
+			{
+				lEmpty.insert(lEmpty.end(), mColumn[i]->mEmpty.begin(), mColumn[i]->mEmpty.end());
+				lUniform.insert(lUniform.end(), mColumn[i]->mUniform.begin(), mColumn[i]->mUniform.end());
+			}
+
+			BOOST_LOG_TRIVIAL(info) << "level " << mDirectory << " skipped " << lEmpty.size() << " empty and " << lUniform.size() << " uniform tiles";
+
+			if (lEmpty.size() || lUniform.size())
+			{
+				json_spirit::mObject lLevel;
+				lLevel["empty"] = lEmpty;
+				lLevel["uniform"] = lUniform;
+				iManifest[mDirectory] = lLevel;
+			}
+
+			if (mParent)
+			{
+				mParent->manifest(iManifest);
+			}
+		}
 };
 
 
 
-TmsTiler::TmsTiler()
+TmsTiler::TmsTiler(uint32_t iThreads, uint32_t iOverview, bool iArchive, float iPrecision, bool iHashes)
+: mThreads(iThreads)
+, mOverview(iOverview)
+, mArchive(iArchive)
+, mPrecision(iPrecision)
+, mHashes(iHashes)
 {
 };
 
+TileSink* TmsTiler::createSink(std::string iName)
+{
+	if (mArchive)
+	{
+		mRoot["archive"] = iName + ".tiles";
+		return new TileArchive("root/" + iName + ".tiles");
+	}
+	return new TileSink("root/" + iName, mHashes);
+}
+
+// tile paths with the hashes of their content in hex
+static void writeHashes(std::string iFile, const std::map<std::string, uint64_t>& iHashes)
+{
+	json_spirit::mObject lHashes;
+	for (std::map<std::string, uint64_t>::const_iterator lIter = iHashes.begin(); lIter != iHashes.end(); lIter++)
+	{
+		char lHash[17];
+		snprintf(lHash, sizeof(lHash), "%016llx", (unsigned long long)lIter->second);
+		lHashes[lIter->first] = std::string(lHash);
+	}
+
+	std::ofstream lStream(iFile);
+	json_spirit::write_stream(json_spirit::mValue(lHashes), lStream);
+}
+
+static void readHashes(std::string iFile, std::map<std::string, uint64_t>& iHashes)
+{
+	std::ifstream lStream(iFile);
+	json_spirit::mValue lValue;
+	if (!lStream || !json_spirit::read_stream(lStream, lValue) || lValue.type() != json_spirit::obj_type)
+	{
+		return;
+	}
+
+	json_spirit::mObject& lHashes = lValue.get_obj();
+	for (json_spirit::mObject::iterator lIter = lHashes.begin(); lIter != lHashes.end(); lIter++)
+	{
+		iHashes[lIter->first] = strtoull(lIter->second.get_str().c_str(), NULL, 16);
+	}
+}
+
+void TmsTiler::closeSink(TileSink* iSink, std::string iName)
+{
+	iSink->close();
+
+	// uploads of a tile tree compare the hashes to skip unchanged tiles
+	if (mHashes && !mArchive)
+	{
+		writeHashes("root/" + iName + ".hashes", iSink->hashes());
+		mRoot["hashes"] = iName + ".hashes";
+	}
+	delete iSink;
+}
+
 void TmsTiler::process(std::string iFile)
 {
 	BOOST_LOG_TRIVIAL(info)  << "Processing file " << iFile;
 
-	TifFile lFile(iFile);
-	
-	mRoot["x0"] = 256*(double)lFile.mInfo.p0.utmX/UTM_HEIGHT;
-	mRoot["x1"] = 256*(double)lFile.mInfo.p1.utmX/UTM_HEIGHT;
-	mRoot["y0"] = 256*(UTM_HEIGHT-(double)lFile.mInfo.p0.utmY)/UTM_HEIGHT;
-	mRoot["y1"] = 256*(UTM_HEIGHT-(double)lFile.mInfo.p1.utmY)/UTM_HEIGHT;
-
-	mRoot["maxZoom"] = (long)lFile.mInfo.maxZoom;
-	mRoot["minZoom"] = (long)lFile.mInfo.minZoom;
-	mRoot["proj"] = lFile.mInfo.proj;
-	
-	boost::filesystem::create_directory(boost::filesystem::path("root"));
-	chdir("root");
+	TifFile lFile(iFile, mThreads, mOverview);
+
+	describe(lFile);
+	tile(lFile);
+}
+
+void TmsTiler::process(TmsTiler& iColor, std::string iColorFile, TmsTiler& iElevation, std::string iElevationFile)
+{
+	BOOST_LOG_TRIVIAL(info)  << "Processing files " << iColorFile << " and " << iElevationFile;
+
+	TifFile lColor(iColorFile, iColor.mThreads, iColor.mOverview);
+	TifFile lElevation(iElevationFile, iElevation.mThreads, iElevation.mOverview);
+
+	iColor.describe(lColor);
+	iElevation.describe(lElevation);
+
+	// both pyramids share the static state of a depth pyramid otherwise
+	if (lColor.mFormat == SAMPLEFORMAT_IEEEFP || lElevation.mFormat != SAMPLEFORMAT_IEEEFP)
+	{
+		iColor.tile(lColor);
+		iElevation.tile(lElevation);
+		return;
+	}
+
+	// an error on either side is raised once both pyramids have stopped
+	std::exception_ptr lColorError;
+	boost::thread lThread([&]()
+	{
+		try
+		{
+			iColor.tile(lColor);
+		}
+		catch (...)
+		{
+			lColorError = std::current_exception();
+		}
+	});
+
+	try
+	{
+		iElevation.tile(lElevation);
+	}
+	catch (...)
+	{
+		lThread.join();
+		throw;
+	}
+	lThread.join();
 
-	UpSampler lSampler(lFile);
-	if (lFile.mFormat == SAMPLEFORMAT_IEEEFP)
+	if (lColorError)
+	{
+		std::rethrow_exception(lColorError);
+	}
+}
+
+void TmsTiler::describe(TifFile& iFile)
+{
+	mRoot["x0"] = 256*(double)iFile.mInfo.p0.utmX/UTM_HEIGHT;
+	mRoot["x1"] = 256*(double)iFile.mInfo.p1.utmX/UTM_HEIGHT;
+	mRoot["y0"] = 256*(UTM_HEIGHT-(double)iFile.mInfo.p0.utmY)/UTM_HEIGHT;
+	mRoot["y1"] = 256*(UTM_HEIGHT-(double)iFile.mInfo.p1.utmY)/UTM_HEIGHT;
+
+	mRoot["maxZoom"] = (long)iFile.mInfo.maxZoom;
+	mRoot["minZoom"] = (long)iFile.mInfo.minZoom;
+	mRoot["proj"] = iFile.mInfo.proj;
+}
+
+void TmsTiler::tile(TifFile& iFile)
+{
+	UpSampler lSampler(iFile);
+
+	// pixels of the maximum zoom level, lower levels halve them
+	json_spirit::mObject lGrid;
+	lGrid["x"] = (double)iFile.mInfo.p0.mapX;
+	lGrid["y"] = (double)iFile.mInfo.p0.mapY;
+	// map coordinates are rounded to floats, updates are placed relative to the exact origin
+	lGrid["utmX"] = iFile.mInfo.p0.utmX;
+	lGrid["utmY"] = iFile.mInfo.p0.utmY;
+	lGrid["width"] = (int)lSampler.mImageW;
+	lGrid["height"] = (int)lSampler.mImageH;
+	mRoot["grid"] = lGrid;
+
+	if (iFile.mFormat == SAMPLEFORMAT_IEEEFP)
 	{
 		// depth
-		boost::filesystem::create_directory(boost::filesystem::path("elevation"));
-		chdir("elevation");
+		TileSink* lSink = createSink("elevation");
 
 		mRoot["size"] = 1; 
 		mRoot["type"] = "float32";
 		mRoot["format"] = ".bin";
+		if (mPrecision > 0)
+		{
+			mRoot["format"] = ".elv";
+			mRoot["precision"] = (double)mPrecision;
+		}
+		ImageYDepth::sPrecision = mPrecision;
 
 		ImageYDepth::sMin = std::numeric_limits<float>::max();
 		ImageYDepth::sMax = -std::numeric_limits<float>::max();
-		ImageXY<float, 1, ImageYDepth> lLevel0(lSampler.mImageW, lSampler.mImageH, lFile.mInfo.maxZoom, lFile.mInfo.minZoom, lFile.mInfo.p0.mapX, lFile.mInfo.p0.mapY, ImageYDepth::NOVALUE_VOXXLR);
+		ImageXY<float, 1, ImageYDepth> lLevel0(*lSink, lSampler.mImageW, lSampler.mImageH, iFile.mInfo.maxZoom, iFile.mInfo.minZoom, iFile.mInfo.p0.mapX, iFile.mInfo.p0.mapY, ImageYDepth::NOVALUE_VOXXLR, mThreads);
 		for (uint32_t y = 0; y < lSampler.mImageH; y ++)   
 		{
 			lSampler.readLine(lLevel0.mLineWindow, y);
@@ -1209,25 +1690,28 @@ void TmsTiler::process(std::string iFile)
 			}
 		}
 		lLevel0.close();
+
+		json_spirit::mObject lSparse;
+		lLevel0.manifest(lSparse);
+		mRoot["sparse"] = lSparse;
+
+		closeSink(lSink, "elevation");
 		
 		BOOST_LOG_TRIVIAL(info) << "min/max " << ImageYDepth::sMin << "/" << ImageYDepth::sMax;
 
 		mRoot["min"] = ImageYDepth::sMin;
 		mRoot["max"] = ImageYDepth::sMax;
-
-		chdir("..");
 	}
 	else
 	{
 		// color
-		boost::filesystem::create_directory(boost::filesystem::path("color"));
-		chdir("color");
+		TileSink* lSink = createSink("color");
 
 		mRoot["size"] = 3;
 		mRoot["type"] = "uint8";
 		mRoot["format"] = ".png";
 
-		ImageXY<unsigned char, 3, ImageYColor> lLevel0(lSampler.mImageW, lSampler.mImageH, lFile.mInfo.maxZoom, lFile.mInfo.minZoom, lFile.mInfo.p0.mapX, lFile.mInfo.p0.mapY, 255);
+		ImageXY<unsigned char, 3, ImageYColor> lLevel0(*lSink, lSampler.mImageW, lSampler.mImageH, iFile.mInfo.maxZoom, iFile.mInfo.minZoom, iFile.mInfo.p0.mapX, iFile.mInfo.p0.mapY, 255, mThreads);
 		for (uint32_t y = 0; y < lSampler.mImageH; y ++)
 		{
 			lSampler.readLine(lLevel0.mLineWindow, y);
@@ -1240,14 +1724,996 @@ void TmsTiler::process(std::string iFile)
 		}
 
 		lLevel0.close();
-		chdir("..");
-	}
 
-	chdir("..");
+		json_spirit::mObject lSparse;
+		lLevel0.manifest(lSparse);
+		mRoot["sparse"] = lSparse;
+
+		closeSink(lSink, "color");
+	}
 };
 
 
 
+//
+// Update
+//
+
+static inline int64 floorDiv(int64 iA, int64 iB)
+{
+	return iA >= 0 ? iA/iB : -((-iA + iB - 1)/iB);
+}
+
+static inline uint64 tileKey(uint32 iX, uint32 iY)
+{
+	return ((uint64)iX << 32) | iY;
+}
+
+// writes the tiles whose content differs from the tile stored under their path
+class UpdateSink : public TileSink
+{
+	public:
+
+		// the hashes of the tiles are kept up to date when the tree has them
+		UpdateSink(std::string iName, const std::map<std::string, uint64_t>& iHashes, bool iRecord, json_spirit::mArray& iChanged, json_spirit::mArray& iRemoved)
+		: TileSink("root/" + iName, iRecord)
+		, mName(iName)
+		, mChanged(iChanged)
+		, mRemoved(iRemoved)
+		{
+			mHashes = iHashes;
+		}
+
+		void write(const std::string& iPath, const void* iData, size_t iSize)
+		{
+			uint64_t lHash = hash(iData, iSize);
+			if (stored(iPath) == lHash)
+			{
+				record(iPath, lHash);
+				return;
+			}
+
+			createDirectory(boost::filesystem::path(iPath).parent_path().string());
+			TileSink::write(iPath, iData, iSize);
+
+			boost::lock_guard<boost::mutex> lLock(mLock);
+			mChanged.push_back(mName + "/" + iPath);
+		}
+
+		bool exists(const std::string& iPath)
+		{
+			return boost::filesystem::exists(boost::filesystem::path(mRoot + "/" + iPath));
+		}
+
+		void remove(const std::string& iPath)
+		{
+			if (boost::filesystem::remove(boost::filesystem::path(mRoot + "/" + iPath)))
+			{
+				boost::lock_guard<boost::mutex> lLock(mLock);
+				mHashes.erase(iPath);
+				mRemoved.push_back(mName + "/" + iPath);
+			}
+		}
+
+	protected:
+
+		std::string mName;
+		json_spirit::mArray& mChanged;
+		json_spirit::mArray& mRemoved;
+
+		// hash of the stored tile, trees written without hashes are read
+		uint64_t stored(const std::string& iPath)
+		{
+			{
+				boost::lock_guard<boost::mutex> lLock(mLock);
+				std::map<std::string, uint64_t>::iterator lIter = mHashes.find(iPath);
+				if (lIter != mHashes.end())
+				{
+					return lIter->second;
+				}
+			}
+
+			std::vector<uint8_t> lData;
+			FILE* lFile = fopen((mRoot + "/" + iPath).c_str(), "rb");
+			if (lFile == NULL)
+			{
+				return 0;
+			}
+			fseek(lFile, 0, SEEK_END);
+			lData.resize(ftell(lFile));
+			fseek(lFile, 0, SEEK_SET);
+			lData.resize(fread(lData.data(), 1, lData.size(), lFile));
+			fclose(lFile);
+			return hash(lData.data(), lData.size());
+		}
+};
+
+// writes the pixels of its tiles as they are
+template <typename T, int S> class ImageYRaw : public ImageY
+{
+	public:
+
+		ImageYRaw(TileSink& iSink, uint32_t iZ, uint32_t iX, uint32_t iTileX, uint32_t iLineX, uint32_t iCount, ImageWindow<T, S>& iWindow)
+		: ImageY(iSink, iZ, iX, iTileX, iCount)
+		, mWindow(iWindow)
+		, mLineX(iLineX)
+		, mValues(256*256*S, iWindow.mInit)
+		{
+		}
+
+		void processLine(uint32_t iLineY, uint32_t iTileY, T* iLine)
+		{
+			if (iLineY > 0 && iLineY % 256 == 0)
+			{
+				uint32_t lTileY = iTileY + iLineY/256-1;
+				for (size_t i=0; i<mValues.size(); i+=S)
+				{
+					if (ImageWindow<T, S>::isValid(&mValues[i]))
+					{
+						mSink.write(mPath + std::to_string((boost::int64_t)(lTileY)), mValues.data(), mValues.size()*sizeof(T));
+						break;
+					}
+				}
+				std::fill(mValues.begin(), mValues.end(), mWindow.mInit);
+			}
+
+			memcpy(&mValues[((iLineY%256)*256+mTileX)*S], &iLine[mLineX*S], mCount*S*sizeof(T));
+		}
+
+	protected:
+
+		ImageWindow<T, S>& mWindow;
+		uint32 mLineX;
+		std::vector<T> mValues;
+};
+
+
+// pixels of the stored tiles without their border
+static bool readTile(std::string iFile, std::string iFormat, unsigned char* iValues)
+{
+	PngReader lReader(iValues);
+	return lReader.read(iFile);
+}
+
+static bool readTile(std::string iFile, std::string iFormat, float* iValues)
+{
+	FILE* lFile = fopen(iFile.c_str(), "rb");
+	if (lFile == NULL)
+	{
+		return false;
+	}
+	std::vector<uint8_t> lData;
+	fseek(lFile, 0, SEEK_END);
+	lData.resize(ftell(lFile));
+	fseek(lFile, 0, SEEK_SET);
+	lData.resize(fread(lData.data(), 1, lData.size(), lFile));
+	fclose(lFile);
+
+	std::vector<float> lTile(260*260);
+	if (iFormat == ".elv")
+	{
+		size_t lSize = lData.size();
+		lData.resize(lSize + 8);
+		if (!ElevationCodec::decode(lData.data(), lSize, 260, 260, ImageYDepth::NOVALUE_VOXXLR, lTile.data()))
+		{
+			return false;
+		}
+	}
+	else if (lData.size() == lTile.size()*sizeof(float))
+	{
+		memcpy(lTile.data(), lData.data(), lData.size());
+	}
+	else
+	{
+		return false;
+	}
+
+	for (int y=0; y<256; y++)
+	{
+		memcpy(&iValues[y*256], &lTile[(y+2)*260+2], 256*sizeof(float));
+	}
+	return true;
+}
+
+static void uniformValue(json_spirit::mArray& iEntry, unsigned char* iValue)
+{
+	for (int s=0; s<3; s++)
+	{
+		iValue[s] = iEntry[2+s].get_int();
+	}
+}
+
+static void uniformValue(json_spirit::mArray& iEntry, float* iValue)
+{
+	iValue[0] = iEntry[2].get_real();
+}
+
+static void uniformEntry(unsigned char* iValue, json_spirit::mArray& iEntry)
+{
+	for (int s=0; s<3; s++)
+	{
+		iEntry.push_back((int)iValue[s]);
+	}
+}
+
+static void uniformEntry(float* iValue, json_spirit::mArray& iEntry)
+{
+	iEntry.push_back((double)iValue[0]);
+}
+
+static void writeTile(TileSink& iSink, std::string iPath, std::vector<unsigned char>& iTile, float iPrecision)
+{
+	PngWriter lWriter(iTile.data());
+	lWriter.write(iSink, iPath);
+}
+
+static void writeTile(TileSink& iSink, std::string iPath, std::vector<float>& iTile, float iPrecision)
+{
+	if (iPrecision > 0)
+	{
+		std::vector<uint8_t> lCode(ElevationCodec::maxEncodedSize(260, 260));
+		size_t lSize = ElevationCodec::encode(iTile.data(), 260, 260, iPrecision, ImageYDepth::NOVALUE_VOXXLR, lCode.data());
+		iSink.write(iPath + ".elv", lCode.data(), lSize);
+	}
+	else
+	{
+		iSink.write(iPath + ".bin", iTile.data(), iTile.size()*sizeof(float));
+	}
+}
+
+
+// one zoom level of a tile tree, pixels are addressed by their position in the level
+template <typename T, int S> class TileLevel
+{
+	public:
+
+		struct Tile
+		{
+			std::vector<T> mValues;
+			bool mChanged;
+		};
+
+		TileLevel(std::string iName, std::string iFormat, uint32 iZ, json_spirit::mObject& iSparse, double iWorldX, double iWorldY, uint32 iWidth, T iInit)
+		: mName(iName)
+		, mFormat(iFormat)
+		, mZoom(std::to_string((boost::int64_t)iZ))
+		, mX0((uint64)(iWorldX*pow(2, iZ)))
+		, mY0((uint64)(iWorldY*pow(2, iZ)))
+		, mWidth(iWidth)
+		, mInit(S, iInit)
+		{
+			if (iSparse.find(mZoom) != iSparse.end())
+			{
+				json_spirit::mObject& lLevel = iSparse[mZoom].get_obj();
+				json_spirit::mArray& lEmpty = lLevel["empty"].get_array();
+				for (size_t i=0; i<lEmpty.size(); i++)
+				{
+					json_spirit::mArray& lTile = lEmpty[i].get_array();
+					mEmpty.insert(tileKey(lTile[0].get_int(), lTile[1].get_int()));
+				}
+				json_spirit::mArray& lUniform = lLevel["uniform"].get_array();
+				for (size_t i=0; i<lUniform.size(); i++)
+				{
+					json_spirit::mArray& lTile = lUniform[i].get_array();
+					mUniform[tileKey(lTile[0].get_int(), lTile[1].get_int())] = lTile;
+				}
+			}
+		}
+
+		// first pixel of the image of the level
+		int64 mX0;
+		int64 mY0;
+		uint32 mWidth;
+
+		std::map<uint64, Tile> mTiles;
+
+		std::set<uint64> mEmpty;
+		std::map<uint64, json_spirit::mArray> mUniform;
+
+		std::string path(uint32 iX, uint32 iY)
+		{
+			return mZoom + "/" + std::to_string((boost::int64_t)iX) + "/" + std::to_string((boost::int64_t)iY);
+		}
+
+		// reads a tile unless it is loaded already, tiles which are not stored hold no data
+		Tile& load(uint32 iX, uint32 iY)
+		{
+			uint64 lKey = tileKey(iX, iY);
+			typename std::map<uint64, Tile>::iterator lIter = mTiles.find(lKey);
+			if (lIter != mTiles.end())
+			{
+				return lIter->second;
+			}
+
+			Tile& lTile = mTiles[lKey];
+			lTile.mChanged = false;
+			lTile.mValues.resize(256*256*S);
+
+			std::map<uint64, json_spirit::mArray>::iterator lUniform = mUniform.find(lKey);
+			if (lUniform != mUniform.end())
+			{
+				T lValue[S];
+				uniformValue(lUniform->second, lValue);
+				for (size_t i=0; i<lTile.mValues.size(); i++)
+				{
+					lTile.mValues[i] = lValue[i%S];
+				}
+			}
+			else if (!readTile("root/" + mName + "/" + path(iX, iY) + mFormat, mFormat, lTile.mValues.data()))
+			{
+				for (size_t i=0; i<lTile.mValues.size(); i++)
+				{
+					lTile.mValues[i] = mInit[i%S];
+				}
+			}
+			return lTile;
+		}
+
+		// loads all tiles holding pixels of columns [iX0, iX1] and rows [iY0, iY1]
+		void load(int64 iX0, int64 iY0, int64 iX1, int64 iY1)
+		{
+			for (int64 y=floorDiv(std::max<int64>(0, iY0), 256); y<=floorDiv(iY1, 256); y++)
+			{
+				for (int64 x=floorDiv(std::max<int64>(0, iX0), 256); x<=floorDiv(iX1, 256); x++)
+				{
+					load(x, y);
+				}
+			}
+		}
+
+		// the pixels of a row of the level, from loaded tiles only
+		void row(int64 iX, int64 iY, uint32 iCount, T* iRow)
+		{
+			for (uint32 i=0; i<iCount; )
+			{
+				int64 lX = iX + i;
+				uint32 lCount = std::min<int64>(iCount - i, 256 - (lX%256 + 256)%256);
+				const Tile* lTile = lX >= 0 && iY >= 0 ? find(floorDiv(lX, 256), floorDiv(iY, 256)) : NULL;
+				for (uint32 j=0; j<lCount; j++)
+				{
+					memcpy(&iRow[(i+j)*S], lTile ? &lTile->mValues[((iY%256)*256 + (lX+j)%256)*S] : mInit.data(), S*sizeof(T));
+				}
+				i += lCount;
+			}
+		}
+
+		const T* pixel(int64 iX, int64 iY)
+		{
+			const Tile* lTile = iX >= 0 && iY >= 0 ? find(floorDiv(iX, 256), floorDiv(iY, 256)) : NULL;
+			return lTile ? &lTile->mValues[((iY%256)*256 + iX%256)*S] : mInit.data();
+		}
+
+		const Tile* find(uint32 iX, uint32 iY)
+		{
+			typename std::map<uint64, Tile>::iterator lIter = mTiles.find(tileKey(iX, iY));
+			return lIter != mTiles.end() ? &lIter->second : NULL;
+		}
+
+		// the columns of tiles which hold pixels of the image
+		bool inGrid(uint32 iX)
+		{
+			return iX >= mX0/256 && iX <= (mX0 + mWidth - 1)/256;
+		}
+
+		void manifest(json_spirit::mObject& iSparse)
+		{
+			json_spirit::mArray lEmpty;
+			for (std::set<uint64>::iterator lIter = mEmpty.begin(); lIter != mEmpty.end(); lIter++)
+			{
+				json_spirit::mArray lTile = { (int)(*lIter >> 32), (int)(*lIter & 0xffffffff) };
+				lEmpty.push_back(lTile);
+			}
+			json_spirit::mArray lUniform;
+			for (std::map<uint64, json_spirit::mArray>::iterator lIter = mUniform.begin(); lIter != mUniform.end(); lIter++)
+			{
+				lUniform.push_back(lIter->second);
+			}
+
+			iSparse.erase(mZoom);
+			if (lEmpty.size() || lUniform.size())
+			{
+				json_spirit::mObject lLevel;
+				lLevel["empty"] = lEmpty;
+				lLevel["uniform"] = lUniform;
+				iSparse[mZoom] = lLevel;
+			}
+		}
+
+		// the tile as TmsTiler stores it, color tiles are the pixels of the image inside them
+		void compose(uint32 iX, uint32 iY, std::vector<unsigned char>& iTile)
+		{
+			iTile.resize(256*256*3);
+			for (int y=0; y<256; y++)
+			{
+				row((int64)256*iX, (int64)256*iY + y, 256, &iTile[y*256*3]);
+				for (int x=0; x<256; x++)
+				{
+					int64 lX = (int64)256*iX + x;
+					if (lX < mX0 || lX >= mX0 + mWidth)
+					{
+						memcpy(&iTile[(y*256+x)*3], mInit.data(), 3);
+					}
+				}
+			}
+		}
+
+		// elevation tiles have a border of two pixels, the first and last columns of the image repeat into it 
+		void compose(uint32 iX, uint32 iY, std::vector<float>& iTile)
+		{
+			iTile.resize(260*260);
+			for (int y=0; y<260; y++)
+			{
+				for (int x=0; x<260; x++)
+				{
+					int64 lX = (int64)256*iX + x - 2;
+					int64 lY = (int64)256*iY + y - 2;
+					if (lX < mX0 - 2 || lX > mX0 + mWidth + 1)
+					{
+						iTile[y*260+x] = mInit[0];
+					}
+					else
+					{
+						iTile[y*260+x] = *pixel(std::min<int64>(std::max<int64>(lX, mX0), mX0 + mWidth - 1), lY);
+					}
+				}
+			}
+		}
+
+	protected:
+
+		std::string mName;
+		std::string mFormat;
+		std::string mZoom;
+		std::vector<T> mInit;
+};
+
+
+// the interior pixels of tile (iX, iY) of the lower level reduced from the level above it with the filter of ImageWindow
+template <typename T, int S> static void reduceTile(TileLevel<T, S>& iLevel, TileLevel<T, S>& iParent, uint32 iX, uint32 iY, std::vector<T>& iValues, T iInit)
+{
+	typedef ImageWindow<T, S> Window;
+	const int TAPS = Window::TAPS;
+
+	int64 lWidth = iLevel.mWidth;
+	int64 lC0 = (int64)256*iX - iParent.mX0;
+	int64 lR0 = (int64)256*iY - iParent.mY0;
+
+	std::fill(iValues.begin(), iValues.end(), iInit);
+
+	// columns of the image of the lower level inside the tile
+	int64 lBegin = std::max<int64>(0, lC0);
+	int64 lEnd = std::min<int64>(lWidth/2, lC0 + 256);
+	if (lBegin >= lEnd)
+	{
+		return;
+	}
+	uint32 lCount = lEnd - lBegin;
+
+	// columns of the level above the filter reaches, repeating its first and last column
+	int64 lFirstX = 2*lBegin - TAPS/2 + 1;
+	uint32 lSpan = 2*lCount + TAPS - 2;
+	int64 lLoadX = std::max<int64>(0, lFirstX);
+	uint32 lLoadCount = std::min<int64>(lWidth - 1, lFirstX + lSpan - 1) - lLoadX + 1;
+
+	// filtered rows 2r-4 to 2r+1 for the rows r of the tile
+	int64 lFirstY = 2*lR0 - TAPS + 2;
+	uint32 lRows = 2*256 + TAPS - 2;
+	std::vector<float> lWeights(lRows*lCount, 0.0f);
+	std::vector<float> lValues(lRows*S*lCount, 0.0f);
+
+	std::vector<T> lLoaded(lLoadCount*S);
+	std::vector<T> lPixels(lSpan*S);
+	std::vector<float> lScratch((S+1)*lSpan);
+	for (uint32 k=0; k<lRows; k++)
+	{
+		int64 lY = lFirstY + k;
+		iLevel.row(iLevel.mX0 + lLoadX, iLevel.mY0 + lY, lLoadCount, lLoaded.data());
+		for (uint32 x=0; x<lSpan; x++)
+		{
+			int64 lX = std::min<int64>(std::max<int64>(lFirstX + x, 0), lWidth - 1);
+			memcpy(&lPixels[x*S], &lLoaded[(lX - lLoadX)*S], S*sizeof(T));
+		}
+		Window::filterRow(lPixels.data(), lCount, &lValues[k*S*lCount], &lWeights[k*lCount], lScratch.data());
+	}
+
+	std::vector<float> lValue(S*lCount);
+	std::vector<float> lWeight(lCount);
+	std::vector<T> lRow0(2*lCount*S);
+	std::vector<T> lRow1(2*lCount*S);
+	float* lRowValues[TAPS];
+	float* lRowWeights[TAPS];
+	for (uint32 y=0; y<256; y++)
+	{
+		if (lR0 + y < 0)
+		{
+			continue;
+		}
+
+		for (int j=0; j<TAPS; j++)
+		{
+			lRowValues[j] = &lValues[(2*y + j)*S*lCount];
+			lRowWeights[j] = &lWeights[(2*y + j)*lCount];
+		}
+		Window::filterColumn(lRowValues, lRowWeights, lCount, lValue.data(), lWeight.data());
+
+		iLevel.row(iLevel.mX0 + 2*lBegin, iLevel.mY0 + lFirstY + 2*y + 2, 2*lCount, lRow0.data());
+		iLevel.row(iLevel.mX0 + 2*lBegin, iLevel.mY0 + lFirstY + 2*y + 3, 2*lCount, lRow1.data());
+		Window::reduceRow(lRow0.data(), lRow1.data(), lValue.data(), lWeight.data(), lCount, iInit, &iValues[(y*256 + lBegin - lC0)*S]);
+	}
+}
+
+
+// a zoom level of an update, the tiles with changed pixels are written and reduced into the level
+// below it once the rows they need are final, rows which no later row needs are dropped
+template <typename T, int S> class LevelUpdate
+{
+	public:
+
+		LevelUpdate(TileLevel<T, S>* iLevel, LevelUpdate<T, S>* iParent, UpdateSink& iSink, std::string iFormat, float iPrecision, uint32 iThreads, T iInit)
+		: mLevel(iLevel)
+		, mParent(iParent)
+		, mChanged(0)
+		, mSink(iSink)
+		, mFormat(iFormat)
+		, mPrecision(iPrecision)
+		, mThreads(iThreads)
+		, mInit(iInit)
+		{
+		}
+
+		~LevelUpdate()
+		{
+			delete mLevel;
+		}
+
+		TileLevel<T, S>* mLevel;
+		LevelUpdate<T, S>* mParent;
+
+		// tiles with changed pixels
+		size_t mChanged;
+
+		// tile (iX, iY) holds changed pixels, rows at and below it are not final yet
+		void change(uint32 iX, uint32 iY)
+		{
+			mChanged++;
+
+			// tiles which show changed pixels, elevation tiles also in their border
+			int lBorder = S == 1 ? 1 : 0;
+			for (int64 y = std::max<int64>(0, (int64)iY - lBorder); y <= (int64)iY + lBorder; y++)
+			{
+				for (int64 x = std::max<int64>(0, (int64)iX - lBorder); x <= (int64)iX + lBorder; x++)
+				{
+					if (mLevel->inGrid(x))
+					{
+						mStore.insert(tileKey(x, y));
+					}
+				}
+			}
+
+			// tiles of the lower level whose filter reaches into the tile
+			if (mParent)
+			{
+				TileLevel<T, S>* lParent = mParent->mLevel;
+				int64 lX = (int64)iX*256 - mLevel->mX0;
+				int64 lY = (int64)iY*256 - mLevel->mY0;
+				int64 lC0 = std::max<int64>(0, floorDiv(lX - 3, 2));
+				int64 lC1 = std::min<int64>(lParent->mWidth - 1, floorDiv(lX + 255 + 2, 2));
+				int64 lR0 = std::max<int64>(0, floorDiv(lY - 1, 2));
+				int64 lR1 = floorDiv(lY + 255 + 4, 2);
+				for (int64 y = floorDiv(lParent->mY0 + lR0, 256); y <= floorDiv(lParent->mY0 + lR1, 256); y++)
+				{
+					for (int64 x = floorDiv(lParent->mX0 + lC0, 256); x <= floorDiv(lParent->mX0 + lC1, 256); x++)
+					{
+						mReduce.insert(tileKey(x, y));
+					}
+				}
+			}
+		}
+
+		// the tiles of the rows above iRow are final
+		void advance(int64 iRow)
+		{
+			store(iRow);
+			if (mParent)
+			{
+				reduce(iRow);
+
+				// the first row of the lower level which needs a row at or below iRow
+				mParent->advance(floorDiv((int64)256*iRow - mLevel->mY0 + 2*mParent->mLevel->mY0 - 513 + 511, 512));
+			}
+
+			// rows further up are neither in the border of a tile nor filtered again
+			for (typename std::map<uint64, typename TileLevel<T, S>::Tile>::iterator lIter = mLevel->mTiles.begin(); lIter != mLevel->mTiles.end(); )
+			{
+				if ((int64)(lIter->first & 0xffffffff) < iRow - 3)
+				{
+					mLevel->mTiles.erase(lIter++);
+				}
+				else
+				{
+					lIter++;
+				}
+			}
+		}
+
+	protected:
+
+		UpdateSink& mSink;
+		std::string mFormat;
+		float mPrecision;
+		uint32 mThreads;
+		T mInit;
+
+		std::set<uint64> mStore;
+		std::set<uint64> mReduce;
+
+		// last row of this level the filter of row iY of the lower level reads
+		int64 lastRow(int64 iY)
+		{
+			return floorDiv(mLevel->mY0 + 2*((int64)256*iY - mParent->mLevel->mY0) + 513, 256);
+		}
+
+		// the tiles to store whose border lies in final rows
+		void store(int64 iRow)
+		{
+			int lBorder = S == 1 ? 1 : 0;
+			std::vector<uint64> lTiles;
+			for (std::set<uint64>::iterator lIter = mStore.begin(); lIter != mStore.end(); )
+			{
+				if ((int64)(*lIter & 0xffffffff) + lBorder < iRow)
+				{
+					lTiles.push_back(*lIter);
+					mStore.erase(lIter++);
+				}
+				else
+				{
+					lIter++;
+				}
+			}
+			if (lTiles.empty())
+			{
+				return;
+			}
+
+			for (size_t i=0; i<lTiles.size(); i++)
+			{
+				int64 lX = lTiles[i] >> 32;
+				int64 lY = lTiles[i] & 0xffffffff;
+				mLevel->load(256*lX - 2, 256*lY - 2, 256*lX + 257, 256*lY + 257);
+			}
+
+			// tiles are composed and written concurrently, the manifest is updated after
+			std::vector<json_spirit::mArray> lUniform(lTiles.size());
+			std::vector<char> lStored(lTiles.size());
+			boost::thread_group lGroup;
+			for (uint32 t=0; t<mThreads; t++)
+			{
+				lGroup.add_thread(new boost::thread([&, t]()
+				{
+					std::vector<T> lTile;
+					for (size_t i=t; i<lTiles.size(); i+=mThreads)
+					{
+						uint32 lX = lTiles[i] >> 32;
+						uint32 lY = lTiles[i] & 0xffffffff;
+						mLevel->compose(lX, lY, lTile);
+
+						bool lIsUniform = true;
+						for (size_t j=S; j<lTile.size() && lIsUniform; j++)
+						{
+							lIsUniform = lTile[j] == lTile[j%S];
+						}
+						lStored[i] = !lIsUniform;
+						if (!lIsUniform)
+						{
+							writeTile(mSink, mLevel->path(lX, lY), lTile, mPrecision);
+						}
+						else if (ImageWindow<T, S>::isValid(&lTile[0]))
+						{
+							lUniform[i] = { (int)lX, (int)lY };
+							uniformEntry(&lTile[0], lUniform[i]);
+						}
+					}
+				}));
+			}
+			lGroup.join_all();
+
+			for (size_t i=0; i<lTiles.size(); i++)
+			{
+				uint32 lX = lTiles[i] >> 32;
+				uint32 lY = lTiles[i] & 0xffffffff;
+				uint64 lKey = lTiles[i];
+				std::string lPath = mLevel->path(lX, lY) + mFormat;
+
+				bool lKnown = mLevel->mEmpty.count(lKey) || mLevel->mUniform.count(lKey) || mSink.exists(lPath);
+				if (!lStored[i])
+				{
+					mSink.remove(lPath);
+				}
+				mLevel->mEmpty.erase(lKey);
+				mLevel->mUniform.erase(lKey);
+				if (lUniform[i].size())
+				{
+					mLevel->mUniform[lKey] = lUniform[i];
+				}
+				else if (!lStored[i] && lKnown)
+				{
+					mLevel->mEmpty.insert(lKey);
+				}
+			}
+		}
+
+		// the tiles of the lower level whose filter only reads final rows
+		void reduce(int64 iRow)
+		{
+			TileLevel<T, S>* lParent = mParent->mLevel;
+			std::vector<uint64> lTiles;
+			for (std::set<uint64>::iterator lIter = mReduce.begin(); lIter != mReduce.end(); )
+			{
+				if (lastRow(*lIter & 0xffffffff) < iRow)
+				{
+					lTiles.push_back(*lIter);
+					mReduce.erase(lIter++);
+				}
+				else
+				{
+					lIter++;
+				}
+			}
+			if (lTiles.empty())
+			{
+				return;
+			}
+
+			for (size_t i=0; i<lTiles.size(); i++)
+			{
+				int64 lX = lTiles[i] >> 32;
+				int64 lY = lTiles[i] & 0xffffffff;
+				lParent->load(lX, lY);
+				int64 lC = 256*lX - lParent->mX0;
+				int64 lR = 256*lY - lParent->mY0;
+				mLevel->load(mLevel->mX0 + 2*lC - 2, mLevel->mY0 + 2*lR - 4, mLevel->mX0 + 2*lC + 513, mLevel->mY0 + 2*lR + 513);
+			}
+
+			std::vector<std::vector<T> > lReduced(lTiles.size());
+			boost::thread_group lGroup;
+			for (uint32 t=0; t<mThreads; t++)
+			{
+				lGroup.add_thread(new boost::thread([&, t]()
+				{
+					for (size_t i=t; i<lTiles.size(); i+=mThreads)
+					{
+						lReduced[i].resize(256*256*S);
+						reduceTile(*mLevel, *lParent, lTiles[i] >> 32, lTiles[i] & 0xffffffff, lReduced[i], mInit);
+					}
+				}));
+			}
+			lGroup.join_all();
+
+			// only pixels of the image are compared, elevation tiles repeat its edges around it
+			for (size_t i=0; i<lTiles.size(); i++)
+			{
+				int64 lX = lTiles[i] >> 32;
+				int64 lY = lTiles[i] & 0xffffffff;
+				typename TileLevel<T, S>::Tile& lTile = lParent->load(lX, lY);
+				int64 lBegin = std::max<int64>(0, lParent->mX0 - 256*lX);
+				int64 lEnd = std::min<int64>(256, lParent->mX0 + lParent->mWidth - 256*lX);
+				for (int y=0; y<256 && !lTile.mChanged; y++)
+				{
+					lTile.mChanged = lBegin < lEnd && memcmp(&lTile.mValues[(y*256+lBegin)*S], &lReduced[i][(y*256+lBegin)*S], (lEnd-lBegin)*S*sizeof(T)) != 0;
+				}
+				if (lTile.mChanged)
+				{
+					lTile.mValues.swap(lReduced[i]);
+					mParent->change(lX, lY);
+				}
+			}
+		}
+};
+
+// merges the valid pixels of the tiles of a raster inside the image of the tree into its maximum zoom level
+template <typename T, int S> class PatchSink : public TileSink
+{
+	public:
+
+		PatchSink(LevelUpdate<T, S>& iLevel, uint32 iHeight)
+		: TileSink("")
+		, mRow(-1)
+		, mLevel(iLevel)
+		, mHeight(iHeight)
+		{
+		}
+
+		void createDirectory(const std::string&)
+		{
+		}
+
+		// the tiles of a row are written concurrently, each row is complete before the next one is written
+		void write(const std::string& iPath, const void* iData, size_t iSize)
+		{
+			uint32 lX;
+			uint32 lY;
+			sscanf(iPath.c_str(), "%*u/%u/%u", &lX, &lY);
+
+			boost::lock_guard<boost::mutex> lLock(mLock);
+			mRow = std::max<int64>(mRow, lY);
+
+			TileLevel<T, S>* lLevel = mLevel.mLevel;
+			if (!lLevel->inGrid(lX))
+			{
+				return;
+			}
+
+			typename TileLevel<T, S>::Tile& lTile = lLevel->load(lX, lY);
+			const T* lValues = (const T*)iData;
+			for (int y=0; y<256; y++)
+			{
+				int64 lPixelY = (int64)256*lY + y;
+				for (int x=0; x<256; x++)
+				{
+					int64 lPixelX = (int64)256*lX + x;
+					T* lPixel = (T*)&lValues[(y*256+x)*S];
+					T* lStored = &lTile.mValues[(y*256+x)*S];
+					if (lPixelX >= lLevel->mX0 && lPixelX < lLevel->mX0 + lLevel->mWidth && lPixelY >= lLevel->mY0 && lPixelY < lLevel->mY0 + mHeight && ImageWindow<T, S>::isValid(lPixel) && memcmp(lPixel, lStored, S*sizeof(T)))
+					{
+						memcpy(lStored, lPixel, S*sizeof(T));
+						lTile.mChanged = true;
+					}
+				}
+			}
+			if (lTile.mChanged)
+			{
+				mLevel.change(lX, lY);
+			}
+		}
+
+		// last row of tiles written
+		int64 mRow;
+
+	protected:
+
+		LevelUpdate<T, S>& mLevel;
+		uint32 mHeight;
+};
+
+
+TmsUpdater::TmsUpdater(uint32_t iThreads)
+: mThreads(std::max<uint32_t>(1, iThreads))
+{
+}
+
+bool TmsUpdater::process(std::string iFile, json_spirit::mObject& iRoot)
+{
+	BOOST_LOG_TRIVIAL(info) << "Updating from file " << iFile;
+
+	if (iRoot.find("archive") != iRoot.end())
+	{
+		BOOST_LOG_TRIVIAL(error) << "Tile trees in the archive " << iRoot["archive"].get_str() << " cannot be updated, tile them again without archive";
+		return false;
+	}
+	if (iRoot.find("grid") == iRoot.end() || iRoot["grid"].get_obj().find("utmX") == iRoot["grid"].get_obj().end())
+	{
+		BOOST_LOG_TRIVIAL(error) << "Only tile trees which record their grid can be updated";
+		return false;
+	}
+
+	TifFile lFile(iFile, mThreads, 0);
+	if (lFile.mInfo.proj == "undef" || lFile.mInfo.proj != iRoot["proj"].get_str())
+	{
+		BOOST_LOG_TRIVIAL(error) << iFile << " is not in the projection of the tile tree";
+		return false;
+	}
+
+	bool lDepth = lFile.mFormat == SAMPLEFORMAT_IEEEFP;
+	if (lDepth != (iRoot["format"].get_str() != ".png"))
+	{
+		BOOST_LOG_TRIVIAL(error) << iFile << " does not hold the data of the tile tree";
+		return false;
+	}
+
+	// the raster is sampled at the pixels of the maximum zoom level of the tree
+	lFile.mInfo.maxZoom = iRoot["maxZoom"].get_int();
+	lFile.mInfo.mapPixelS = UTM_HEIGHT/(256*pow(2, lFile.mInfo.maxZoom));
+
+	if (lDepth)
+	{
+		ImageYDepth::sMin = iRoot["min"].get_real();
+		ImageYDepth::sMax = iRoot["max"].get_real();
+		update<float, 1>(lFile, iRoot, "elevation", ImageYDepth::NOVALUE_VOXXLR);
+		iRoot["min"] = ImageYDepth::sMin;
+		iRoot["max"] = ImageYDepth::sMax;
+	}
+	else
+	{
+		update<unsigned char, 3>(lFile, iRoot, "color", 255);
+	}
+	return true;
+}
+
+template <typename T, int S> void TmsUpdater::update(TifFile& iFile, json_spirit::mObject& iRoot, std::string iName, T iInit)
+{
+	json_spirit::mObject& lGrid = iRoot["grid"].get_obj();
+	double lWorldX = lGrid["x"].get_real();
+	double lWorldY = lGrid["y"].get_real();
+	uint32 lWidth = lGrid["width"].get_int();
+	uint32 lHeight = lGrid["height"].get_int();
+
+	uint32 lMaxZoom = iRoot["maxZoom"].get_int();
+	uint32 lMinZoom = iRoot["minZoom"].get_int();
+	std::string lFormat = iRoot["format"].get_str();
+	float lPrecision = iRoot.find("precision") != iRoot.end() ? iRoot["precision"].get_real() : 0;
+
+	if (iRoot.find("sparse") == iRoot.end())
+	{
+		iRoot["sparse"] = json_spirit::mObject();
+	}
+	json_spirit::mObject& lSparse = iRoot["sparse"].get_obj();
+
+	// trees tiled without hashes compare against the stored tiles
+	std::map<std::string, uint64_t> lHashes;
+	bool lRecord = iRoot.find("hashes") != iRoot.end();
+	if (lRecord)
+	{
+		readHashes("root/" + iName + ".hashes", lHashes);
+	}
+	UpdateSink lSink(iName, lHashes, lRecord, mChanged, mRemoved);
+	lHashes.clear();
+
+	// the levels from the minimum zoom level up, each reduces into the one before it
+	std::vector<LevelUpdate<T, S>*> lLevels;
+	for (uint32 z = lMinZoom; z <= lMaxZoom; z++)
+	{
+		TileLevel<T, S>* lLevel = new TileLevel<T, S>(iName, lFormat, z, lSparse, lWorldX, lWorldY, lWidth >> (lMaxZoom - z), iInit);
+		lLevels.push_back(new LevelUpdate<T, S>(lLevel, lLevels.empty() ? NULL : lLevels.back(), lSink, lFormat, lPrecision, mThreads, iInit));
+	}
+
+	// the raster is offset from the origin of the tree as it was placed, not from its own rounded map coordinates
+	double lMapX = lWorldX + (iFile.mInfo.p0.utmX - lGrid["utmX"].get_real())/UTM_HEIGHT*256;
+	double lMapY = lWorldY - (iFile.mInfo.p0.utmY - lGrid["utmY"].get_real())/UTM_HEIGHT*256;
+
+	// each row of tiles of the raster at the maximum zoom level is merged as it is complete and passed down the levels
+	LevelUpdate<T, S>& lTop = *lLevels.back();
+	PatchSink<T, S> lPatch(lTop, lHeight);
+	{
+		UpSampler lSampler(iFile);
+		ImageXY<T, S, ImageYRaw<T, S> > lLevel(lPatch, lSampler.mImageW, lSampler.mImageH, lMaxZoom, lMaxZoom, lMapX, lMapY, iInit, mThreads);
+		int64 lRow = 0;
+		for (uint32_t y = 0; y < lSampler.mImageH; y++)
+		{
+			lSampler.readLine(lLevel.mLineWindow, y);
+			lLevel.processLine();
+
+			if (lPatch.mRow >= lRow)
+			{
+				lRow = lPatch.mRow + 1;
+				lTop.advance(lRow);
+			}
+		}
+		lLevel.close();
+	}
+	lTop.advance(std::numeric_limits<int32>::max());
+
+	// the manifest of every level whose tiles were reduced again
+	for (size_t i = lLevels.size(); i-- > 0; )
+	{
+		BOOST_LOG_TRIVIAL(info) << "level " << (lMinZoom + i) << " " << lLevels[i]->mChanged << " changed tiles";
+		if (i == lLevels.size() - 1 || lLevels[i+1]->mChanged)
+		{
+			lLevels[i]->mLevel->manifest(lSparse);
+		}
+	}
+	for (size_t i=0; i<lLevels.size(); i++)
+	{
+		delete lLevels[i];
+	}
+
+	if (lRecord)
+	{
+		writeHashes("root/" + iName + ".hashes", lSink.hashes());
+	}
+}
+
+
+
 /*
 
 
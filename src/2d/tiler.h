@@ -10,6 +10,11 @@
 
 #include "png.h"
 
+#include <map>
+
+#include "tileSink.h"
+#include "tileArchive.h"
+
 class PngImage
 {
 	public:
@@ -63,7 +68,23 @@ class PngWriter
 		PngWriter(unsigned char iValues[256*256*3]);
 		~PngWriter();
 
-		void write(std::string iName);
+		void write(TileSink& iSink, std::string iName);
+
+	private:
+
+		png_bytep* mImageRows;
+};
+
+
+class PngReader
+{
+	public:
+
+		PngReader(unsigned char iValues[256*256*3]);
+		~PngReader();
+
+		// false if iFile is not a 256x256 rgb tile
+		bool read(std::string iFile);
 
 	private:
 
@@ -82,7 +103,8 @@ class TifFile
 {
 	public:
 
-		TifFile(std::string iFile);
+		// iOverview selects one of the reduced resolution images stored in the file, 0 is the full image
+		TifFile(std::string iFile, uint32 iThreads, uint32 iOverview);
 		~TifFile();
 
 		uint32 mImageW;
@@ -98,6 +120,8 @@ class TifFile
 		uint16 mBitsPerSample;
 
 		TIFF* mFile;
+		std::string mName;
+		tdir_t mDirectory;
 
 		struct Point
 		{
@@ -121,40 +145,76 @@ class TifFile
 			std::string proj;
 		} mInfo;
 
-		void readLine(uint32_t iLine, uint8* iBuffer);
+		// keeps any iRows consecutive rows in memory
+		void cache(uint32 iRows);
+
+		// row iLine of the image, it stays valid while rows up to the cached footprint below it are read
+		uint8* getLine(uint32_t iLine);
 
 	protected:
 
 		TifFormat* mReader;
 
 		uint16 mConfig;
+
+		// rows are decoded in bands of mBandH rows aligned to the blocks of the file
+		struct Band
+		{
+			int64 mBegin;
+			uint8* mData;
+		};
+
+		std::vector<Band> mBands;
+		uint32 mBandH;
+		uint32 mNext;
+		size_t mRowSize;
+
+		void selectOverview(uint32 iOverview);
 };
 
 class TifFormat
 {
 	public:
 
-		virtual void readLine(uint32_t iLine, uint8* iBuffer) = 0;
+		TifFormat(TifFile& iFile, uint32 iThreads);
+		virtual ~TifFormat();
+
+		// decodes rows [iBegin, iEnd) into consecutive rows of iBand, iBegin is a multiple of mRows
+		void readBand(uint32_t iBegin, uint32_t iEnd, uint8* iBand);
+
+		// rows decoded as one block
+		uint32 mRows;
+
+	protected:
+
+		TifFile& mFile;
+
+		// every thread decodes through its own handle, the first is the handle of the file
+		std::vector<TIFF*> mHandles;
+
+		virtual uint32 countBlocks(uint32_t iBegin, uint32_t iEnd) = 0;
+		virtual void readBlock(uint32 iThread, uint32 iBlock, uint32_t iBegin, uint32_t iEnd, uint8* iBand) = 0;
+
+		void readBlocks(uint32 iThread, uint32 iThreads, uint32 iCount, uint32_t iBegin, uint32_t iEnd, uint8* iBand);
 };
 
 class TifTiledFormat : public TifFormat
 {
 	public:
 
-		TifTiledFormat(TifFile& iFile);
+		TifTiledFormat(TifFile& iFile, uint32 iThreads);
 		~TifTiledFormat();
 
-		void readLine(uint32_t iLine, uint8* iBuffer);
-
 	protected:
 
 		uint32 mTileW;
 		uint32 mTileH;
+		uint32 mTilesX;
 
-		int32 mTileY;
+		std::vector<tdata_t> mBuffer;
 
-		tdata_t* mBuffer;
-		TifFile mFile;
+		uint32 countBlocks(uint32_t iBegin, uint32_t iEnd);
+		void readBlock(uint32 iThread, uint32 iBlock, uint32_t iBegin, uint32_t iEnd, uint8* iBand);
 };
 
 
@@ -162,15 +222,17 @@ class TifStripedFormat : public TifFormat
 {
 	public:
 
-		TifStripedFormat(TifFile& iFile);
-		~TifStripedFormat();
-
-		void readLine(uint32_t iLine, uint8* iBuffer);
+		TifStripedFormat(TifFile& iFile, uint32 iThreads);
 
 	protected:
 
-		tdata_t mBuffer;
-		TifFile mFile;
+		// strips taller than this are read one scanline at a time
+		static const uint32 MAX_STRIP = 1024;
+
+		uint32 countBlocks(uint32_t iBegin, uint32_t iEnd);
+		void readBlock(uint32 iThread, uint32 iBlock, uint32_t iBegin, uint32_t iEnd, uint8* iBand);
+
+		bool mScanlines;
 };
 
 
@@ -205,17 +267,27 @@ class UpSampler : public Sampler
 
 		TifFile& mFile;
 
-		struct Cache 
+		double mScalarX;
+		double mScalarY;
+
+		// source columns and weight of the second one for every output column, the same on every row
+		std::vector<uint32> mX0;
+		std::vector<uint32> mX1;
+		std::vector<float> mFractX;
+
+		// source rows interpolated along x, output rows between the same two source rows share them
+		struct Row
 		{
 			int32 y;
-			uint8* buffer;
+			std::vector<float> values;
+			std::vector<float> valid;
 		};
 
-		Cache mCache[2];
-		double mScalarX;
-		double mScalarY;
+		Row mRows[2];
 
-		uint8* getLine(int32 iY);
+		Row& getRow(int32 iY);
+		void lerpColor(uint8* iLine, Row& iRow);
+		void lerpDepth(uint8* iLine, Row& iRow);
 
 		PngImage* mPngImage;
 };
@@ -237,8 +309,6 @@ class NoSampler : public Sampler
 	private:
 	
 		TifFile& mFile;
-		uint8* mBuffer;
-	
 };
 
 
@@ -247,14 +317,19 @@ class ImageY
 {
 	public:
 
-		ImageY(uint32 iZ, uint32 iX, uint32 iTileX, uint32 iCount);
+		ImageY(TileSink& iSink, uint32 iZ, uint32 iX, uint32 iTileX, uint32 iCount);
+
+		// tiles which were not written, [x,y] if they hold no data and [x,y,value...] if every pixel is the same
+		json_spirit::mArray mEmpty;
+		json_spirit::mArray mUniform;
 
-		virtual void processLine(uint32 iLineY, uint32 iTileY) = 0;
-	
 	protected:
 
+		TileSink& mSink;
+		uint32 mX;
 		std::string mDirectoryZ;
 		std::string mDirectoryX;
+		std::string mPath;
 		uint32 mTileX;
 		uint32 mCount;
 };
@@ -264,15 +339,16 @@ class ImageYColor : public ImageY
 {
 	public:
 
-		ImageYColor(uint32 iZ, uint32 iX, uint32 iTileX, uint32 iLineX, uint32 iCount, ImageWindow<unsigned char, 3>& iWindow);
+		ImageYColor(TileSink& iSink, uint32 iZ, uint32 iX, uint32 iTileX, uint32 iLineX, uint32 iCount, ImageWindow<unsigned char, 3>& iWindow);
 
-		void processLine(uint32 iLineY, uint32 iTileY);
+		void processLine(uint32 iLineY, uint32 iTileY, unsigned char* iLine);
 
 	protected:
 
 		void clearImage();
+		bool isUniform();
 
-		unsigned char* mLine;
+		uint32 mLineX;
 		unsigned char mValues[256*256*3];
 
 		PngWriter mWriter;
@@ -291,17 +367,22 @@ class ImageYDepth : public ImageY
 		static float NOVALUE_PIX4D;
 		static float NOVALUE_VOXXLR;
 
-		ImageYDepth(uint32 iZ, uint32 iX, uint32 iTileX, int32 iLineX, uint32 iCount, ImageWindow<float, 1>& iWindow);
+		// tiles are quantized to this precision when it is not 0, else they are written as floats
+		static float sPrecision;
 
-		void processLine(uint32 iLineY, uint32 iTileY);
+		ImageYDepth(TileSink& iSink, uint32 iZ, uint32 iX, uint32 iTileX, int32 iLineX, uint32 iCount, ImageWindow<float, 1>& iWindow);
+
+		void processLine(uint32 iLineY, uint32 iTileY, float* iLine);
 
 	protected:
 	
 		void clearImage();
+		bool isUniform();
 
 		int32 mLineX;
 
 		float mValues[260*260];
+		std::vector<uint8_t> mCode;
 		
 		ImageWindow<float, 1>& mWindow;
 };
@@ -316,13 +397,59 @@ class TmsTiler
 {
 	public:
 
-		TmsTiler();
+		// bands are tiled by iThreads threads, the output does not depend on their number
+		// with iArchive the tiles of a dataset go into a single tile archive
+		// elevation is quantized to iPrecision when it is not 0
+		// with iHashes the content hashes of the tiles of a tile tree are written next to it
+		TmsTiler(uint32 iThreads, uint32 iOverview, bool iArchive, float iPrecision, bool iHashes);
 
 		void process(std::string iFile);
+
+		// tiles a color and an elevation raster at the same time
+		static void process(TmsTiler& iColor, std::string iColorFile, TmsTiler& iElevation, std::string iElevationFile);
 		
 		json_spirit::mObject mRoot;
 
 	protected:
 
+		uint32 mThreads;
+		uint32 mOverview;
+		bool mArchive;
+		float mPrecision;
+		bool mHashes;
+
+		TileSink* createSink(std::string iName);
+		void closeSink(TileSink* iSink, std::string iName);
+
+		void describe(TifFile& iFile);
+		void tile(TifFile& iFile);
+
 };
 
+
+//
+// Updates a tile tree made by TmsTiler from rasters which cover part of it. The tiles of the maximum
+// zoom level under a raster are merged with its valid pixels and every tile of a lower level which
+// is made from a changed tile is reduced again from the tiles of the level above it. Tiles whose
+// content did not change are not written again.
+//
+
+class TmsUpdater
+{
+	public:
+
+		TmsUpdater(uint32 iThreads);
+
+		// merges iFile into the dataset described by iRoot, false if the tree cannot be updated from it
+		bool process(std::string iFile, json_spirit::mObject& iRoot);
+
+		// paths below root of the tiles written and removed
+		json_spirit::mArray mChanged;
+		json_spirit::mArray mRemoved;
+
+	protected:
+
+		uint32 mThreads;
+
+		template <typename T, int S> void update(TifFile& iFile, json_spirit::mObject& iRoot, std::string iName, T iInit);
+};
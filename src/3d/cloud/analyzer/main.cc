@@ -21,6 +21,10 @@ bool processFile(json_spirit::mObject& iObject)
 {
 	uint64_t lPointCount; 
 	FILE* lFile = PointCloud::readHeader(iObject["file"].get_str(), 0, lPointCount);
+	if (!lFile)
+	{
+		return false;
+	}
 	fclose(lFile);
 
 	uint64_t lThreads = std::thread::hardware_concurrency();
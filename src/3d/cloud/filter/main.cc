@@ -16,37 +16,65 @@
 
 #include "voxelFilter.h"
 #include "radiusFilter.h"
+#include "../statisticalFilter.h"
 
 
 bool processFile(json_spirit::mObject& iConfig)
 {
-	uint64_t lPointCount;
-	FILE* lFile = PointCloud::readHeader(iConfig["file"].get_str(), 0, lPointCount);
-	fclose(lFile); 
+	PointCloud::configure(iConfig);
 
 	float lResolution = iConfig["resolution"].get_real();
 
-	uint64_t lThreads = std::thread::hardware_concurrency();
-	// 250 bytes per point includes voxel grid memory, file handles etc. 
-	KdFileTree lFileTree;
-	lFileTree.construct(iConfig["file"].get_str(), std::min((uint64_t)(availableMemory() / 250) / lThreads, lPointCount / lThreads), 1.1*KdFileTree::SIGMA*lResolution);
-	
 	json_spirit::mObject lFilter = iConfig["filter"].get_obj();
+	bool lFiltered = false;
 
-	if (lFilter.find("voxel") != iConfig.end() && !lFilter["voxel"].is_null())
+	// streams over the file without building the tree
+	if (lFilter.find("outlier") != lFilter.end() && !lFilter["outlier"].is_null())
 	{
-		VoxelFilter lVoxelFilter(lResolution);
-		lFileTree.process(lVoxelFilter, KdFileTree::LEAVES);
+		StatisticalFilter lStatisticalFilter(lResolution, lFilter["outlier"].get_real(), availableMemory() / 2);
+		lStatisticalFilter.process(iConfig["file"].get_str());
+		lFiltered = true;
 	}
 
-	if (lFilter.find("density") != iConfig.end() && !lFilter["density"].is_null())
+	bool lVoxel = lFilter.find("voxel") != lFilter.end() && !lFilter["voxel"].is_null();
+	bool lDensity = lFilter.find("density") != lFilter.end() && !lFilter["density"].is_null();
+	if (lVoxel || lDensity)
 	{
-		RadiusFilter lRadiusFilter(lResolution, lFilter["density"].get_real());
-		lFileTree.process(lRadiusFilter, KdFileTree::LEAVES);
+		uint64_t lPointCount;
+		FILE* lFile = PointCloud::readHeader(iConfig["file"].get_str(), 0, lPointCount);
+		if (!lFile)
+		{
+			return false;
+		}
+		fclose(lFile); 
+
+		uint64_t lThreads = std::thread::hardware_concurrency();
+		// 250 bytes per point includes voxel grid memory, file handles etc. 
+		KdFileTree lFileTree;
+		lFileTree.construct(iConfig["file"].get_str(), std::min((uint64_t)(availableMemory() / 250) / lThreads, lPointCount / lThreads), 1.1*KdFileTree::SIGMA*lResolution);
+
+		if (lVoxel)
+		{
+			VoxelFilter lVoxelFilter(lResolution);
+			lFileTree.process(lVoxelFilter, KdFileTree::LEAVES);
+		}
+
+		if (lDensity)
+		{
+			RadiusFilter lRadiusFilter(lResolution, lFilter["density"].get_real());
+			lFileTree.process(lRadiusFilter, KdFileTree::LEAVES);
+		}
+
+		lFileTree.collapse(iConfig["file"].get_str(), lResolution);
+		lFileTree.remove();
+		lFiltered = true;
 	}
 
-	lFileTree.collapse(iConfig["file"].get_str(), lResolution);
-	lFileTree.remove();
+	// rewritten clouds come out slab by slab or leaf by leaf so their blocks stay tight
+	if (lFiltered)
+	{
+		PointCloud::updateBlocks(iConfig["file"].get_str());
+	}
 
 	json_spirit::mObject lResult;
 	json_spirit::write_stream(json_spirit::mValue(lResult), std::cout);
@@ -9,6 +9,10 @@
 #include <boost/filesystem.hpp>
 #include <boost/regex.hpp>
 
+#include <deque>
+#include <exception>
+#include <stdexcept>
+
 #if defined(WIN32)
 #include <Windows.h>
 #endif
@@ -46,13 +50,15 @@ struct E57
 	int64_t* idElementValue;
 	int64_t* startPointIndex;
 	int64_t* pointCount;
-	int8_t* rowIndex;
+	int32_t* rowIndex;
 	int32_t* columnIndex;
+	uint8_t* mKeep;
 
 	int mIndex;
 
-	int mIntensityAttribute;
-	int mColorAttribute;
+	// decoded blocks waiting for the main thread, at most E57Importer::QUEUE_SIZE of them
+	std::deque<E57Importer::Batch*> mBatches;
+	std::exception_ptr mError;
 
 	glm::dmat4 mWorldPose;
 
@@ -86,6 +92,7 @@ struct E57
 	, pointCount(NULL)
 	, rowIndex(NULL)
 	, columnIndex(NULL)
+	, mKeep(NULL)
 	, mIndex(iIndex)
 	{
 		iReader.ReadData3D(iIndex, mHeader);
@@ -105,6 +112,7 @@ struct E57
 		xData = new double[nSize];
 		yData = new double[nSize];
 		zData = new double[nSize];
+		mKeep = new uint8_t[nSize];
 		if (mHeader.pointFields.cartesianInvalidStateField)
 		{
 			isInvalidData = new int8_t[nSize];
@@ -145,7 +153,7 @@ struct E57
 
 		if(mHeader.pointFields.rowIndexField)
 		{
-			rowIndex = new int8_t[nSize];
+			rowIndex = new int32_t[nSize];
 		}
 
 		if(mHeader.pointFields.columnIndexField)
@@ -157,70 +165,184 @@ struct E57
 	
 	~E57()
 	{
-		if(isInvalidData) delete isInvalidData;
-		if(xData) delete xData;
-		if(yData) delete yData;
-		if(zData) delete zData;
-		if(intData) delete intData;
-		if(redData) delete redData;
-		if(greenData) delete greenData;
-		if(blueData) delete blueData;
+		if(isInvalidData) delete[] isInvalidData;
+		if(xData) delete[] xData;
+		if(yData) delete[] yData;
+		if(zData) delete[] zData;
+		if(intData) delete[] intData;
+		if(redData) delete[] redData;
+		if(greenData) delete[] greenData;
+		if(blueData) delete[] blueData;
+		if(rowIndex) delete[] rowIndex;
+		if(columnIndex) delete[] columnIndex;
+		if(mKeep) delete[] mKeep;
+		for (std::deque<E57Importer::Batch*>::iterator lIter = mBatches.begin(); lIter != mBatches.end(); lIter++)
+		{
+			delete *lIter;
+		}
+	}
+
+	bool gridded()
+	{
+		return rowIndex && columnIndex;
+	}
+
+	glm::dvec3 origin(CloudImporter& iImporter)
+	{
+		glm::dvec4 lOrigin = iImporter.mTransform*mWorldPose*glm::dvec4(0, 0, 0, 1);
+		iImporter.convertCoords(&lOrigin[0]);
+		return glm::dvec3(lOrigin[0], lOrigin[1], lOrigin[2]);
+	}
+
+	// the pose, the import transform and the axis conversion in one matrix
+	glm::dmat4 matrix(CloudImporter& iImporter)
+	{
+		glm::dmat4 lMatrix = iImporter.mTransform*mWorldPose;
+		for (int i = 0; i < 4; i++)
+		{
+			iImporter.convertCoords(&lMatrix[i][0]);
+		}
+		return lMatrix;
+	}
+
+	// transforms a block in place and marks the points to keep, plain loops over the buffers vectorize
+	void transform(unsigned iSize, glm::dmat4& iMatrix, double iRadius2)
+	{
+		double m00 = iMatrix[0][0], m01 = iMatrix[0][1], m02 = iMatrix[0][2];
+		double m10 = iMatrix[1][0], m11 = iMatrix[1][1], m12 = iMatrix[1][2];
+		double m20 = iMatrix[2][0], m21 = iMatrix[2][1], m22 = iMatrix[2][2];
+		double m30 = iMatrix[3][0], m31 = iMatrix[3][1], m32 = iMatrix[3][2];
+
+		double* __restrict x = xData;
+		double* __restrict y = yData;
+		double* __restrict z = zData;
+		uint8_t* __restrict lKeep = mKeep;
+		for (unsigned i = 0; i < iSize; i++)
+		{
+			double lX = x[i];
+			double lY = y[i];
+			double lZ = z[i];
+			lKeep[i] = lX*lX + lY*lY + lZ*lZ < iRadius2;
+			x[i] = m00*lX + m10*lY + m20*lZ + m30;
+			y[i] = m01*lX + m11*lY + m21*lZ + m31;
+			z[i] = m02*lX + m12*lY + m22*lZ + m32;
+		}
+
+		if (isInvalidData)
+		{
+			for (unsigned i = 0; i < iSize; i++)
+			{
+				lKeep[i] &= !isInvalidData[i];
+			}
+		}
 	}
 
-	unsigned long read(Point& iPoint, e57::Reader& iReader, FILE* iOutputFile, CloudImporter& iImporter, float iRadius2)
+	// decodes the scan with its own reader and hands it to iImporter a block at a time, safe to run next to other scans
+	void read(e57::Reader& iReader, E57Importer& iImporter, float iRadius2)
 	{
+		if (gridded())
+		{
+			readGrid(iReader, iImporter, iRadius2);
+			return;
+		}
+
 		e57::CompressedVectorReader lReader = start(iReader);
 
-		unsigned long lPointCount = 0;
+		E57Importer::Batch lBatch;
 		unsigned size = 0;
-		glm::mat4 lWorkdMatrix = iImporter.mTransform*mWorldPose;
+		glm::dmat4 lMatrix = matrix(iImporter);
 		while (size = lReader.read())
 		{
+			transform(size, lMatrix, iRadius2);
 			for (unsigned long i = 0; i < size; i++)
 			{
-				if (!isInvalidData || !isInvalidData[i])
+				if (mKeep[i])
 				{
-					glm::dvec4 lScanPosition = glm::dvec4(xData[i], yData[i], zData[i], 1.0);
-					if (lScanPosition.x*lScanPosition.x + lScanPosition.y*lScanPosition.y + lScanPosition.z*lScanPosition.z < iRadius2)
+					ScanGrid::Sample lSample;
+					memset(&lSample, 0, sizeof(lSample));
+					lSample.mValid = true;
+					lSample.mPosition[0] = xData[i];
+					lSample.mPosition[1] = yData[i];
+					lSample.mPosition[2] = zData[i];
+
+					if (bColor)
 					{
-						glm::dvec4 lWorldPostion = lWorkdMatrix*lScanPosition;
-						iImporter.convertCoords(&lWorldPostion[0]);
-						iImporter.growMinMax(&lWorldPostion[0]);
+						//Normalize color to 0 - 255
+						lSample.mColor[0] = ((redData[i] - colorRedOffset) * 255)/colorRedRange;
+						lSample.mColor[1] = ((greenData[i] - colorGreenOffset) * 255)/colorGreenRange;
+						lSample.mColor[2] = ((blueData[i] - colorBlueOffset) * 255)/colorBlueRange;
+					}
 
-						iPoint.position[0] = lWorldPostion[0];
-						iPoint.position[1] = lWorldPostion[1];
-						iPoint.position[2] = lWorldPostion[2];
+					if (bIntensity)
+					{
+						//Normalize intensity to 0 - 1.
+						lSample.mIntensity = (intData[i] - intOffset)/intRange*USHRT_MAX;
+					}
 
-						if (bColor)
-						{             
-							ColorType& lColor = *(ColorType*)iPoint.getAttribute(mColorAttribute);
+					lBatch.push_back(lSample);
+				}
+			}
+			iImporter.push(this, lBatch);
+		}
 
-							//Normalize color to 0 - 255
-							lColor.mValue[0] = ((redData[i] - colorRedOffset) * 255)/colorRedRange;
-							lColor.mValue[1] = ((greenData[i] - colorGreenOffset) * 255)/colorBlueRange;
-							lColor.mValue[2] = ((blueData[i] - colorBlueOffset) * 255)/colorBlueRange;
+		lReader.close();
+	}
 
-							//iImporter.recordColor(lColor.mValue[0],lColor.mValue[1],lColor.mValue[2]);
-						}
+	// structured scans carry their row and column so normals can be taken from the grid
+	void readGrid(e57::Reader& iReader, E57Importer& iImporter, float iRadius2)
+	{
+		e57::CompressedVectorReader lReader = start(iReader);
+
+		glm::dmat4 lMatrix = matrix(iImporter);
+		E57Importer::Batch lBatch;
+		ScanGrid lGrid(origin(iImporter), &lBatch);
+
+		// some scanners store their grid row by row
+		bool lTransposed = false;
+		bool lFirst = true;
+
+		unsigned size = 0;
+		while (size = lReader.read())
+		{
+			if (lFirst && size > 1)
+			{
+				lTransposed = rowIndex[0] == rowIndex[1];
+				lFirst = false;
+			}
 
-						if (bIntensity)
-						{         
-							IntensityType& lIntensityAttribute = *(IntensityType*)iPoint.getAttribute(mIntensityAttribute);
+			transform(size, lMatrix, iRadius2);
+			for (unsigned long i = 0; i < size; i++)
+			{
+				if (mKeep[i])
+				{
+					ScanGrid::Sample& lSample = lTransposed ? lGrid.at(columnIndex[i], rowIndex[i]) : lGrid.at(rowIndex[i], columnIndex[i]);
+					lSample.mValid = true;
+					lSample.mPosition[0] = xData[i];
+					lSample.mPosition[1] = yData[i];
+					lSample.mPosition[2] = zData[i];
 
-							double lIntensity = (intData[i] - intOffset)/intRange; //Normalize intensity to 0 - 1.
-							lIntensityAttribute.mValue = lIntensity*USHRT_MAX;
-						}
+					if (bColor)
+					{
+						lSample.mColor[0] = ((redData[i] - colorRedOffset) * 255)/colorRedRange;
+						lSample.mColor[1] = ((greenData[i] - colorGreenOffset) * 255)/colorGreenRange;
+						lSample.mColor[2] = ((blueData[i] - colorBlueOffset) * 255)/colorBlueRange;
+					}
 
-						iPoint.write(iOutputFile);
-						lPointCount++;
+					if (bIntensity)
+					{
+						lSample.mIntensity = (intData[i] - intOffset)/intRange*USHRT_MAX;
 					}
 				}
 			}
+
+			// the grid holds back the last columns until their neighbours have arrived
+			iImporter.push(this, lBatch);
 		}
 
 		lReader.close();
 
-		return lPointCount;
+		lGrid.finish();
+		iImporter.push(this, lBatch);
 	}
 
 	e57::CompressedVectorReader start(e57::Reader& iReader)
@@ -241,6 +363,7 @@ struct E57
 								NULL,
 								NULL,
 								NULL,
+								NULL,
 								rowIndex,                       //!< pointer to a buffer with the rowIndex
 								columnIndex                     //!< pointer to a buffer with the columnIndex
 								);
@@ -286,6 +409,93 @@ bool E57Importer::filtered(std::string iName)
 	return false;
 }
 
+void E57Importer::decode(e57::Reader* iReader, std::vector<E57*>* iScans)
+{
+	while (true)
+	{
+		size_t lIndex;
+		{
+			boost::unique_lock<boost::mutex> lLock(mLock);
+			if (mNext == iScans->size())
+			{
+				return;
+			}
+			lIndex = mNext++;
+		}
+
+		E57* lScan = (*iScans)[lIndex];
+		try
+		{
+			lScan->read(*iReader, *this, mRadius2);
+		}
+		catch (...)
+		{
+			lScan->mError = std::current_exception();
+		}
+
+		{
+			boost::unique_lock<boost::mutex> lLock(mLock);
+			mDone[lIndex] = true;
+		}
+		mCondition.notify_all();
+	}
+}
+
+void E57Importer::push(E57* iScan, Batch& iBatch)
+{
+	if (iBatch.empty())
+	{
+		return;
+	}
+
+	Batch* lBatch = new Batch();
+	lBatch->swap(iBatch);
+	{
+		boost::unique_lock<boost::mutex> lLock(mLock);
+		while (iScan->mBatches.size() >= QUEUE_SIZE && !mAbort)
+		{
+			mCondition.wait(lLock);
+		}
+		if (mAbort)
+		{
+			delete lBatch;
+			throw std::runtime_error("import abandoned");
+		}
+		iScan->mBatches.push_back(lBatch);
+	}
+	mCondition.notify_all();
+}
+
+// scans with color or intensity add them, structured scans add normals
+void E57Importer::attributes(e57::Data3D& iHeader, PointCloudAttributes& iAttributes)
+{
+	if (iHeader.pointFields.colorRedField)
+	{
+		iAttributes.createAttribute(Attribute::COLOR, COLOR_TEMPLATE);
+	}
+	if (iHeader.pointFields.intensityField)
+	{
+		iAttributes.createAttribute(Attribute::INTENSITY, INTENSITY_TEMPLATE);
+	}
+	if (iHeader.pointFields.rowIndexField && iHeader.pointFields.columnIndexField)
+	{
+		PackedNormalType lNormal;
+		iAttributes.createAttribute(Attribute::NORMAL, lNormal);
+	}
+}
+
+void E57Importer::attributes(std::string iName, PointCloudAttributes& iAttributes)
+{
+	e57::Reader lReader(iName);
+	for (int32_t i=0; i<lReader.GetData3DCount(); i++)
+	{
+		e57::Data3D lHeader;
+		lReader.ReadData3D(i, lHeader);
+		attributes(lHeader, iAttributes);
+	}
+	lReader.Close();
+}
+
 json_spirit::mObject E57Importer::import (std::string iName)
 {
 	e57::Reader eReader(iName);
@@ -298,36 +508,128 @@ json_spirit::mObject E57Importer::import (std::string iName)
 	{
 		E57* lScan = new E57(eReader, i);
 		lList.push_back(lScan);
-		if (lScan->bColor)
-		{
-			lScan->mColorAttribute = lAttributes.createAttribute(Attribute::COLOR, COLOR_TEMPLATE);
-		}
-		if (lScan->bIntensity)
-		{
-			lScan->mIntensityAttribute = lAttributes.createAttribute(Attribute::INTENSITY, INTENSITY_TEMPLATE);
-		}
+		attributes(lScan->mHeader, lAttributes);
 	}
 
 	// write ply
 	Point lPoint(lAttributes);
+	int lColorIndex = lAttributes.getAttributeIndex(Attribute::COLOR);
+	int lIntensityIndex = lAttributes.getAttributeIndex(Attribute::INTENSITY);
+	int lNormalIndex = lAttributes.getAttributeIndex(Attribute::NORMAL);
 
 	boost::filesystem::path lPath(iName);
-	FILE* lOutputFile = PointCloud::writeHeader(lPath.stem().string(), lAttributes, 0, 0, 0);
+	mName = lPath.stem().string();
+	FILE* lOutputFile = createOutput(lPath.stem().string(), lAttributes);
 	uint64_t lPointCount = 0;
 
+	std::vector<E57*> lScans;
 	for (std::vector<E57*>::iterator lIter = lList.begin(); lIter != lList.end(); lIter++)
 	{
 		std::string lName((*lIter)->mHeader.name);
 		if (!filtered(lName))
 		{
 			BOOST_LOG_TRIVIAL(info) << "File - " << (*lIter)->mHeader.name << "  :   " << (*lIter)->nPointsSize;
-			lPointCount += (*lIter)->read(lPoint, eReader, lOutputFile, *this, mRadius2);
+			lScans.push_back(*lIter);
+			mScanners.push_back((*lIter)->origin(*this));
+		}
+	}
+
+	// every worker opens the file on its own, readers can not be shared between threads
+	uint32_t lThreads = std::max<uint32_t>(1, std::min<uint32_t>(mThreads, lScans.size()));
+	std::vector<e57::Reader*> lReaders;
+	for (uint32_t t = 0; t < lThreads; t++)
+	{
+		lReaders.push_back(new e57::Reader(iName));
+	}
+
+	mNext = 0;
+	mAbort = false;
+	mDone.assign(lScans.size(), false);
+	boost::thread_group lGroup;
+	for (uint32_t t = 0; t < lThreads; t++)
+	{
+		lGroup.add_thread(new boost::thread(&E57Importer::decode, this, lReaders[t], &lScans));
+	}
+
+	// the blocks of each scan are written in file order as they arrive
+	std::exception_ptr lError;
+	for (size_t s = 0; s < lScans.size() && !lError; s++)
+	{
+		boost::unique_lock<boost::mutex> lLock(mLock);
+		while (true)
+		{
+			while (lScans[s]->mBatches.empty() && !mDone[s])
+			{
+				mCondition.wait(lLock);
+			}
+
+			if (lScans[s]->mBatches.empty())
+			{
+				break;
+			}
+
+			Batch* lBatch = lScans[s]->mBatches.front();
+			lScans[s]->mBatches.pop_front();
+			lLock.unlock();
+			mCondition.notify_all();
+
+			for (Batch::iterator lIter = lBatch->begin(); lIter != lBatch->end(); lIter++)
+			{
+				growMinMax(lIter->mPosition);
+
+				lPoint.position[0] = lIter->mPosition[0];
+				lPoint.position[1] = lIter->mPosition[1];
+				lPoint.position[2] = lIter->mPosition[2];
+				if (lColorIndex != -1)
+				{
+					memcpy(((ColorType*)lPoint.getAttribute(lColorIndex))->mValue, lIter->mColor, sizeof(lIter->mColor));
+				}
+				if (lIntensityIndex != -1)
+				{
+					((IntensityType*)lPoint.getAttribute(lIntensityIndex))->mValue = lIter->mIntensity;
+				}
+				if (lNormalIndex != -1)
+				{
+					setNormal(lPoint.getAttribute(lNormalIndex), lIter->mNormal);
+				}
+				write(lPoint, lOutputFile);
+			}
+			lPointCount += lBatch->size();
+			delete lBatch;
+
+			lLock.lock();
 		}
+
+		if (lScans[s]->mError)
+		{
+			// no worker takes another scan and the ones in flight stop at their next block
+			mNext = lScans.size();
+			mAbort = true;
+			lError = lScans[s]->mError;
+			lLock.unlock();
+			mCondition.notify_all();
+		}
+	}
+	lGroup.join_all();
+
+	for (std::vector<e57::Reader*>::iterator lIter = lReaders.begin(); lIter != lReaders.end(); lIter++)
+	{
+		(*lIter)->Close();
+		delete *lIter;
+	}
+
+	for (std::vector<E57*>::iterator lIter = lList.begin(); lIter != lList.end(); lIter++)
+	{
+		delete *lIter;
+	}
+
+	if (lError)
+	{
+		dropOutput(lOutputFile);
+		std::rethrow_exception(lError);
 	}
 
-	PointCloud::updateSize(lOutputFile, lPointCount);
-	PointCloud::updateSpatialBounds(lOutputFile, mMinD, mMaxD);
-	fclose(lOutputFile);
+	lPointCount = closeOutput(lOutputFile, lPointCount);
 
     json_spirit::mObject lMeta = getMeta();
 	lMeta["file"] = lPath.stem().string();
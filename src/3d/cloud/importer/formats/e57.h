@@ -1,7 +1,17 @@
 #pragma once
 
 #include "importer.h"
+#include "scanGrid.h"
 
+#include <boost/thread.hpp>
+
+namespace e57
+{
+	class Reader;
+	class Data3D;
+}
+
+struct E57;
 
 class E57Importer  : public CloudImporter
 {
@@ -10,11 +20,32 @@ class E57Importer  : public CloudImporter
 		E57Importer(json_spirit::mObject& iConfig);
 	
 		json_spirit::mObject import (std::string iName);
+		void attributes(std::string iName, PointCloudAttributes& iAttributes);
 
 	protected:
 
 		float mRadius2;
 
 		bool filtered(std::string iName);
+		void attributes(e57::Data3D& iHeader, PointCloudAttributes& iAttributes);
+
+		// a scan may hold this many decoded blocks before its worker waits for the main thread
+		static const size_t QUEUE_SIZE = 4;
+
+		typedef std::vector<ScanGrid::Sample> Batch;
+
+		// scans are handed out to the workers in file order, their blocks are written in that order
+		boost::mutex mLock;
+		boost::condition_variable mCondition;
+		size_t mNext;
+		bool mAbort;
+		std::vector<bool> mDone;
+
+		void decode(e57::Reader* iReader, std::vector<E57*>* iScans);
+
+		// queues a decoded block of iScan for the main thread and leaves iBatch empty
+		void push(E57* iScan, Batch& iBatch);
+
+		friend struct E57;
 
 }; 
@@ -1578,6 +1578,92 @@ void  SourceDestBufferImpl::setNextInt64(int64_t value, double scale, double off
     nextIndex_++;
 }
 
+/// Store values whose range is known to fit T, returns false if any of them doesn't
+template <typename T>
+static bool setNextIntegers(char* p, size_t stride, const int64_t* values, size_t count, int64_t minimum, int64_t maximum)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (values[i] < minimum || maximum < values[i])
+            return(false);
+    }
+    for (size_t i = 0; i < count; i++)
+        *reinterpret_cast<T*>(p + i*stride) = static_cast<T>(values[i]);
+    return(true);
+}
+
+void  SourceDestBufferImpl::setNextInt64s(const int64_t* values, size_t count)
+{
+    /// don't checkImageFileOpen
+
+    /// Verify have room
+    if (nextIndex_ + count > capacity_)
+        throw E57_EXCEPTION2(E57_ERROR_INTERNAL, "pathName=" + pathName_);
+
+    /// Common representations are stored in one loop, the rest and any value out of range go through setNextInt64
+    char* p = &base_[nextIndex_*stride_];
+    bool stored = false;
+    switch (memoryRepresentation_) {
+        case E57_UINT8:
+            stored = setNextIntegers<uint8_t>(p, stride_, values, count, E57_UINT8_MIN, E57_UINT8_MAX);
+            break;
+        case E57_INT16:
+            stored = setNextIntegers<int16_t>(p, stride_, values, count, E57_INT16_MIN, E57_INT16_MAX);
+            break;
+        case E57_UINT16:
+            stored = setNextIntegers<uint16_t>(p, stride_, values, count, E57_UINT16_MIN, E57_UINT16_MAX);
+            break;
+        case E57_INT32:
+            stored = setNextIntegers<int32_t>(p, stride_, values, count, E57_INT32_MIN, E57_INT32_MAX);
+            break;
+        case E57_INT64:
+            for (size_t i = 0; i < count; i++)
+                *reinterpret_cast<int64_t*>(p + i*stride_) = values[i];
+            stored = true;
+            break;
+        case E57_REAL64:
+            if (doConversion_) {
+                for (size_t i = 0; i < count; i++)
+                    *reinterpret_cast<double*>(p + i*stride_) = static_cast<double>(values[i]);
+                stored = true;
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (stored) {
+        nextIndex_ += count;
+        return;
+    }
+    for (size_t i = 0; i < count; i++)
+        setNextInt64(values[i]);
+}
+
+void  SourceDestBufferImpl::setNextInt64s(const int64_t* values, size_t count, double scale, double offset)
+{
+    /// don't checkImageFileOpen
+
+    if (!doScaling_) {
+        setNextInt64s(values, count);
+        return;
+    }
+
+    /// Verify have room
+    if (nextIndex_ + count > capacity_)
+        throw E57_EXCEPTION2(E57_ERROR_INTERNAL, "pathName=" + pathName_);
+
+    /// Scaled values usually end up in doubles, everything else goes through setNextInt64
+    if (memoryRepresentation_ == E57_REAL64 && doConversion_) {
+        char* p = &base_[nextIndex_*stride_];
+        for (size_t i = 0; i < count; i++)
+            *reinterpret_cast<double*>(p + i*stride_) = values[i]*scale + offset;
+        nextIndex_ += count;
+        return;
+    }
+    for (size_t i = 0; i < count; i++)
+        setNextInt64(values[i], scale, offset);
+}
+
 void SourceDestBufferImpl::setNextFloat(float value)
 {
     /// don't checkImageFileOpen
@@ -8419,7 +8505,6 @@ size_t BitpackIntegerDecoder<RegisterT>::inputProcessAligned(const char* inbuf,
 #endif
 
     const RegisterT* inp = reinterpret_cast<const RegisterT*>(inbuf);
-    unsigned wordPosition = 0;      /// The index in inbuf of the word we are currently working on.
 
     ///  For example on little endian machine:
     ///  Assume: registerT=uint32_t, bitOffset=20, destBitMask=0x00007fff (for a 15 bit value).
@@ -8431,9 +8516,39 @@ size_t BitpackIntegerDecoder<RegisterT>::inputProcessAligned(const char* inbuf,
     ///  destBitmask                          00000000 00000000 01111111 11111111
     ///  w & mask                             00000000 00000000 0HHHLLLL LLLLLLLL
 
-    size_t bitOffset = firstBit;
+    values_.resize(recordCount);
+    int64_t* values = recordCount ? &values_[0] : 0;
+    size_t i = 0;
+
+#ifndef E57_BIGENDIAN
+    /// Records are little endian bit fields, so any record of up to 57 bits lies within the eight bytes
+    /// starting at the byte that holds its first bit. Those records are unpacked with one unaligned load each,
+    /// as long as the load stays inside the input.
+    if (bitsPerRecord_ <= 57) {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(inbuf);
+        const uint64_t mask = (1ULL<<bitsPerRecord_) - 1;
+        const size_t endByte = endBit / 8;
+        size_t fastCount = 0;
+        if (endByte >= 8 && 8*(endByte - 8) + 7 >= firstBit)
+            fastCount = min(recordCount, (8*(endByte - 8) + 7 - firstBit) / bitsPerRecord_ + 1);
+
+        const int64_t minimum = minimum_;
+        const unsigned bits = bitsPerRecord_;
+        for (; i < fastCount; i++) {
+            size_t bit = firstBit + i*bits;
+            uint64_t w;
+            memcpy(&w, bytes + bit/8, sizeof(w));
+            values[i] = minimum + static_cast<int64_t>((w >> (bit%8)) & mask);
+        }
+    }
+#endif
+
+    /// Remaining records one register at a time
+    size_t bitOffset = firstBit + i*bitsPerRecord_;
+    unsigned wordPosition = static_cast<unsigned>(bitOffset / (8*sizeof(RegisterT)));
+    bitOffset %= 8*sizeof(RegisterT);
 
-    for (size_t i = 0; i < recordCount; i++) {
+    for (; i < recordCount; i++) {
         /// Get lower word (contains at least the LSbit of the value),
         RegisterT low = inp[wordPosition];
         SWAB(&low);  // swab if necessary
@@ -8468,13 +8583,7 @@ size_t BitpackIntegerDecoder<RegisterT>::inputProcessAligned(const char* inbuf,
         cout << "  Storing value=" << value << endl;
 #endif
 
-        /// The parameter isScaledInteger_ determines which version of setNextInt64 gets called
-        if (isScaledInteger_)
-            destBuffer_->setNextInt64(value, scale_, offset_);
-        else
-            destBuffer_->setNextInt64(value);
-
-        /// Store the result in next avaiable position in the user's dest buffer
+        values[i] = value;
 
         /// Calc next bit alignment and which word it starts in
         bitOffset += bitsPerRecord_;
@@ -8488,6 +8597,12 @@ size_t BitpackIntegerDecoder<RegisterT>::inputProcessAligned(const char* inbuf,
 #endif
     }
 
+    /// The parameter isScaledInteger_ determines which version of setNextInt64s gets called
+    if (isScaledInteger_)
+        destBuffer_->setNextInt64s(values, recordCount, scale_, offset_);
+    else
+        destBuffer_->setNextInt64s(values, recordCount);
+
     /// Update counts of records processed
     currentRecordIndex_ += recordCount;
 
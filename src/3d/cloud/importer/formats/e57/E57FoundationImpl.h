@@ -456,6 +456,8 @@ public:
     ustring         getNextString();
     void            setNextInt64(int64_t value);
     void            setNextInt64(int64_t value, double scale, double offset);
+    void            setNextInt64s(const int64_t* values, size_t count);
+    void            setNextInt64s(const int64_t* values, size_t count, double scale, double offset);
     void            setNextFloat(float value);
     void            setNextDouble(double value);
     void            setNextString(const ustring& value);
@@ -1314,6 +1316,7 @@ protected: //================
     double      offset_;
     unsigned    bitsPerRecord_;
     RegisterT   destBitMask_;
+    std::vector<int64_t> values_;   /// Records of one call, stored into destBuffer_ in one go
 };
 
 //================================================================
@@ -1,4 +1,8 @@
 #include <limits>
+#include <algorithm>
+#include <tuple>
+#include <thread>
+#include <stdexcept>
 
 #include <boost/log/core.hpp>
 #include <boost/log/trivial.hpp>
@@ -7,10 +11,16 @@
 
 
 CloudImporter::CloudImporter(json_spirit::mObject& iConfig)
-: mCoords(CloudImporter::RIGHT_Z_UP)
+: mSink(0)
+, mCoords(CloudImporter::RIGHT_Z_UP)
 , mScalarD(1.0)
 , mTransform(1.0)
+, mOffset(0.0)
+, mThreads(std::max(1u, std::thread::hardware_concurrency()))
 , mConfig(iConfig)
+, mEpsilon(0)
+, mStride(0)
+, mDuplicates(0)
 {
 	if (iConfig.find("coords") != iConfig.end())
 	{
@@ -43,6 +53,22 @@ CloudImporter::CloudImporter(json_spirit::mObject& iConfig)
 		}
 	};
 
+	if (iConfig.find("dedup") != iConfig.end())
+	{
+		if (!iConfig["dedup"].is_null())
+		{
+			mEpsilon = iConfig["dedup"].get_real();
+		}
+	}
+
+	if (iConfig.find("threads") != iConfig.end())
+	{
+		if (!iConfig["threads"].is_null())
+		{
+			mThreads = std::max(1, iConfig["threads"].get_int());
+		}
+	}
+
 	BOOST_LOG_TRIVIAL(info) << "CT: " << mTransform[0][0] << " " << mTransform[0][1] << " " << mTransform[0][2] << " " << mTransform[0][3];
 	BOOST_LOG_TRIVIAL(info) << "    " << mTransform[1][0] << " " << mTransform[1][1] << " " << mTransform[1][2] << " " << mTransform[1][3];
 	BOOST_LOG_TRIVIAL(info) << "    " << mTransform[2][0] << " " << mTransform[2][1] << " " << mTransform[2][2] << " " << mTransform[2][3];
@@ -80,6 +106,65 @@ uint16_t CloudImporter::sDefaultClasses[19*3] =
 	255,255,255			// 18 High Noise  
 };
 
+json_spirit::mObject CloudImporter::import(std::string iName)
+{
+	throw std::runtime_error("no importer for " + iName);
+}
+
+void CloudImporter::attributes(std::string iName, PointCloudAttributes& iAttributes)
+{
+	throw std::runtime_error("the attributes of " + iName + " are not known before its import");
+}
+
+FILE* CloudImporter::createOutput(std::string iName, PointCloudAttributes& iAttributes)
+{
+	if (mSink)
+	{
+		mSink->open(*this, iAttributes);
+		return NULL;
+	}
+	FILE* lFile = PointCloud::writeHeader(iName, iAttributes);
+	try
+	{
+		createShards(iAttributes);
+	}
+	catch (...)
+	{
+		if (lFile)
+		{
+			fclose(lFile);
+			std::remove(PointCloud::fileName(iName).c_str());
+		}
+		throw;
+	}
+	return lFile;
+}
+
+uint64_t CloudImporter::closeOutput(FILE* iFile, uint64_t iCount)
+{
+	if (mSink)
+	{
+		mSink->close();
+		return iCount;
+	}
+
+	iCount = flush(iFile, iCount);
+	PointCloud::updateSize(iFile, iCount);
+	PointCloud::updateSpatialBounds(iFile, mMinD, mMaxD);
+	fclose(iFile);
+	return iCount;
+}
+
+void CloudImporter::dropOutput(FILE* iFile)
+{
+	dropShards();
+	if (iFile)
+	{
+		fclose(iFile);
+		std::remove(PointCloud::fileName(mName).c_str());
+	}
+}
+
 json_spirit::mObject CloudImporter::getMeta()
 {
     json_spirit::mObject lMeta;
@@ -96,8 +181,274 @@ json_spirit::mObject CloudImporter::getMeta()
 	}
 	lMeta["transform"] = lTransform;
 
+	json_spirit::mArray lOffset;
+	lOffset.push_back(json_spirit::mValue(mOffset[0]));
+	lOffset.push_back(json_spirit::mValue(mOffset[1]));
+	lOffset.push_back(json_spirit::mValue(mOffset[2]));
+	lMeta["offset"] = lOffset;
+
+	if (mEpsilon > 0)
+	{
+		lMeta["duplicates"] = mDuplicates;
+	}
+
+	if (mScanners.size())
+	{
+		json_spirit::mArray lScanners;
+		for (std::vector<glm::dvec3>::iterator lIter = mScanners.begin(); lIter != mScanners.end(); lIter++)
+		{
+			json_spirit::mArray lPosition;
+			lPosition.push_back(json_spirit::mValue((*lIter)[0]));
+			lPosition.push_back(json_spirit::mValue((*lIter)[1]));
+			lPosition.push_back(json_spirit::mValue((*lIter)[2]));
+			lScanners.push_back(lPosition);
+		}
+		lMeta["scanners"] = lScanners;
+	}
+
 	return lMeta;
 }
+
+//
+// Points are quantized to mEpsilon and spread over shard files by the high bits of their hashed 
+// cell so that only one shard has to be held in memory when duplicates are removed. A shard that
+// does not fit into memory is split again by the following bits of the hash.
+//
+
+extern unsigned long long availableMemory();
+
+typedef std::tuple<int64_t, int64_t, int64_t, uint64_t> QuantizedPoint;
+
+static inline void quantize(float* iPosition, double iEpsilon, int64_t* iCell)
+{
+	iCell[0] = (int64_t)floor(iPosition[0] / iEpsilon);
+	iCell[1] = (int64_t)floor(iPosition[1] / iEpsilon);
+	iCell[2] = (int64_t)floor(iPosition[2] / iEpsilon);
+}
+
+static inline uint64_t hash(float* iPosition, double iEpsilon)
+{
+	int64_t lCell[3];
+	quantize(iPosition, iEpsilon, lCell);
+	uint64_t lHash = (uint64_t)lCell[0] * 73856093ull ^ (uint64_t)lCell[1] * 19349663ull ^ (uint64_t)lCell[2] * 83492791ull;
+	return lHash * 0x9E3779B97F4A7C15ull;
+}
+
+static void discard(std::vector<FILE*>& iShards, std::vector<std::string>& iNames)
+{
+	for (size_t i = 0; i < iShards.size(); i++)
+	{
+		if (iShards[i])
+		{
+			fclose(iShards[i]);
+		}
+		std::remove(iNames[i].c_str());
+	}
+	iShards.clear();
+}
+
+static bool openShards(std::vector<FILE*>& iShards, std::vector<std::string>& iNames)
+{
+	for (size_t i = 0; i < iNames.size(); i++)
+	{
+		FILE* lShard = fopen(iNames[i].c_str(), "wb+");
+		if (!lShard)
+		{
+			BOOST_LOG_TRIVIAL(error) << "Cannot create " << iNames[i];
+			iNames.resize(i);
+			discard(iShards, iNames);
+			return false;
+		}
+		iShards.push_back(lShard);
+	}
+	return true;
+}
+
+std::string CloudImporter::shardName(std::string iPath)
+{
+	return mName + "-dedup-" + iPath + ".tmp";
+}
+
+void CloudImporter::createShards(PointCloudAttributes& iAttributes)
+{
+	if (mEpsilon <= 0 || mShards.size())
+	{
+		return;
+	}
+
+	mStride = sizeof(float) * 3 + iAttributes.bytesPerPoint();
+
+	std::vector<std::string> lNames;
+	for (int i = 0; i < (1 << SHARD_BITS); i++)
+	{
+		lNames.push_back(shardName(std::to_string(i)));
+	}
+	if (!openShards(mShards, lNames))
+	{
+		throw std::runtime_error("cannot create the duplicate removal shards of " + mName);
+	}
+}
+
+void CloudImporter::shard(Point& iPoint)
+{
+	if (mShards.empty())
+	{
+		throw std::runtime_error("the duplicate removal shards of " + mName + " were not created with its output");
+	}
+	iPoint.write(mShards[hash(iPoint.position, mEpsilon) >> (64 - SHARD_BITS)]);
+}
+
+uint64_t CloudImporter::flush(FILE* iFile, uint64_t iCount)
+{
+	if (mEpsilon <= 0 || mShards.empty())
+	{
+		return iCount;
+	}
+
+	uint64_t lWritten = 0;
+	size_t s = 0;
+	try
+	{
+		for (; s < mShards.size(); s++)
+		{
+			lWritten += dedup(mShards[s], std::to_string(s), SHARD_BITS, iFile);
+		}
+	}
+	catch (...)
+	{
+		// the failed shard is already gone
+		std::vector<FILE*> lShards(mShards.begin() + s + 1, mShards.end());
+		std::vector<std::string> lNames;
+		for (size_t i = s + 1; i < mShards.size(); i++)
+		{
+			lNames.push_back(shardName(std::to_string(i)));
+		}
+		discard(lShards, lNames);
+		mShards.clear();
+		throw;
+	}
+	mShards.clear();
+
+	mDuplicates = iCount - lWritten;
+	BOOST_LOG_TRIVIAL(info) << "Removed " << mDuplicates << " duplicates of " << iCount << " points at " << mEpsilon;
+	return lWritten;
+}
+
+void CloudImporter::dropShards()
+{
+	std::vector<std::string> lNames;
+	for (size_t i = 0; i < mShards.size(); i++)
+	{
+		lNames.push_back(shardName(std::to_string(i)));
+	}
+	discard(mShards, lNames);
+}
+
+uint64_t CloudImporter::dedup(FILE* iShard, std::string iPath, int iBits, FILE* iFile)
+{
+	uint64_t lSize = ftell(iShard);
+	uint64_t lCount = lSize / mStride;
+	uint64_t lMemory = std::max<uint64_t>(1, availableMemory() / 2);
+	uint64_t lNeeded = lCount * (mStride + sizeof(QuantizedPoint));
+	fseek(iShard, 0, SEEK_SET);
+
+	// split by the next bits of the hash until every part fits, points of one cell always stay together
+	if (lNeeded > lMemory && iBits < 64)
+	{
+		int lBits = 1;
+		while (lBits < SHARD_BITS && iBits + lBits < 64 && (lNeeded >> lBits) > lMemory)
+		{
+			lBits++;
+		}
+
+		std::vector<FILE*> lShards;
+		std::vector<std::string> lNames;
+		for (int i = 0; i < (1 << lBits); i++)
+		{
+			lNames.push_back(shardName(iPath + "-" + std::to_string(i)));
+		}
+		if (!openShards(lShards, lNames))
+		{
+			fclose(iShard);
+			std::remove(shardName(iPath).c_str());
+			throw std::runtime_error("cannot split the duplicate removal shard " + shardName(iPath));
+		}
+
+		const size_t BLOCK_SIZE = 65536;
+		std::vector<uint8_t> lBuffer(BLOCK_SIZE * mStride);
+		uint64_t lSplit = 0;
+		bool lWritten = true;
+		size_t lRead;
+		while (lWritten && (lRead = fread(&lBuffer[0], mStride, std::min<uint64_t>(BLOCK_SIZE, lCount - lSplit), iShard)) > 0)
+		{
+			for (size_t i = 0; i < lRead && lWritten; i++)
+			{
+				uint8_t* lPointer = &lBuffer[i * mStride];
+				lWritten = fwrite(lPointer, mStride, 1, lShards[(hash((float*)lPointer, mEpsilon) << iBits) >> (64 - lBits)]) == 1;
+			}
+			lSplit += lRead;
+		}
+		fclose(iShard);
+		std::remove(shardName(iPath).c_str());
+		std::vector<uint8_t>().swap(lBuffer);
+
+		if (lSplit != lCount || !lWritten)
+		{
+			discard(lShards, lNames);
+			throw std::runtime_error("cannot split the duplicate removal shard " + shardName(iPath));
+		}
+
+		uint64_t lKept = 0;
+		size_t i = 0;
+		try
+		{
+			for (; i < lShards.size(); i++)
+			{
+				// a part that kept every point holds a single cell, splitting it further does not help
+				int lNext = (uint64_t)ftell(lShards[i]) == lSize ? 64 : iBits + lBits;
+				lKept += dedup(lShards[i], iPath + "-" + std::to_string(i), lNext, iFile);
+			}
+		}
+		catch (...)
+		{
+			std::vector<FILE*> lRest(lShards.begin() + i + 1, lShards.end());
+			std::vector<std::string> lRestNames(lNames.begin() + i + 1, lNames.end());
+			discard(lRest, lRestNames);
+			throw;
+		}
+		return lKept;
+	}
+
+	std::vector<uint8_t> lBuffer(lSize);
+	bool lRead = !lSize || fread(&lBuffer[0], 1, lSize, iShard) == lSize;
+	fclose(iShard);
+	std::remove(shardName(iPath).c_str());
+	if (!lRead)
+	{
+		throw std::runtime_error("cannot read the duplicate removal shard " + shardName(iPath));
+	}
+
+	// sorting on cell and then arrival keeps the first point of every cell
+	std::vector<QuantizedPoint> lCells(lCount);
+	for (uint64_t i = 0; i < lCount; i++)
+	{
+		int64_t lCell[3];
+		quantize((float*)&lBuffer[i * mStride], mEpsilon, lCell);
+		lCells[i] = QuantizedPoint(lCell[0], lCell[1], lCell[2], i);
+	}
+	std::sort(lCells.begin(), lCells.end());
+
+	uint64_t lWritten = 0;
+	for (uint64_t i = 0; i < lCount; i++)
+	{
+		if (i == 0 || std::get<0>(lCells[i]) != std::get<0>(lCells[i - 1]) || std::get<1>(lCells[i]) != std::get<1>(lCells[i - 1]) || std::get<2>(lCells[i]) != std::get<2>(lCells[i - 1]))
+		{
+			fwrite(&lBuffer[std::get<3>(lCells[i]) * mStride], mStride, 1, iFile);
+			lWritten++;
+		}
+	}
+	return lWritten;
+}
         		
 
 void CloudImporter::done() 
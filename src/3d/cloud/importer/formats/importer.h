@@ -2,11 +2,42 @@
 
 #include "../../pointCloud.h"
 
+class CloudImporter;
+
+//
+// Takes the points of an importer in place of a file of its own, as when several files are merged
+// into one output.
+//
+
+class CloudSink
+{
+	public:
+
+		virtual ~CloudSink() {};
+
+		// called once the attributes and the offset of the importer are known, before its first point
+		virtual void open(CloudImporter& iImporter, PointCloudAttributes& iAttributes) = 0;
+		virtual void write(Point& iPoint) = 0;
+
+		// called after the last point
+		virtual void close() = 0;
+};
+
 class CloudImporter
 {
 	public:
 
 		CloudImporter(json_spirit::mObject& iConfig);
+		virtual ~CloudImporter() {};
+
+		// imports iName and returns its meta data, the points go to their own file or to mSink
+		virtual json_spirit::mObject import(std::string iName);
+
+		// the attributes import writes for iName, known before any of its points are read
+		virtual void attributes(std::string iName, PointCloudAttributes& iAttributes);
+
+		// takes the points instead of the output file if set
+		CloudSink* mSink;
 	
 
 		static const uint8_t RIGHT_Y_UP = 0;
@@ -82,12 +113,57 @@ class CloudImporter
 			mMaxD[2] = std::max<double>(iPosition[2], mMaxD[2]);
 		}
 	
+		//
+		// Duplicates
+		//
+
+		// every importer writes through here so points within mEpsilon of an earlier one can be dropped
+		inline void write(Point& iPoint, FILE* iFile)
+		{
+			if (mSink)
+			{
+				mSink->write(iPoint);
+			}
+			else if (mEpsilon > 0)
+			{
+				shard(iPoint);
+			}
+			else
+			{
+				iPoint.write(iFile);
+			}
+		}
+
+		// the output of an import, NULL when mSink takes the points
+		FILE* createOutput(std::string iName, PointCloudAttributes& iAttributes);
+
+		// removes the duplicates, completes the header and closes the output, returns the number of points in it
+		uint64_t closeOutput(FILE* iFile, uint64_t iCount);
+
+		// removes the output of an import that failed
+		void dropOutput(FILE* iFile);
+
+		// appends the sharded points to iFile and returns the number of points written
+		uint64_t flush(FILE* iFile, uint64_t iCount);
+
+		// closes and removes the shards of an import that failed before its flush
+		void dropShards();
+
 		void done();
  
 		json_spirit::mObject getMeta();
 		
 		glm::dmat4 mTransform;
 
+		// positions of the scanners in output coordinates, if the format knows them
+		std::vector<glm::dvec3> mScanners;
+
+		// subtracted from the source coordinates to keep the output near the origin
+		glm::dvec3 mOffset;
+
+		// threads an importer may decode with, fewer when several files are imported at once
+		uint32_t mThreads;
+
 	protected:
 
 		json_spirit::mObject& mConfig;
@@ -96,4 +172,20 @@ class CloudImporter
 
 		uint8_t mCoords;
 		double mScalarD;
+
+		// name of the output, temporary files are named after it
+		std::string mName;
+
+		static const int SHARD_BITS = 8;
+
+		double mEpsilon;
+		uint32_t mStride;
+		uint64_t mDuplicates;
+		std::vector<FILE*> mShards;
+
+		// the shards are created with the output, before any thread can write a point
+		void createShards(PointCloudAttributes& iAttributes);
+		void shard(Point& iPoint);
+		std::string shardName(std::string iPath);
+		uint64_t dedup(FILE* iShard, std::string iPath, int iBits, FILE* iFile);
 }; 
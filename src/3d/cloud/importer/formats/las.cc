@@ -1,7 +1,10 @@
-#include "laszip/laszip_api.h"
-
 #include "las.h"
 
+#include <limits>
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/thread.hpp>
 #include <boost/log/core.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/filesystem.hpp>
@@ -27,103 +30,185 @@ struct GeoKeys
 	pKey[8]; 
 };
 
-json_spirit::mObject LasImporter::import (std::string iName)
+LasImporter::Reader LasImporter::open(std::string iName)
 {
-	laszip_POINTER lReader;
-	laszip_header* lHeader;
-	laszip_point* lLazPoint;
-
-	laszip_create(&lReader);
+	Reader lReader;
+	laszip_create(&lReader.mReader);
 	laszip_BOOL request_reader = 1;
-	laszip_request_compatibility_mode(lReader, request_reader);
+	laszip_request_compatibility_mode(lReader.mReader, request_reader);
 	laszip_BOOL is_compressed = true;
-	laszip_open_reader(lReader, iName.c_str(), &is_compressed);
-	laszip_get_header_pointer(lReader, &lHeader);
+	laszip_open_reader(lReader.mReader, iName.c_str(), &is_compressed);
+	laszip_get_header_pointer(lReader.mReader, &lReader.mHeader);
+	laszip_get_point_pointer(lReader.mReader, &lReader.mPoint);
+	return lReader;
+}
 
-	laszip_get_point_pointer(lReader, &lLazPoint);
-	unsigned long lPointCount = (lHeader->number_of_point_records ? lHeader->number_of_point_records : lHeader->extended_number_of_point_records);
-	BOOST_LOG_TRIVIAL(info) << iName << " contains " << lPointCount << " points ";
+//
+// LASzip keeps its own VLR out of the header it hands out, so the chunk size is read from the file.
+// Ranges are a multiple of it and seeking lands on a chunk start instead of decoding the points 
+// before it. The chunk table of variable sized chunks is compressed and not exposed by LASzip, 
+// so those files get longer ranges to keep the partial chunk at their start a small share.
+//
 
-	PointCloudAttributes lAttributes;
-	int lIntensityIndex = lAttributes.createAttribute(Attribute::INTENSITY, INTENSITY_TEMPLATE);
-	int lColorIndex = -1;
-	if (lHeader->point_data_format > 1)
+void LasImporter::attributes(laszip_header* iHeader, PointCloudAttributes& iAttributes)
+{
+	iAttributes.createAttribute(Attribute::INTENSITY, INTENSITY_TEMPLATE);
+	if (iHeader->point_data_format > 1)
 	{
-		lColorIndex = lAttributes.createAttribute(Attribute::COLOR, COLOR_TEMPLATE);
+		iAttributes.createAttribute(Attribute::COLOR, COLOR_TEMPLATE);
 	}
-    
-	uint16_t minI = std::numeric_limits<uint16_t>::max();
-	uint16_t maxI = 0;
+	iAttributes.createAttribute(Attribute::CLASS, CLASS_TEMPLATE);
+}
 
-    uint8_t minClass = 255;
-    uint8_t maxClass = 0;
+void LasImporter::attributes(std::string iName, PointCloudAttributes& iAttributes)
+{
+	Reader lReader = open(iName);
+	attributes(lReader.mHeader, iAttributes);
+	laszip_close_reader(lReader.mReader);
+	laszip_destroy(lReader.mReader);
+}
 
-	// AABB pass to find center
-	BOOST_LOG_TRIVIAL(info) << "AABB pass ";
-	laszip_seek_point(lReader, 0);
-	for(unsigned long long p=0; p < lPointCount; p++)
+uint64_t LasImporter::rangeSize(std::string iName)
+{
+	FILE* lFile = fopen(iName.c_str(), "rb");
+	if (!lFile)
 	{
-		laszip_read_point(lReader);
-		double lCoords[3];
-		lCoords[0] = (lLazPoint->X)*lHeader->x_scale_factor + lHeader->x_offset;
-		lCoords[1] = (lLazPoint->Y)*lHeader->y_scale_factor + lHeader->y_offset;
-		lCoords[2] = (lLazPoint->Z)*lHeader->z_scale_factor + lHeader->z_offset;
-		convertCoords(lCoords);
+		return RANGE_SIZE;
+	}
 
-        minClass = std::min(lLazPoint->classification, minClass);
-        maxClass = std::max(lLazPoint->classification, maxClass);
-  
-		growMinMax(lCoords);
+	// header size and number of variable length records, a file too short for them gets the default
+	uint16_t lHeaderSize = 0;
+	uint32_t lRecords = 0;
+	if (fseek(lFile, 94, SEEK_SET) || fread(&lHeaderSize, sizeof(lHeaderSize), 1, lFile) != 1 ||
+		fseek(lFile, 100, SEEK_SET) || fread(&lRecords, sizeof(lRecords), 1, lFile) != 1)
+	{
+		fclose(lFile);
+		return RANGE_SIZE;
+	}
 
-		minI = std::min(lLazPoint->intensity, minI);
-		maxI = std::max(lLazPoint->intensity, maxI);
+	uint32_t lChunkSize = 0;
+	long lOffset = lHeaderSize;
+	for (uint32_t r = 0; r < lRecords; r++)
+	{
+		// reserved, user id, record id, length after header, description
+		uint8_t lRecord[54];
+		fseek(lFile, lOffset, SEEK_SET);
+		if (fread(lRecord, sizeof(lRecord), 1, lFile) != 1)
+		{
+			break;
+		}
 
-		if (p%10000000==0)
+		uint16_t lId = lRecord[18] | (lRecord[19] << 8);
+		uint16_t lLength = lRecord[20] | (lRecord[21] << 8);
+		if (lId == 22204 && !strncmp((char*)lRecord + 2, "laszip encoded", 16) && lLength >= 16)
 		{
-			BOOST_LOG_TRIVIAL(info) << p;
+			// compressor, coder, version, options and then the chunk size
+			uint8_t lPayload[16];
+			if (fread(lPayload, sizeof(lPayload), 1, lFile) == 1)
+			{
+				lChunkSize = lPayload[12] | (lPayload[13] << 8) | (lPayload[14] << 16) | ((uint32_t)lPayload[15] << 24);
+			}
+			break;
 		}
+		lOffset += sizeof(lRecord) + lLength;
+	}
+	fclose(lFile);
 
-        // REMOVE_
-        // if ((p+1)%10000000==0)
-		// {
-        //      break;
-        //  }
-        // REMOVE_
+	if (lChunkSize == 0)
+	{
+		return RANGE_SIZE;
+	}
+	if (lChunkSize == std::numeric_limits<uint32_t>::max())
+	{
+		BOOST_LOG_TRIVIAL(info) << iName << " has variable chunks";
+		return 4 * RANGE_SIZE;
 	}
+	BOOST_LOG_TRIVIAL(info) << iName << " has chunks of " << lChunkSize << " points";
+	return std::max<uint64_t>(1, (RANGE_SIZE + lChunkSize / 2) / lChunkSize) * lChunkSize;
+}
+
+void LasImporter::decode(Reader* iReader, uint64_t iFirst, uint64_t iCount, glm::dvec3 iCenter, std::vector<Sample>* iSamples)
+{
+	laszip_header* lHeader = iReader->mHeader;
+	laszip_point* lLazPoint = iReader->mPoint;
+
+	iSamples->resize(iCount);
+	laszip_seek_point(iReader->mReader, iFirst);
+	for (uint64_t p=0; p < iCount; p++)
+	{
+		laszip_read_point(iReader->mReader);
+
+		Sample& lSample = (*iSamples)[p];
+		lSample.mPosition[0] = (lLazPoint->X)*lHeader->x_scale_factor + lHeader->x_offset;
+		lSample.mPosition[1] = (lLazPoint->Y)*lHeader->y_scale_factor + lHeader->y_offset;
+		lSample.mPosition[2] = (lLazPoint->Z)*lHeader->z_scale_factor + lHeader->z_offset;
+		convertCoords(lSample.mPosition);
+		lSample.mPosition[0] -= iCenter[0];
+		lSample.mPosition[1] -= iCenter[1];
+		lSample.mPosition[2] -= iCenter[2];
+
+		lSample.mIntensity = lLazPoint->intensity;
+		lSample.mClass = lLazPoint->classification;
+
+		laszip_U16 r = lLazPoint->rgb[0];
+		laszip_U16 g = lLazPoint->rgb[1];
+		laszip_U16 b = lLazPoint->rgb[2];
+		if (r > 255 || g > 255 || b > 255)
+		{
+			lSample.mColor[0] = r/256;
+			lSample.mColor[1] = g/256;
+			lSample.mColor[2] = b/256;
+		}
+		else
+		{
+			lSample.mColor[0] = (uint8_t)r;
+			lSample.mColor[1] = (uint8_t)g;
+			lSample.mColor[2] = (uint8_t)b;
+		}
+	}
+}
+
+json_spirit::mObject LasImporter::import (std::string iName)
+{
+	uint32_t lThreads = mThreads;
+	std::vector<Reader> lReaders;
+	for (uint32_t t = 0; t < lThreads; t++)
+	{
+		lReaders.push_back(open(iName));
+	}
+	laszip_header* lHeader = lReaders[0].mHeader;
+
+	unsigned long lPointCount = (lHeader->number_of_point_records ? lHeader->number_of_point_records : lHeader->extended_number_of_point_records);
+	BOOST_LOG_TRIVIAL(info) << iName << " contains " << lPointCount << " points ";
+
+	// the header bounds give the center so the points are only decoded once
+	double lHeaderMin[3] = { lHeader->min_x, lHeader->min_y, lHeader->min_z };
+	double lHeaderMax[3] = { lHeader->max_x, lHeader->max_y, lHeader->max_z };
+	convertCoords(lHeaderMin);
+	convertCoords(lHeaderMax);
 
 	glm::dvec3 lCenter;
-	lCenter[0] = (mMinD[0] + mMaxD[0]) / 2;
-	lCenter[1] = (mMinD[1] + mMaxD[1]) / 2;
-	lCenter[2] = (mMinD[2] + mMaxD[2]) / 2;
-
-	mMinD[0] -= lCenter[0];
-	mMinD[1] -= lCenter[1];
-	mMinD[2] -= lCenter[2];
-	mMaxD[0] -= lCenter[0];
-	mMaxD[1] -= lCenter[1];
-	mMaxD[2] -= lCenter[2];
-
-
-    int lClassIndex = -1;
-    if (minClass != maxClass)
-    {
-        lClassIndex = lAttributes.createAttribute(Attribute::CLASS, CLASS_TEMPLATE);
-    }
-	double lScalerI = std::numeric_limits<uint16_t>::max()/(double)(maxI - minI != 0 ? maxI - minI : 1);
+	lCenter[0] = (lHeaderMin[0] + lHeaderMax[0]) / 2;
+	lCenter[1] = (lHeaderMin[1] + lHeaderMax[1]) / 2;
+	lCenter[2] = (lHeaderMin[2] + lHeaderMax[2]) / 2;
+	mOffset = lCenter;
 
+	// intensities are written as read and classes always, both are settled once their range is known
+	PointCloudAttributes lAttributes;
+	attributes(lHeader, lAttributes);
+	int lIntensityIndex = lAttributes.getAttributeIndex(Attribute::INTENSITY);
+	int lColorIndex = lAttributes.getAttributeIndex(Attribute::COLOR);
+	int lClassIndex = lAttributes.getAttributeIndex(Attribute::CLASS);
+    
+	uint16_t minI = std::numeric_limits<uint16_t>::max();
+	uint16_t maxI = 0;
 
-    //
-    // Main Pass
-    //
+    uint8_t minClass = 255;
+    uint8_t maxClass = 0;
 
 	Point lPoint(lAttributes);
 	IntensityType& lIntensity = *(IntensityType*)lPoint.getAttribute(lIntensityIndex);
-
-    ClassType* lClass = 0;
-    if (lClassIndex!= -1)
-    {
-	    lClass = (ClassType*)lPoint.getAttribute(lClassIndex);
-    }
+	ClassType& lClass = *(ClassType*)lPoint.getAttribute(lClassIndex);
 
 	ColorType* lColor = 0;
 	if (lHeader->point_data_format > 1)
@@ -138,73 +223,146 @@ json_spirit::mObject LasImporter::import (std::string iName)
 	}
 	*/
 	boost::filesystem::path lPath(iName);
+	mName = lPath.stem().string();
+	std::string lRawName = lPath.stem().string() + "-raw";
 
-	// main pass
+	// main pass, a generation of ranges is decoded while the previous one is written in order
 	BOOST_LOG_TRIVIAL(info) << "Main pass ";
-	FILE* lOutputFile = PointCloud::writeHeader(lPath.stem().string(), lAttributes);
-	laszip_seek_point(lReader, 0);
-	for(unsigned long p=0; p < lPointCount; p++)
+	FILE* lOutputFile = createOutput(lRawName, lAttributes);
+
+	std::vector<std::vector<Sample>> lSamples[2];
+	lSamples[0].resize(lThreads);
+	lSamples[1].resize(lThreads);
+
+	uint64_t lRangeSize = rangeSize(iName);
+	uint64_t lNextRange = 0;
+	auto lLaunch = [&](std::vector<std::vector<Sample>>& iSamples, boost::thread_group& iGroup)
 	{
-		laszip_read_point(lReader);
-		double lCoords[3];
-		lCoords[0] = (lLazPoint->X)*lHeader->x_scale_factor + lHeader->x_offset;
-		lCoords[1] = (lLazPoint->Y)*lHeader->y_scale_factor + lHeader->y_offset;
-		lCoords[2] = (lLazPoint->Z)*lHeader->z_scale_factor + lHeader->z_offset;
-		convertCoords(lCoords);
-		lCoords[0] -= lCenter[0];
-		lCoords[1] -= lCenter[1];
-		lCoords[2] -= lCenter[2];
-		growMinMax(lCoords);
-
-		lPoint.position[0] = (float)lCoords[0];
-		lPoint.position[1] = (float)lCoords[1];
-		lPoint.position[2] = (float)lCoords[2];
-
-		lIntensity.mValue = lLazPoint->intensity*lScalerI;
-        if(lClass)
-        {
-		    lClass->mValue = lLazPoint->classification; 
-        }
+		size_t lCount = 0;
+		for (uint32_t t = 0; t < lThreads && lNextRange < lPointCount; t++)
+		{
+			uint64_t lSize = std::min<uint64_t>(lRangeSize, lPointCount - lNextRange);
+			iGroup.add_thread(new boost::thread(&LasImporter::decode, this, &lReaders[t], lNextRange, lSize, lCenter, &iSamples[t]));
+			lNextRange += lSize;
+			lCount++;
+		}
+		return lCount;
+	};
+
+	uint64_t lWritten = 0;
+	boost::thread_group* lGroup = new boost::thread_group();
+	size_t lCount = lLaunch(lSamples[0], *lGroup);
+	for (int g = 0; lCount; g ^= 1)
+	{
+		lGroup->join_all();
+		delete lGroup;
+
+		// the readers of this generation are done, the next one reuses them
+		lGroup = new boost::thread_group();
+		size_t lNext = lLaunch(lSamples[g ^ 1], *lGroup);
 
+		for (size_t t = 0; t < lCount; t++)
+		{
+			for (std::vector<Sample>::iterator lIter = lSamples[g][t].begin(); lIter != lSamples[g][t].end(); lIter++)
+			{
+				growMinMax(lIter->mPosition);
+
+				lPoint.position[0] = (float)lIter->mPosition[0];
+				lPoint.position[1] = (float)lIter->mPosition[1];
+				lPoint.position[2] = (float)lIter->mPosition[2];
+
+				minClass = std::min(lIter->mClass, minClass);
+				maxClass = std::max(lIter->mClass, maxClass);
+
+				minI = std::min(lIter->mIntensity, minI);
+				maxI = std::max(lIter->mIntensity, maxI);
+
+				lIntensity.mValue = lIter->mIntensity;
+				lClass.mValue = lIter->mClass; 
+				if (lColor)
+				{
+					memcpy(lColor->mValue, lIter->mColor, sizeof(lIter->mColor));
+				}
+				write(lPoint, lOutputFile);
+
+				if (lWritten%10000000==0)
+				{
+					BOOST_LOG_TRIVIAL(info) << lWritten;
+				}
+				lWritten++;
+			}
+		}
+
+		lCount = lNext;
+	}
+	lGroup->join_all();
+	delete lGroup;
+
+	for (std::vector<Reader>::iterator lIter = lReaders.begin(); lIter != lReaders.end(); lIter++)
+	{
+		laszip_close_reader(lIter->mReader);
+		laszip_destroy(lIter->mReader);
+	}
+
+	lPointCount = closeOutput(lOutputFile, lPointCount);
+
+	// merged files keep the intensities as read and their classes, the range is only known at the end
+	double lScalerI = std::numeric_limits<uint16_t>::max()/(double)(maxI - minI != 0 ? maxI - minI : 1);
+	if (!mSink && (lScalerI != 1.0 || minClass == maxClass))
+	{
+		// rescale the intensities and drop a constant class in one pass over the intermediate file
+		BOOST_LOG_TRIVIAL(info) << "Rescale pass ";
+
+		PointCloudAttributes lFinalAttributes;
+		int lFinalIntensityIndex = lFinalAttributes.createAttribute(Attribute::INTENSITY, INTENSITY_TEMPLATE);
+		int lFinalColorIndex = -1;
 		if (lColor)
 		{
-			laszip_U16 r = lLazPoint->rgb[0];
-			laszip_U16 g = lLazPoint->rgb[1];
-			laszip_U16 b = lLazPoint->rgb[2];
+			lFinalColorIndex = lFinalAttributes.createAttribute(Attribute::COLOR, COLOR_TEMPLATE);
+		}
+		int lFinalClassIndex = -1;
+		if (minClass != maxClass)
+		{
+			lFinalClassIndex = lFinalAttributes.createAttribute(Attribute::CLASS, CLASS_TEMPLATE);
+		}
 
-			if (r > 255 || g > 255 || b > 255)
+		Point lFinal(lFinalAttributes);
+		IntensityType& lFinalIntensity = *(IntensityType*)lFinal.getAttribute(lFinalIntensityIndex);
+
+		FILE* lFinalFile = PointCloud::writeHeader(lPath.stem().string(), lFinalAttributes, lPointCount);
+		PointCloud::updateSpatialBounds(lFinalFile, mMinD, mMaxD);
+		fseek(lFinalFile, 0, SEEK_END);
+
+		uint64_t lSize;
+		lOutputFile = PointCloud::readHeader(lRawName, 0, lSize);
+		if (!lOutputFile)
+		{
+			fclose(lFinalFile);
+			throw std::runtime_error("cannot read " + PointCloud::fileName(lRawName));
+		}
+		for (uint64_t p=0; p < lSize; p++)
+		{
+			lPoint.read(lOutputFile);
+			memcpy(lFinal.position, lPoint.position, sizeof(lPoint.position));
+			lFinalIntensity.mValue = lIntensity.mValue*lScalerI;
+			if (lColor)
 			{
-				lColor->mValue[0] = r/256;
-				lColor->mValue[1] = g/256;
-				lColor->mValue[2] = b/256;
+				memcpy(((ColorType*)lFinal.getAttribute(lFinalColorIndex))->mValue, lColor->mValue, sizeof(lColor->mValue));
 			}
-			else
+			if (lFinalClassIndex != -1)
 			{
-				lColor->mValue[0] = (uint8_t)r;
-				lColor->mValue[1] = (uint8_t)g;
-				lColor->mValue[2] = (uint8_t)b;
+				((ClassType*)lFinal.getAttribute(lFinalClassIndex))->mValue = lClass.mValue;
 			}
+			lFinal.write(lFinalFile);
 		}
-		lPoint.write(lOutputFile);
-		
-		if (p%10000000==0)
-		{
-			BOOST_LOG_TRIVIAL(info) << p;
-		}
-
-        // REMOVE_
-       // if ((p+1)%10000000==0)
-		//{
-       //     lPointCount = p;
-       //     break;
-       // }
-        // REMOVE_
+		fclose(lOutputFile);
+		fclose(lFinalFile);
+		boost::filesystem::remove(PointCloud::fileName(lRawName));
+	}
+	else if (!mSink)
+	{
+		boost::filesystem::rename(PointCloud::fileName(lRawName), PointCloud::fileName(lPath.stem().string()));
 	}
-
-	PointCloud::updateSize(lOutputFile, lPointCount);
-	PointCloud::updateSpatialBounds(lOutputFile, mMinD, mMaxD);
-	fclose(lOutputFile);
-	laszip_close_reader(lReader);
 
 	json_spirit::mObject lMeta = getMeta();
 	lMeta["file"] = lPath.stem().string();
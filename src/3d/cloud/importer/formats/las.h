@@ -1,5 +1,7 @@
 #pragma once
 
+#include "laszip/laszip_api.h"
+
 #include "importer.h"
 
 
@@ -10,6 +12,32 @@ class LasImporter : public CloudImporter
 		LasImporter(json_spirit::mObject& iConfig);
 	
 		json_spirit::mObject import (std::string iName);
+		void attributes(std::string iName, PointCloudAttributes& iAttributes);
 
 	//	uint64_t append(FILE* iFIle, std::string iName, PointCloud& iCloud);
+
+	protected:
+
+		// points of a range are decoded in one go, ranges of a LAZ file hold whole chunks
+		static const uint64_t RANGE_SIZE = 50000;
+
+		struct Reader
+		{
+			laszip_POINTER mReader;
+			laszip_header* mHeader;
+			laszip_point* mPoint;
+		};
+
+		struct Sample
+		{
+			double mPosition[3];
+			uint16_t mIntensity;
+			uint8_t mClass;
+			uint8_t mColor[3];
+		};
+
+		Reader open(std::string iName);
+		void attributes(laszip_header* iHeader, PointCloudAttributes& iAttributes);
+		uint64_t rangeSize(std::string iName);
+		void decode(Reader* iReader, uint64_t iFirst, uint64_t iCount, glm::dvec3 iCenter, std::vector<Sample>* iSamples);
 }; 
@@ -0,0 +1,377 @@
+#include "merge.h"
+
+#include <limits>
+#include <algorithm>
+#include <typeinfo>
+#include <stdexcept>
+
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+#include <boost/filesystem.hpp>
+
+static std::vector<std::string> names(PointCloudAttributes& iAttributes)
+{
+	json_spirit::mArray lArray;
+	iAttributes.toJson(lArray);
+
+	std::vector<std::string> lNames;
+	for (json_spirit::mArray::iterator lIter = lArray.begin(); lIter != lArray.end(); lIter++)
+	{
+		lNames.push_back(lIter->get_obj()["name"].get_str());
+	}
+	return lNames;
+}
+
+MergeImporter::MergeImporter(json_spirit::mObject& iConfig)
+: CloudImporter(iConfig)
+, mRecordSize(0)
+, mOutputFile(0)
+, mCount(0)
+, mParts(0)
+, mNext(0)
+, mCentered(false)
+, mAbort(false)
+{
+};
+
+MergeImporter::Part::Part()
+: mMerge(0)
+, mIndex(0)
+, mShift(0.0)
+, mCount(0)
+{
+};
+
+void MergeImporter::merge(Part& iPart, PointCloudAttributes& iAttributes)
+{
+	iPart.mNames = names(iAttributes);
+	std::vector<Attribute*>& lList = iAttributes;
+	std::vector<Attribute*>& lMerged = mAttributes;
+	for (size_t i = 0; i < lList.size(); i++)
+	{
+		int lIndex = mAttributes.getAttributeIndex(iPart.mNames[i]);
+		if (lIndex == -1)
+		{
+			mAttributes.createAttribute(iPart.mNames[i], *lList[i]);
+		}
+		else if (typeid(*lMerged[lIndex]) != typeid(*lList[i]))
+		{
+			if (iPart.mNames[i] != Attribute::NORMAL)
+			{
+				throw std::runtime_error("the " + iPart.mNames[i] + " of " + iPart.mFile + " does not match the one of the files before it");
+			}
+			BOOST_LOG_TRIVIAL(info) << "Converting the normals of " << iPart.mFile;
+		}
+	}
+}
+
+//
+// Every file is decoded by its own importer which hands its points to its part. The part moves
+// them from the center of the file to the common one and into the merged layout.
+//
+
+glm::dvec3 MergeImporter::center(Part& iPart, glm::dvec3 iOffset)
+{
+	boost::unique_lock<boost::mutex> lLock(mLock);
+	if (iPart.mIndex == 0)
+	{
+		mOffset = iOffset;
+		mCentered = true;
+		mCondition.notify_all();
+	}
+	else
+	{
+		while (!mCentered && !mAbort)
+		{
+			mCondition.wait(lLock);
+		}
+		if (!mCentered)
+		{
+			throw std::runtime_error("merge stopped before " + iPart.mFile + " was imported");
+		}
+	}
+	return iOffset - mOffset;
+}
+
+void MergeImporter::Part::open(CloudImporter& iImporter, PointCloudAttributes& iAttributes)
+{
+	std::vector<std::string> lNames = names(iAttributes);
+	std::vector<Attribute*>& lList = iAttributes;
+	std::vector<Attribute*>& lMerged = mMerge->mAttributes;
+
+	// the import may only write attributes the merged layout knows, in the type found before
+	for (size_t i = 0; i < lNames.size(); i++)
+	{
+		if (mMerge->mAttributes.getAttributeIndex(lNames[i]) == -1)
+		{
+			throw std::runtime_error("the " + lNames[i] + " of " + mFile + " was not known before its import");
+		}
+	}
+
+	mSources.assign(lMerged.size(), Source());
+	for (size_t a = 0; a < lMerged.size(); a++)
+	{
+		mSources[a].mIndex = iAttributes.getAttributeIndex(mMerge->mNames[a]);
+		mSources[a].mNormal = false;
+		if (mSources[a].mIndex != -1 && typeid(*lMerged[a]) != typeid(*lList[mSources[a].mIndex]))
+		{
+			if (mMerge->mNames[a] != Attribute::NORMAL)
+			{
+				throw std::runtime_error("the " + mMerge->mNames[a] + " of " + mFile + " changed during its import");
+			}
+			mSources[a].mNormal = true;
+			mNormal.reset(lMerged[a]->clone());
+		}
+	}
+
+	mShift = mMerge->center(*this, iImporter.mOffset);
+
+	mBatch.resize(BATCH_SIZE * mMerge->mRecordSize);
+	mCount = 0;
+	std::fill(mMin, mMin + 3, std::numeric_limits<double>::max());
+	std::fill(mMax, mMax + 3, -std::numeric_limits<double>::max());
+}
+
+void MergeImporter::Part::write(Point& iPoint)
+{
+	uint8_t* lRecord = &mBatch[mCount * mMerge->mRecordSize];
+
+	float lPosition[3];
+	for (int i = 0; i < 3; i++)
+	{
+		double lCoord = iPoint.position[i] + mShift[i];
+		mMin[i] = std::min(lCoord, mMin[i]);
+		mMax[i] = std::max(lCoord, mMax[i]);
+		lPosition[i] = (float)lCoord;
+	}
+	memcpy(lRecord, lPosition, sizeof(lPosition));
+	lRecord += sizeof(lPosition);
+
+	std::vector<Attribute*>& lMerged = mMerge->mAttributes;
+	for (size_t a = 0; a < lMerged.size(); a++)
+	{
+		Source& lSource = mSources[a];
+		if (lSource.mIndex == -1)
+		{
+			memset(lRecord, 0, lMerged[a]->bytesPerPoint());
+		}
+		else if (lSource.mNormal)
+		{
+			float lNormal[3];
+			getNormal(iPoint.getAttribute(lSource.mIndex), lNormal);
+			setNormal(mNormal.get(), lNormal);
+			mNormal->store(lRecord);
+		}
+		else
+		{
+			iPoint.getAttribute(lSource.mIndex)->store(lRecord);
+		}
+		lRecord += lMerged[a]->bytesPerPoint();
+	}
+
+	if (++mCount == BATCH_SIZE)
+	{
+		flush();
+	}
+}
+
+void MergeImporter::Part::flush()
+{
+	if (mCount)
+	{
+		mMerge->append(&mBatch[0], mCount, mMin, mMax);
+	}
+	mCount = 0;
+	std::fill(mMin, mMin + 3, std::numeric_limits<double>::max());
+	std::fill(mMax, mMax + 3, -std::numeric_limits<double>::max());
+}
+
+void MergeImporter::Part::close()
+{
+	flush();
+	std::vector<uint8_t>().swap(mBatch);
+}
+
+// importers do not expect their points to be refused, a failed write stops the merge once they are done
+void MergeImporter::append(uint8_t* iRecords, size_t iCount, double* iMin, double* iMax)
+{
+	boost::unique_lock<boost::mutex> lLock(mLock);
+	if (mAbort)
+	{
+		return;
+	}
+
+	try
+	{
+		if (mEpsilon > 0)
+		{
+			for (size_t i = 0; i < iCount; i++)
+			{
+				uint8_t* lRecord = iRecords + i * mRecordSize;
+				memcpy(mPoint->position, lRecord, sizeof(mPoint->position));
+				mPoint->map(lRecord + sizeof(mPoint->position));
+				CloudImporter::write(*mPoint, mOutputFile);
+			}
+		}
+		else if (fwrite(iRecords, mRecordSize, iCount, mOutputFile) != iCount)
+		{
+			throw std::runtime_error("cannot write " + PointCloud::fileName(mName));
+		}
+	}
+	catch (...)
+	{
+		mError = std::current_exception();
+		mAbort = true;
+		mNext = mParts;
+		mCondition.notify_all();
+		return;
+	}
+
+	growMinMax(iMin);
+	growMinMax(iMax);
+	mCount += iCount;
+}
+
+void MergeImporter::importParts(std::vector<Part>* iParts)
+{
+	while (true)
+	{
+		size_t lIndex;
+		{
+			boost::unique_lock<boost::mutex> lLock(mLock);
+			if (mNext == iParts->size())
+			{
+				return;
+			}
+			lIndex = mNext++;
+		}
+
+		Part& lPart = (*iParts)[lIndex];
+		try
+		{
+			lPart.mImporter->mSink = &lPart;
+			lPart.mMeta = lPart.mImporter->import(lPart.mFile);
+		}
+		catch (...)
+		{
+			lPart.mError = std::current_exception();
+
+			// files waiting for the center or not started yet are given up
+			boost::unique_lock<boost::mutex> lLock(mLock);
+			mAbort = true;
+			mNext = iParts->size();
+			mCondition.notify_all();
+		}
+	}
+}
+
+json_spirit::mObject MergeImporter::import(std::vector<std::string> iFiles, std::string iOutput, Create iCreate)
+{
+	uint32_t lWorkers = std::min<uint32_t>(mThreads, iFiles.size());
+
+	// the attributes of every file are known before any point is read so the output is written once
+	std::vector<Part> lParts(iFiles.size());
+	for (size_t i = 0; i < lParts.size(); i++)
+	{
+		Part& lPart = lParts[i];
+		lPart.mMerge = this;
+		lPart.mIndex = i;
+		lPart.mFile = iFiles[i];
+
+		lPart.mConfig = mConfig;
+		lPart.mConfig["file"] = json_spirit::mArray(1, json_spirit::mValue(lPart.mFile));
+		lPart.mConfig["threads"] = (int)std::max<uint32_t>(1, mThreads / lWorkers);
+
+		// duplicates are removed once while merging
+		lPart.mConfig["dedup"] = json_spirit::mValue();
+
+		lPart.mImporter.reset(iCreate(lPart.mConfig, lPart.mFile));
+		if (!lPart.mImporter)
+		{
+			throw std::runtime_error("unknown format of " + lPart.mFile);
+		}
+
+		PointCloudAttributes lAttributes;
+		lPart.mImporter->attributes(lPart.mFile, lAttributes);
+		merge(lPart, lAttributes);
+	}
+
+	mNames = names(mAttributes);
+	for (std::vector<Part>::iterator lPart = lParts.begin(); lPart != lParts.end(); lPart++)
+	{
+		for (std::vector<std::string>::iterator lName = mNames.begin(); lName != mNames.end(); lName++)
+		{
+			if (std::find(lPart->mNames.begin(), lPart->mNames.end(), *lName) == lPart->mNames.end())
+			{
+				BOOST_LOG_TRIVIAL(warning) << lPart->mFile << " has no " << *lName << ", its points get zero";
+			}
+		}
+	}
+
+	mName = iOutput;
+	mRecordSize = sizeof(float) * 3 + mAttributes.bytesPerPoint();
+	mPoint.reset(new Point(mAttributes));
+	mOutputFile = PointCloud::writeHeader(iOutput, mAttributes);
+	if (!mOutputFile)
+	{
+		throw std::runtime_error("cannot create " + PointCloud::fileName(iOutput));
+	}
+	try
+	{
+		createShards(mAttributes);
+	}
+	catch (...)
+	{
+		dropOutput(mOutputFile);
+		throw;
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "Merging " << lParts.size() << " files with " << lWorkers << " workers";
+	mParts = lParts.size();
+	mNext = 0;
+	mCount = 0;
+	mCentered = false;
+	mAbort = false;
+	boost::thread_group lGroup;
+	for (uint32_t t = 0; t < lWorkers; t++)
+	{
+		lGroup.add_thread(new boost::thread(&MergeImporter::importParts, this, &lParts));
+	}
+	lGroup.join_all();
+
+	std::exception_ptr lError = mError;
+	for (std::vector<Part>::iterator lPart = lParts.begin(); lPart != lParts.end() && !lError; lPart++)
+	{
+		lError = lPart->mError;
+	}
+	if (lError)
+	{
+		dropShards();
+		fclose(mOutputFile);
+		std::remove(PointCloud::fileName(iOutput).c_str());
+		std::rethrow_exception(lError);
+	}
+
+	for (std::vector<Part>::iterator lPart = lParts.begin(); lPart != lParts.end(); lPart++)
+	{
+		if (lPart->mMeta.find("scanners") != lPart->mMeta.end())
+		{
+			glm::dvec3 lShift = lPart->mImporter->mOffset - mOffset;
+			json_spirit::mArray& lScanners = lPart->mMeta["scanners"].get_array();
+			for (json_spirit::mArray::iterator lIter = lScanners.begin(); lIter != lScanners.end(); lIter++)
+			{
+				json_spirit::mArray& lPosition = lIter->get_array();
+				mScanners.push_back(glm::dvec3(lPosition[0].get_real(), lPosition[1].get_real(), lPosition[2].get_real()) + lShift);
+			}
+		}
+	}
+
+	uint64_t lPointCount = flush(mOutputFile, mCount);
+	PointCloud::updateSize(mOutputFile, lPointCount);
+	PointCloud::updateSpatialBounds(mOutputFile, mMinD, mMaxD);
+	fclose(mOutputFile);
+
+	json_spirit::mObject lMeta = getMeta();
+	lMeta["file"] = iOutput;
+	return lMeta;
+}
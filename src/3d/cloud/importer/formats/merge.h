@@ -0,0 +1,101 @@
+#pragma once
+
+#include <memory>
+#include <exception>
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+#include "importer.h"
+
+//
+// Imports several files with a worker per file into a single output. The attributes of all files
+// are merged before any point is read, every importer then hands its points to the shared output in
+// batches. Points are kept around the center of the first file.
+//
+
+class MergeImporter : public CloudImporter
+{
+	public:
+
+		// creates the importer of iFile, NULL if the format is not known
+		typedef boost::function<CloudImporter*(json_spirit::mObject& iConfig, std::string iFile)> Create;
+
+		MergeImporter(json_spirit::mObject& iConfig);
+
+		json_spirit::mObject import(std::vector<std::string> iFiles, std::string iOutput, Create iCreate);
+
+	protected:
+
+		static const size_t BATCH_SIZE = 65536;
+
+		// a file being merged, its points are moved to the merged layout and center as they arrive
+		class Part : public CloudSink
+		{
+			public:
+
+				Part();
+
+				MergeImporter* mMerge;
+				size_t mIndex;
+
+				std::string mFile;
+				json_spirit::mObject mConfig;
+				std::unique_ptr<CloudImporter> mImporter;
+				json_spirit::mObject mMeta;
+				std::exception_ptr mError;
+
+				// attribute names found before the import
+				std::vector<std::string> mNames;
+
+				void open(CloudImporter& iImporter, PointCloudAttributes& iAttributes);
+				void write(Point& iPoint);
+				void close();
+
+			protected:
+
+				// where a merged attribute comes from, -1 for attributes the file does not have
+				struct Source
+				{
+					int mIndex;
+					bool mNormal;
+				};
+
+				std::vector<Source> mSources;
+				std::unique_ptr<Attribute> mNormal;
+				glm::dvec3 mShift;
+
+				std::vector<uint8_t> mBatch;
+				size_t mCount;
+				double mMin[3];
+				double mMax[3];
+
+				void flush();
+		};
+
+		PointCloudAttributes mAttributes;
+		std::vector<std::string> mNames;
+		size_t mRecordSize;
+		std::unique_ptr<Point> mPoint;
+		FILE* mOutputFile;
+		uint64_t mCount;
+		std::exception_ptr mError;
+
+		boost::mutex mLock;
+		boost::condition_variable mCondition;
+		size_t mParts;
+		size_t mNext;
+		bool mCentered;
+		bool mAbort;
+
+		void importParts(std::vector<Part>* iParts);
+
+		// adds the attributes of a file to the merged ones, only normals may differ in their type
+		void merge(Part& iPart, PointCloudAttributes& iAttributes);
+
+		// the offset of the first file is the center of the output, the others wait for it
+		glm::dvec3 center(Part& iPart, glm::dvec3 iOffset);
+
+		// writes a batch of merged records, batches of different files may interleave
+		void append(uint8_t* iRecords, size_t iCount, double* iMin, double* iMax);
+};
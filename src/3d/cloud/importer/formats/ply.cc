@@ -8,342 +8,105 @@ static const uint8_t ASCII = 1;
 static const uint8_t BINARY_LITTLE_ENDIAN = 2;
 static const uint8_t BINARY_BIG_ENDIAN = 3;
 
-class TypeReader
-{
-	public:
-
-		virtual void skipA(char* iString) = 0;
-		virtual float getFloatA(char* iString) = 0;
-		virtual uint8_t getUint8A(char* iString) = 0;
-		virtual uint16_t getUint16A(char* iString) = 0;
-
-		virtual void skipBL(FILE* iFile) = 0;
-		virtual float getFloatBL(FILE* iFile, uint8_t iEndian) = 0;
-		virtual uint8_t getUint8BL(FILE* iFile, uint8_t iEndian) = 0;
-		virtual uint16_t getUint16BL(FILE* iFile, uint8_t iEndian) = 0;
-
-	protected:
-
-		float reverseFloat(const float inFloat)
-		{
-		   float retVal;
-		   char *floatToConvert = ( char* ) & inFloat;
-		   char *returnFloat = ( char* ) & retVal;
-
-		   // swap the bytes into a temporary buffer
-		   returnFloat[0] = floatToConvert[3];
-		   returnFloat[1] = floatToConvert[2];
-		   returnFloat[2] = floatToConvert[1];
-		   returnFloat[3] = floatToConvert[0];
-
-		   return retVal;
-		}
-};
-
-
-#define TYPEREADER(type,vartype,format) \
-class type##Reader : public TypeReader \
-{\
-	public:\
-	\
-		inline type readBL(FILE* iFile)\
-		{\
-			type lValue;\
-			fread(&lValue, sizeof(type),1,iFile);\
-			return lValue;\
-		};\
-		\
-		float getFloatBL(FILE* iFile, uint8_t iEndian)\
-		{\
-			float lValue = (float)readBL(iFile);\
-			if (iEndian == BINARY_BIG_ENDIAN)\
-			{\
-				return reverseFloat(lValue);\
-			}\
-			return lValue;\
-		};\
-		uint8_t getUint8BL(FILE* iFile, uint8_t iEndian)\
-		{\
-			return (uint8_t)readBL(iFile);\
-		};\
-		uint16_t getUint16BL(FILE* iFile, uint8_t iEndian)\
-		{\
-			return (uint16_t)readBL(iFile);\
-		};\
-		void skipBL(FILE* iFile)\
-		{\
-			readBL(iFile);\
-		};\
-		\
-		inline type readA(char* iString)\
-		{\
-			vartype lValue;\
-			sscanf(iString, format, &lValue);\
-			return lValue;\
-		};\
-		\
-		float getFloatA(char* iValue)\
-		{\
-			return (float)readA(iValue);\
-		};\
-		uint8_t getUint8A(char* iValue)\
-		{\
-			return (uint8_t)readA(iValue);\
-		};\
-		uint16_t getUint16A(char* iValue)\
-		{\
-			return (uint16_t)readA(iValue);\
-		};\
-		void skipA(char* iValue)\
-		{\
-			readA(iValue);\
-		};\
-		\
-} type##Instance;\
-
-
-
-TYPEREADER(uint32_t, uint32_t, "%du");
-TYPEREADER(uint16_t, uint16_t,"%hu");
-TYPEREADER(uint8_t, uint16_t,"%hu");
-TYPEREADER(int32_t, int32_t, "%d");
-TYPEREADER(int16_t, int16_t, "%hd");
-TYPEREADER(int8_t, int8_t, "%hhd");
-TYPEREADER(float,float,"%f");
-TYPEREADER(double,double,"%lf");
-
-
-class PropertyReader
-{
-	public:
-
-		virtual void readBL(Point& iPoint, FILE* iFile, uint8_t iEndian) = 0;
-		virtual void readA(Point& iPoint, char* iBuffer) = 0;
-};
-
-class VertexReader : public PropertyReader
-{
-	public:
-
-		TypeReader& mReader;
-		int mIndex;
-
-		VertexReader(int iIndex, TypeReader& iReader)
-		: mIndex(iIndex)
-		, mReader(iReader)
-		{
-		}
-
-		void readBL(Point& iPoint, FILE* iFile, uint8_t iEndian)
-		{
-			iPoint.position[mIndex] = mReader.getFloatBL(iFile, iEndian);
-		};
-		void readA(Point& iPoint, char* iString)
-		{
-			iPoint.position[mIndex] = mReader.getFloatA(iString);
-		};
-};
-
-class NormalReader : public PropertyReader
-{
-	public:
-
-		TypeReader& mReader;
-		int mAttributeIndex;
-		int mIndex;
-
-		NormalReader(int iIndex, TypeReader& iReader, int iAttributeIndex)
-		: mIndex(iIndex)
-		, mReader(iReader)
-		, mAttributeIndex(iAttributeIndex)
-		{
-		}
-
-		void readBL(Point& iPoint, FILE* iFile, uint8_t iEndian)
-		{
-			NormalType& lAttribute = *(NormalType*)iPoint.getAttribute(mAttributeIndex);
-			lAttribute.mValue[mIndex] = mReader.getFloatBL(iFile, iEndian);
-		};
-		void readA(Point& iPoint, char* iString)
-		{
-			NormalType& lAttribute = *(NormalType*)iPoint.getAttribute(mAttributeIndex);
-			lAttribute.mValue[mIndex] = mReader.getFloatA(iString);
-		};
-};
-
-class ColorReader : public PropertyReader
-{
-	public:
-
-		TypeReader& mReader;
-		int mAttributeIndex;
-		int mIndex;
-
-		ColorReader(int iIndex, TypeReader& iReader, int iAttributeIndex)
-		: mIndex(iIndex)
-		, mReader(iReader)
-		, mAttributeIndex(iAttributeIndex)
-		{
-		}
-
-		void readBL(Point& iPoint, FILE* iFile, uint8_t iEndian)
-		{
-			ColorType& lAttribute = *(ColorType*)iPoint.getAttribute(mAttributeIndex);
-			lAttribute.mValue[mIndex] = mReader.getUint8BL(iFile, iEndian);
-		};
-		void readA(Point& iPoint, char* iString)
-		{
-			ColorType& lAttribute = *(ColorType*)iPoint.getAttribute(mAttributeIndex);
-			lAttribute.mValue[mIndex] = mReader.getUint8A(iString);
-		};
-};
-
-class IntensityReader : public PropertyReader
-{
-	public:
-
-		TypeReader& mReader;
-		int mAttributeIndex;
-	
-		IntensityReader(TypeReader& iReader, int iAttributeIndex)
-		: mReader(iReader)
-		, mAttributeIndex(iAttributeIndex)
-		{
-		}
-
-		void readBL(Point& iPoint, FILE* iFile, uint8_t iEndian)
-		{
-			ClassType& lAttribute = *(ClassType*)iPoint.getAttribute(mAttributeIndex);
-			lAttribute.mValue = mReader.getUint16BL(iFile, iEndian);
-		};
-		void readA(Point& iPoint, char* iString)
-		{
-			ClassType& lAttribute = *(ClassType*)iPoint.getAttribute(mAttributeIndex);
-			lAttribute.mValue = mReader.getUint16A(iString);
-		};
-};
-
-class ClassReader : public PropertyReader
-{
-	public:
-
-		TypeReader& mReader;
-		int mAttributeIndex;
-	
-		ClassReader(TypeReader& iReader, int iAttributeIndex)
-		: mReader(iReader)
-		, mAttributeIndex(iAttributeIndex)
-		{
-		}
-
-		void readBL(Point& iPoint, FILE* iFile, uint8_t iEndian)
-		{
-			ClassType& lAttribute = *(ClassType*)iPoint.getAttribute(mAttributeIndex);
-			lAttribute.mValue = mReader.getUint8BL(iFile, iEndian);
-		};
-		void readA(Point& iPoint, char* iString)
-		{
-			ClassType& lAttribute = *(ClassType*)iPoint.getAttribute(mAttributeIndex);
-			lAttribute.mValue = mReader.getUint8A(iString);
-		};
-};
-
-class NullReader : public PropertyReader
-{
-	public:
-
-		TypeReader& mReader;
+static const uint8_t INT8 = 1;
+static const uint8_t UINT8 = 2;
+static const uint8_t INT16 = 3;
+static const uint8_t UINT16 = 4;
+static const uint8_t INT32 = 5;
+static const uint8_t UINT32 = 6;
+static const uint8_t FLOAT = 7;
+static const uint8_t DOUBLE = 8;
 
-		NullReader(TypeReader& iReader)
-		: mReader(iReader)
-		{
-		}
+static const size_t sTypeSize[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
 
-		void readBL(Point& iPoint, FILE* iFile, uint8_t iEndian)
-		{
-			mReader.getFloatBL(iFile, iEndian);
-		};
+typedef void (*ConvertFunction)(const uint8_t* iFrom, size_t iFromStride, uint8_t* iTo, size_t iToStride, size_t iCount);
 
-		void readA(Point& iPoint, char* iString)
-		{
-			mReader.getFloatA(iString);
-		};
-};
-
-
-TypeReader& getReader(char* iType)
+static uint8_t getType(const char* iType)
 {
 	if (!strcmp(iType, "char") || !strcmp(iType, "int8"))
 	{
-		return int16_tInstance;
+		return INT8;
 	}
-	else if (!strcmp(iType, "short") || !strcmp(iType, "int16"))
+	else if (!strcmp(iType, "uchar") || !strcmp(iType, "uint8"))
 	{
-		return int16_tInstance;
+		return UINT8;
 	}
-	else if (!strcmp(iType, "int") || !strcmp(iType, "int32"))
+	else if (!strcmp(iType, "short") || !strcmp(iType, "int16"))
 	{
-		return int32_tInstance;
+		return INT16;
 	}
-	else if (!strcmp(iType, "uchar") || !strcmp(iType, "uint8"))
+	else if (!strcmp(iType, "ushort") || !strcmp(iType, "uint16"))
 	{
-		return uint8_tInstance;
+		return UINT16;
 	}
-	else if (!strcmp(iType, "ushort") || !strcmp(iType, "uint16"))
+	else if (!strcmp(iType, "int") || !strcmp(iType, "int32"))
 	{
-		return uint16_tInstance;
+		return INT32;
 	}
 	else if (!strcmp(iType, "uint") || !strcmp(iType, "uint32"))
 	{
-		return uint32_tInstance;
+		return UINT32;
 	}
 	else if (!strcmp(iType, "float") || !strcmp(iType, "float32"))
 	{
-		return floatInstance;
+		return FLOAT;
 	}
 	else if (!strcmp(iType, "double") || !strcmp(iType, "float64"))
 	{
-		return doubleInstance;
+		return DOUBLE;
 	}
+	return 0;
 }
 
+static bool isLittleEndian()
+{
+	uint16_t lValue = 1;
+	return *(uint8_t*)&lValue == 1;
+}
 
-void readPlyPoint(Point& iPoint, FILE* iFile, uint32_t iFormat, PropertyReader** iFields, uint32_t iIndex)
+template <class S, class T, bool SWAP> static void convert(const uint8_t* iFrom, size_t iFromStride, uint8_t* iTo, size_t iToStride, size_t iCount)
 {
-	switch (iFormat)
+	for (size_t i = 0; i < iCount; i++, iFrom += iFromStride, iTo += iToStride)
 	{
-		case BINARY_LITTLE_ENDIAN:
-		case BINARY_BIG_ENDIAN:
-			{
-				for (int i=0; i<iIndex; i++)
-				{
-					iFields[i]->readBL(iPoint, iFile, iFormat);
-				}
-			}
-			break;
-		case ASCII:
-			{
-				char lLine[256];
-				fgets(lLine, 256, iFile); 
-				uint8_t lLength = strlen(lLine);
-				lLine[lLength-1] = 0x00;
+		uint8_t lBytes[sizeof(S)];
+		for (size_t b = 0; b < sizeof(S); b++)
+		{
+			lBytes[b] = iFrom[SWAP ? sizeof(S) - 1 - b : b];
+		}
 
-				int lPtr = 0;
-				for (int i=0; i<iIndex; i++)
-				{
-					char lValue[255];
-					while (lLine[lPtr] == ' ')
-					{
-						lPtr++;
-					}
-					sscanf(&lLine[lPtr], "%s", lValue);
-					iFields[i]->readA(iPoint, lValue);
-					lPtr+= strlen(lValue)+1;
-				}
-			}
-			break;
-	}		
-};
+		S lSource;
+		memcpy(&lSource, lBytes, sizeof(S));
+		T lTarget = (T)lSource;
+		memcpy(iTo, &lTarget, sizeof(T));
+	}
+}
+
+template <class T, bool SWAP> static ConvertFunction select(uint8_t iType)
+{
+	switch (iType)
+	{
+		case INT8: return convert<int8_t, T, SWAP>;
+		case UINT8: return convert<uint8_t, T, SWAP>;
+		case INT16: return convert<int16_t, T, SWAP>;
+		case UINT16: return convert<uint16_t, T, SWAP>;
+		case INT32: return convert<int32_t, T, SWAP>;
+		case UINT32: return convert<uint32_t, T, SWAP>;
+		case FLOAT: return convert<float, T, SWAP>;
+		case DOUBLE: return convert<double, T, SWAP>;
+	}
+	return 0;
+}
+
+static ConvertFunction select(uint8_t iType, uint8_t iTarget, bool iSwap)
+{
+	switch (iTarget)
+	{
+		case UINT8: return iSwap ? select<uint8_t, true>(iType) : select<uint8_t, false>(iType);
+		case UINT16: return iSwap ? select<uint16_t, true>(iType) : select<uint16_t, false>(iType);
+		case FLOAT: return iSwap ? select<float, true>(iType) : select<float, false>(iType);
+	}
+	return 0;
+}
 
 
 PlyImporter::PlyImporter(json_spirit::mObject& iConfig)
@@ -351,171 +114,347 @@ PlyImporter::PlyImporter(json_spirit::mObject& iConfig)
 {
 };
 
-
-json_spirit::mObject PlyImporter::import (json_spirit::mArray iFiles, std::string iOutput)
+bool PlyImporter::readHeader(std::string iName, Layout& iLayout)
 {
-	FILE* lInputFile = fopen(iFiles[0].get_str().c_str(),"rb");
-
-	char lLine[1024];
-	size_t lLength = 0;
-	fgets(lLine, 256, lInputFile); 
-	lLine[strlen(lLine)-1] = 0x00;
+	FILE* lFile = fopen(iName.c_str(), "rb");
+	if (!lFile)
+	{
+		return false;
+	}
 
-	PointCloudAttributes lAttributes;
-	PropertyReader* lFields[200];
-	memset(lFields,0,sizeof(lFields));
+	iLayout.mFormat = 0;
+	iLayout.mCount = 0;
+	iLayout.mStride = 0;
+	iLayout.mStart = 0;
+	iLayout.mProperties.clear();
 
-	uint32_t lFormat = 0;
-	uint32_t lIndex = 0;
 	bool lVertexElement = false;
-	while (fgets(lLine,1024,lInputFile)) 
+	char lLine[1024];
+	while (fgets(lLine, sizeof(lLine), lFile))
 	{
-		char lBuffer[4][64];
-		//std::cout << lLine << "\n";
-		sscanf(lLine, "%s %s %s", (char*)&lBuffer[0], (char*)&lBuffer[1], (char*)&lBuffer[2]);
+		char lBuffer[3][64] = {};
+		sscanf(lLine, "%63s %63s %63s", lBuffer[0], lBuffer[1], lBuffer[2]);
 		if (!strcmp(lBuffer[0], "format"))
 		{
-			if (!strcmp(lBuffer[1],"ascii"))
+			if (!strcmp(lBuffer[1], "ascii"))
 			{
-				lFormat = ASCII;
+				iLayout.mFormat = ASCII;
 			}
-			else if (!strcmp(lBuffer[1],"binary_little_endian"))
+			else if (!strcmp(lBuffer[1], "binary_little_endian"))
 			{
-				lFormat = BINARY_LITTLE_ENDIAN;
+				iLayout.mFormat = BINARY_LITTLE_ENDIAN;
 			}
-			else if (!strcmp(lBuffer[1],"binary_big_endian"))
+			else if (!strcmp(lBuffer[1], "binary_big_endian"))
 			{
-				lFormat = BINARY_BIG_ENDIAN;
+				iLayout.mFormat = BINARY_BIG_ENDIAN;
 			}
 		}
-		if (!strcmp(lBuffer[0], "property") && lVertexElement)
+		else if (!strcmp(lBuffer[0], "element"))
 		{
-			if (!strcmp(lBuffer[2], "x"))
-			{
-				lFields[lIndex] = new VertexReader(0, getReader(lBuffer[1]));
-			}
-			else if (!strcmp(lBuffer[2], "y"))
+			lVertexElement = !strcmp(lBuffer[1], "vertex");
+			if (lVertexElement)
 			{
-				lFields[lIndex] = new VertexReader(1, getReader(lBuffer[1]));
+				iLayout.mCount = strtoull(lBuffer[2], 0, 10);
 			}
-			else if (!strcmp(lBuffer[2], "z"))
-			{
-				lFields[lIndex] = new VertexReader(2, getReader(lBuffer[1]));
-			}
-			else if (!strcmp(lBuffer[2], "nx"))
-			{
-				lFields[lIndex] = new NormalReader(0, getReader(lBuffer[1]), lAttributes.createAttribute(Attribute::NORMAL, NORMAL_TEMPLATE));
-			}
-			else if (!strcmp(lBuffer[2], "ny"))
-			{
-				lFields[lIndex] = new NormalReader(1, getReader(lBuffer[1]), lAttributes.createAttribute(Attribute::NORMAL, NORMAL_TEMPLATE));
-			}
-			else if (!strcmp(lBuffer[2], "nz"))
-			{
-				lFields[lIndex] = new NormalReader(2, getReader(lBuffer[1]), lAttributes.createAttribute(Attribute::NORMAL, NORMAL_TEMPLATE));
-			}
-			else if (!strcmp(lBuffer[2], "r") || !strcmp(lBuffer[2], "red") || !strcmp(lBuffer[2], "diffuse_red"))
-			{
-				lFields[lIndex] = new ColorReader(0, getReader(lBuffer[1]), lAttributes.createAttribute(Attribute::COLOR, COLOR_TEMPLATE));
-			}
-			else if (!strcmp(lBuffer[2], "g") || !strcmp(lBuffer[2], "green") || !strcmp(lBuffer[2], "diffuse_green"))
-			{
-				lFields[lIndex] = new ColorReader(1, getReader(lBuffer[1]), lAttributes.createAttribute(Attribute::COLOR, COLOR_TEMPLATE));
-			}
-			else if (!strcmp(lBuffer[2], "b") || !strcmp(lBuffer[2], "blue") || !strcmp(lBuffer[2], "diffuse_blue"))
+		}
+		else if (!strcmp(lBuffer[0], "property") && lVertexElement)
+		{
+			Property lProperty;
+			lProperty.mName = lBuffer[2];
+			lProperty.mType = getType(lBuffer[1]);
+			lProperty.mSource = iLayout.mStride;
+			if (!lProperty.mType)
 			{
-				lFields[lIndex] = new ColorReader(2, getReader(lBuffer[1]), lAttributes.createAttribute(Attribute::COLOR, COLOR_TEMPLATE));
+				BOOST_LOG_TRIVIAL(error) << iName << " has an unsupported vertex property " << lBuffer[1];
+				fclose(lFile);
+				return false;
 			}
-			else if (!strcmp(lBuffer[2], "intensity"))
+			iLayout.mStride += sTypeSize[lProperty.mType];
+			iLayout.mProperties.push_back(lProperty);
+		}
+		else if (!strncmp(lLine, "end_header", 10))
+		{
+			iLayout.mStart = ftell(lFile);
+			fclose(lFile);
+			return iLayout.mFormat != 0;
+		}
+	}
+
+	fclose(lFile);
+	return false;
+}
+
+//
+// Every property that maps to the position or an attribute becomes a step converting it from its
+// place in a source record to its place in an output record. Steps that only move bytes are merged
+// so the x, y and z of a float cloud are a single copy.
+//
+
+void PlyImporter::compile(Layout& iLayout, PointCloudAttributes& iAttributes)
+{
+	std::vector<Attribute*>& lList = iAttributes;
+	std::vector<size_t> lOffsets(lList.size());
+	size_t lOffset = sizeof(float) * 3;
+	for (size_t i = 0; i < lList.size(); i++)
+	{
+		lOffsets[i] = lOffset;
+		lOffset += lList[i]->bytesPerPoint();
+	}
+
+	// ascii bodies are parsed into records of doubles
+	bool lSwap = iLayout.mFormat == (isLittleEndian() ? BINARY_BIG_ENDIAN : BINARY_LITTLE_ENDIAN);
+
+	iLayout.mSteps.clear();
+	for (size_t i = 0; i < iLayout.mProperties.size(); i++)
+	{
+		Property& lProperty = iLayout.mProperties[i];
+		const char* lName = lProperty.mName.c_str();
+
+		size_t lTarget;
+		uint8_t lTargetType;
+		if (!strcmp(lName, "x") || !strcmp(lName, "y") || !strcmp(lName, "z"))
+		{
+			lTarget = sizeof(float) * (lName[0] - 'x');
+			lTargetType = FLOAT;
+		}
+		else if (!strcmp(lName, "nx") || !strcmp(lName, "ny") || !strcmp(lName, "nz"))
+		{
+			lTarget = lOffsets[iAttributes.getAttributeIndex(Attribute::NORMAL)] + sizeof(float) * (lName[1] - 'x');
+			lTargetType = FLOAT;
+		}
+		else if (!strcmp(lName, "r") || !strcmp(lName, "red") || !strcmp(lName, "diffuse_red"))
+		{
+			lTarget = lOffsets[iAttributes.getAttributeIndex(Attribute::COLOR)];
+			lTargetType = UINT8;
+		}
+		else if (!strcmp(lName, "g") || !strcmp(lName, "green") || !strcmp(lName, "diffuse_green"))
+		{
+			lTarget = lOffsets[iAttributes.getAttributeIndex(Attribute::COLOR)] + 1;
+			lTargetType = UINT8;
+		}
+		else if (!strcmp(lName, "b") || !strcmp(lName, "blue") || !strcmp(lName, "diffuse_blue"))
+		{
+			lTarget = lOffsets[iAttributes.getAttributeIndex(Attribute::COLOR)] + 2;
+			lTargetType = UINT8;
+		}
+		else if (!strcmp(lName, "intensity"))
+		{
+			lTarget = lOffsets[iAttributes.getAttributeIndex(Attribute::INTENSITY)];
+			lTargetType = UINT16;
+		}
+		else if (!strcmp(lName, "class"))
+		{
+			lTarget = lOffsets[iAttributes.getAttributeIndex(Attribute::CLASS)];
+			lTargetType = UINT8;
+		}
+		else
+		{
+			continue;
+		}
+
+		Step lStep;
+		lStep.mSource = iLayout.mFormat == ASCII ? i * sizeof(double) : lProperty.mSource;
+		lStep.mTarget = lTarget;
+		lStep.mBytes = sTypeSize[lTargetType];
+		lStep.mConvert = 0;
+
+		uint8_t lType = iLayout.mFormat == ASCII ? DOUBLE : lProperty.mType;
+		if (lType != lTargetType || (lSwap && lStep.mBytes > 1))
+		{
+			lStep.mConvert = select(lType, lTargetType, lSwap);
+		}
+
+		if (!lStep.mConvert && iLayout.mSteps.size())
+		{
+			Step& lLast = iLayout.mSteps.back();
+			if (!lLast.mConvert && lLast.mSource + lLast.mBytes == lStep.mSource && lLast.mTarget + lLast.mBytes == lStep.mTarget)
 			{
-				lFields[lIndex] = new IntensityReader(getReader(lBuffer[1]), lAttributes.createAttribute(Attribute::INTENSITY, INTENSITY_TEMPLATE));
+				lLast.mBytes += lStep.mBytes;
+				continue;
 			}
-			else if (!strcmp(lBuffer[2], "class"))
+		}
+		iLayout.mSteps.push_back(lStep);
+	}
+}
+
+size_t PlyImporter::readAscii(FILE* iFile, Layout& iLayout, uint8_t* iRecords, size_t iCount)
+{
+	size_t lValues = iLayout.mProperties.size();
+	size_t lCount = 0;
+	char lLine[1024];
+	while (lCount < iCount && fgets(lLine, sizeof(lLine), iFile))
+	{
+		double* lRecord = (double*)iRecords + lCount * lValues;
+		char* lPosition = lLine;
+		for (size_t i = 0; i < lValues; i++)
+		{
+			char* lEnd;
+			lRecord[i] = strtod(lPosition, &lEnd);
+			lPosition = lEnd;
+		}
+
+		// blank lines are not vertices
+		if (lPosition != lLine)
+		{
+			lCount++;
+		}
+	}
+	return lCount;
+}
+
+json_spirit::mObject PlyImporter::import (json_spirit::mArray iFiles, std::string iOutput)
+{
+	// all headers are read first so the output has the attributes of every file
+	PointCloudAttributes lAttributes;
+	std::vector<Layout> lLayouts(iFiles.size());
+	for (size_t i = 0; i < iFiles.size(); i++)
+	{
+		Layout& lLayout = lLayouts[i];
+		if (!readHeader(iFiles[i].get_str(), lLayout))
+		{
+			BOOST_LOG_TRIVIAL(error) << "Could not read the header of " << iFiles[i].get_str();
+			lLayout.mCount = 0;
+			continue;
+		}
+
+		for (std::vector<Property>::iterator lIter = lLayout.mProperties.begin(); lIter != lLayout.mProperties.end(); lIter++)
+		{
+			const char* lName = lIter->mName.c_str();
+			if (!strcmp(lName, "nx") || !strcmp(lName, "ny") || !strcmp(lName, "nz"))
 			{
-				lFields[lIndex] = new ClassReader(getReader(lBuffer[1]), lAttributes.createAttribute(Attribute::CLASS, CLASS_TEMPLATE));
+				lAttributes.createAttribute(Attribute::NORMAL, NORMAL_TEMPLATE);
 			}
-			else
+			else if (!strcmp(lName, "r") || !strcmp(lName, "red") || !strcmp(lName, "diffuse_red") ||
+					 !strcmp(lName, "g") || !strcmp(lName, "green") || !strcmp(lName, "diffuse_green") ||
+					 !strcmp(lName, "b") || !strcmp(lName, "blue") || !strcmp(lName, "diffuse_blue"))
 			{
-				lFields[lIndex] = new NullReader(getReader(lBuffer[1]));
+				lAttributes.createAttribute(Attribute::COLOR, COLOR_TEMPLATE);
 			}
-			lIndex++; 
-		}
-		else if (!strcmp(lBuffer[0], "element"))
-		{
-			if (!strcmp(lBuffer[1], "vertex"))
+			else if (!strcmp(lName, "intensity"))
 			{
-				lVertexElement = true;
+				lAttributes.createAttribute(Attribute::INTENSITY, INTENSITY_TEMPLATE);
 			}
-			else
+			else if (!strcmp(lName, "class"))
 			{
-				lVertexElement = false;
+				lAttributes.createAttribute(Attribute::CLASS, CLASS_TEMPLATE);
 			}
 		}
-		else if (!strncmp(lLine, "end_header", 10))
-		{
-			break;
-		}
 	}
-	fclose(lInputFile);
-
-	Point lPoint(lAttributes);
 
-	ColorType* lColor = 0;
-	int lColorIndex = lAttributes.getAttributeIndex(Attribute::COLOR);
-	if (lColorIndex != -1)
+	for (std::vector<Layout>::iterator lIter = lLayouts.begin(); lIter != lLayouts.end(); lIter++)
 	{
-		lColor = (ColorType*)lPoint.getAttribute(lColorIndex);
+		compile(*lIter, lAttributes);
 	}
-	unsigned long lTotalPoints = 0;
-	
+
+	Point lPoint(lAttributes);
+	size_t lOutputStride = sizeof(float) * 3 + lAttributes.bytesPerPoint();
+	std::vector<uint8_t> lOutput(BLOCK_SIZE * lOutputStride);
+	std::vector<uint8_t> lInput;
+
+	uint64_t lTotalPoints = 0;
+
 	boost::filesystem::path lPath(iOutput);
+	mName = lPath.stem().string();
 	FILE* lOutputFile = PointCloud::writeHeader(lPath.stem().string(), lAttributes);
-
-	for (int i=0; i<iFiles.size(); i++)
+	try
 	{
-		FILE* lInputFile = fopen(iFiles[i].get_str().c_str(),"rb");
+		createShards(lAttributes);
+	}
+	catch (...)
+	{
+		dropOutput(lOutputFile);
+		throw;
+	}
 
-		unsigned long lPointCount = 0;
-		char lLine[1024];
-		while (fgets(lLine,1024,lInputFile)) 
+	for (size_t i = 0; i < iFiles.size(); i++)
+	{
+		Layout& lLayout = lLayouts[i];
+		if (!lLayout.mCount)
 		{
-			char lBuffer[4][64];
-			//std::cout << lLine << "\n";
-			sscanf(lLine, "%s %s %s", (char*)&lBuffer[0], (char*)&lBuffer[1], (char*)&lBuffer[2]);
+			continue;
+		}
+
+		FILE* lInputFile = fopen(iFiles[i].get_str().c_str(), "rb");
+		fseek(lInputFile, lLayout.mStart, SEEK_SET);
+
+		size_t lInputStride = lLayout.mFormat == ASCII ? lLayout.mProperties.size() * sizeof(double) : lLayout.mStride;
+		lInput.resize(BLOCK_SIZE * lInputStride);
 
-			if (!strcmp(lBuffer[1], "vertex"))
+		BOOST_LOG_TRIVIAL(info) << iFiles[i].get_str() << " contains " << lLayout.mCount << " points ";
+		uint64_t lRemaining = lLayout.mCount;
+		while (lRemaining)
+		{
+			size_t lCount = std::min<uint64_t>(BLOCK_SIZE, lRemaining);
+			if (lLayout.mFormat == ASCII)
+			{
+				lCount = readAscii(lInputFile, lLayout, &lInput[0], lCount);
+			}
+			else
 			{
-				sscanf(lBuffer[2], "%lu", &lPointCount);
+				lCount = fread(&lInput[0], lInputStride, lCount, lInputFile);
 			}
-			else if (!strncmp(lLine, "end_header", 10))
+			if (!lCount)
 			{
 				break;
 			}
-		}
+			lRemaining -= lCount;
 
-		BOOST_LOG_TRIVIAL(info) << iFiles[i].get_str() << " contains " << lPointCount << " points ";
-		for(unsigned long p=0; p < lPointCount; p++)
-		{
-			readPlyPoint(lPoint, lInputFile, lFormat, lFields, lIndex);
+			// attributes a file does not have stay zero
+			memset(&lOutput[0], 0, lCount * lOutputStride);
+			for (std::vector<Step>::iterator lStep = lLayout.mSteps.begin(); lStep != lLayout.mSteps.end(); lStep++)
+			{
+				if (lStep->mConvert)
+				{
+					lStep->mConvert(&lInput[lStep->mSource], lInputStride, &lOutput[lStep->mTarget], lOutputStride, lCount);
+				}
+				else
+				{
+					const uint8_t* lFrom = &lInput[lStep->mSource];
+					uint8_t* lTo = &lOutput[lStep->mTarget];
+					for (size_t p = 0; p < lCount; p++, lFrom += lInputStride, lTo += lOutputStride)
+					{
+						memcpy(lTo, lFrom, lStep->mBytes);
+					}
+				}
+			}
 
-			glm::dvec4 lPosition = mTransform*glm::dvec4(lPoint.position[0], lPoint.position[1], lPoint.position[2], 1.0);
-			lPoint.position[0] = lPosition[0];
-			lPoint.position[1] = lPosition[1];
-			lPoint.position[2] = lPosition[2];
+			for (size_t p = 0; p < lCount; p++)
+			{
+				uint8_t* lRecord = &lOutput[p * lOutputStride];
+				memcpy(lPoint.position, lRecord, sizeof(lPoint.position));
 
-			convertCoords(lPoint.position); 
-			growMinMax(lPoint.position);
+				glm::dvec4 lPosition = mTransform*glm::dvec4(lPoint.position[0], lPoint.position[1], lPoint.position[2], 1.0);
+				lPoint.position[0] = lPosition[0];
+				lPoint.position[1] = lPosition[1];
+				lPoint.position[2] = lPosition[2];
+
+				convertCoords(lPoint.position);
+				growMinMax(lPoint.position);
+
+				if (mEpsilon > 0)
+				{
+					lPoint.map(lRecord + sizeof(lPoint.position));
+					write(lPoint, lOutputFile);
+				}
+				else
+				{
+					memcpy(lRecord, lPoint.position, sizeof(lPoint.position));
+				}
+			}
 
-			lPoint.write(lOutputFile);
+			if (mEpsilon <= 0)
+			{
+				fwrite(&lOutput[0], lOutputStride, lCount, lOutputFile);
+			}
+			lTotalPoints += lCount;
 		}
 		fclose(lInputFile);
-
-		lTotalPoints += lPointCount;
 	}
 
+	lTotalPoints = flush(lOutputFile, lTotalPoints);
 	PointCloud::updateSize(lOutputFile, lTotalPoints);
 	PointCloud::updateSpatialBounds(lOutputFile, mMinD, mMaxD);
-	fclose(lOutputFile); 
+	fclose(lOutputFile);
 
 	json_spirit::mObject lMeta = getMeta();
 	lMeta["file"] = lPath.stem().string();
@@ -7,7 +7,46 @@ class PlyImporter : public CloudImporter
 	public:
 
 		PlyImporter(json_spirit::mObject& iConfig);
-	
+
 		json_spirit::mObject import(json_spirit::mArray iFiles, std::string iOutput);
 
-}; 
+	protected:
+
+		// vertices converted at once
+		static const uint64_t BLOCK_SIZE = 65536;
+
+		// converts iCount values iFromStride bytes apart to values iToStride bytes apart
+		typedef void (*Convert)(const uint8_t* iFrom, size_t iFromStride, uint8_t* iTo, size_t iToStride, size_t iCount);
+
+		struct Property
+		{
+			std::string mName;
+			uint8_t mType;
+			size_t mSource;
+		};
+
+		// one step of the plan compiled from a header, a raw copy of mBytes if mConvert is 0
+		struct Step
+		{
+			size_t mSource;
+			size_t mTarget;
+			size_t mBytes;
+			Convert mConvert;
+		};
+
+		struct Layout
+		{
+			uint8_t mFormat;
+			uint64_t mCount;
+			size_t mStride;
+			long mStart;
+			std::vector<Property> mProperties;
+			std::vector<Step> mSteps;
+		};
+
+		bool readHeader(std::string iName, Layout& iLayout);
+		void compile(Layout& iLayout, PointCloudAttributes& iAttributes);
+
+		// parses up to iCount lines of an ascii body into records of doubles
+		size_t readAscii(FILE* iFile, Layout& iLayout, uint8_t* iRecords, size_t iCount);
+};
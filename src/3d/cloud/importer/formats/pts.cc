@@ -1,4 +1,5 @@
 #include "pts.h"
+#include "textReader.h"
 
 #include <boost/log/core.hpp>
 #include <boost/log/trivial.hpp>
@@ -9,121 +10,132 @@ PtsImporter::PtsImporter(json_spirit::mObject& iConfig)
 {
 };
 
-json_spirit::mObject PtsImporter::import(std::string iName)
+// the number of elements on the first data line gives the attributes
+void PtsImporter::attributes(TextReader& iReader, PointCloudAttributes& iAttributes)
 {
-	FILE* lInputFile = fopen(iName.c_str(), "rb");
-
-	PointCloudAttributes lCloud;
-	int lIntensityIndex = -1;
-	int lColorIndex = -1;
-
-	// determine point attributes by number of elements on each data line
-	char lLine[1024];
-	fgets(lLine, 256, lInputFile); // just skip first line ..
-	fgets(lLine,1024, lInputFile);
-	float lCoords[3];
-	int lIntensity;
-	char lColor[3];
-	switch (sscanf(lLine, "%f %f %f %d %hhu %hhu %hhu", lCoords+0, lCoords+1, lCoords+2, &lIntensity, lColor+0, lColor+1, lColor+2))
+	TextReader::Line lLine;
+	const char* lData = TextReader::parseLine(iReader.begin(), iReader.end(), lLine); // just skip first line ..
+	TextReader::parseLine(lData, iReader.end(), lLine);
+	switch (lLine.mCount)
 	{
 		case 4: 
-			lIntensityIndex = lCloud.createAttribute(Attribute::INTENSITY, INTENSITY_TEMPLATE);
+			iAttributes.createAttribute(Attribute::INTENSITY, INTENSITY_TEMPLATE);
 			break;
 		case 6:
-			lColorIndex = lCloud.createAttribute(Attribute::COLOR, COLOR_TEMPLATE);
+			iAttributes.createAttribute(Attribute::COLOR, COLOR_TEMPLATE);
 			break;
 		case 7: 
-			lColorIndex = lCloud.createAttribute(Attribute::COLOR, COLOR_TEMPLATE);
-			lIntensityIndex = lCloud.createAttribute(Attribute::INTENSITY, INTENSITY_TEMPLATE);
+			iAttributes.createAttribute(Attribute::COLOR, COLOR_TEMPLATE);
+			iAttributes.createAttribute(Attribute::INTENSITY, INTENSITY_TEMPLATE);
 			break;
 	};
+}
+
+void PtsImporter::attributes(std::string iName, PointCloudAttributes& iAttributes)
+{
+	TextReader lReader(iName, 1);
+	attributes(lReader, iAttributes);
+}
 
+json_spirit::mObject PtsImporter::import(std::string iName)
+{
+	TextReader lReader(iName, mThreads);
+
+	PointCloudAttributes lCloud;
+	attributes(lReader, lCloud);
+	int lIntensityIndex = lCloud.getAttributeIndex(Attribute::INTENSITY);
+	int lColorIndex = lCloud.getAttributeIndex(Attribute::COLOR);
 
-	// aabb pass
-	BOOST_LOG_TRIVIAL(info) << "AABB pass  ";
-	// AABB pass
-	fseek(lInputFile, 0, SEEK_SET);
-	fgets(lLine, 256, lInputFile); // just skip first line ..
-	while (fgets(lLine, 256, lInputFile))
+	// the center is estimated from lines spread over the file so it is only parsed once
+	std::vector<TextReader::Line> lSample(SAMPLE_SIZE);
+	lSample.resize(lReader.sample(lSample.data(), lSample.size()));
+
+	double lSampleMin[3] = { std::numeric_limits<double>::max(), std::numeric_limits<double>::max(), std::numeric_limits<double>::max() };
+	double lSampleMax[3] = { -std::numeric_limits<double>::max(), -std::numeric_limits<double>::max(), -std::numeric_limits<double>::max() };
+	for (std::vector<TextReader::Line>::iterator lIter = lSample.begin(); lIter != lSample.end(); lIter++)
 	{
-		int lIntensity;
-		double lCoords[3];
-		sscanf(lLine, "%lf %lf %lf", lCoords+0, lCoords+1, lCoords+2);
-		convertCoords(lCoords);
-		growMinMax(lCoords);
+		if (lIter->mCount >= 3)
+		{
+			double lCoords[3] = { lIter->mValue[0], lIter->mValue[1], lIter->mValue[2] };
+			convertCoords(lCoords);
+			for (int i = 0; i < 3; i++)
+			{
+				lSampleMin[i] = std::min(lCoords[i], lSampleMin[i]);
+				lSampleMax[i] = std::max(lCoords[i], lSampleMax[i]);
+			}
+		}
 	}
 
-	glm::dvec3 lCenter;
-	lCenter[0] = (mMinD[0] + mMaxD[0])/2;
-	lCenter[1] = (mMinD[1] + mMaxD[1])/2;
-	lCenter[2] = (mMinD[2] + mMaxD[2])/2;
-
-	mMinD[0] -= lCenter[0];
-	mMinD[1] -= lCenter[1];
-	mMinD[2] -= lCenter[2];
-	mMaxD[0] -= lCenter[0];
-	mMaxD[1] -= lCenter[1];
-	mMaxD[2] -= lCenter[2];
+	glm::dvec3 lCenter(0.0);
+	if (lSampleMin[0] <= lSampleMax[0])
+	{
+		lCenter[0] = (lSampleMin[0] + lSampleMax[0])/2;
+		lCenter[1] = (lSampleMin[1] + lSampleMax[1])/2;
+		lCenter[2] = (lSampleMin[2] + lSampleMax[2])/2;
+	}
+	mOffset = lCenter;
 
 	BOOST_LOG_TRIVIAL(info) << "Main pass";
 	boost::filesystem::path lPath(iName);
+	mName = lPath.stem().string();
 
 	// Main pass		
 	Point lPoint(lCloud);
 
-	FILE* lOutputFile = PointCloud::writeHeader(lPath.stem().string(), lCloud);
+	FILE* lOutputFile = createOutput(lPath.stem().string(), lCloud);
 	IntensityType* lIntensityAttribute = (IntensityType*)lPoint.getAttribute(lIntensityIndex);
 	ColorType* lColorAttribute = (ColorType*)lPoint.getAttribute(lColorIndex);
 
-	fseek(lInputFile, 0, SEEK_SET);
-	fgets(lLine, 256, lInputFile); // just skip first line ..
 	uint64_t lPointCount = 0;
-	while (fgets(lLine, 256, lInputFile))
+	bool lFirst = true;
+	lReader.read([&](TextReader::Line* iLines, size_t iCount)
 	{
-		int lIntensity;
-		char lColor[3];
-		double lCoords[3];
-		sscanf(lLine, "%lf %lf %lf %d %hhu %hhu %hhu", lCoords+0, lCoords+1, lCoords+2, &lIntensity, lColor+0, lColor+1, lColor+2);
-
-		convertCoords(lCoords);
-		lCoords[0] -= lCenter[0];
-		lCoords[1] -= lCenter[1];
-		lCoords[2] -= lCenter[2];
-
-		// assign to point
-		if (lIntensityAttribute)
-		{
-			lIntensityAttribute->mValue = ((lIntensity + 2048.0)/4096.0)*USHRT_MAX;
-		}
-		if (lColorAttribute)
-		{
-			memcpy(lColorAttribute->mValue, lColor, sizeof(lColor));
-			//recordColor(lColorAttribute->mValue[0], lColorAttribute->mValue[1], lColorAttribute->mValue[2]);
-		}
-		lPoint.position[0] = lCoords[0];
-		lPoint.position[1] = lCoords[1];
-		lPoint.position[2] = lCoords[2];
-		lPoint.write(lOutputFile);
-	
-		if (lPointCount%10000000 == 0)
+		for (size_t i = 0; i < iCount; i++)
 		{
-			BOOST_LOG_TRIVIAL(info) << "Main pass at " << lPointCount << " points";
+			TextReader::Line& lLine = iLines[i];
+			if (lFirst || lLine.mCount < 3)
+			{
+				lFirst = false;
+				continue;
+			}
+
+			double lCoords[3] = { lLine.mValue[0], lLine.mValue[1], lLine.mValue[2] };
+			convertCoords(lCoords);
+			lCoords[0] -= lCenter[0];
+			lCoords[1] -= lCenter[1];
+			lCoords[2] -= lCenter[2];
+			growMinMax(lCoords);
+
+			// assign to point
+			if (lIntensityAttribute)
+			{
+				lIntensityAttribute->mValue = ((lLine.mValue[3] + 2048.0)/4096.0)*USHRT_MAX;
+			}
+			if (lColorAttribute)
+			{
+				// x y z r g b or x y z i r g b
+				int lOffset = lLine.mCount == 6 ? 3 : 4;
+				lColorAttribute->mValue[0] = lLine.mValue[lOffset + 0];
+				lColorAttribute->mValue[1] = lLine.mValue[lOffset + 1];
+				lColorAttribute->mValue[2] = lLine.mValue[lOffset + 2];
+			}
+			lPoint.position[0] = lCoords[0];
+			lPoint.position[1] = lCoords[1];
+			lPoint.position[2] = lCoords[2];
+			write(lPoint, lOutputFile);
+		
+			if (lPointCount%10000000 == 0)
+			{
+				BOOST_LOG_TRIVIAL(info) << "Main pass at " << lPointCount << " points";
+			}
+
+			lPointCount ++;
 		}
+	});
 
-		lPointCount ++;
-	}
-	fclose(lInputFile);
-
-	PointCloud::updateSpatialBounds(lOutputFile, mMinD, mMaxD);
-	PointCloud::updateSize(lOutputFile, lPointCount);
-	fclose(lOutputFile);
+	lPointCount = closeOutput(lOutputFile, lPointCount);
 
 	json_spirit::mObject lMeta = getMeta();
 	lMeta["file"] = lPath.stem().string();
 	return lMeta;
 }
-
-
-
-
-
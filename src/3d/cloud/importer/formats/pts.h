@@ -1,6 +1,7 @@
 #pragma once
 
 #include "importer.h"
+#include "textReader.h"
 
 class PtsImporter : public CloudImporter
 {
@@ -9,4 +10,11 @@ class PtsImporter : public CloudImporter
 		PtsImporter(json_spirit::mObject& iConfig);
 	
 		json_spirit::mObject import (std::string iName);
+		void attributes(std::string iName, PointCloudAttributes& iAttributes);
+
+	private:
+
+		static const int SAMPLE_SIZE = 4096;
+
+		void attributes(TextReader& iReader, PointCloudAttributes& iAttributes);
 }; 
@@ -1,4 +1,7 @@
 #include "ptx.h"
+#include "scanGrid.h"
+
+#include <memory>
 
 #include <boost/log/core.hpp>
 #include <boost/log/trivial.hpp>
@@ -9,226 +12,168 @@ PtxImporter::PtxImporter(json_spirit::mObject& iConfig)
 {
 };
 
-uint64_t PtxImporter::readHeader(FILE* iFile, char* iLine, glm::dmat4& iMatrix)
-{
-	long lColumns;
-	sscanf(iLine, "%ld", &lColumns);
-	//std::cout << iLine << "\n"; 
-
-	fgets(iLine, 256, iFile);
+//
+// A scan starts with ten header lines: columns, rows, the scanner position and axes and the
+// 4x4 transformation. Its points follow column by column.
+//
 
-	long lRows;
-	sscanf(iLine, "%ld", &lRows);
-	//std::cout << iLine << "\n"; 
+uint64_t PtxImporter::readHeader(TextReader::Line* iHeader, glm::dmat4& iMatrix, uint64_t& iRows)
+{
+	uint64_t lColumns = iHeader[0].mValue[0];
+	iRows = iHeader[1].mValue[0];
 
 	// skip the scanner location matrix
 	for (int i=0; i<4; i++)
 	{
-		fgets(iLine, 256, iFile);
-	//	std::cout << iLine << "\n"; 
+		for (int j=0; j<4; j++)
+		{
+			iMatrix[i][j] = iHeader[6 + i].mValue[j];
+		}
 	}
 
-	/*
-	fgets(iLine, 256, iFile);
-	sscanf(iLine, "%lf %lf %lf %lf", &iMatrix[0][0], &iMatrix[1][0], &iMatrix[2][0], &iMatrix[3][0]);
-	fgets(iLine, 256, iFile);
-	sscanf(iLine, "%lf %lf %lf %lf", &iMatrix[0][1], &iMatrix[1][1], &iMatrix[2][1], &iMatrix[3][1]);
-	fgets(iLine, 256, iFile);
-	sscanf(iLine, "%lf %lf %lf %lf", &iMatrix[0][2], &iMatrix[1][2], &iMatrix[2][2], &iMatrix[3][2]);
-	fgets(iLine, 256, iFile);
-	sscanf(iLine, "%lf %lf %lf %lf", &iMatrix[0][3], &iMatrix[1][3], &iMatrix[2][3], &iMatrix[3][3]);
-	*/
-
-		//read cloud transformation matrix
-	/*
-			for (int i=0; i<4; ++i)
-			{
-				line = inFile.readLine();
-				tokens = line.split(" ",QString::SkipEmptyParts);
-				if (tokens.size() != 4)
-					return CC_FERR_MALFORMED_FILE;
-
-				float* col = cloudTrans.getColumn(i);
-				for (int j=0; j<4; ++j)
-				{
-					col[j] = tokens[j].toFloat(&ok);
-					if (!ok)
-						return CC_FERR_MALFORMED_FILE;
-				}
-			}
-	*/
-
-	fgets(iLine, 256, iFile);
-	//std::cout << iLine << "\n"; 
-	sscanf(iLine, "%lf %lf %lf %lf", &iMatrix[0][0], &iMatrix[0][1], &iMatrix[0][2], &iMatrix[0][3]);
-	fgets(iLine, 256, iFile);
-	//std::cout << iLine << "\n"; 
-	sscanf(iLine, "%lf %lf %lf %lf", &iMatrix[1][0], &iMatrix[1][1], &iMatrix[1][2], &iMatrix[1][3]);
-	fgets(iLine, 256, iFile);
-	//std::cout << iLine << "\n"; 
-	sscanf(iLine, "%lf %lf %lf %lf", &iMatrix[2][0], &iMatrix[2][1], &iMatrix[2][2], &iMatrix[2][3]);
-	fgets(iLine, 256, iFile);
-	//std::cout << iLine << "\n"; 
-	sscanf(iLine, "%lf %lf %lf %lf", &iMatrix[3][0], &iMatrix[3][1], &iMatrix[3][2], &iMatrix[3][3]);
-
-
-	return lColumns*lRows;
+	return lColumns*iRows;
 }
 
-json_spirit::mObject PtxImporter::import(std::string iName)
+// the number of elements on the first point gives the attributes, normals are taken from the scan grid
+void PtxImporter::attributes(TextReader& iReader, PointCloudAttributes& iAttributes)
 {
-	uint64_t lTotalCount = 0;
-   
-	PointCloudAttributes lAttributes;
-
-	FILE* lInputFile = fopen(iName.c_str(),"rb");
-	glm::dmat4 lMatrix(1.0);
-	char lLine[1024];
-	// determine attributes
-	fgets(lLine,1024, lInputFile);
-	uint64_t lPointCount = readHeader(lInputFile, lLine, lMatrix);
-	fgets(lLine,1024, lInputFile);
-	float lCoords[3];
-	float lIntensity;
-	char lColor[3];
-	switch (sscanf(lLine, "%f %f %f %f %hhu %hhu %hhu", lCoords+0, lCoords+1, lCoords+2, &lIntensity, lColor+0, lColor+1, lColor+2))
+	TextReader::Line lLine;
+	const char* lPosition = iReader.begin();
+	for (int i=0; i<11 && lPosition < iReader.end(); i++)
+	{
+		lPosition = TextReader::parseLine(lPosition, iReader.end(), lLine);
+	}
+	switch (lLine.mCount)
 	{
 		case 4: 
-			lAttributes.createAttribute(Attribute::INTENSITY, INTENSITY_TEMPLATE);
+			iAttributes.createAttribute(Attribute::INTENSITY, INTENSITY_TEMPLATE);
 			break;
 		case 7: 
-			lAttributes.createAttribute(Attribute::COLOR, COLOR_TEMPLATE);
-			lAttributes.createAttribute(Attribute::INTENSITY, INTENSITY_TEMPLATE);
+			iAttributes.createAttribute(Attribute::COLOR, COLOR_TEMPLATE);
+			iAttributes.createAttribute(Attribute::INTENSITY, INTENSITY_TEMPLATE);
 			break;
 	};
 
-	int lIntensityIndex = lAttributes.getAttributeIndex(Attribute::INTENSITY);
+	PackedNormalType lNormal;
+	iAttributes.createAttribute(Attribute::NORMAL, lNormal);
+}
+
+void PtxImporter::attributes(std::string iName, PointCloudAttributes& iAttributes)
+{
+	TextReader lReader(iName, 1);
+	attributes(lReader, iAttributes);
+}
+
+json_spirit::mObject PtxImporter::import(std::string iName)
+{
+	uint64_t lTotalCount = 0;
+   
+	PointCloudAttributes lAttributes;
+
+	TextReader lReader(iName, mThreads);
+	attributes(lReader, lAttributes);
+
 	int lColorIndex = lAttributes.getAttributeIndex(Attribute::COLOR);
 
-	// AABB pass
-	BOOST_LOG_TRIVIAL(info) << "AABB pass  ";
-	fseek(lInputFile, 0, SEEK_SET);
-	while (fgets(lLine, 256, lInputFile))
-	{
-		glm::dvec4 lCoords;
-		
-		lCoords[3] = 1;
-		uint64_t lPointCount = readHeader(lInputFile, lLine, lMatrix);
-		for (uint64_t i=0; i<lPointCount; i++)
-		{
-			if (fgets(lLine,1024,lInputFile)) 
-			{
-				double lX, lY, lZ;
-				//sscanf(lLine, "%lf %lf %lf", &lCoords[0], &lCoords[1], &lCoords[2]);
-				sscanf(lLine, "%lf %lf %lf", &lX, &lY, &lZ);
-				if (lX != 0 && lY != 0 && lZ != 0)
-				{
-					lCoords[0] = lX;
-					lCoords[1] = lY;
-					lCoords[2] = lZ;
-					lCoords= lMatrix*lCoords;
-					convertCoords(&lCoords[0]);
-					growMinMax(&lCoords[0]);
-				}
-			}
+	TextReader::Line lHeader[HEADER_LINES] = {};
+	uint32_t lHeaderLine = 0;
+	uint64_t lRemaining = 0;
+	uint64_t lIndex = 0;
+	uint64_t lRows = 1;
+	glm::dmat4 lMatrix(1.0);
 
-			if (i%10000000 == 0)
-			{
-				BOOST_LOG_TRIVIAL(info) << "AABB pass at " << i << " points";
-			}
-		}
+	// the first scanner position is the center so the file is only parsed once
+	const char* lPosition = lReader.begin();
+	for (int i=0; i<HEADER_LINES && lPosition < lReader.end(); i++)
+	{
+		lPosition = TextReader::parseLine(lPosition, lReader.end(), lHeader[i]);
 	}
+	readHeader(lHeader, lMatrix, lRows);
 
-	glm::dvec3 lCenter;
-	lCenter[0] = (mMinD[0] + mMaxD[0]) / 2;
-	lCenter[1] = (mMinD[1] + mMaxD[1]) / 2;
-	lCenter[2] = (mMinD[2] + mMaxD[2]) / 2;
-
-	mMinD[0] -= lCenter[0];
-	mMinD[1] -= lCenter[1];
-	mMinD[2] -= lCenter[2];
-	mMaxD[0] -= lCenter[0];
-	mMaxD[1] -= lCenter[1];
-	mMaxD[2] -= lCenter[2];
+	glm::dvec4 lFirst = lMatrix*glm::dvec4(0, 0, 0, 1);
+	convertCoords(&lFirst[0]);
+	glm::dvec3 lCenter(lFirst[0], lFirst[1], lFirst[2]);
+	mOffset = lCenter;
 
 	BOOST_LOG_TRIVIAL(info) << "Main pass";
 	boost::filesystem::path lPath(iName);
+	mName = lPath.stem().string();
 
 	// Main pass		
 	Point lPoint(lAttributes);
 
-	FILE* lOutputFile = PointCloud::writeHeader(lPath.stem().string(), lAttributes);
-	IntensityType* lIntensityAttribute = (IntensityType*)lPoint.getAttribute(lIntensityIndex);
-	ColorType* lColorAttribute = (ColorType*)lPoint.getAttribute(lColorIndex);
+	FILE* lOutputFile = createOutput(lPath.stem().string(), lAttributes);
 
-	BOOST_LOG_TRIVIAL(info) << "AABB pass";
-	fseek(lInputFile, 0, SEEK_SET);
-	while (fgets(lLine, 256, lInputFile))
+	std::unique_ptr<ScanGrid> lGrid;
+	lReader.read([&](TextReader::Line* iLines, size_t iCount)
 	{
-		glm::dvec4 lCoords;
-		lCoords[3] = 1;
-		uint64_t lPointCount = readHeader(lInputFile, lLine, lMatrix);
-		for (uint64_t i=0; i<lPointCount; i++)
+		for (size_t i = 0; i < iCount; i++)
 		{
-			if (fgets(lLine,1024,lInputFile)) 
+			TextReader::Line& lLine = iLines[i];
+			if (!lRemaining)
 			{
-				float lIntensity;
-				char lColor[3];
-				double lX, lY, lZ;
-
-				if (lColorIndex != -1)
-				{
-					sscanf(lLine, "%lf %lf %lf %f %hhu %hhu %hhu", &lX, &lY, &lZ, &lIntensity, lColor+0, lColor+1, lColor+2);
-				}
-				else
+				lHeader[lHeaderLine++] = lLine;
+				if (lHeaderLine == HEADER_LINES)
 				{
-					sscanf(lLine, "%lf %lf %lf %f", &lX, &lY, &lZ, &lIntensity);
+					lRemaining = readHeader(lHeader, lMatrix, lRows);
+					lHeaderLine = 0;
+					lIndex = 0;
+
+					// scanner position
+					glm::dvec4 lOrigin = lMatrix*glm::dvec4(0, 0, 0, 1);
+					convertCoords(&lOrigin[0]);
+					mScanners.push_back(glm::dvec3(lOrigin[0], lOrigin[1], lOrigin[2]) - lCenter);
+					lGrid.reset(new ScanGrid(*this, lAttributes, lPoint, mScanners.back(), lOutputFile));
 				}
+				continue;
+			}
 
-				if (lX != 0 && lY != 0 && lZ != 0)
+			if (lLine.mCount >= 3 && lLine.mValue[0] != 0 && lLine.mValue[1] != 0 && lLine.mValue[2] != 0)
+			{
+				glm::dvec4 lCoords = lMatrix*glm::dvec4(lLine.mValue[0], lLine.mValue[1], lLine.mValue[2], 1);
+				convertCoords(&lCoords[0]);
+				lCoords[0] -= lCenter[0];
+				lCoords[1] -= lCenter[1];
+				lCoords[2] -= lCenter[2];
+				growMinMax(&lCoords[0]);
+
+				// points are listed column by column
+				ScanGrid::Sample& lSample = lGrid->at(lIndex % lRows, lIndex / lRows);
+				lSample.mValid = true;
+				lSample.mPosition[0] = lCoords[0];
+				lSample.mPosition[1] = lCoords[1];
+				lSample.mPosition[2] = lCoords[2];
+				lSample.mIntensity = lLine.mCount > 3 ? lLine.mValue[3]*USHRT_MAX : 0;
+				if (lColorIndex != -1 && lLine.mCount >= 7)
 				{
-					lCoords[0] = lX;
-					lCoords[1] = lY;
-					lCoords[2] = lZ;
-					lCoords = lMatrix*lCoords;
-					convertCoords(&lCoords[0]);
-					lCoords[0] -= lCenter[0];
-					lCoords[1] -= lCenter[1];
-					lCoords[2] -= lCenter[2];
-
-					// assign to point
-					if (lIntensityAttribute)
-					{
-						lIntensityAttribute->mValue = lIntensity*USHRT_MAX;
-					}
-					if (lColorAttribute)
-					{
-						memcpy(lColorAttribute->mValue, lColor, sizeof(lColor));
-					}
-					lPoint.position[0] = lCoords[0];
-					lPoint.position[1] = lCoords[1];
-					lPoint.position[2] = lCoords[2];
-					lPoint.write(lOutputFile);
-					lTotalCount ++;
+					lSample.mColor[0] = lLine.mValue[4];
+					lSample.mColor[1] = lLine.mValue[5];
+					lSample.mColor[2] = lLine.mValue[6];
 				}
 			}
 
-			if (i%10000000 == 0)
+			if (lIndex%10000000 == 0)
+			{
+				BOOST_LOG_TRIVIAL(info) << "Main pass at " << lIndex << " points";
+			}
+
+			lIndex++;
+			if (!--lRemaining)
 			{
-				BOOST_LOG_TRIVIAL(info) << "Main pass at " << i << " points";
+				lTotalCount += lGrid->finish();
+				lGrid.reset();
 			}
 		}
+	});
+
+	if (lGrid)
+	{
+		lTotalCount += lGrid->finish();
 	}
 
-	PointCloud::updateSize(lOutputFile, lTotalCount);
-	PointCloud::updateSpatialBounds(lOutputFile, mMinD, mMaxD);
-	fclose(lOutputFile);
-	fclose(lInputFile);
+	lTotalCount = closeOutput(lOutputFile, lTotalCount);
 
 	json_spirit::mObject lMeta = getMeta();
 	lMeta["file"] = lPath.stem().string();
 	return lMeta;
 }
-
-
-
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "importer.h"
+#include "textReader.h"
 
 class PtxImporter : public CloudImporter
 {
@@ -9,9 +10,13 @@ class PtxImporter : public CloudImporter
 		PtxImporter(json_spirit::mObject& iConfig);
 	
 		json_spirit::mObject import (std::string iName);
+		void attributes(std::string iName, PointCloudAttributes& iAttributes);
 
 	private:
+
+		static const int HEADER_LINES = 10;
 	
-		uint64_t readHeader(FILE* iFile, char* lLine, glm::dmat4& iMatrx);
+		uint64_t readHeader(TextReader::Line* iHeader, glm::dmat4& iMatrx, uint64_t& iRows);
+		void attributes(TextReader& iReader, PointCloudAttributes& iAttributes);
 
 }; 
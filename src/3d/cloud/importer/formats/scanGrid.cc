@@ -0,0 +1,232 @@
+#include "scanGrid.h"
+
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+
+const float ScanGrid::DISCONTINUITY = 0.05f;
+
+ScanGrid::ScanGrid(CloudImporter& iImporter, PointCloudAttributes& iAttributes, Point& iPoint, glm::dvec3 iOrigin, FILE* iFile)
+: mImporter(&iImporter)
+, mPoint(&iPoint)
+, mOrigin(iOrigin)
+, mFile(iFile)
+, mBatch(0)
+, mColorIndex(iAttributes.getAttributeIndex(Attribute::COLOR))
+, mIntensityIndex(iAttributes.getAttributeIndex(Attribute::INTENSITY))
+, mNormalIndex(iAttributes.getAttributeIndex(Attribute::NORMAL))
+, mFirst(-1)
+, mLast(-1)
+, mOrdered(true)
+, mPending(false)
+, mWritten(0)
+{
+	memset(&mScratch, 0, sizeof(mScratch));
+}
+
+ScanGrid::ScanGrid(glm::dvec3 iOrigin, std::vector<Sample>* iBatch)
+: mImporter(0)
+, mPoint(0)
+, mOrigin(iOrigin)
+, mFile(0)
+, mBatch(iBatch)
+, mColorIndex(-1)
+, mIntensityIndex(-1)
+, mNormalIndex(-1)
+, mFirst(-1)
+, mLast(-1)
+, mOrdered(true)
+, mPending(false)
+, mWritten(0)
+{
+	memset(&mScratch, 0, sizeof(mScratch));
+}
+
+ScanGrid::Sample& ScanGrid::at(int64_t iRow, int64_t iColumn)
+{
+	if (mOrdered && (iRow < 0 || iColumn < 0 || iColumn < mLast))
+	{
+		BOOST_LOG_TRIVIAL(info) << "Scan is not ordered by column at " << iRow << ", " << iColumn << ". Writing remaining points without normals";
+		emit(mLast - 1);
+		emit(mLast);
+		mOrdered = false;
+	}
+
+	if (!mOrdered)
+	{
+		if (mPending && mScratch.mValid)
+		{
+			write(mScratch, glm::dvec3(0));
+		}
+		memset(&mScratch, 0, sizeof(mScratch));
+		mPending = true;
+		return mScratch;
+	}
+
+	if (mLast < 0 || iColumn - mLast > 3)
+	{
+		// start over, columns left behind have no right neighbour
+		emit(mLast - 1);
+		emit(mLast);
+		for (int i = 0; i < 3; i++)
+		{
+			mColumns[i].clear();
+		}
+		mFirst = iColumn;
+		mLast = iColumn;
+	}
+
+	while (mLast < iColumn)
+	{
+		// columns mLast-2 to mLast are complete, emit the middle one while both its neighbours are held
+		emit(mLast - 1);
+		mLast++;
+
+		std::vector<Sample>& lColumn = mColumns[mLast % 3];
+		for (std::vector<Sample>::iterator lIter = lColumn.begin(); lIter != lColumn.end(); lIter++)
+		{
+			lIter->mValid = false;
+		}
+	}
+
+	std::vector<Sample>& lColumn = mColumns[iColumn % 3];
+	if (iRow >= lColumn.size())
+	{
+		Sample lEmpty;
+		memset(&lEmpty, 0, sizeof(lEmpty));
+		lColumn.resize(iRow + 1, lEmpty);
+	}
+	return lColumn[iRow];
+}
+
+uint64_t ScanGrid::finish()
+{
+	if (mOrdered)
+	{
+		emit(mLast - 1);
+		emit(mLast);
+	}
+	else if (mPending && mScratch.mValid)
+	{
+		write(mScratch, glm::dvec3(0));
+	}
+	mPending = false;
+	mLast = -1;
+
+	return mWritten;
+}
+
+ScanGrid::Sample* ScanGrid::sample(int64_t iRow, int64_t iColumn)
+{
+	if (iRow < 0 || iColumn < mFirst || iColumn < mLast - 2 || iColumn > mLast)
+	{
+		return 0;
+	}
+
+	std::vector<Sample>& lColumn = mColumns[iColumn % 3];
+	if (iRow >= lColumn.size() || !lColumn[iRow].mValid)
+	{
+		return 0;
+	}
+	return &lColumn[iRow];
+}
+
+bool ScanGrid::neighbour(Sample& iSample, double iRange, Sample* iNeighbour)
+{
+	if (!iNeighbour)
+	{
+		return false;
+	}
+
+	glm::dvec3 lDelta(iNeighbour->mPosition[0] - iSample.mPosition[0], iNeighbour->mPosition[1] - iSample.mPosition[1], iNeighbour->mPosition[2] - iSample.mPosition[2]);
+	return glm::length(lDelta) <= DISCONTINUITY * iRange;
+}
+
+static inline glm::dvec3 tangent(ScanGrid::Sample& iSample, ScanGrid::Sample* iLow, ScanGrid::Sample* iHigh)
+{
+	ScanGrid::Sample& lLow = iLow ? *iLow : iSample;
+	ScanGrid::Sample& lHigh = iHigh ? *iHigh : iSample;
+	return glm::dvec3(lHigh.mPosition[0] - lLow.mPosition[0], lHigh.mPosition[1] - lLow.mPosition[1], lHigh.mPosition[2] - lLow.mPosition[2]);
+}
+
+void ScanGrid::emit(int64_t iColumn)
+{
+	if (iColumn < 0 || iColumn < mFirst || iColumn < mLast - 2)
+	{
+		return;
+	}
+
+	std::vector<Sample>& lColumn = mColumns[iColumn % 3];
+	for (int64_t r = 0; r < lColumn.size(); r++)
+	{
+		Sample& lSample = lColumn[r];
+		if (!lSample.mValid)
+		{
+			continue;
+		}
+
+		glm::dvec3 lPosition(lSample.mPosition[0], lSample.mPosition[1], lSample.mPosition[2]);
+		glm::dvec3 lView = mOrigin - lPosition;
+		double lRange = glm::length(lView);
+
+		Sample* lUp = sample(r - 1, iColumn);
+		Sample* lDown = sample(r + 1, iColumn);
+		Sample* lLeft = sample(r, iColumn - 1);
+		Sample* lRight = sample(r, iColumn + 1);
+
+		glm::dvec3 lNormal(0);
+		glm::dvec3 lAlongColumn = tangent(lSample, neighbour(lSample, lRange, lUp) ? lUp : 0, neighbour(lSample, lRange, lDown) ? lDown : 0);
+		glm::dvec3 lAlongRow = tangent(lSample, neighbour(lSample, lRange, lLeft) ? lLeft : 0, neighbour(lSample, lRange, lRight) ? lRight : 0);
+		glm::dvec3 lCross = glm::cross(lAlongColumn, lAlongRow);
+		double lLength = glm::length(lCross);
+		if (lLength > 0)
+		{
+			// face the scanner
+			lNormal = lCross / lLength;
+			if (glm::dot(lNormal, lView) < 0)
+			{
+				lNormal = -lNormal;
+			}
+		}
+
+		write(lSample, lNormal);
+	}
+}
+
+void ScanGrid::write(Sample& iSample, glm::dvec3 iNormal)
+{
+	mWritten++;
+
+	if (mBatch)
+	{
+		iSample.mNormal[0] = iNormal[0];
+		iSample.mNormal[1] = iNormal[1];
+		iSample.mNormal[2] = iNormal[2];
+		mBatch->push_back(iSample);
+		return;
+	}
+
+	mPoint->position[0] = iSample.mPosition[0];
+	mPoint->position[1] = iSample.mPosition[1];
+	mPoint->position[2] = iSample.mPosition[2];
+
+	if (mColorIndex != -1)
+	{
+		memcpy(((ColorType*)mPoint->getAttribute(mColorIndex))->mValue, iSample.mColor, sizeof(iSample.mColor));
+	}
+
+	if (mIntensityIndex != -1)
+	{
+		((IntensityType*)mPoint->getAttribute(mIntensityIndex))->mValue = iSample.mIntensity;
+	}
+
+	if (mNormalIndex != -1)
+	{
+		Vec3IntPacked& lPacked = ((PackedNormalType*)mPoint->getAttribute(mNormalIndex))->mValue;
+		lPacked.i32f3.x = floor(iNormal[0] * 511);
+		lPacked.i32f3.y = floor(iNormal[1] * 511);
+		lPacked.i32f3.z = floor(iNormal[2] * 511);
+		lPacked.i32f3.a = 0;
+	}
+
+	mImporter->write(*mPoint, mFile);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include "importer.h"
+
+//
+// Organized scans deliver their points column by column. Three columns are kept so the normal
+// of a point can be taken from its row and column neighbours before the point is written.
+// Points arriving out of column order are written without a normal.
+//
+
+class ScanGrid
+{
+	public:
+
+		struct Sample
+		{
+			bool mValid;
+			double mPosition[3];
+			uint8_t mColor[3];
+			uint16_t mIntensity;
+			float mNormal[3];
+		};
+
+		// iOrigin is the scanner position in the same frame as the sample positions
+		ScanGrid(CloudImporter& iImporter, PointCloudAttributes& iAttributes, Point& iPoint, glm::dvec3 iOrigin, FILE* iFile);
+
+		// appends the emitted samples with their normal to iBatch, for scans decoded off the main thread
+		ScanGrid(glm::dvec3 iOrigin, std::vector<Sample>* iBatch);
+
+		Sample& at(int64_t iRow, int64_t iColumn);
+
+		// writes the remaining columns and returns the number of points written
+		uint64_t finish();
+
+		// neighbours further apart than this fraction of their range lie across a depth discontinuity
+		static const float DISCONTINUITY;
+
+	protected:
+
+		CloudImporter* mImporter;
+		Point* mPoint;
+		glm::dvec3 mOrigin;
+		FILE* mFile;
+		std::vector<Sample>* mBatch;
+
+		int mColorIndex;
+		int mIntensityIndex;
+		int mNormalIndex;
+
+		std::vector<Sample> mColumns[3];
+		int64_t mFirst;
+		int64_t mLast;
+		bool mOrdered;
+		bool mPending;
+		uint64_t mWritten;
+
+		Sample mScratch;
+
+		Sample* sample(int64_t iRow, int64_t iColumn);
+		bool neighbour(Sample& iSample, double iRange, Sample* iNeighbour);
+
+		void emit(int64_t iColumn);
+		void write(Sample& iSample, glm::dvec3 iNormal);
+};
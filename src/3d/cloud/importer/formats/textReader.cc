@@ -0,0 +1,164 @@
+#include "textReader.h"
+
+#include <thread>
+#include <cstring>
+#include <cmath>
+
+#include <boost/thread.hpp>
+#include <boost/filesystem.hpp>
+
+TextReader::TextReader(std::string iName, uint32_t iThreads)
+: mBegin(0)
+, mEnd(0)
+, mThreads(iThreads ? iThreads : std::max<uint32_t>(1, std::thread::hardware_concurrency()))
+{
+	if (boost::filesystem::file_size(iName) > 0)
+	{
+		mFile = boost::interprocess::file_mapping(iName.c_str(), boost::interprocess::read_only);
+		mRegion = boost::interprocess::mapped_region(mFile, boost::interprocess::read_only);
+		mRegion.advise(boost::interprocess::mapped_region::advice_sequential);
+
+		mBegin = (const char*)mRegion.get_address();
+		mEnd = mBegin + mRegion.get_size();
+	}
+}
+
+double TextReader::scale(double iValue, int iExponent)
+{
+	static const double sPowers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	if (iValue == 0 || iExponent == 0)
+	{
+		return iValue;
+	}
+	else if (iExponent > 0)
+	{
+		return iExponent <= 22 ? iValue * sPowers[iExponent] : iValue * pow(10.0, iExponent);
+	}
+	else
+	{
+		return iExponent >= -22 ? iValue / sPowers[-iExponent] : iValue / pow(10.0, -iExponent);
+	}
+}
+
+const char* TextReader::parseLine(const char* iPosition, const char* iEnd, Line& iLine)
+{
+	const char* p = iPosition;
+	iLine.mCount = 0;
+	while (p < iEnd && *p != '\n')
+	{
+		if (*p == ' ' || *p == '\t' || *p == '\r' || *p == ',')
+		{
+			p++;
+		}
+		else
+		{
+			double lValue;
+			const char* lNext = iLine.mCount < MAX_VALUES ? parseNumber(p, iEnd, lValue) : 0;
+			if (!lNext)
+			{
+				// not a number, ignore the rest of the line
+				const char* lEnd = (const char*)memchr(p, '\n', iEnd - p);
+				p = lEnd ? lEnd : iEnd;
+				break;
+			}
+			iLine.mValue[iLine.mCount++] = lValue;
+			p = lNext;
+		}
+	}
+	return p < iEnd ? p + 1 : iEnd;
+}
+
+size_t TextReader::sample(Line* iLines, size_t iCount)
+{
+	size_t lCount = 0;
+	uint64_t lSize = mEnd - mBegin;
+	for (size_t i = 0; i < iCount && lSize; i++)
+	{
+		const char* lPosition = mBegin + lSize * i / iCount;
+		const char* lEnd = (const char*)memchr(lPosition, '\n', mEnd - lPosition);
+		if (lEnd)
+		{
+			parseLine(lEnd + 1, mEnd, iLines[lCount]);
+			if (iLines[lCount].mCount)
+			{
+				lCount++;
+			}
+		}
+	}
+	return lCount;
+}
+
+void TextReader::parseBlock(const char* iBegin, const char* iEnd, std::vector<Line>* iLines)
+{
+	iLines->clear();
+
+	Line lLine;
+	const char* p = iBegin;
+	while (p < iEnd)
+	{
+		p = parseLine(p, iEnd, lLine);
+		if (lLine.mCount)
+		{
+			iLines->push_back(lLine);
+		}
+	}
+}
+
+const char* TextReader::blockEnd(const char* iBegin)
+{
+	if (mEnd - iBegin <= BLOCK_SIZE)
+	{
+		return mEnd;
+	}
+
+	const char* lEnd = (const char*)memchr(iBegin + BLOCK_SIZE, '\n', mEnd - iBegin - BLOCK_SIZE);
+	return lEnd ? lEnd + 1 : mEnd;
+}
+
+void TextReader::read(Consumer iConsumer)
+{
+	uint32_t lThreads = mThreads;
+
+	// two generations of blocks, one is parsed while the other is consumed
+	std::vector<std::vector<Line>> lLines[2];
+	lLines[0].resize(lThreads);
+	lLines[1].resize(lThreads);
+
+	const char* lPosition = mBegin;
+	auto lLaunch = [&](std::vector<std::vector<Line>>& iLines, boost::thread_group& iGroup)
+	{
+		size_t lCount = 0;
+		for (uint32_t t = 0; t < lThreads && lPosition < mEnd; t++)
+		{
+			const char* lEnd = blockEnd(lPosition);
+			iGroup.add_thread(new boost::thread(&TextReader::parseBlock, lPosition, lEnd, &iLines[t]));
+			lPosition = lEnd;
+			lCount++;
+		}
+		return lCount;
+	};
+
+	boost::thread_group* lGroup = new boost::thread_group();
+	size_t lCount = lLaunch(lLines[0], *lGroup);
+	for (int g = 0; lCount; g ^= 1)
+	{
+		lGroup->join_all();
+		delete lGroup;
+
+		lGroup = new boost::thread_group();
+		size_t lNext = lLaunch(lLines[g ^ 1], *lGroup);
+
+		for (size_t t = 0; t < lCount; t++)
+		{
+			if (lLines[g][t].size())
+			{
+				iConsumer(lLines[g][t].data(), lLines[g][t].size());
+			}
+		}
+
+		lCount = lNext;
+	}
+	lGroup->join_all();
+	delete lGroup;
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+//
+// Memory maps a text file of numbers and parses it in blocks split at line boundaries. Blocks are
+// parsed by all cores while the lines of the previous ones are handed to the caller in file order.
+//
+
+class TextReader
+{
+	public:
+
+		static const int MAX_VALUES = 8;
+		static const uint64_t BLOCK_SIZE = 4 * 1024 * 1024;
+
+		struct Line
+		{
+			double mValue[MAX_VALUES];
+			uint8_t mCount;
+		};
+
+		typedef std::function<void(Line* iLines, size_t iCount)> Consumer;
+
+		// iThreads limits the blocks parsed at once, all cores if 0
+		TextReader(std::string iName, uint32_t iThreads = 0);
+
+		const char* begin() { return mBegin; }
+		const char* end() { return mEnd; }
+
+		// hands every line of the file to iConsumer, lines without numbers are skipped
+		void read(Consumer iConsumer);
+
+		// parses the line after each of iCount evenly spaced offsets, the first line is never returned
+		size_t sample(Line* iLines, size_t iCount);
+
+		static const char* parseLine(const char* iPosition, const char* iEnd, Line& iLine);
+
+		static inline const char* parseNumber(const char* iPosition, const char* iEnd, double& iValue)
+		{
+			const char* p = iPosition;
+			bool lNegative = false;
+			if (p < iEnd && (*p == '-' || *p == '+'))
+			{
+				lNegative = *p == '-';
+				p++;
+			}
+
+			// up to 19 significant digits fit into the mantissa, the remaining ones only scale
+			uint64_t lMantissa = 0;
+			int lDigits = 0;
+			int lExponent = 0;
+			const char* lStart = p;
+			for (; p < iEnd && *p >= '0' && *p <= '9'; p++)
+			{
+				if (lDigits < 19)
+				{
+					lMantissa = lMantissa * 10 + (*p - '0');
+					lDigits += lMantissa != 0;
+				}
+				else
+				{
+					lExponent++;
+				}
+			}
+			if (p < iEnd && *p == '.')
+			{
+				p++;
+				for (; p < iEnd && *p >= '0' && *p <= '9'; p++)
+				{
+					if (lDigits < 19)
+					{
+						lMantissa = lMantissa * 10 + (*p - '0');
+						lDigits += lMantissa != 0;
+						lExponent--;
+					}
+				}
+			}
+			if (p == lStart || (p == lStart + 1 && *lStart == '.'))
+			{
+				return 0;
+			}
+			if (p < iEnd && (*p == 'e' || *p == 'E'))
+			{
+				const char* lMark = p++;
+				bool lNegativeExponent = false;
+				if (p < iEnd && (*p == '-' || *p == '+'))
+				{
+					lNegativeExponent = *p == '-';
+					p++;
+				}
+				if (p < iEnd && *p >= '0' && *p <= '9')
+				{
+					int lValue = 0;
+					for (; p < iEnd && *p >= '0' && *p <= '9'; p++)
+					{
+						lValue = std::min(lValue * 10 + (*p - '0'), 9999);
+					}
+					lExponent += lNegativeExponent ? -lValue : lValue;
+				}
+				else
+				{
+					p = lMark;
+				}
+			}
+
+			iValue = scale((double)lMantissa, lExponent);
+			if (lNegative)
+			{
+				iValue = -iValue;
+			}
+			return p;
+		}
+
+	protected:
+
+		boost::interprocess::file_mapping mFile;
+		boost::interprocess::mapped_region mRegion;
+		const char* mBegin;
+		const char* mEnd;
+		uint32_t mThreads;
+
+		static double scale(double iValue, int iExponent);
+		static void parseBlock(const char* iBegin, const char* iEnd, std::vector<Line>* iLines);
+
+		const char* blockEnd(const char* iBegin);
+};
@@ -8,6 +8,8 @@
 #include <fstream>
 #include <map>
 #include <string>
+#include <algorithm>
+#include <memory>
 
 #include "float.h" 
  
@@ -19,6 +21,8 @@
 #include "../point.h"
 #include "../kdTree.h"
 #include "../kdFileTree.h"
+#include "../statisticalFilter.h"
+#include "../spatialSort.h"
 
 #include "formats/importer.h"
 #include "formats/ply.h"
@@ -26,43 +30,109 @@
 #include "formats/las.h"
 #include "formats/ptx.h"
 #include "formats/pts.h"
+#include "formats/merge.h"
   
 
+CloudImporter* createImporter(json_spirit::mObject& iConfig, std::string iFile)
+{
+	std::string lType = boost::filesystem::extension(iFile);
+	if (lType == ".e57")
+	{
+		return new E57Importer(iConfig);
+	}
+	else if (lType == ".las" || lType == ".laz" || lType == ".LAS" || lType == ".LAZ")
+	{
+		return new LasImporter(iConfig);
+	}
+	else if (lType == ".pts")
+	{
+		return new PtsImporter(iConfig);
+	}
+	else if (lType == ".ptx")
+	{
+		return new PtxImporter(iConfig);
+	}
+	return NULL;
+};
+
+json_spirit::mObject importFile(json_spirit::mObject& iConfig, std::string iFile)
+{
+	std::unique_ptr<CloudImporter> lImporter(createImporter(iConfig, iFile));
+	if (!lImporter)
+	{
+		return json_spirit::mObject();
+	}
+	return lImporter->import(iFile);
+};
+
 bool processFile(json_spirit::mObject& iConfig)
 {
+	PointCloud::configure(iConfig);
+
 	json_spirit::mArray lFiles = iConfig["file"].get_array();
 	json_spirit::mObject lProperties;
 
 	std::string lType = boost::filesystem::extension(lFiles[0].get_str());
-	if (lType == ".e57")
+	if (lType == ".ply")  /* this can only be used internally */
 	{
-		E57Importer lImporter(iConfig);
-		lProperties = lImporter.import(lFiles[0].get_str()); // only one supported
+		PlyImporter lImporter(iConfig);
+		lProperties = lImporter.import(lFiles, iConfig["output"].get_str());
 	}
-	else if (lType == ".las" || lType == ".laz" || lType == ".LAS" || lType == ".LAZ")
+	else if (lFiles.size() > 1)
 	{
-		LasImporter lImporter(iConfig);
-		lProperties = lImporter.import(lFiles[0].get_str());
+		std::vector<std::string> lNames;
+		for (json_spirit::mArray::iterator lIter = lFiles.begin(); lIter != lFiles.end(); lIter++)
+		{
+			lNames.push_back(lIter->get_str());
+		}
+
+		std::string lOutput = boost::filesystem::path(lNames[0]).stem().string();
+		if (iConfig.find("output") != iConfig.end() && !iConfig["output"].is_null())
+		{
+			lOutput = iConfig["output"].get_str();
+		}
+
+		MergeImporter lImporter(iConfig);
+		lProperties = lImporter.import(lNames, lOutput, createImporter);
 	}
-	else if (lType == ".e57")
+	else
 	{
-		E57Importer lImporter(iConfig);
-		lProperties = lImporter.import(lFiles[0].get_str());
+		lProperties = importFile(iConfig, lFiles[0].get_str());
 	}
-	else if (lType == ".pts")
+
+	// noise removal on the imported file before any other stage reads it
+	if (iConfig.find("outlier") != iConfig.end() && !iConfig["outlier"].is_null())
 	{
-		PtsImporter lImporter(iConfig);
-		lProperties = lImporter.import(lFiles[0].get_str());
+		float lResolution = 0;
+		if (iConfig.find("resolution") != iConfig.end() && !iConfig["resolution"].is_null())
+		{
+			lResolution = iConfig["resolution"].get_real();
+		}
+
+		StatisticalFilter lFilter(lResolution, iConfig["outlier"].get_real(), availableMemory() / 2);
+		lProperties["outliers"] = lFilter.process(lProperties["file"].get_str());
 	}
-	else if (lType == ".ptx")
+
+	// spatially ordered output makes the block bounds tight enough for partitioning to skip most blocks
+	if (iConfig.find("sort") != iConfig.end() && !iConfig["sort"].is_null() && iConfig["sort"].get_bool() && lProperties.find("file") != lProperties.end())
 	{
-		PtxImporter lImporter(iConfig);
-		lProperties = lImporter.import(lFiles[0].get_str());
+		SpatialSort lSort(availableMemory() / 2);
+		lSort.process(lProperties["file"].get_str());
 	}
-	else if (lType == ".ply")  /* this can only be used internally */
+
+	if (lProperties.find("file") != lProperties.end())
 	{
-		PlyImporter lImporter(iConfig);
-		lProperties = lImporter.import(lFiles, iConfig["output"].get_str());
+		// block bounds let later stages skip or split the cloud without reading it
+		PointCloud::updateBlocks(lProperties["file"].get_str());
+
+		if (iConfig.find("debug") != iConfig.end() && iConfig["debug"].type() == json_spirit::array_type)
+		{
+			json_spirit::mArray& lDebug = iConfig["debug"].get_array();
+			if (std::find(lDebug.begin(), lDebug.end(), json_spirit::mValue("ply")) != lDebug.end())
+			{
+				PointCloud::exportPly(lProperties["file"].get_str());
+			}
+		}
 	}
 
 	json_spirit::write_stream(json_spirit::mValue(lProperties), std::cout);
@@ -72,7 +142,15 @@ bool processFile(json_spirit::mObject& iConfig)
 
 int main(int argc, char *argv[])
 {
-	task::initialize("importer", argv[1], boost::function<bool(json_spirit::mObject&)>(processFile));
+	try
+	{
+		task::initialize("importer", argv[1], boost::function<bool(json_spirit::mObject&)>(processFile));
+	}
+	catch (std::exception& e)
+	{
+		BOOST_LOG_TRIVIAL(error) << "Import failed: " << e.what();
+		return EXIT_FAILURE;
+	}
 
     return EXIT_SUCCESS;
 }
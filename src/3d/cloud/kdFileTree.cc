@@ -24,8 +24,6 @@
 #include <boost/log/attributes/attribute_set.hpp>
 #include <boost/log/attributes/attribute_value_set.hpp>
 
-#include "voxelHashIndex2.h"
-
 #define TIMING 1
 
 extern unsigned long long availableMemory();
@@ -174,25 +172,25 @@ bool KdFileTreeNode::grow(std::string iIndent, uint32_t iLeafsize)
 	return mAlive;
 }
 
-void KdFileTreeNode::feed(uint8_t* iBuffer, uint32_t iStride, size_t iCount, boost::thread_group*& iGroup, int32_t iThreadCount)
+void KdFileTreeNode::feed(uint8_t* iBuffer, uint32_t iStride, size_t iCount, uint64_t iFirst, std::vector<PointCloud::Block>* iBlocks, boost::thread_group*& iGroup, int32_t iThreadCount)
 {
 	if (mChildLow && mChildHigh)
 	{
 		if (mChildLow->mAlive)
 		{
-			mChildLow->feed(iBuffer, iStride, iCount, iGroup, iThreadCount);
+			mChildLow->feed(iBuffer, iStride, iCount, iFirst, iBlocks, iGroup, iThreadCount);
 		}
 
 		if (mChildHigh->mAlive)
 		{
-			mChildHigh->feed(iBuffer, iStride, iCount, iGroup, iThreadCount);
+			mChildHigh->feed(iBuffer, iStride, iCount, iFirst, iBlocks, iGroup, iThreadCount);
 		}
 	}
 	else
 	{
 		if (mAlive)
 		{
-			iGroup->add_thread(new boost::thread (&KdFileTreeNode::recordChunk, this, iBuffer, iStride, iCount));
+			iGroup->add_thread(new boost::thread (&KdFileTreeNode::recordChunk, this, iBuffer, iStride, iCount, iFirst, iBlocks));
 			if (iGroup->size() >= iThreadCount)
 			{
 			//	BOOST_LOG_TRIVIAL(info) << "Waiting for " << iGroup->size() << " theads to complete ";
@@ -204,17 +202,61 @@ void KdFileTreeNode::feed(uint8_t* iBuffer, uint32_t iStride, size_t iCount, boo
 	}
 }
 
-void KdFileTreeNode::recordChunk(uint8_t* iBuffer, uint32_t iStride, size_t iCount) 
+void KdFileTreeNode::ranges(size_t iCount, uint64_t iFirst, std::vector<PointCloud::Block>* iBlocks, float* iMin, float* iMax, std::vector<Range>& iRanges)
+{
+	iRanges.clear();
+	if (!iBlocks || iBlocks->empty())
+	{
+		Range lRange = { 0, iCount, false };
+		iRanges.push_back(lRange);
+		return;
+	}
+
+	for (uint64_t b = iFirst / PointCloud::BLOCK_SIZE; b < iBlocks->size() && b * PointCloud::BLOCK_SIZE < iFirst + iCount; b++)
+	{
+		PointCloud::Block& lBlock = (*iBlocks)[b];
+		if (lBlock.mMin[0] > iMax[0] || lBlock.mMax[0] < iMin[0] ||
+			lBlock.mMin[1] > iMax[1] || lBlock.mMax[1] < iMin[1] ||
+			lBlock.mMin[2] > iMax[2] || lBlock.mMax[2] < iMin[2])
+		{
+			continue;
+		}
+
+		bool lInside = lBlock.mMin[0] >= iMin[0] && lBlock.mMax[0] <= iMax[0] &&
+			lBlock.mMin[1] >= iMin[1] && lBlock.mMax[1] <= iMax[1] &&
+			lBlock.mMin[2] >= iMin[2] && lBlock.mMax[2] <= iMax[2];
+
+		size_t lBegin = std::max<uint64_t>(b * PointCloud::BLOCK_SIZE, iFirst) - iFirst;
+		size_t lEnd = std::min<uint64_t>(b * PointCloud::BLOCK_SIZE + lBlock.mCount, iFirst + iCount) - iFirst;
+		if (iRanges.size() && iRanges.back().mEnd == lBegin && iRanges.back().mInside == lInside)
+		{
+			iRanges.back().mEnd = lEnd;
+		}
+		else
+		{
+			Range lRange = { lBegin, lEnd, lInside };
+			iRanges.push_back(lRange);
+		}
+	}
+}
+
+void KdFileTreeNode::recordChunk(uint8_t* iBuffer, uint32_t iStride, size_t iCount, uint64_t iFirst, std::vector<PointCloud::Block>* iBlocks) 
 {
-	for (uint32_t i=0; i<iCount; i++)
+	std::vector<Range> lRanges;
+	ranges(iCount, iFirst, iBlocks, min, max, lRanges);
+
+	for (std::vector<Range>::iterator lRange = lRanges.begin(); lRange != lRanges.end(); lRange++)
 	{
-		float* lPosition = (float*)(iBuffer + i*iStride); 
-		if (contains(lPosition))
+		for (size_t i = lRange->mBegin; i < lRange->mEnd; i++)
 		{
-			mCount++;
-			median[0] += (lPosition[0]-median[0])/mCount;
-			median[1] += (lPosition[1]-median[1])/mCount;
-			median[2] += (lPosition[2]-median[2])/mCount;
+			float* lPosition = (float*)(iBuffer + i*iStride); 
+			if (lRange->mInside || contains(lPosition))
+			{
+				mCount++;
+				median[0] += (lPosition[0]-median[0])/mCount;
+				median[1] += (lPosition[1]-median[1])/mCount;
+				median[2] += (lPosition[2]-median[2])/mCount;
+			}
 		}
 	}
 }
@@ -233,7 +275,7 @@ void KdFileTreeNode::openFiles(PointCloudAttributes& iAttributes, float iResolut
 	}
 }
 
-void KdFileTreeNode::writeChunk(uint8_t* iBuffer, uint32_t iStride, size_t iCount, float iOverlap)
+void KdFileTreeNode::writeChunk(uint8_t* iBuffer, uint32_t iStride, size_t iCount, uint64_t iFirst, std::vector<PointCloud::Block>* iBlocks, float iOverlap)
 {
 	float lMin[3];
 	memcpy(lMin, min, sizeof(min));
@@ -247,34 +289,57 @@ void KdFileTreeNode::writeChunk(uint8_t* iBuffer, uint32_t iStride, size_t iCoun
 	lMax[1] += iOverlap;
 	lMax[2] += iOverlap;
 
+	std::vector<Range> lRanges;
+	ranges(iCount, iFirst, iBlocks, lMin, lMax, lRanges);
+
 	uint8_t* lPointer = iBuffer;
-	for (size_t i = 0; i < iCount; i++)
+	for (std::vector<Range>::iterator lRange = lRanges.begin(); lRange != lRanges.end(); lRange++)
 	{
-		if (mVolumeLimit && mCount > mVolumeLimit)
+		if (lRange->mInside)
 		{
-			break;
+			// every point of the range belongs here, it is copied as it is
+			uint64_t lCount = lRange->mEnd - lRange->mBegin;
+			if (mVolumeLimit)
+			{
+				if (mCount > mVolumeLimit)
+				{
+					return;
+				}
+				lCount = std::min<uint64_t>(lCount, mVolumeLimit + 1 - mCount);
+			}
+			fwrite(iBuffer + lRange->mBegin * iStride, iStride, lCount, mFile);
+			mCount += lCount;
+			continue;
 		}
-		lPointer = iBuffer + i * iStride;
 
-		float* lP = (float*)lPointer;
-		if (lP[0] >= lMin[0] && lP[0] <= lMax[0] && lP[1] >= lMin[1] && lP[1] <= lMax[1] && lP[2] >= lMin[2] && lP[2] <= lMax[2])
+		for (size_t i = lRange->mBegin; i < lRange->mEnd; i++)
 		{
-			fwrite(lPointer, 1, iStride, mFile);
-			mCount++;
+			if (mVolumeLimit && mCount > mVolumeLimit)
+			{
+				return;
+			}
+			lPointer = iBuffer + i * iStride;
+
+			float* lP = (float*)lPointer;
+			if (lP[0] >= lMin[0] && lP[0] <= lMax[0] && lP[1] >= lMin[1] && lP[1] <= lMax[1] && lP[2] >= lMin[2] && lP[2] <= lMax[2])
+			{
+				fwrite(lPointer, 1, iStride, mFile);
+				mCount++;
+			}
 		}
 	}
 }
 
-void KdFileTreeNode::write(uint8_t* iBuffer, uint32_t iStride, uint32_t iCount, float iOverlap, boost::thread_group*& iGroup, int32_t iThreadCount)
+void KdFileTreeNode::write(uint8_t* iBuffer, uint32_t iStride, uint32_t iCount, uint64_t iFirst, std::vector<PointCloud::Block>* iBlocks, float iOverlap, boost::thread_group*& iGroup, int32_t iThreadCount)
 {
 	if (mChildLow && mChildHigh)
 	{
-		mChildLow->write(iBuffer, iStride, iCount, iOverlap, iGroup, iThreadCount);
-		mChildHigh->write(iBuffer, iStride, iCount, iOverlap, iGroup, iThreadCount);
+		mChildLow->write(iBuffer, iStride, iCount, iFirst, iBlocks, iOverlap, iGroup, iThreadCount);
+		mChildHigh->write(iBuffer, iStride, iCount, iFirst, iBlocks, iOverlap, iGroup, iThreadCount);
 	}
 	else
 	{
-		iGroup->add_thread(new boost::thread (&KdFileTreeNode::writeChunk, this, iBuffer, iStride, iCount, iOverlap));
+		iGroup->add_thread(new boost::thread (&KdFileTreeNode::writeChunk, this, iBuffer, iStride, iCount, iFirst, iBlocks, iOverlap));
 		if (iGroup->size() >= iThreadCount)
 		{
 			iGroup->join_all();
@@ -328,7 +393,55 @@ void KdFileTreeNode::deleteFiles()
 		mChildHigh->deleteFiles();
 	}
 
-	std::remove(std::string(mPath + ".ply").c_str());
+	std::remove(PointCloud::fileName(mPath).c_str());
+}
+
+void KdFileTreeNode::openLevel(PointCloudAttributes& iAttributes, float iResolution, uint8_t iHeight)
+{
+	if (mHeight == iHeight)
+	{
+		mFile = PointCloud::writeHeader(mPath, iAttributes, 0, min, max, iResolution);
+		mCount = 0;
+	}
+	else if (mHeight > iHeight && mChildLow && mChildHigh)
+	{
+		mChildLow->openLevel(iAttributes, iResolution, iHeight);
+		mChildHigh->openLevel(iAttributes, iResolution, iHeight);
+	}
+}
+
+void KdFileTreeNode::writeLevel(uint8_t* iBuffer, uint32_t iStride, uint32_t iCount, float iOverlap, uint8_t iHeight, boost::thread_group*& iGroup, int32_t iThreadCount)
+{
+	if (mHeight == iHeight)
+	{
+		iGroup->add_thread(new boost::thread (&KdFileTreeNode::writeChunk, this, iBuffer, iStride, iCount, 0, (std::vector<PointCloud::Block>*)0, iOverlap));
+		if (iGroup->size() >= iThreadCount)
+		{
+			iGroup->join_all();
+			delete iGroup;
+			iGroup = new boost::thread_group();
+		}
+	}
+	else if (mHeight > iHeight && mChildLow && mChildHigh)
+	{
+		mChildLow->writeLevel(iBuffer, iStride, iCount, iOverlap, iHeight, iGroup, iThreadCount);
+		mChildHigh->writeLevel(iBuffer, iStride, iCount, iOverlap, iHeight, iGroup, iThreadCount);
+	}
+}
+
+void KdFileTreeNode::closeLevel(uint8_t iHeight)
+{
+	if (mHeight == iHeight)
+	{
+		PointCloud::updateSize(mFile, mCount);
+		fclose(mFile);
+		mFile = 0;
+	}
+	else if (mHeight > iHeight && mChildLow && mChildHigh)
+	{
+		mChildLow->closeLevel(iHeight);
+		mChildHigh->closeLevel(iHeight);
+	}
 }
 
 bool KdFileTreeNode::prune()
@@ -365,6 +478,10 @@ uint64_t KdFileTreeNode::collapse(FILE* iFile, uint32_t iStride, float* iMin, fl
 		
 		uint64_t lCount;
 		FILE* lFile = PointCloud::readHeader(mPath, 0, lCount);
+		if (!lFile)
+		{
+			return 0;
+		}
 
 		PointBuffer lPointBuffer(lFile, lCount, iStride, lCount*iStride);
 		lPointBuffer.begin();
@@ -426,10 +543,16 @@ void KdFileTree::construct(std::string iName, uint32_t iLeafsize, float iOverlap
 	uint64_t lPointCount;
 	float lResolution;
 	FILE* lFile = PointCloud::readHeader(iName, &mPointAttributes, lPointCount, mRoot->min, mRoot->max, &lResolution);
+	if (!lFile)
+	{
+		return;
+	}
+	PointCloud::readBlocks(iName, mBlocks);
 
 	BOOST_LOG_TRIVIAL(info) << "Constructing filetree for " << lPointCount << " points:";
 	BOOST_LOG_TRIVIAL(info) << "   Leafsize " << iLeafsize << " points ";
 	BOOST_LOG_TRIVIAL(info) << "   Overlap " << iOverlap << " meters ";
+	BOOST_LOG_TRIVIAL(info) << "   Blocks " << mBlocks.size();
 
 	// pass one - build tree
 	PointBuffer lPointBuffer(lFile, lPointCount, mPointAttributes.bytesPerPoint() + 3 * sizeof(float), availableMemory());
@@ -441,7 +564,7 @@ void KdFileTree::construct(std::string iName, uint32_t iLeafsize, float iOverlap
 			PointBuffer::Chunk& lChunk = lPointBuffer.next();
 
 			boost::thread_group* lGroup = new boost::thread_group();
-			mRoot->feed(lChunk.mData, lPointBuffer.mStride, lChunk.mSize, lGroup, std::thread::hardware_concurrency());
+			mRoot->feed(lChunk.mData, lPointBuffer.mStride, lChunk.mSize, lChunk.mFirst, &mBlocks, lGroup, std::thread::hardware_concurrency());
 			lGroup->join_all();
 			delete lGroup;
 		}
@@ -459,7 +582,7 @@ void KdFileTree::construct(std::string iName, uint32_t iLeafsize, float iOverlap
 		PointBuffer::Chunk& lChunk = lPointBuffer.next();
 
 		boost::thread_group* lGroup = new boost::thread_group();
-		mRoot->write(lChunk.mData, lPointBuffer.mStride, lChunk.mSize, iOverlap, lGroup, std::thread::hardware_concurrency());
+		mRoot->write(lChunk.mData, lPointBuffer.mStride, lChunk.mSize, lChunk.mFirst, &mBlocks, iOverlap, lGroup, std::thread::hardware_concurrency());
 		lGroup->join_all();
 		delete lGroup;
 	}
@@ -517,22 +640,59 @@ void KdFileTree::remove()
 json_spirit::mArray KdFileTree::fill(float iSigma, float iResolution) 
 {
 	json_spirit::mArray lLOD;
-	iResolution *= iSigma;
-
-	// downsample leaf nodes into file "doc...."
-	std::string lName = "res-" + std::to_string(iResolution);
-	FILE* lFile = PointCloud::writeHeader(lName, mPointAttributes, 0, mRoot->min, mRoot->max, iResolution);
-	Downsampler lSampler(lFile, iResolution);
-	process(lSampler, LEAVES); 
-	PointCloud::updateSize(lFile, lSampler.mWritten);
-	fclose(lFile);
-	BOOST_LOG_TRIVIAL(info) << "Resolution = " << iResolution << " points " << lSampler.mWritten;
 
+	// reload tree so node heights are counted from the leaves
+	delete mRoot;
+	std::ifstream lStream("index.json");
+	json_spirit::mValue lJson;
+	json_spirit::read_stream(lStream, lJson);
+	lStream.close();
+	mRoot = new KdFileTreeNode(lJson.get_obj());
+
+	if (mRoot->mHeight == 0)
+	{
+		return lLOD;
+	}
+
+	// reduce the nodes into one file "res-...." per level, the children of a node before the node
+	MultiResolutionReducer lReducer(mRoot->min, mRoot->max, iResolution, iSigma, mRoot->mHeight);
+	lReducer.initTraveral(mPointAttributes);
+	for (uint8_t h = 1; h <= mRoot->mHeight; h++)
+	{
+		std::vector<KdFileTreeNode*> lVector;
+		getLevel(lVector, *mRoot, h);
+
+		boost::thread_group* lGroup = new boost::thread_group();
+		for (std::vector<KdFileTreeNode*>::iterator lIter = lVector.begin(); lIter != lVector.end(); lIter++)
+		{
+			if (lGroup->size() == std::thread::hardware_concurrency())
+			{
+				lGroup->join_all();
+				delete lGroup;
+				lGroup = new boost::thread_group();
+			}
+			lGroup->add_thread(new boost::thread(&MultiResolutionReducer::reduceNode, &lReducer, boost::ref(*(*lIter)), *lIter == mRoot));
+		}
+		lGroup->join_all();
+		delete lGroup;
+	}
+	lReducer.completeTraveral(mPointAttributes);
+
+	// a node of height h holds the points of level h, leaves keep their own points
 	uint64_t lPointCount;
-	while(!mRoot->prune()) // discard leaf layer
+	for (uint8_t h = 1; h <= mRoot->mHeight; h++)
 	{
-		FILE* lFile = PointCloud::readHeader(lName, NULL, lPointCount);
-		mRoot->openFiles(mPointAttributes, iResolution);
+		MultiResolutionReducer::Level& lLevel = lReducer.mLevels[h - 1];
+		BOOST_LOG_TRIVIAL(info) << "Resolution = " << lLevel.mResolution << " points " << lLevel.mWritten;
+
+		// nodes of a level that cannot be read are left empty
+		FILE* lFile = PointCloud::readHeader(lLevel.mName, NULL, lPointCount);
+		mRoot->openLevel(mPointAttributes, lLevel.mResolution, h);
+		if (!lFile)
+		{
+			mRoot->closeLevel(h);
+			continue;
+		}
 
 		PointBuffer lPointBuffer(lFile, lPointCount, mPointAttributes.bytesPerPoint() + 3 * sizeof(float), availableMemory());
 		lPointBuffer.begin();
@@ -541,34 +701,15 @@ json_spirit::mArray KdFileTree::fill(float iSigma, float iResolution)
 			PointBuffer::Chunk& lChunk = lPointBuffer.next();
 
 			boost::thread_group* lGroup = new boost::thread_group();
-			mRoot->write(lChunk.mData, lPointBuffer.mStride, lChunk.mSize, iResolution, lGroup, std::thread::hardware_concurrency() );
+			mRoot->writeLevel(lChunk.mData, lPointBuffer.mStride, lChunk.mSize, lLevel.mResolution, h, lGroup, std::thread::hardware_concurrency());
 			lGroup->join_all();
 			delete lGroup;
 		}
 		fclose(lFile);
 
-		mRoot->closeFiles();
-
-		iResolution *= iSigma;
-
-	    // downsample leaf nodes into file "doc...."
-		lName = "res-" + std::to_string(iResolution);
-		lFile = PointCloud::writeHeader(lName, mPointAttributes, 0, mRoot->min, mRoot->max, iResolution);
-		Downsampler lSampler(lFile, iResolution);
-		process(lSampler, LEAVES); 
-		PointCloud::updateSize(lFile, lSampler.mWritten);
-		fclose(lFile);
-		BOOST_LOG_TRIVIAL(info) << "Resolution = " << iResolution << " points " << lSampler.mWritten;
+		mRoot->closeLevel(h);
 	}
 
-	// reload tree
-	delete mRoot;
-	std::ifstream lStream("index.json");
-	json_spirit::mValue lJson;
-	json_spirit::read_stream(lStream, lJson);
-	lStream.close();
-	mRoot = new KdFileTreeNode(lJson.get_obj());
-
 	return lLOD;
 };
 
@@ -599,6 +740,19 @@ void KdFileTree::getNodes(std::vector<KdFileTreeNode*>& iList, KdFileTreeNode& i
 	}
 }
 
+void KdFileTree::getLevel(std::vector<KdFileTreeNode*>& iList, KdFileTreeNode& iNode, uint8_t iHeight)
+{
+	if (iNode.mHeight == iHeight)
+	{
+		iList.push_back(&iNode);
+	}
+	else if (iNode.mHeight > iHeight && iNode.mChildLow && iNode.mChildHigh)
+	{
+		getLevel(iList, *iNode.mChildLow, iHeight);
+		getLevel(iList, *iNode.mChildHigh, iHeight);
+	}
+}
+
 void KdFileTree::processNode(KdFileTree::InorderOperation& iProcessor, KdFileTreeNode& iNode)
 {
 	PointCloud lCloud;
@@ -660,98 +814,364 @@ void KdFileTree::InorderOperation::completeTraveral(PointCloudAttributes& iAttri
 // Fill internal nodes
 //
 
-Downsampler::Downsampler(FILE* iFile, float iResolution)
+MultiResolutionReducer::MultiResolutionReducer(float* iMin, float* iMax, float iResolution, float iSigma, uint8_t iLevels)
 	: InorderOperation("Lod")
-	, mFile(iFile)
-	, mWritten(0)
-	, mResolution(iResolution)
+	, mAttributes(0)
+	, mIntensityIndex(-1)
+	, mColorIndex(-1)
+	, mClassIndex(-1)
+	, mNormalIndex(-1)
+{
+	memcpy(mMin, iMin, sizeof(mMin));
+	memcpy(mMax, iMax, sizeof(mMax));
+
+	mGrid[0] = iResolution;
+	mGrid[1] = (double)iResolution * iSigma;
+
+	for (uint8_t h = 1; h <= iLevels; h++)
+	{
+		float lResolution = (float)(mGrid[h % 2] * (1 << (h / 2)));
+
+		Level lLevel;
+		lLevel.mName = "res-" + std::to_string(lResolution);
+		lLevel.mResolution = lResolution;
+		lLevel.mFile = 0;
+		lLevel.mWritten = 0;
+		mLevels.push_back(lLevel);
+	}
+}
+
+void MultiResolutionReducer::initTraveral(PointCloudAttributes& iAttributes)
+{
+	InorderOperation::initTraveral(iAttributes);
+
+	mAttributes = &iAttributes;
+	mIntensityIndex = iAttributes.getAttributeIndex(Attribute::INTENSITY);
+	mColorIndex = iAttributes.getAttributeIndex(Attribute::COLOR);
+	mClassIndex = iAttributes.getAttributeIndex(Attribute::CLASS);
+	mNormalIndex = iAttributes.getAttributeIndex(Attribute::NORMAL);
+
+	for (std::vector<Level>::iterator lIter = mLevels.begin(); lIter != mLevels.end(); lIter++)
+	{
+		lIter->mFile = PointCloud::writeHeader(lIter->mName, iAttributes, 0, mMin, mMax, lIter->mResolution);
+	}
+}
+
+void MultiResolutionReducer::completeTraveral(PointCloudAttributes& iAttributes)
+{
+	for (std::vector<Level>::iterator lIter = mLevels.begin(); lIter != mLevels.end(); lIter++)
+	{
+		PointCloud::updateSize(lIter->mFile, lIter->mWritten);
+		fclose(lIter->mFile);
+		lIter->mFile = 0;
+	}
+
+	InorderOperation::completeTraveral(iAttributes);
+}
+
+// whether the highest set bit of iA is below the one of iB
+static inline bool lessMsb(uint32_t iA, uint32_t iB)
 {
+	return iA < iB && iA < (iA ^ iB);
 }
 
+// morton order without interleaving the bits, the axis with the highest differing bit decides
+static inline bool mortonLess(const uint32_t* iA, const uint32_t* iB)
+{
+	int lAxis = 0;
+	uint32_t lBits = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		uint32_t lDiff = iA[i] ^ iB[i];
+		if (lessMsb(lBits, lDiff))
+		{
+			lAxis = i;
+			lBits = lDiff;
+		}
+	}
+	return iA[lAxis] < iB[lAxis];
+}
 
-void Downsampler::processNode(KdFileTreeNode& iNode, PointCloud& iCloud)
+void MultiResolutionReducer::add(Cell& iCell, Cell& iSource)
 {
-	VoxelHashIndex2 lVoxelHash(iCloud.mPoints, mResolution);
+	iCell.mCount += iSource.mCount;
+	for (int i = 0; i < 3; i++)
+	{
+		iCell.mSum[i] += iSource.mSum[i];
+		iCell.mColor[i] += iSource.mColor[i];
+	}
+	iCell.mIntensity = std::max(iCell.mIntensity, iSource.mIntensity);
 
-	uint32_t lCount = 0;
-	for (uint32_t i = 0; i < iCloud.size(); i++)
+	// a class held by more than half of the points always keeps the lead
+	if (iCell.mClass == iSource.mClass)
+	{
+		iCell.mVotes += iSource.mVotes;
+	}
+	else if (iCell.mVotes >= iSource.mVotes)
+	{
+		iCell.mVotes -= iSource.mVotes;
+	}
+	else
 	{
-		lVoxelHash.project(iCloud[i]->position, i);
+		iCell.mClass = iSource.mClass;
+		iCell.mVotes = iSource.mVotes - iCell.mVotes;
 	}
 
-	int lIntensityIndex = iCloud.getAttributeIndex(Attribute::INTENSITY);
-	int lColorIndex = iCloud.getAttributeIndex(Attribute::COLOR);
-	int lClassIndex = iCloud.getAttributeIndex(Attribute::CLASS);
+	// normals of a surface may point either way, align before summing
+	float lSign = iCell.mNormal[0] * iSource.mNormal[0] + iCell.mNormal[1] * iSource.mNormal[1] + iCell.mNormal[2] * iSource.mNormal[2] < 0 ? -1.0f : 1.0f;
+	for (int i = 0; i < 3; i++)
+	{
+		iCell.mNormal[i] += lSign * iSource.mNormal[i];
+	}
+}
 
-	mWriteLock.lock();
+void MultiResolutionReducer::collapse(std::vector<Cell>& iCells)
+{
+	size_t lSize = 0;
+	for (size_t i = 0; i < iCells.size(); i++)
+	{
+		if (lSize && !memcmp(iCells[lSize - 1].mIndex, iCells[i].mIndex, sizeof(iCells[i].mIndex)))
+		{
+			add(iCells[lSize - 1], iCells[i]);
+		}
+		else
+		{
+			iCells[lSize++] = iCells[i];
+		}
+	}
+	iCells.resize(lSize);
+}
 
-	std::vector<VoxelHashIndex2::Voxel*>& lGrid = lVoxelHash.getGrid();
-	for (std::vector<VoxelHashIndex2::Voxel*>::iterator lIter = lGrid.begin(); lIter != lGrid.end(); lIter++)
+void MultiResolutionReducer::sort(std::vector<Cell>& iCells)
+{
+	std::sort(iCells.begin(), iCells.end(), [](const Cell& iA, const Cell& iB)
 	{
-		VoxelHashIndex2::Voxel* lVoxel = *lIter;
-		if (lVoxel)
+		return mortonLess(iA.mIndex, iB.mIndex);
+	});
+	collapse(iCells);
+}
+
+void MultiResolutionReducer::merge(std::vector<Cell>& iLow, std::vector<Cell>& iHigh, std::vector<Cell>& iCells)
+{
+	iCells.resize(iLow.size() + iHigh.size());
+	std::merge(iLow.begin(), iLow.end(), iHigh.begin(), iHigh.end(), iCells.begin(), [](const Cell& iA, const Cell& iB)
+	{
+		return mortonLess(iA.mIndex, iB.mIndex);
+	});
+	collapse(iCells);
+}
+
+void MultiResolutionReducer::coarsen(std::vector<Cell>& iCells)
+{
+	// halving every index keeps the morton order, the cells of a coarser one stay adjacent
+	for (std::vector<Cell>::iterator lIter = iCells.begin(); lIter != iCells.end(); lIter++)
+	{
+		lIter->mIndex[0] >>= 1;
+		lIter->mIndex[1] >>= 1;
+		lIter->mIndex[2] >>= 1;
+	}
+	collapse(iCells);
+}
+
+void MultiResolutionReducer::readCells(KdFileTreeNode& iNode, std::vector<Cell>& iLevel, std::vector<Cell>& iNext)
+{
+	iLevel.clear();
+	iNext.clear();
+
+	if (iNode.mChildLow && iNode.mChildHigh)
+	{
+		std::string lName = iNode.mPath + ".cells";
+		FILE* lFile = fopen(lName.c_str(), "rb");
+		if (lFile == NULL)
+		{
+			BOOST_LOG_TRIVIAL(error) << "Could not read " << lName;
+			return;
+		}
+		uint64_t lSize[2];
+		if (fread(lSize, sizeof(lSize), 1, lFile) != 1)
+		{
+			lSize[0] = lSize[1] = 0;
+		}
+		iLevel.resize(lSize[0]);
+		iNext.resize(lSize[1]);
+		if ((iLevel.size() && fread(&iLevel[0], sizeof(Cell), iLevel.size(), lFile) != iLevel.size()) ||
+			(iNext.size() && fread(&iNext[0], sizeof(Cell), iNext.size(), lFile) != iNext.size()))
 		{
-			Point lPoint(iCloud);
-			memset(lPoint.position, 0, sizeof(lPoint.position));
+			BOOST_LOG_TRIVIAL(error) << "Could not read " << lName;
+			iLevel.clear();
+			iNext.clear();
+		}
+		fclose(lFile);
+		std::remove(lName.c_str());
+		return;
+	}
+
+	PointCloud lCloud;
+	lCloud.readFile(iNode.mPath);
+	lCloud.addAttributes(*mAttributes);
+
+	int lIntensityIndex = lCloud.getAttributeIndex(Attribute::INTENSITY);
+	int lColorIndex = lCloud.getAttributeIndex(Attribute::COLOR);
+	int lClassIndex = lCloud.getAttributeIndex(Attribute::CLASS);
+	int lNormalIndex = lCloud.getAttributeIndex(Attribute::NORMAL);
+
+	// every point is a cell of its own. Overlap points are left to the leaf that owns them 
+	iLevel.reserve(lCloud.size());
+	for (uint32_t i = 0; i < lCloud.size(); i++)
+	{
+		Point& lSample = *lCloud[i];
+		if (!iNode.contains(lSample.position))
+		{
+			continue;
+		}
+
+		Cell lCell;
+		memset(&lCell, 0, sizeof(lCell));
+		lCell.mCount = 1;
+		lCell.mSum[0] = lSample.position[0];
+		lCell.mSum[1] = lSample.position[1];
+		lCell.mSum[2] = lSample.position[2];
+
+		if (lIntensityIndex != -1)
+		{
+			lCell.mIntensity = ((IntensityType*)lSample.getAttribute(lIntensityIndex))->mValue;
+		}
 
-			// create class histogram
-			uint32_t lClassH[20];
-			if (lClassIndex != -1)
+		if (lColorIndex != -1)
+		{
+			ColorType& lColor = *(ColorType*)lSample.getAttribute(lColorIndex);
+			lCell.mColor[0] = lColor.mValue[0];
+			lCell.mColor[1] = lColor.mValue[1];
+			lCell.mColor[2] = lColor.mValue[2];
+		}
+
+		if (lClassIndex != -1)
+		{
+			lCell.mClass = ((ClassType*)lSample.getAttribute(lClassIndex))->mValue;
+			lCell.mVotes = 1;
+		}
+
+		if (lNormalIndex != -1)
+		{
+			getNormal(lSample.getAttribute(lNormalIndex), lCell.mNormal);
+		}
+
+		iLevel.push_back(lCell);
+	}
+
+	// the only sorts, once on each grid
+	iNext = iLevel;
+	std::vector<Cell>* lLevels[2] = { &iLevel, &iNext };
+	for (int l = 0; l < 2; l++)
+	{
+		for (std::vector<Cell>::iterator lIter = lLevels[l]->begin(); lIter != lLevels[l]->end(); lIter++)
+		{
+			for (int i = 0; i < 3; i++)
 			{
-				memset(lClassH, 0, sizeof(lClassH));
+				lIter->mIndex[i] = (uint32_t)std::max(0.0, floor((lIter->mSum[i] - mMin[i]) / mGrid[l]));
 			}
+		}
+		sort(*lLevels[l]);
+	}
+}
 
-			double lWeight = 1.0 / lVoxel->list.size();
-			for (std::vector<uint32_t>::iterator lIter1 = lVoxel->list.begin(); lIter1 != lVoxel->list.end(); lIter1++)
-			{
-				Point& lSample = *iCloud[*lIter1];
+void MultiResolutionReducer::writeCells(KdFileTreeNode& iNode, std::vector<Cell>& iLevel, std::vector<Cell>& iNext)
+{
+	std::string lName = iNode.mPath + ".cells";
+	FILE* lFile = fopen(lName.c_str(), "wb");
+	if (lFile == NULL)
+	{
+		BOOST_LOG_TRIVIAL(error) << "Could not write " << lName;
+		return;
+	}
+	uint64_t lSize[2] = { iLevel.size(), iNext.size() };
+	if (fwrite(lSize, sizeof(lSize), 1, lFile) != 1 ||
+		(iLevel.size() && fwrite(&iLevel[0], sizeof(Cell), iLevel.size(), lFile) != iLevel.size()) ||
+		(iNext.size() && fwrite(&iNext[0], sizeof(Cell), iNext.size(), lFile) != iNext.size()))
+	{
+		BOOST_LOG_TRIVIAL(error) << "Could not write " << lName;
+	}
+	fclose(lFile);
+}
 
-				if (lIntensityIndex != -1)
-				{
-					IntensityType& lIntensity = *(IntensityType*)lPoint.getAttribute(lIntensityIndex);
-					lIntensity.max(*lSample.getAttribute(lIntensityIndex));
-				}
+void MultiResolutionReducer::writeLevel(Level& iLevel, std::vector<Cell>& iCells)
+{
+	Point lPoint(*mAttributes);
 
-				if (lColorIndex != -1)
-				{
-					ColorType& lColor = *(ColorType*)lPoint.getAttribute(lColorIndex);
-					lColor.add(*lSample.getAttribute(lColorIndex), lWeight);
-				}
+	boost::lock_guard<boost::mutex> lLock(mWriteLock);
 
-				if (lClassIndex != -1)
-				{
-					ClassType& lClass = *(ClassType*)lSample.getAttribute(lClassIndex);
-					if (lClass.mValue < 20)
-					{
-						lClassH[lClass.mValue]++;
-					}
-				}
+	for (std::vector<Cell>::iterator lIter = iCells.begin(); lIter != iCells.end(); lIter++)
+	{
+		Cell& lCell = *lIter;
 
-				lPoint.position[0] += lSample.position[0] * lWeight;
-				lPoint.position[1] += lSample.position[1] * lWeight;
-				lPoint.position[2] += lSample.position[2] * lWeight;
-			}
+		lPoint.position[0] = lCell.mSum[0] / lCell.mCount;
+		lPoint.position[1] = lCell.mSum[1] / lCell.mCount;
+		lPoint.position[2] = lCell.mSum[2] / lCell.mCount;
 
-			if (lClassIndex != -1)
+		if (mIntensityIndex != -1)
+		{
+			((IntensityType*)lPoint.getAttribute(mIntensityIndex))->mValue = lCell.mIntensity;
+		}
+
+		if (mColorIndex != -1)
+		{
+			ColorType& lColor = *(ColorType*)lPoint.getAttribute(mColorIndex);
+			for (int i = 0; i < 3; i++)
 			{
-				// find max in class histogram
-				int lMax = 0;
-				for (int i = 0; i < 20; i++)
-				{
-					if (lClassH[i] > lClassH[lMax])
-					{
-						lMax = i;
-					}
-				}
-				ClassType& lClass = *(ClassType*)lPoint.getAttribute(lClassIndex);
-				lClass.mValue = lMax;
+				lColor.mValue[i] = (uint8_t)((lCell.mColor[i] + lCell.mCount / 2) / lCell.mCount);
 			}
+		}
 
-			lPoint.write(mFile);
-			mWritten++;
+		if (mClassIndex != -1)
+		{
+			((ClassType*)lPoint.getAttribute(mClassIndex))->mValue = lCell.mClass;
 		}
+
+		if (mNormalIndex != -1)
+		{
+			setNormal(lPoint.getAttribute(mNormalIndex), lCell.mNormal);
+		}
+
+		lPoint.write(iLevel.mFile);
 	}
+	iLevel.mWritten += iCells.size();
+}
+
+void MultiResolutionReducer::reduceNode(KdFileTreeNode& iNode, bool iRoot)
+{
+	std::vector<Cell> lLevel[2];
+	std::vector<Cell> lNext[2];
 
-	mWriteLock.unlock();
+	KdFileTreeNode* lChildren[2] = { iNode.mChildLow, iNode.mChildHigh };
+	for (int c = 0; c < 2; c++)
+	{
+		readCells(*lChildren[c], lLevel[c], lNext[c]);
 
+		// no node of the heights in between covers a shallower child, its own cells stand for it there
+		for (uint8_t h = lChildren[c]->mHeight + 1; h < iNode.mHeight; h++)
+		{
+			lLevel[c].swap(lNext[c]);
+			coarsen(lNext[c]);
+			writeLevel(mLevels[h - 1], lLevel[c]);
+		}
+	}
+
+	// the children on the grid of this level are its cells, on the grid of theirs the ones above
+	std::vector<Cell> lCells;
+	merge(lNext[0], lNext[1], lCells);
+	std::vector<Cell>().swap(lNext[0]);
+	std::vector<Cell>().swap(lNext[1]);
+
+	writeLevel(mLevels[iNode.mHeight - 1], lCells);
+
+	if (!iRoot)
+	{
+		std::vector<Cell> lAbove;
+		merge(lLevel[0], lLevel[1], lAbove);
+		std::vector<Cell>().swap(lLevel[0]);
+		std::vector<Cell>().swap(lLevel[1]);
+		coarsen(lAbove);
+
+		writeCells(iNode, lCells, lAbove);
+	}
 }
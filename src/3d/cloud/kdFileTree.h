@@ -42,14 +42,20 @@ class KdFileTreeNode
 		uint64_t mCount;
 		uint64_t mVolumeLimit;
 
-		void feed(uint8_t* iBuffer, uint32_t iStride, size_t iCount, boost::thread_group*& iGroup, int32_t iThreadCount);
+		// iBlocks, if any, are the blocks of the file the chunk starting at point iFirst was read from
+		void feed(uint8_t* iBuffer, uint32_t iStride, size_t iCount, uint64_t iFirst, std::vector<PointCloud::Block>* iBlocks, boost::thread_group*& iGroup, int32_t iThreadCount);
 		bool grow(std::string iIndent, uint32_t iLeafsize);
 
 		void openFiles(PointCloudAttributes& iAttributes, float iResolution);
-		void write(uint8_t* iBuffer, uint32_t iStride, uint32_t iCount, float iOverlap, boost::thread_group*& iGroup, int32_t iThreadCount);
+		void write(uint8_t* iBuffer, uint32_t iStride, uint32_t iCount, uint64_t iFirst, std::vector<PointCloud::Block>* iBlocks, float iOverlap, boost::thread_group*& iGroup, int32_t iThreadCount);
 		json_spirit::mObject closeFiles();
 		void deleteFiles();
 
+		// same as above but restricted to the nodes with the given height
+		void openLevel(PointCloudAttributes& iAttributes, float iResolution, uint8_t iHeight);
+		void writeLevel(uint8_t* iBuffer, uint32_t iStride, uint32_t iCount, float iOverlap, uint8_t iHeight, boost::thread_group*& iGroup, int32_t iThreadCount);
+		void closeLevel(uint8_t iHeight);
+
 		bool prune();
 		uint64_t collapse(FILE* iFile, uint32_t iStride, float* iMin, float* iMax);
 
@@ -58,8 +64,19 @@ class KdFileTreeNode
 		KdFileTreeNode();
 		KdFileTreeNode(KdFileTreeNode& iNode);
 
-		void recordChunk(uint8_t* iBuffer, uint32_t iStride, size_t iCount);
-		void writeChunk(uint8_t* iBuffer, uint32_t iStride, size_t iCount, float iOverlap);
+		void recordChunk(uint8_t* iBuffer, uint32_t iStride, size_t iCount, uint64_t iFirst, std::vector<PointCloud::Block>* iBlocks);
+		void writeChunk(uint8_t* iBuffer, uint32_t iStride, size_t iCount, uint64_t iFirst, std::vector<PointCloud::Block>* iBlocks, float iOverlap);
+
+		// consecutive points of a chunk, mInside if their blocks lie within the box so none needs a test
+		struct Range
+		{
+			size_t mBegin;
+			size_t mEnd;
+			bool mInside;
+		};
+
+		// ranges of a chunk whose blocks intersect the box, the whole chunk without blocks
+		void ranges(size_t iCount, uint64_t iFirst, std::vector<PointCloud::Block>* iBlocks, float* iMin, float* iMax, std::vector<Range>& iRanges);
 
 		static const int X = 0;
 		static const int Y = 1;
@@ -85,6 +102,9 @@ class KdFileTree
 
 		PointCloudAttributes mPointAttributes;
 
+		// block bounds of the input, nodes skip the blocks outside of them. Tight if the importer sorted it
+		std::vector<PointCloud::Block> mBlocks;
+
 	public:
 
 		// 100000 points in a leaf node i.e. one packet going to browser ~ 2MB uncompressed
@@ -140,30 +160,89 @@ class KdFileTree
 		KdFileTreeNode* mRoot;
 
 		void getNodes(std::vector<KdFileTreeNode*>& iList, KdFileTreeNode& iNode, uint8_t iNodes);
+		void getLevel(std::vector<KdFileTreeNode*>& iList, KdFileTreeNode& iNode, uint8_t iHeight);
 		void processNode(KdFileTree::InorderOperation& iProcessor, KdFileTreeNode& iNode);
 
 }; 
 
-class Downsampler : public KdFileTree::InorderOperation
+//
+// Reduces the leaves into all levels of detail. Nodes are reduced one height at a time, each from 
+// the cells of its two children merged on the grid of its level, so a cell is written once for all
+// the leaves below a node. The grids of the even levels are the resolution doubled per two levels,
+// the ones of the odd levels the same times sigma. Each family nests, so a cell of level h + 2 is
+// its cells of level h with their index halved. Leaves sort their points once per family along a
+// morton curve, every level above only merges and halves sorted cells.
+//
+
+class MultiResolutionReducer : public KdFileTree::InorderOperation
 {
 	public:
 
-		Downsampler(FILE* iFile, float iResolution);
+		MultiResolutionReducer(float* iMin, float* iMax, float iResolution, float iSigma, uint8_t iLevels);
+
+		struct Level
+		{
+			std::string mName;
+			float mResolution;
+			FILE* mFile;
+			uint64_t mWritten;
+		};
+
+		std::vector<Level> mLevels;
+
+		void initTraveral(PointCloudAttributes& iAttributes);
+		void completeTraveral(PointCloudAttributes& iAttributes);
 
-		uint64_t mWritten;
+		// iNode has height h and is reduced into level h, its children must have been reduced before
+		void reduceNode(KdFileTreeNode& iNode, bool iRoot);
 
 	protected:
 
-		FILE* mFile;
+		// the class is the majority vote of the points, mVotes what is left of its lead
+		struct Cell
+		{
+			uint32_t mIndex[3];
+			uint32_t mCount;
+			double mSum[3];
+			uint32_t mColor[3];
+			float mNormal[3];
+			uint32_t mVotes;
+			uint16_t mIntensity;
+			uint8_t mClass;
+		};
 
-		float mResolution;
+		float mMin[3];
+		float mMax[3];
+
+		// grids of level 0 and 1, level h uses the one of h % 2 with cells 2^(h / 2) times as large
+		double mGrid[2];
+
+		PointCloudAttributes* mAttributes;
+		int mIntensityIndex;
+		int mColorIndex;
+		int mClassIndex;
+		int mNormalIndex;
 
 		boost::mutex mWriteLock;
 
-		// traversal
-		void processNode(KdFileTreeNode& iNode, PointCloud& iCloud);
-};
+		static void add(Cell& iCell, Cell& iSource);
 
+		// cells with the same index become one, they must be adjacent
+		static void collapse(std::vector<Cell>& iCells);
+
+		// sorts along the morton curve, cells with the same index become one
+		static void sort(std::vector<Cell>& iCells);
+		static void merge(std::vector<Cell>& iLow, std::vector<Cell>& iHigh, std::vector<Cell>& iCells);
+
+		// moves sorted cells from level h to level h + 2, the order stays
+		static void coarsen(std::vector<Cell>& iCells);
+
+		// the cells of a node on the grid of its height and of the one above, a leaf on level 0 and 1
+		void readCells(KdFileTreeNode& iNode, std::vector<Cell>& iLevel, std::vector<Cell>& iNext);
+		void writeCells(KdFileTreeNode& iNode, std::vector<Cell>& iLevel, std::vector<Cell>& iNext);
+
+		void writeLevel(Level& iLevel, std::vector<Cell>& iCells);
+};
 
 
 
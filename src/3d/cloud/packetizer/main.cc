@@ -16,13 +16,38 @@
 #include "../kdFileTree.h"
 
 #include "packetProcessor.h"
+#include "normalProcessor.h"
 
 bool processFile(json_spirit::mObject& iConfig)
 {
+	PointCloud::configure(iConfig);
+
 	float lResolution = PointCloud::readResolution(iConfig["file"].get_str());
 
+	float lOverlap = 1.6*KdFileTree::SIGMA*lResolution;
+
 	KdFileTree lFileTree;
-	lFileTree.construct(iConfig["file"].get_str(), 120000, 1.6*KdFileTree::SIGMA*lResolution);
+	lFileTree.construct(iConfig["file"].get_str(), 120000, lOverlap);
+
+	// orient normals in the leaves before they are reduced into the levels above, only on request,
+	// the packets otherwise compute unoriented normals where the importer gave none
+	if (iConfig.find("orient") != iConfig.end() && !iConfig["orient"].is_null() && iConfig["orient"].get_bool())
+	{
+		std::vector<glm::dvec3> lScanners;
+		if (iConfig.find("scanners") != iConfig.end() && !iConfig["scanners"].is_null())
+		{
+			json_spirit::mArray& lArray = iConfig["scanners"].get_array();
+			for (json_spirit::mArray::iterator lIter = lArray.begin(); lIter != lArray.end(); lIter++)
+			{
+				json_spirit::mArray& lPosition = lIter->get_array();
+				lScanners.push_back(glm::dvec3(lPosition[0].get_real(), lPosition[1].get_real(), lPosition[2].get_real()));
+			}
+		}
+
+		NormalProcessor lNormals(lOverlap, lScanners);
+		lFileTree.process(lNormals, KdFileTree::LEAVES);
+	}
+
 	lFileTree.fill(KdFileTree::SIGMA, lResolution);
 
 	PacketProcessor lProcessor;
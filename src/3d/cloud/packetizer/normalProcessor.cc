@@ -1,5 +1,8 @@
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <unordered_map>
+#include <thread>
 
 #include <boost/log/core.hpp>
 #include <boost/log/trivial.hpp>
@@ -11,9 +14,14 @@
 
 #define PACKED_NORMAL 1
 
+static const uint32_t NONE = 0xffffffff;
 
-NormalProcessor::NormalProcessor()
+NormalProcessor::NormalProcessor(float iOverlap, std::vector<glm::dvec3>& iScanners)
 : InorderOperation("Normal")
+, mOverlap(iOverlap)
+, mScanners(iScanners)
+, mNormals(false)
+, mActive(0)
 {
 };
 
@@ -21,6 +29,9 @@ void NormalProcessor::initTraveral(PointCloudAttributes& iAttributes)
 {
 	InorderOperation::initTraveral(iAttributes);
 
+	// normals of the importer are kept and seed the orientation
+	mNormals = iAttributes.getAttributeIndex(Attribute::NORMAL) != -1;
+
 #if defined PACKED_NORMAL
 	PackedNormalType lAttribute;
 #else
@@ -30,88 +41,681 @@ void NormalProcessor::initTraveral(PointCloudAttributes& iAttributes)
 	iAttributes.createAttribute(Attribute::NORMAL, lAttribute);
 }
 
-void NormalProcessor::processLeaf(KdFileTreeNode& iNode, PointCloud& iCloud)
+void NormalProcessor::processNode(KdFileTreeNode& iNode, PointCloud& iCloud)
 {
-	computeNormals(iCloud, iCloud.getAttributeIndex(Attribute::NORMAL));
+	uint32_t lThreads = std::max<uint32_t>(1, std::thread::hardware_concurrency() / ++mActive);
+
+	uint32_t lSize = iCloud.size();
+	uint32_t lNormalIndex = iCloud.getAttributeIndex(Attribute::NORMAL);
+
+	std::vector<glm::vec3> lNormals(lSize, glm::vec3(0));
+	std::vector<bool> lSeed(lSize, false);
+	if (mNormals)
+	{
+		for (uint32_t i = 0; i < lSize; i++)
+		{
+			getNormal(iCloud[i]->getAttribute(lNormalIndex), &lNormals[i][0]);
+			lSeed[i] = lNormals[i][0] != 0 || lNormals[i][1] != 0 || lNormals[i][2] != 0;
+		}
+	}
+
+	//
+	// unoriented normals and the knn graph
+	//
+	KdTree<KdSpatialDomain> lTree(iCloud, 100);
+	lTree.construct();
+
+	std::vector<Edge> lEdges;
+	lEdges.reserve(lSize * K);
+
+	std::vector<std::pair<uint32_t, float>> lSearch;
+	for (uint32_t i = 0; i < lSize; i++)
+	{
+		lSearch.clear();
+		lTree.knn<K>(i, lSearch);
+
+		if (!lSeed[i])
+		{
+			glm::dmat3 lCovariance;
+			computeCovariance(iCloud, lSearch, lCovariance);
+
+			glm::dmat3 lEigenVectors;
+			glm::dvec3 lEigenValues;
+			if (computeEigen(lCovariance, lEigenVectors, lEigenValues))
+			{
+				int lMinimum = 0;
+				for (int m = 1; m < 3; m++)
+				{
+					if (fabs(lEigenValues[m]) < fabs(lEigenValues[lMinimum]))
+					{
+						lMinimum = m;
+					}
+				}
+
+				glm::dvec3 lNormal(lEigenVectors[0][lMinimum], lEigenVectors[1][lMinimum], lEigenVectors[2][lMinimum]);
+				double lLength = glm::length(lNormal);
+				if (lLength > 0)
+				{
+					lNormals[i] = glm::vec3(lNormal / lLength);
+				}
+			}
+		}
+
+		for (std::vector<std::pair<uint32_t, float>>::iterator lIter = lSearch.begin(); lIter != lSearch.end(); lIter++)
+		{
+			if (lIter->first != i && lIter->second != FLT_MAX)
+			{
+				Edge lEdge;
+				lEdge.mA = std::min(i, lIter->first);
+				lEdge.mB = std::max(i, lIter->first);
+				lEdges.push_back(lEdge);
+			}
+		}
+	}
+
+	// the knn relation is not symmetric, keep every edge once
+	std::sort(lEdges.begin(), lEdges.end(), [](const Edge& iA, const Edge& iB)
+	{
+		return iA.mA < iB.mA || (iA.mA == iB.mA && iA.mB < iB.mB);
+	});
+	lEdges.erase(std::unique(lEdges.begin(), lEdges.end(), [](const Edge& iA, const Edge& iB)
+	{
+		return iA.mA == iB.mA && iA.mB == iB.mB;
+	}), lEdges.end());
+
+	// Hoppe's criterion, nearly parallel normals are the cheapest to propagate over
+	for (std::vector<Edge>::iterator lIter = lEdges.begin(); lIter != lEdges.end(); lIter++)
+	{
+		lIter->mWeight = 1.0f - fabs(hoppe(&lNormals[lIter->mA][0], &lNormals[lIter->mB][0]));
+	}
+
+	std::vector<uint32_t> lSpanning;
+	spanningTree(lSize, lEdges, lSpanning, lThreads);
+
+	//
+	// propagate along the tree, the sign of every point is relative to the root of its component
+	//
+	std::vector<uint32_t> lOffsets(lSize + 1, 0);
+	for (std::vector<uint32_t>::iterator lIter = lSpanning.begin(); lIter != lSpanning.end(); lIter++)
+	{
+		lOffsets[lEdges[*lIter].mA + 1]++;
+		lOffsets[lEdges[*lIter].mB + 1]++;
+	}
+	for (uint32_t i = 0; i < lSize; i++)
+	{
+		lOffsets[i + 1] += lOffsets[i];
+	}
+	std::vector<uint32_t> lAdjacent(lOffsets[lSize]);
+	std::vector<uint32_t> lFill(lOffsets.begin(), lOffsets.end() - 1);
+	for (std::vector<uint32_t>::iterator lIter = lSpanning.begin(); lIter != lSpanning.end(); lIter++)
+	{
+		Edge& lEdge = lEdges[*lIter];
+		lAdjacent[lFill[lEdge.mA]++] = lEdge.mB;
+		lAdjacent[lFill[lEdge.mB]++] = lEdge.mA;
+	}
+
+	std::vector<int8_t> lSign(lSize, 0);
+	std::vector<uint32_t> lComponent(lSize);
+	std::vector<Component> lComponents;
+	std::vector<uint32_t> lMembers;
+	for (uint32_t lRoot = 0; lRoot < lSize; lRoot++)
+	{
+		if (lSign[lRoot])
+		{
+			continue;
+		}
+
+		// breadth first, lMembers doubles as the queue
+		lMembers.clear();
+		lMembers.push_back(lRoot);
+		lSign[lRoot] = 1;
+		for (size_t q = 0; q < lMembers.size(); q++)
+		{
+			uint32_t lParent = lMembers[q];
+			for (uint32_t a = lOffsets[lParent]; a < lOffsets[lParent + 1]; a++)
+			{
+				uint32_t lChild = lAdjacent[a];
+				if (!lSign[lChild])
+				{
+					lSign[lChild] = hoppe(&lNormals[lParent][0], &lNormals[lChild][0]) < 0 ? -lSign[lParent] : lSign[lParent];
+					lMembers.push_back(lChild);
+				}
+			}
+		}
+
+		float lEvidence = vote(&lNormals[0], &lSign[0], lMembers, lSeed, iCloud);
+		int8_t lGlobal = lEvidence < 0 ? -1 : 1;
+		for (std::vector<uint32_t>::iterator lIter = lMembers.begin(); lIter != lMembers.end(); lIter++)
+		{
+			if (!lSeed[*lIter])
+			{
+				lNormals[*lIter] *= (float)(lGlobal * lSign[*lIter]);
+			}
+			lComponent[*lIter] = lComponents.size();
+		}
+
+		Component lRecord;
+		lRecord.mEvidence = fabs(lEvidence);
+		lRecord.mSize = lMembers.size();
+		lComponents.push_back(lRecord);
+	}
+
+	for (uint32_t i = 0; i < lSize; i++)
+	{
+		if (!lSeed[i])
+		{
+			setNormal(iCloud[i]->getAttribute(lNormalIndex), &lNormals[i][0]);
+		}
+	}
+
+	//
+	// points in the overlap are shared with the neighbouring leaves
+	//
+	std::vector<Shared> lShared;
+	for (uint32_t i = 0; i < lSize; i++)
+	{
+		float* lPosition = iCloud[i]->position;
+		bool lBorder = !iNode.contains(lPosition);
+		for (int a = 0; a < 3 && !lBorder; a++)
+		{
+			lBorder = lPosition[a] - iNode.min[a] <= mOverlap || iNode.max[a] - lPosition[a] <= mOverlap;
+		}
+
+		if (lBorder)
+		{
+			Shared lPoint;
+			memcpy(lPoint.mPosition, lPosition, sizeof(lPoint.mPosition));
+			lPoint.mComponent = lComponent[i];
+			memcpy(lPoint.mNormal, &lNormals[i][0], sizeof(lPoint.mNormal));
+			lShared.push_back(lPoint);
+		}
+	}
+
+	mLock.lock();
+	Leaf lLeaf;
+	lLeaf.mNode = &iNode;
+	lLeaf.mBase = mComponents.size();
+	lLeaf.mCount = lComponents.size();
+	mLeaves.push_back(lLeaf);
+	mComponents.insert(mComponents.end(), lComponents.begin(), lComponents.end());
+	mLock.unlock();
+
+	for (std::vector<Shared>::iterator lIter = lShared.begin(); lIter != lShared.end(); lIter++)
+	{
+		lIter->mComponent += lLeaf.mBase;
+	}
+	std::sort(lShared.begin(), lShared.end(), [](const Shared& iA, const Shared& iB)
+	{
+		return memcmp(iA.mPosition, iB.mPosition, sizeof(iA.mPosition)) < 0;
+	});
+	writeShared(iNode, lShared);
+
+	// remember the component of every point in case it has to be flipped
+	writeComponents(iNode, lComponent);
 
 	iCloud.writeFile(iNode.mPath);
+
+	mActive--;
 };
 
-void NormalProcessor::processInternal(KdFileTreeNode& iNode, PointCloud& iCloud)
+float NormalProcessor::vote(glm::vec3* iNormals, int8_t* iSign, std::vector<uint32_t>& iMembers, std::vector<bool>& iSeed, PointCloud& iCloud)
 {
-	computeNormals(iCloud, iCloud.getAttributeIndex(Attribute::NORMAL));
+	// normals of the importer know their side
+	float lVote = 0;
+	for (std::vector<uint32_t>::iterator lIter = iMembers.begin(); lIter != iMembers.end(); lIter++)
+	{
+		if (iSeed[*lIter])
+		{
+			lVote += iSign[*lIter];
+		}
+	}
+	if (lVote != 0)
+	{
+		return lVote;
+	}
 
-	iCloud.writeFile(iNode.mPath);
-};
+	// otherwise face the closest scanner
+	if (mScanners.size())
+	{
+		for (std::vector<uint32_t>::iterator lIter = iMembers.begin(); lIter != iMembers.end(); lIter++)
+		{
+			glm::dvec3 lPosition(iCloud[*lIter]->position[0], iCloud[*lIter]->position[1], iCloud[*lIter]->position[2]);
+			glm::dvec3 lView = mScanners[0] - lPosition;
+			for (size_t s = 1; s < mScanners.size(); s++)
+			{
+				glm::dvec3 lOther = mScanners[s] - lPosition;
+				if (glm::dot(lOther, lOther) < glm::dot(lView, lView))
+				{
+					lView = lOther;
+				}
+			}
 
+			double lDot = glm::dot(glm::dvec3(iNormals[*lIter]), lView);
+			if (lDot != 0)
+			{
+				lVote += lDot > 0 ? iSign[*lIter] : -iSign[*lIter];
+			}
+		}
+		if (lVote != 0)
+		{
+			return lVote;
+		}
+	}
 
-void NormalProcessor::computeNormals(PointCloud& iPoints, uint32_t iNormalIndex)
-{
-	KdTree<KdSpatialDomain> lTree(iPoints, 100);
-	lTree.construct();
+	// or mostly up, weak evidence for outdoor scenes
+	for (std::vector<uint32_t>::iterator lIter = iMembers.begin(); lIter != iMembers.end(); lIter++)
+	{
+		lVote += iSign[*lIter] * iNormals[*lIter][1];
+	}
+	return lVote / iMembers.size();
+}
 
-	//
-	// compute normals
-	//
-	std::vector<std::pair<uint32_t, float>> lRadiusSearch;
-	for (size_t i=0; i<iPoints.size(); i++)
+//
+// Boruvka: every round each component picks its cheapest outgoing edge and all of them are 
+// merged, so there are at most log(n) rounds. The search for the cheapest edge of every point
+// runs in parallel.
+//
+
+void NormalProcessor::spanningTree(uint32_t iSize, std::vector<Edge>& iEdges, std::vector<uint32_t>& iTree, uint32_t iThreads)
+{
+	std::vector<uint32_t> lOffsets(iSize + 1, 0);
+	for (std::vector<Edge>::iterator lIter = iEdges.begin(); lIter != iEdges.end(); lIter++)
+	{
+		lOffsets[lIter->mA + 1]++;
+		lOffsets[lIter->mB + 1]++;
+	}
+	for (uint32_t i = 0; i < iSize; i++)
 	{
-		Point& lPoint = *iPoints[i];
+		lOffsets[i + 1] += lOffsets[i];
+	}
+	std::vector<uint32_t> lIncident(lOffsets[iSize]);
+	std::vector<uint32_t> lFill(lOffsets.begin(), lOffsets.end() - 1);
+	for (uint32_t e = 0; e < iEdges.size(); e++)
+	{
+		lIncident[lFill[iEdges[e].mA]++] = e;
+		lIncident[lFill[iEdges[e].mB]++] = e;
+	}
 
-		lRadiusSearch.clear();
-		lTree.knn<7>(i, lRadiusSearch);
+	// ties are broken on the edge index so the order is strict and no cycle can form
+	auto lCheaper = [&iEdges](uint32_t iA, uint32_t iB)
+	{
+		return iB == NONE || iEdges[iA].mWeight < iEdges[iB].mWeight || (iEdges[iA].mWeight == iEdges[iB].mWeight && iA < iB);
+	};
 
-		glm::dmat3 lCovariance;
-		computeCovariance(iPoints, lRadiusSearch, lCovariance);
+	UnionFind lSets(iSize);
+	std::vector<uint32_t> lComponent(iSize);
+	std::vector<uint32_t> lBest(iSize);
+	std::vector<uint32_t> lCheapest(iSize);
 
-		glm::dvec3 lNormal;
-		glm::dmat3 lEigenVectors;
-		glm::dvec3 lEigenValues;
-		if (computeEigen(lCovariance, lEigenVectors, lEigenValues))
+	bool lMerged = true;
+	while (lMerged)
+	{
+		for (uint32_t i = 0; i < iSize; i++)
 		{
-			lEigenValues[0] = fabs(lEigenValues[0]);
-			lEigenValues[1] = fabs(lEigenValues[1]);
-			lEigenValues[2] = fabs(lEigenValues[2]);
+			lComponent[i] = lSets.find(i);
+		}
 
-			int lMinimum = 0;
-			for (int m=1; m<3; m++)
+		auto lSearch = [&](uint32_t iBegin, uint32_t iEnd)
+		{
+			for (uint32_t i = iBegin; i < iEnd; i++)
 			{
-				if (lEigenValues[m] < lEigenValues[lMinimum])
+				uint32_t lEdge = NONE;
+				for (uint32_t a = lOffsets[i]; a < lOffsets[i + 1]; a++)
 				{
-					lMinimum = m;
+					uint32_t e = lIncident[a];
+					uint32_t lOther = iEdges[e].mA == i ? iEdges[e].mB : iEdges[e].mA;
+					if (lComponent[lOther] != lComponent[i] && lCheaper(e, lEdge))
+					{
+						lEdge = e;
+					}
 				}
+				lBest[i] = lEdge;
 			}
+		};
 
-			lNormal[0] = lEigenVectors[0][lMinimum];
-			lNormal[1] = lEigenVectors[1][lMinimum];
-			lNormal[2] = lEigenVectors[2][lMinimum];
+		if (iThreads > 1)
+		{
+			boost::thread_group lGroup;
+			uint32_t lChunk = (iSize + iThreads - 1) / iThreads;
+			for (uint32_t t = 0; t < iThreads; t++)
+			{
+				uint32_t lBegin = std::min(iSize, t * lChunk);
+				uint32_t lEnd = std::min(iSize, lBegin + lChunk);
+				lGroup.add_thread(new boost::thread(lSearch, lBegin, lEnd));
+			}
+			lGroup.join_all();
 		}
 		else
 		{
-			lPoint.set(Point::DELETED);
+			lSearch(0, iSize);
+		}
+
+		std::fill(lCheapest.begin(), lCheapest.end(), NONE);
+		for (uint32_t i = 0; i < iSize; i++)
+		{
+			if (lBest[i] != NONE && lCheaper(lBest[i], lCheapest[lComponent[i]]))
+			{
+				lCheapest[lComponent[i]] = lBest[i];
+			}
+		}
+
+		lMerged = false;
+		for (uint32_t i = 0; i < iSize; i++)
+		{
+			uint32_t e = lCheapest[i];
+			if (e != NONE && lSets.unite(iEdges[e].mA, iEdges[e].mB))
+			{
+				iTree.push_back(e);
+				lMerged = true;
+			}
+		}
+	}
+}
+
+void NormalProcessor::completeTraveral(PointCloudAttributes& iAttributes)
+{
+	std::vector<bool> lFlip(mComponents.size(), false);
+	fixup(lFlip);
+
+	for (std::vector<Leaf>::iterator lIter = mLeaves.begin(); lIter != mLeaves.end(); lIter++)
+	{
+		std::remove((lIter->mNode->mPath + ".shr").c_str());
+	}
+
+	// rewrite the leaves that hold flipped components
+	boost::thread_group* lGroup = new boost::thread_group();
+	for (std::vector<Leaf>::iterator lIter = mLeaves.begin(); lIter != mLeaves.end(); lIter++)
+	{
+		bool lFlipped = false;
+		for (uint32_t c = 0; c < lIter->mCount && !lFlipped; c++)
+		{
+			lFlipped = lFlip[lIter->mBase + c];
+		}
+
+		std::string lName = lIter->mNode->mPath + ".cmp";
+		if (!lFlipped)
+		{
+			std::remove(lName.c_str());
+			continue;
+		}
+
+		if (lGroup->size() == std::thread::hardware_concurrency())
+		{
+			lGroup->join_all();
+			delete lGroup;
+			lGroup = new boost::thread_group();
+		}
+		lGroup->add_thread(new boost::thread([this, &lFlip, lIter]()
+		{
+			PointCloud lCloud;
+			lCloud.readFile(lIter->mNode->mPath);
+			uint32_t lNormalIndex = lCloud.getAttributeIndex(Attribute::NORMAL);
+
+			// the leaf keeps its normals when its components are lost
+			std::vector<uint32_t> lComponent(lCloud.size());
+			if (!readComponents(*lIter->mNode, lComponent))
+			{
+				return;
+			}
+
+			for (uint32_t i = 0; i < lCloud.size(); i++)
+			{
+				if (lFlip[lIter->mBase + lComponent[i]])
+				{
+					float lNormal[3];
+					getNormal(lCloud[i]->getAttribute(lNormalIndex), lNormal);
+					lNormal[0] = -lNormal[0];
+					lNormal[1] = -lNormal[1];
+					lNormal[2] = -lNormal[2];
+					setNormal(lCloud[i]->getAttribute(lNormalIndex), lNormal);
+				}
+			}
+
+			lCloud.writeFile(lIter->mNode->mPath);
+		}));
+	}
+	lGroup->join_all();
+	delete lGroup;
+
+	mLeaves.clear();
+	mComponents.clear();
+
+	InorderOperation::completeTraveral(iAttributes);
+}
+
+void NormalProcessor::writeComponents(KdFileTreeNode& iNode, std::vector<uint32_t>& iComponent)
+{
+	std::string lName = iNode.mPath + ".cmp";
+	FILE* lFile = fopen(lName.c_str(), "wb");
+	if (lFile == NULL)
+	{
+		BOOST_LOG_TRIVIAL(error) << "Could not write " << lName;
+		return;
+	}
+	size_t lWritten = fwrite(iComponent.data(), sizeof(uint32_t), iComponent.size(), lFile);
+	fclose(lFile);
+	if (lWritten != iComponent.size())
+	{
+		BOOST_LOG_TRIVIAL(error) << "Could not write " << lName;
+		std::remove(lName.c_str());
+	}
+}
+
+bool NormalProcessor::readComponents(KdFileTreeNode& iNode, std::vector<uint32_t>& iComponent)
+{
+	std::string lName = iNode.mPath + ".cmp";
+	FILE* lFile = fopen(lName.c_str(), "rb");
+	if (lFile == NULL)
+	{
+		BOOST_LOG_TRIVIAL(error) << "Could not read " << lName;
+		return false;
+	}
+	size_t lRead = fread(iComponent.data(), sizeof(uint32_t), iComponent.size(), lFile);
+	fclose(lFile);
+	std::remove(lName.c_str());
+	if (lRead != iComponent.size())
+	{
+		BOOST_LOG_TRIVIAL(error) << "Could not read " << lName;
+		return false;
+	}
+	return true;
+}
+
+void NormalProcessor::writeShared(KdFileTreeNode& iNode, std::vector<Shared>& iShared)
+{
+	std::string lName = iNode.mPath + ".shr";
+	FILE* lFile = fopen(lName.c_str(), "wb");
+	if (lFile == NULL)
+	{
+		BOOST_LOG_TRIVIAL(error) << "Could not write " << lName;
+		return;
+	}
+	size_t lWritten = fwrite(iShared.data(), sizeof(Shared), iShared.size(), lFile);
+	fclose(lFile);
+	if (lWritten != iShared.size())
+	{
+		BOOST_LOG_TRIVIAL(error) << "Could not write " << lName;
+		std::remove(lName.c_str());
+	}
+}
+
+bool NormalProcessor::readShared(KdFileTreeNode& iNode, std::vector<Shared>& iShared)
+{
+	std::string lName = iNode.mPath + ".shr";
+	FILE* lFile = fopen(lName.c_str(), "rb");
+	if (lFile == NULL)
+	{
+		BOOST_LOG_TRIVIAL(error) << "Could not read " << lName;
+		return false;
+	}
+	fseek(lFile, 0, SEEK_END);
+	long lSize = ftell(lFile);
+	fseek(lFile, 0, SEEK_SET);
+	iShared.resize(std::max(0L, lSize) / sizeof(Shared));
+	size_t lRead = iShared.size() ? fread(iShared.data(), sizeof(Shared), iShared.size(), lFile) : 0;
+	fclose(lFile);
+	if (lSize < 0 || lRead != iShared.size())
+	{
+		BOOST_LOG_TRIVIAL(error) << "Could not read " << lName;
+		iShared.clear();
+		return false;
+	}
+	return true;
+}
+
+// both lists are sorted by position, every pair of points at the same position votes
+void NormalProcessor::compare(std::vector<Shared>& iA, std::vector<Shared>& iB, std::unordered_map<uint64_t, float>& iVotes)
+{
+	size_t a = 0;
+	size_t b = 0;
+	while (a < iA.size() && b < iB.size())
+	{
+		int lOrder = memcmp(iA[a].mPosition, iB[b].mPosition, sizeof(iA[a].mPosition));
+		if (lOrder < 0)
+		{
+			a++;
+			continue;
+		}
+		if (lOrder > 0)
+		{
+			b++;
+			continue;
 		}
 
-		lNormal = glm::normalize(lNormal);
-		
-		#if defined PACKED_NORMAL
+		size_t lEndA = a + 1;
+		while (lEndA < iA.size() && !memcmp(iA[a].mPosition, iA[lEndA].mPosition, sizeof(iA[a].mPosition)))
+		{
+			lEndA++;
+		}
+		size_t lEndB = b + 1;
+		while (lEndB < iB.size() && !memcmp(iB[b].mPosition, iB[lEndB].mPosition, sizeof(iB[b].mPosition)))
+		{
+			lEndB++;
+		}
 
-			PackedNormalType& lNormalAttribute = *(PackedNormalType*)lPoint.getAttribute(iNormalIndex);
+		for (size_t i = a; i < lEndA; i++)
+		{
+			for (size_t j = b; j < lEndB; j++)
+			{
+				uint32_t lA = std::min(iA[i].mComponent, iB[j].mComponent);
+				uint32_t lB = std::max(iA[i].mComponent, iB[j].mComponent);
+				float lDot = hoppe(iA[i].mNormal, iB[j].mNormal);
+				if (lA != lB && lDot != 0)
+				{
+					iVotes[((uint64_t)lA << 32) | lB] += lDot > 0 ? 1.0f : -1.0f;
+				}
+			}
+		}
+		a = lEndA;
+		b = lEndB;
+	}
+}
 
-			Vec3IntPacked& lPacked = lNormalAttribute.mValue;
-			lPacked.i32f3.x = floor(lNormal[0]*511);
-			lPacked.i32f3.y = floor(lNormal[1]*511);
-			lPacked.i32f3.z = floor(lNormal[2]*511);
-			lPacked.i32f3.a = 0;
+//
+// Components of different leaves that share points vote on whether they agree. The strongest 
+// votes are applied first, each set of joined components then follows the side most of its
+// evidence is on.
+//
 
-		#else
+void NormalProcessor::fixup(std::vector<bool>& iFlip)
+{
+	// only leaves whose boxes touch once grown by the overlap can hold the same points, two of them are read at a time
+	auto lTouch = [this](KdFileTreeNode& iA, KdFileTreeNode& iB)
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			if (iA.min[a] - mOverlap > iB.max[a] + mOverlap || iB.min[a] - mOverlap > iA.max[a] + mOverlap)
+			{
+				return false;
+			}
+		}
+		return true;
+	};
 
-			NormalType& lNormalAttribute = *(NormalType*)lPoint.getAttribute(iNormalIndex);
-			lNormalAttribute.mValue[0] = lNormal[0];
-			lNormalAttribute.mValue[1] = lNormal[1];
-			lNormalAttribute.mValue[2] = lNormal[2];
+	std::unordered_map<uint64_t, float> lVotes;
+	std::vector<Shared> lA;
+	std::vector<Shared> lB;
+	for (size_t i = 0; i < mLeaves.size(); i++)
+	{
+		if (!readShared(*mLeaves[i].mNode, lA) || lA.empty())
+		{
+			continue;
+		}
+		for (size_t j = i + 1; j < mLeaves.size(); j++)
+		{
+			if (lTouch(*mLeaves[i].mNode, *mLeaves[j].mNode) && readShared(*mLeaves[j].mNode, lB))
+			{
+				compare(lA, lB, lVotes);
+			}
+		}
+	}
+	std::vector<Shared>().swap(lA);
+	std::vector<Shared>().swap(lB);
 
-		#endif
+	std::vector<std::pair<uint64_t, float>> lOrder(lVotes.begin(), lVotes.end());
+	std::sort(lOrder.begin(), lOrder.end(), [](const std::pair<uint64_t, float>& iA, const std::pair<uint64_t, float>& iB)
+	{
+		return fabs(iA.second) > fabs(iB.second) || (fabs(iA.second) == fabs(iB.second) && iA.first < iB.first);
+	});
+
+	// union find that keeps the parity of every component relative to its root
+	std::vector<uint32_t> lParent(mComponents.size());
+	std::vector<uint8_t> lParity(mComponents.size(), 0);
+	std::vector<uint32_t> lSize(mComponents.size(), 1);
+	for (uint32_t c = 0; c < lParent.size(); c++)
+	{
+		lParent[c] = c;
 	}
+	auto lFind = [&](uint32_t c, uint8_t& iParity)
+	{
+		iParity = 0;
+		while (lParent[c] != c)
+		{
+			iParity ^= lParity[c];
+			c = lParent[c];
+		}
+		return c;
+	};
+
+	for (std::vector<std::pair<uint64_t, float>>::iterator lIter = lOrder.begin(); lIter != lOrder.end(); lIter++)
+	{
+		uint8_t lParityA, lParityB;
+		uint32_t lA = lFind(lIter->first >> 32, lParityA);
+		uint32_t lB = lFind(lIter->first & 0xffffffff, lParityB);
+		if (lA != lB && lIter->second != 0)
+		{
+			if (lSize[lA] < lSize[lB])
+			{
+				std::swap(lA, lB);
+			}
+			lParent[lB] = lA;
+			lParity[lB] = lParityA ^ lParityB ^ (lIter->second < 0 ? 1 : 0);
+			lSize[lA] += lSize[lB];
+		}
+	}
+
+	// every component votes for the side it was given with the weight of its evidence
+	std::vector<float> lEvidence(mComponents.size(), 0);
+	std::vector<float> lPoints(mComponents.size(), 0);
+	std::vector<uint8_t> lRelative(mComponents.size());
+	std::vector<uint32_t> lRoot(mComponents.size());
+	for (uint32_t c = 0; c < mComponents.size(); c++)
+	{
+		lRoot[c] = lFind(c, lRelative[c]);
+		lEvidence[lRoot[c]] += lRelative[c] ? -mComponents[c].mEvidence : mComponents[c].mEvidence;
+		lPoints[lRoot[c]] += lRelative[c] ? -(float)mComponents[c].mSize : (float)mComponents[c].mSize;
+	}
+
+	uint32_t lFlipped = 0;
+	for (uint32_t c = 0; c < mComponents.size(); c++)
+	{
+		uint32_t r = lRoot[c];
+		bool lRootFlipped = lEvidence[r] < 0 || (lEvidence[r] == 0 && lPoints[r] < 0);
+		iFlip[c] = (lRelative[c] != 0) != lRootFlipped;
+		lFlipped += iFlip[c];
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "Oriented " << mComponents.size() << " components in " << mLeaves.size() << " leaves, " << lFlipped << " flipped to agree across leaves";
 }
 
 void NormalProcessor::computeCovariance(PointCloud& iCloud, std::vector<std::pair<uint32_t, float>>& iIndex, glm::dmat3& iMatrix)
@@ -1,69 +1,136 @@
 #pragma once
 
+#include <atomic>
+#include <unordered_map>
+
 #include "../kdFileTree.h"
 
+//
+// Computes and orients the normals of every leaf. Normals are propagated along a minimum spanning
+// tree of the knn graph, one connected component at a time. The sign of a component is taken from
+// normals the importer derived from a scan grid, from the scanner positions or, lacking both, by
+// pointing most of its normals up. Leaves are oriented independently and then made consistent with
+// each other using the points they share in their overlap.
+//
+
 class NormalProcessor : public KdFileTree::InorderOperation
 {
 	public:
 
-		NormalProcessor();
+		static const int K = 8;
+
+		NormalProcessor(float iOverlap, std::vector<glm::dvec3>& iScanners);
 
-		static void computeNormals(PointCloud& iPoints, uint32_t iNormalIndex);
 		void initTraveral(PointCloudAttributes& iAttributes);
+		void completeTraveral(PointCloudAttributes& iAttributes);
+
+		void processNode(KdFileTreeNode& iNode, PointCloud& iCloud);
 
 	protected:
 
-		uint8_t mInstruction;
-	
-		static void computeCovariance(PointCloud& iCloud, std::vector<std::pair<uint32_t, float>>& iIndex, glm::dmat3& iMatrix);
-		static bool computeEigen(glm::dmat3& iMatrix, glm::dmat3& iVectors, glm::dvec3& iValues, unsigned maxIterationCount = 50);
+		float mOverlap;
+		std::vector<glm::dvec3> mScanners;
+		bool mNormals;
+		std::atomic<uint32_t> mActive;
 
-		struct EdgeComparator
+		struct Edge
 		{
-			std::map<std::pair<uint32_t,uint32_t>, float>& mWeights;
+			uint32_t mA;
+			uint32_t mB;
+			float mWeight;
+		};
 
-			EdgeComparator(std::map<std::pair<uint32_t,uint32_t>, float>& iWeights) 
-			: mWeights(iWeights) 
-			{ 
+		struct UnionFind
+		{
+			std::vector<uint32_t> mParent;
+			std::vector<uint8_t> mRank;
+
+			UnionFind(uint32_t iSize)
+			: mParent(iSize)
+			, mRank(iSize, 0)
+			{
+				for (uint32_t i = 0; i < iSize; i++)
+				{
+					mParent[i] = i;
+				}
 			}
 
-			bool operator()(std::pair<uint32_t,uint32_t>& a, std::pair<uint32_t,uint32_t>& b) const
+			uint32_t find(uint32_t i)
 			{
+				while (mParent[i] != i)
+				{
+					mParent[i] = mParent[mParent[i]];
+					i = mParent[i];
+				}
+				return i;
+			}
 
-				return mWeights[a] < mWeights[b];
+			bool unite(uint32_t iA, uint32_t iB)
+			{
+				iA = find(iA);
+				iB = find(iB);
+				if (iA == iB)
+				{
+					return false;
+				}
+				if (mRank[iA] < mRank[iB])
+				{
+					std::swap(iA, iB);
+				}
+				mParent[iB] = iA;
+				if (mRank[iA] == mRank[iB])
+				{
+					mRank[iA]++;
+				}
+				return true;
 			}
 		};
 
-		// Xie Criterion
-		inline float xie(float* n1, float* n2, float* p1, float* p2)
+		// a component of one leaf and how sure its orientation is
+		struct Component
 		{
-			float e[3];
-			e[0] = p1[0]-p2[0];
-			e[1] = p1[1]-p2[1];
-			e[2] = p1[2]-p2[2];
-
-			float el = sqrt(e[0]*e[0]+e[1]*e[1]+e[2]*e[2]);
-			e[0]/=el;
-			e[1]/=el;
-			e[2]/=el; 
-
-			float dot = e[0]*n1[0] + e[1]*n1[1] + e[2]*n1[2];
-			
-			float n[3];
-			n[0] = n1[0] - 2*dot*e[0];
-			n[1] = n1[1] - 2*dot*e[1];
-			n[2] = n1[2] - 2*dot*e[2];
-
-			return n[0]*n2[0] + n[1]*n2[1] + n[2]*n2[2];
-		}
+			float mEvidence;
+			uint32_t mSize;
+		};
+
+		// point of a leaf that other leaves may hold as well
+		struct Shared
+		{
+			float mPosition[3];
+			uint32_t mComponent;
+			float mNormal[3];
+		};
 
-		inline float hoppe(float* n1, float* n2, float* p1, float* p2)
+		struct Leaf
+		{
+			KdFileTreeNode* mNode;
+			uint32_t mBase;
+			uint32_t mCount;
+		};
+
+		boost::mutex mLock;
+		std::vector<Component> mComponents;
+		std::vector<Leaf> mLeaves;
+
+		static void computeCovariance(PointCloud& iCloud, std::vector<std::pair<uint32_t, float>>& iIndex, glm::dmat3& iMatrix);
+		static bool computeEigen(glm::dmat3& iMatrix, glm::dmat3& iVectors, glm::dvec3& iValues, unsigned maxIterationCount = 50);
+
+		static void spanningTree(uint32_t iSize, std::vector<Edge>& iEdges, std::vector<uint32_t>& iTree, uint32_t iThreads);
+
+		inline float hoppe(float* n1, float* n2)
 		{
 			return n1[0]*n2[0] + n1[1]*n2[1] + n1[2]*n2[2];
 		}
-	
 
+		float vote(glm::vec3* iNormals, int8_t* iSign, std::vector<uint32_t>& iMembers, std::vector<bool>& iSeed, PointCloud& iCloud);
+		void fixup(std::vector<bool>& iFlip);
+
+		// the shared points of a leaf sorted by position, kept on disk until the leaves are compared in pairs
+		void writeShared(KdFileTreeNode& iNode, std::vector<Shared>& iShared);
+		bool readShared(KdFileTreeNode& iNode, std::vector<Shared>& iShared);
+		void compare(std::vector<Shared>& iA, std::vector<Shared>& iB, std::unordered_map<uint64_t, float>& iVotes);
 
-		void processLeaf(KdFileTreeNode& iNode, PointCloud& iCloud);
-		void processInternal(KdFileTreeNode& iNode, PointCloud& iCloud);
+		// the component of every point of a leaf, read back if one of them is flipped
+		void writeComponents(KdFileTreeNode& iNode, std::vector<uint32_t>& iComponent);
+		bool readComponents(KdFileTreeNode& iNode, std::vector<uint32_t>& iComponent);
 };
@@ -31,6 +31,7 @@ PacketProcessor::PacketProcessor()
 : InorderOperation("Packetizer")
 , mTotalStorage(0)
 , mTotalWritten(0)
+, mNormals(false)
 {
 }
 
@@ -43,6 +44,8 @@ void PacketProcessor::initTraveral(PointCloudAttributes& iAttributes)
 		boost::filesystem::create_directory("./root");
 	}
 
+	mNormals = iAttributes.getAttributeIndex(Attribute::NORMAL) != -1;
+
 #if defined PACKED_NORMAL
 	PackedNormalType lAttribute;
 #else
@@ -52,8 +55,30 @@ void PacketProcessor::initTraveral(PointCloudAttributes& iAttributes)
 	iAttributes.createAttribute(Attribute::NORMAL, lAttribute);
 }
 
-void PacketProcessor::computeNormals(PointCloud& iPoints, uint32_t iNormalIndex)
+static inline bool hasNormal(Attribute* iAttribute)
 {
+	float lNormal[3];
+	getNormal(iAttribute, lNormal);
+	return lNormal[0] != 0 || lNormal[1] != 0 || lNormal[2] != 0;
+}
+
+void PacketProcessor::computeNormals(PointCloud& iPoints, uint32_t iNormalIndex, bool iMissing)
+{
+	std::vector<uint32_t> lMissing;
+	lMissing.reserve(iPoints.size());
+	for (uint32_t i = 0; i < iPoints.size(); i++)
+	{
+		if (!iMissing || !hasNormal(iPoints[i]->getAttribute(iNormalIndex)))
+		{
+			lMissing.push_back(i);
+		}
+	}
+
+	if (lMissing.empty())
+	{
+		return;
+	}
+
 	KdTree<KdSpatialDomain> lTree(iPoints, 100);
 	lTree.construct();
 
@@ -61,8 +86,9 @@ void PacketProcessor::computeNormals(PointCloud& iPoints, uint32_t iNormalIndex)
 	// compute normals
 	//
 	std::vector<std::pair<uint32_t, float>> lRadiusSearch;
-	for (size_t i = 0; i < iPoints.size(); i++)
+	for (std::vector<uint32_t>::iterator lIter = lMissing.begin(); lIter != lMissing.end(); lIter++)
 	{
+		uint32_t i = *lIter;
 		Point& lPoint = *iPoints[i];
 
 		lRadiusSearch.clear();
@@ -100,24 +126,9 @@ void PacketProcessor::computeNormals(PointCloud& iPoints, uint32_t iNormalIndex)
 
 		lNormal = glm::normalize(lNormal);
 
-#if defined PACKED_NORMAL
-
-		PackedNormalType& lNormalAttribute = *(PackedNormalType*)lPoint.getAttribute(iNormalIndex);
-
-		Vec3IntPacked& lPacked = lNormalAttribute.mValue;
-		lPacked.i32f3.x = floor(lNormal[0] * 511);
-		lPacked.i32f3.y = floor(lNormal[1] * 511);
-		lPacked.i32f3.z = floor(lNormal[2] * 511);
-		lPacked.i32f3.a = 0;
-
-#else
-
-		NormalType& lNormalAttribute = *(NormalType*)lPoint.getAttribute(iNormalIndex);
-		lNormalAttribute.mValue[0] = lNormal[0];
-		lNormalAttribute.mValue[1] = lNormal[1];
-		lNormalAttribute.mValue[2] = lNormal[2];
-
-#endif
+		// the input may already carry float normals
+		float lValue[3] = { (float)lNormal[0], (float)lNormal[1], (float)lNormal[2] };
+		setNormal(lPoint.getAttribute(iNormalIndex), lValue);
 	}
 }
 
@@ -264,7 +275,7 @@ bool PacketProcessor::computeEigen(glm::dmat3& iMatrix, glm::dmat3& iVectors, gl
 
 void PacketProcessor::processNode(KdFileTreeNode& iNode, PointCloud& iCloud)
 {
-	computeNormals(iCloud, iCloud.getAttributeIndex(Attribute::NORMAL));
+	computeNormals(iCloud, iCloud.getAttributeIndex(Attribute::NORMAL), mNormals);
 
 	//
 	// compute tight AABB
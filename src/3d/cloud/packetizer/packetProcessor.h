@@ -24,10 +24,13 @@ class PacketProcessor : public KdFileTree::InorderOperation
 		uint64_t mTotalStorage;
 		uint64_t mTotalWritten;
 
+		// normals came with the input, only fill in the missing ones
+		bool mNormals;
+
 		void initTraveral(PointCloudAttributes& iAttributes);
 
 		// Normal Calculation
-		static void computeNormals(PointCloud& iPoints, uint32_t iNormalIndex);
+		static void computeNormals(PointCloud& iPoints, uint32_t iNormalIndex, bool iMissing = false);
 		static void computeCovariance(PointCloud& iCloud, std::vector<std::pair<uint32_t, float>>& iIndex, glm::dmat3& iMatrix);
 		static bool computeEigen(glm::dmat3& iMatrix, glm::dmat3& iVectors, glm::dvec3& iValues, unsigned maxIterationCount = 50);
 
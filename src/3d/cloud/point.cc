@@ -70,6 +70,44 @@ ColorType COLOR_TEMPLATE;
 ClassType CLASS_TEMPLATE;
 NormalType NORMAL_TEMPLATE;
 
+void getNormal(Attribute* iAttribute, float* iNormal)
+{
+	if (PackedNormalType* lPacked = dynamic_cast<PackedNormalType*>(iAttribute))
+	{
+		iNormal[0] = lPacked->mValue.i32f3.x / 511.0f;
+		iNormal[1] = lPacked->mValue.i32f3.y / 511.0f;
+		iNormal[2] = lPacked->mValue.i32f3.z / 511.0f;
+	}
+	else
+	{
+		memcpy(iNormal, ((NormalType*)iAttribute)->mValue, 3 * sizeof(float));
+	}
+}
+
+void setNormal(Attribute* iAttribute, float* iNormal)
+{
+	float lLength = sqrt(iNormal[0] * iNormal[0] + iNormal[1] * iNormal[1] + iNormal[2] * iNormal[2]);
+	float lNormal[3] = { 0, 0, 0 };
+	if (lLength > 0)
+	{
+		lNormal[0] = iNormal[0] / lLength;
+		lNormal[1] = iNormal[1] / lLength;
+		lNormal[2] = iNormal[2] / lLength;
+	}
+
+	if (PackedNormalType* lPacked = dynamic_cast<PackedNormalType*>(iAttribute))
+	{
+		lPacked->mValue.i32f3.x = floor(lNormal[0] * 511);
+		lPacked->mValue.i32f3.y = floor(lNormal[1] * 511);
+		lPacked->mValue.i32f3.z = floor(lNormal[2] * 511);
+		lPacked->mValue.i32f3.a = 0;
+	}
+	else
+	{
+		memcpy(((NormalType*)iAttribute)->mValue, lNormal, sizeof(lNormal));
+	}
+}
+
 Point::Point()
 : mWeight(0)
 , mMask(0)
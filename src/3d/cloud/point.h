@@ -28,6 +28,7 @@ class Attribute
 		virtual void write(FILE* iFile) = 0;	
 		virtual void read(FILE* iFile) = 0;
 		virtual uint8_t map(uint8_t* iPointer) = 0;
+		virtual uint8_t store(uint8_t* iPointer) = 0;
 
 		virtual void toJson(json_spirit::mObject& iObject) = 0;
 		
@@ -60,6 +61,11 @@ template <class T> class SingleAttribute : public Attribute
 			memcpy(&mValue, iPointer, sizeof(mValue)); 
 			return sizeof(mValue);
 		};
+		uint8_t store(uint8_t* iPointer)
+		{
+			memcpy(iPointer, &mValue, sizeof(mValue));
+			return sizeof(mValue);
+		};
 		
  		static const char * cTypeName;
 		void toJson(json_spirit::mObject& iObject)
@@ -130,6 +136,11 @@ template <class T, int N> class ArrayAttribute : public Attribute
 			memcpy(mValue, iPointer, sizeof(mValue)); 
 			return sizeof(mValue);
 		};
+		uint8_t store(uint8_t* iPointer)
+		{
+			memcpy(iPointer, mValue, sizeof(mValue));
+			return sizeof(mValue);
+		};
 	
  		void toJson(json_spirit::mObject& iObject)
 		{
@@ -168,6 +179,10 @@ extern ColorType COLOR_TEMPLATE;
 extern ClassType CLASS_TEMPLATE;
 extern IntensityType INTENSITY_TEMPLATE;
 
+// normals are stored either as floats or packed into 10 bits per axis, a zero normal is a missing one
+void getNormal(Attribute* iAttribute, float* iNormal);
+void setNormal(Attribute* iAttribute, float* iNormal);
+
 
 
 
@@ -48,6 +48,7 @@ PointBuffer::Chunk& PointBuffer::next()
 	if (mCurrent != mIter) 
 	{
 		mChunk.mSize = fread(mChunk.mData, mStride, POINTS_PER_IO, mFile);
+		mChunk.mFirst = mIter*POINTS_PER_IO;
 		BOOST_LOG_TRIVIAL(info) << "fread " << mChunk.mSize;
 		mCurrent = mIter;
 	}
@@ -27,6 +27,7 @@ class PointBuffer
 		{
 			uint8_t* mData;
 			size_t mSize;
+			size_t mFirst; // index of the first point in the file
 		} Chunk;
 
 		void begin();
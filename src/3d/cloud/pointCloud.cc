@@ -1,4 +1,5 @@
 #include <inttypes.h> 
+#include <cstddef>
 
 #include <boost/log/core.hpp>
 #include <boost/log/trivial.hpp>
@@ -7,6 +8,32 @@
 #include "json_spirit/json_spirit_writer_template.h"
 
 #include "pointCloud.h"
+#include "pointCodec.h"
+
+static const char MAGIC[4] = { 'V', 'X', 'P', 'C' };
+static const uint32_t VERSION = 1;
+
+// fields are little endian like the points, the attribute schema follows as json
+struct CloudHeader
+{
+	char mMagic[4];
+	uint32_t mVersion;
+	uint64_t mSize;
+	float mMin[3];
+	float mMax[3];
+	float mResolution;
+	uint32_t mStride;
+	uint64_t mBlocks;
+	uint32_t mSchema;
+	uint32_t mCodec;
+};
+
+struct CloudBlock
+{
+	uint64_t mCount;
+	float mMin[3];
+	float mMax[3];
+};
 
 //
 // Attribute API
@@ -106,41 +133,6 @@ int PointCloudAttributes::createAttribute(const std::string& iName, Attribute& i
 }
 
 
-void PointCloudAttributes::readHeader(char* iName)
-{
-	if (!strcmp(iName, "nx") || !strcmp(iName, "ny")|| !strcmp(iName, "nz"))
-	{
-		NormalType lAttribute;
-		createAttribute(Attribute::NORMAL, lAttribute);
-	}
-	else if (!strcmp(iName, "np"))
-	{
-		PackedNormalType lAttribute;
-		createAttribute(Attribute::NORMAL, lAttribute);
-	}
-	else if (!strcmp(iName, "red") || !strcmp(iName, "green") || !strcmp(iName, "blue"))
-	{
-		ColorType lAttribute;
-		createAttribute(Attribute::COLOR, lAttribute);
-	}
-	else if (!strcmp(iName, "r") || !strcmp(iName, "g") || !strcmp(iName, "b"))
-	{
-		ColorType lAttribute;
-		createAttribute(Attribute::COLOR, lAttribute);
-	}
-	else if (!strcmp(iName, "class"))	
-	{
-		ClassType lAttribute;
-		createAttribute(Attribute::CLASS, lAttribute);
-	}
-	else if (!strcmp(iName, "intensity"))
-	{
-		IntensityType lAttribute;
-		createAttribute(Attribute::INTENSITY, lAttribute);
-	}
-}
-
-
 void PointCloudAttributes::writeHeader(FILE* iFile)
 {
 	for (size_t i=0; i<mList.size(); i++)
@@ -285,6 +277,17 @@ int PointCloudAttributes::getAttributeIndex(const std::string& iName)
 };
 
 
+// decoding runs below the speed of a fast disk, so coding is only worth it on slow storage
+bool PointCloud::sCompress = false;
+
+void PointCloud::configure(json_spirit::mObject& iConfig)
+{
+	if (iConfig.find("compress") != iConfig.end() && !iConfig["compress"].is_null())
+	{
+		sCompress = iConfig["compress"].get_bool();
+	}
+}
+
 float PointCloud::MIN[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
 float PointCloud::MAX[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
 
@@ -343,100 +346,82 @@ Attribute* PointCloud::getAttribute(Point& iPoint, const std::string& iName)
 // Reading
 //
 
+std::string PointCloud::fileName(std::string iName)
+{
+	return iName + ".vxc";
+}
+
 uint64_t PointCloud::readPointCount(std::string iName)
 {
 	uint64_t lPointCount;
 	FILE* lFile = readHeader(iName, 0, lPointCount);
-	fclose(lFile);
+	if (lFile)
+	{
+		fclose(lFile);
+	}
 	return lPointCount;
 };
 
 float PointCloud::readResolution(std::string iName)
 {
 	uint64_t lPointCount;
-	float lResolution;
+	float lResolution = 0;
 	FILE* lFile = readHeader(iName, 0, lPointCount, 0, 0, &lResolution);
-	fclose(lFile);
+	if (lFile)
+	{
+		fclose(lFile);
+	}
 	return lResolution;
 };
 
 FILE* PointCloud::readHeader(std::string iName, PointCloudAttributes* iAttributes, uint64_t& iSize, float* iMin, float* iMax, float* iResolution)
 {
-	std::string lName = iName + ".ply";
-	FILE* lFile = fopen(lName.c_str(), "rb");
-	char lLine[1024];
+	FILE* lFile = fopen(fileName(iName).c_str(), "rb");
 
-	while (fgets(lLine, 1024, lFile))
+	CloudHeader lHeader;
+	iSize = 0;
+	if (!lFile || fread(&lHeader, sizeof(lHeader), 1, lFile) != 1 || memcmp(lHeader.mMagic, MAGIC, sizeof(lHeader.mMagic)))
 	{
-		char lBuffer[5][64];
-		sscanf(lLine, "%s %s %s %s %s", (char*)&lBuffer[0], (char*)&lBuffer[1], (char*)&lBuffer[2], (char*)&lBuffer[3], (char*)&lBuffer[4]);
-		if (!strcmp(lBuffer[0], "property"))
-		{
-			if (iAttributes)
-			{
-				iAttributes->readHeader(lBuffer[2]);
-			}
-		}
-		else if (!strcmp(lBuffer[0], "comment"))
-		{
-			if (!strcmp(lBuffer[1], "minx"))
-			{
-				if (iMin)
-				{
-					sscanf(lBuffer[2], "%f", &iMin[0]);
-				}
-			}
-			else if (!strcmp(lBuffer[1], "miny"))
-			{
-				if (iMin)
-				{
-					sscanf(lBuffer[2], "%f", &iMin[1]);
-				}
-			}
-			else if (!strcmp(lBuffer[1], "minz"))
-			{
-				if (iMin)
-				{
-					sscanf(lBuffer[2], "%f", &iMin[2]);
-				}
-			}
-			else if (!strcmp(lBuffer[1], "maxx"))
-			{
-				if (iMax)
-				{
-					sscanf(lBuffer[2], "%f", &iMax[0]);
-				}
-			}
-			else if (!strcmp(lBuffer[1], "maxy"))
-			{
-				if (iMax)
-				{
-					sscanf(lBuffer[2], "%f", &iMax[1]);
-				}
-			}
-			else if (!strcmp(lBuffer[1], "maxz"))
-			{
-				if (iMax)
-				{
-					sscanf(lBuffer[2], "%f", &iMax[2]);
-				}
-			}
-			else if (!strcmp(lBuffer[1], "resolution"))
-			{
-				if (iResolution)
-				{
-					sscanf(lBuffer[2], "%f", iResolution);
-				}
-			}
-		}
-		else if (!strcmp(lBuffer[0], "element"))
+		BOOST_LOG_TRIVIAL(error) << fileName(iName) << " is not a point cloud";
+		if (lFile)
 		{
-			std::sscanf(lBuffer[2], "%" SCNu64, &iSize);
+			fclose(lFile);
 		}
-		else if (!strncmp(lLine, "end_header", 10))
+		return NULL;
+	}
+
+	if (iMin)
+	{
+		memcpy(iMin, lHeader.mMin, sizeof(lHeader.mMin));
+	}
+	if (iMax)
+	{
+		memcpy(iMax, lHeader.mMax, sizeof(lHeader.mMax));
+	}
+	if (iResolution)
+	{
+		*iResolution = lHeader.mResolution;
+	}
+	if (iAttributes)
+	{
+		std::string lSchema(lHeader.mSchema, '\0');
+		if (lSchema.size() && fread(&lSchema[0], 1, lSchema.size(), lFile) != lSchema.size())
 		{
-			break;
+			BOOST_LOG_TRIVIAL(error) << "Could not read the attributes of " << fileName(iName);
+			fclose(lFile);
+			return NULL;
 		}
+
+		json_spirit::mValue lValue;
+		json_spirit::read_string(lSchema, lValue);
+		iAttributes->fromJson(lValue.get_array());
+	}
+
+	iSize = lHeader.mSize;
+	fseek(lFile, HEADER_SIZE, SEEK_SET);
+	if (lHeader.mCodec)
+	{
+		return PointCodec::openReader(lFile, HEADER_SIZE, lHeader.mStride, lHeader.mSize);
 	}
 	return lFile;
 }
@@ -447,6 +432,10 @@ void PointCloud::readFile(std::string& iName)
 	boost::posix_time::ptime t1 = boost::posix_time::second_clock::local_time();
 
 	FILE* lFile = readHeader(iName, this, mPointCount, mMinExtent, mMaxExtent, &mResolution);
+	if (!lFile)
+	{
+		return;
+	}
 
 	mPoints.reserve(mPointCount);
 	for (uint32_t i=0; i<mPointCount; i++)
@@ -486,102 +475,51 @@ void PointCloud::writeFile(std::string& iName)
 	fclose(lFile);
 }
 
-#define UPDATE_FIXED_LINE(format, value)\
-	{\
-		char lBuffer[100]; \
-		memset(lBuffer, ' ', sizeof(lBuffer));\
-		lBuffer[99] = '\n';\
-		sprintf(lBuffer, format, value);\
-		lBuffer[strlen(lBuffer)] = ' ';\
-		fseek(iFile, lLineStart, SEEK_SET);\
-		fwrite(lBuffer, sizeof(lBuffer), 1, iFile);\
-		fseek(iFile, lLineStart+100, SEEK_SET);\
-	}\
-
-#define CREATE_FIXED_LINE(format, value)\
-	{\
-		char lBuffer[100];\
-		memset(lBuffer, ' ', sizeof(lBuffer));\
-		lBuffer[99] = '\n';\
-		sprintf(lBuffer, format, value);\
-		lBuffer[strlen(lBuffer)] = ' ';\
-		fwrite(lBuffer, sizeof(lBuffer), 1, lFile);\
-	}\
-
-
 FILE* PointCloud::writeHeader(std::string iName, PointCloudAttributes& iAttributes, uint64_t iSize, float* iMin, float* iMax, float iResolution)
 {
-	std::string lName = iName + ".ply";
-	FILE* lFile = fopen(lName.c_str(), "wb+");
-
-	fprintf(lFile, "ply\nformat binary_little_endian 1.0\n");
-	if (iMin)
-	{
-		CREATE_FIXED_LINE("comment minx %f", iMin[0]);
-		CREATE_FIXED_LINE("comment miny %f", iMin[1]);
-		CREATE_FIXED_LINE("comment minz %f", iMin[2]);
-	}
-	else
-	{
-		CREATE_FIXED_LINE("comment minx %f", MIN[0]);
-		CREATE_FIXED_LINE("comment miny %f", MIN[1]);
-		CREATE_FIXED_LINE("comment minz %f", MIN[2]);
-	}
-	if (iMax)
-	{
-		CREATE_FIXED_LINE("comment maxx %f", iMax[0]);
-		CREATE_FIXED_LINE("comment maxy %f", iMax[1]);
-		CREATE_FIXED_LINE("comment maxz %f", iMax[2]);
-	}
-	else
+	FILE* lFile = fopen(fileName(iName).c_str(), "wb+");
+
+	json_spirit::mArray lArray;
+	iAttributes.toJson(lArray);
+	std::string lSchema = json_spirit::write_string(json_spirit::mValue(lArray));
+
+	CloudHeader lHeader;
+	memset(&lHeader, 0, sizeof(lHeader));
+	memcpy(lHeader.mMagic, MAGIC, sizeof(lHeader.mMagic));
+	lHeader.mVersion = VERSION;
+	lHeader.mSize = iSize;
+	memcpy(lHeader.mMin, iMin ? iMin : MIN, sizeof(lHeader.mMin));
+	memcpy(lHeader.mMax, iMax ? iMax : MAX, sizeof(lHeader.mMax));
+	lHeader.mResolution = iResolution;
+	lHeader.mStride = sizeof(float) * 3 + iAttributes.bytesPerPoint();
+	lHeader.mSchema = std::min<size_t>(lSchema.size(), HEADER_SIZE - sizeof(lHeader));
+	lHeader.mCodec = sCompress && PointCodec::available();
+
+	std::vector<uint8_t> lBuffer(HEADER_SIZE, 0);
+	memcpy(&lBuffer[0], &lHeader, sizeof(lHeader));
+	memcpy(&lBuffer[sizeof(lHeader)], lSchema.c_str(), lHeader.mSchema);
+	fwrite(&lBuffer[0], lBuffer.size(), 1, lFile);
+
+	if (lHeader.mCodec)
 	{
-		CREATE_FIXED_LINE("comment maxx %f", MAX[0]);
-		CREATE_FIXED_LINE("comment maxy %f", MAX[1]);
-		CREATE_FIXED_LINE("comment maxz %f", MAX[2]);
+		return PointCodec::openWriter(lFile, HEADER_SIZE, lHeader.mStride);
 	}
-
-	CREATE_FIXED_LINE("comment resolution %f", iResolution);
-
-	CREATE_FIXED_LINE("element vertex %lu", iSize);
-
-	fprintf(lFile, "property float x\n"
-				   "property float y\n"
-				   "property float z\n");
-
-	iAttributes.writeHeader(lFile);
-
-	fprintf(lFile, "end_header\n");
-
 	return lFile;
 }
 
-
-
 FILE* PointCloud::updateHeader(std::string iName)
 {
-	std::string lName = iName + ".ply";
-	FILE* lFile = fopen(lName.c_str(), "rb+");
-
-	return lFile;
+	return fopen(fileName(iName).c_str(), "rb+");
 }
 
-
-
 void PointCloud::updateSize(FILE* iFile, uint64_t iSize)
 {
-	fseek(iFile, 0, SEEK_SET);
-	char lLine[1024];
-    size_t lLength = 0;
-	uint32_t lLineStart = ftell(iFile);
-	while (fgets(lLine,1024,iFile)) 
-	{
-		if (!strncmp(lLine, "element vertex", 14))
-		{
-			UPDATE_FIXED_LINE("element vertex %lu", iSize);
-			break;
-		}
-		lLineStart = ftell(iFile);
-	}
+	// a block table no longer matches the points
+	uint64_t lBlocks = 0;
+	fseek(iFile, offsetof(CloudHeader, mSize), SEEK_SET);
+	fwrite(&iSize, sizeof(iSize), 1, iFile);
+	fseek(iFile, offsetof(CloudHeader, mBlocks), SEEK_SET);
+	fwrite(&lBlocks, sizeof(lBlocks), 1, iFile);
 }
 
 void PointCloud::updateSpatialBounds(FILE* iFile, double* iMin, double* iMax)
@@ -601,60 +539,157 @@ void PointCloud::updateSpatialBounds(FILE* iFile, double* iMin, double* iMax)
 
 void PointCloud::updateSpatialBounds(FILE* iFile, float* iMin, float* iMax)
 {
-	fseek(iFile, 0, SEEK_SET);
-	char lLine[1024];
-    size_t lLength = 0;
-	uint32_t lLineStart = ftell(iFile);
-	while (fgets(lLine,1024,iFile)) 
+	fseek(iFile, offsetof(CloudHeader, mMin), SEEK_SET);
+	fwrite(iMin, sizeof(float), 3, iFile);
+	fseek(iFile, offsetof(CloudHeader, mMax), SEEK_SET);
+	fwrite(iMax, sizeof(float), 3, iFile);
+};
+
+void PointCloud::updateResolution(FILE* iFile, float iResolution)
+{
+	fseek(iFile, offsetof(CloudHeader, mResolution), SEEK_SET);
+	fwrite(&iResolution, sizeof(iResolution), 1, iFile);
+}
+
+//
+// The block table follows the points, the offset, count and bounds of every block.
+//
+
+void PointCloud::updateBlocks(std::string iName)
+{
+	FILE* lFile = updateHeader(iName);
+	CloudHeader lHeader;
+	if (!lFile || fread(&lHeader, sizeof(lHeader), 1, lFile) != 1)
 	{
-		//std::cout << strlen(lLine) << ":" << ftell(iFile) << "--" << lLine << "\n";
-		
-		if (!strncmp(lLine, "comment minx", 12))
-		{
-			UPDATE_FIXED_LINE("comment minx %f", iMin[0]);
-		}
-		else if (!strncmp(lLine, "comment miny", 12))
-		{
-			UPDATE_FIXED_LINE("comment miny %f", iMin[1]);
-		}
-		else if (!strncmp(lLine, "comment minz", 12))
+		if (lFile)
 		{
-			UPDATE_FIXED_LINE("comment minz %f", iMin[2]);
+			fclose(lFile);
 		}
-		else if (!strncmp(lLine, "comment maxx", 12))
-		{
-			UPDATE_FIXED_LINE("comment maxx %f", iMax[0]);
-		}
-		else if (!strncmp(lLine, "comment maxy", 12))
+		return;
+	}
+
+	// the table follows the points, coded ones end with their last frame
+	uint64_t lTable = lHeader.mCodec ? PointCodec::end(lFile, HEADER_SIZE, lHeader.mSize) : HEADER_SIZE + lHeader.mSize * lHeader.mStride;
+
+	uint64_t lSize;
+	FILE* lInputFile = readHeader(iName, 0, lSize);
+	if (!lInputFile)
+	{
+		fclose(lFile);
+		return;
+	}
+
+	std::vector<CloudBlock> lEntries;
+	std::vector<uint8_t> lBuffer((size_t)BLOCK_SIZE * lHeader.mStride);
+	for (uint64_t lFirst = 0; lFirst < lHeader.mSize; lFirst += BLOCK_SIZE)
+	{
+		CloudBlock lEntry;
+		lEntry.mCount = std::min<uint64_t>(BLOCK_SIZE, lHeader.mSize - lFirst);
+		memcpy(lEntry.mMin, MIN, sizeof(MIN));
+		memcpy(lEntry.mMax, MAX, sizeof(MAX));
+		lEntry.mCount = fread(&lBuffer[0], lHeader.mStride, lEntry.mCount, lInputFile);
+
+		for (uint64_t i = 0; i < lEntry.mCount; i++)
 		{
-			UPDATE_FIXED_LINE("comment maxy %f", iMax[1]);
+			float lPosition[3];
+			memcpy(lPosition, &lBuffer[i * lHeader.mStride], sizeof(lPosition));
+			for (int k = 0; k < 3; k++)
+			{
+				lEntry.mMin[k] = std::min(lPosition[k], lEntry.mMin[k]);
+				lEntry.mMax[k] = std::max(lPosition[k], lEntry.mMax[k]);
+			}
 		}
-		else if (!strncmp(lLine, "comment maxz", 12))
+		lEntries.push_back(lEntry);
+	}
+	fclose(lInputFile);
+
+	fseek(lFile, lTable, SEEK_SET);
+	if (lEntries.size())
+	{
+		fwrite(&lEntries[0], sizeof(CloudBlock), lEntries.size(), lFile);
+	}
+	fseek(lFile, offsetof(CloudHeader, mBlocks), SEEK_SET);
+	fwrite(&lTable, sizeof(lTable), 1, lFile);
+	fclose(lFile);
+}
+
+bool PointCloud::readBlocks(std::string iName, std::vector<Block>& iBlocks)
+{
+	iBlocks.clear();
+
+	FILE* lFile = fopen(fileName(iName).c_str(), "rb");
+	CloudHeader lHeader;
+	if (!lFile || fread(&lHeader, sizeof(lHeader), 1, lFile) != 1 || !lHeader.mBlocks)
+	{
+		if (lFile)
 		{
-			UPDATE_FIXED_LINE("comment maxz %f", iMax[2]);
-			break;
+			fclose(lFile);
 		}
-		
-		lLineStart = ftell(iFile);
+		return false;
 	}
-};
 
-void PointCloud::updateResolution(FILE* iFile, float iResolution)
+	std::vector<CloudBlock> lEntries((lHeader.mSize + BLOCK_SIZE - 1) / BLOCK_SIZE);
+	fseek(lFile, lHeader.mBlocks, SEEK_SET);
+	bool lValid = lEntries.empty() || fread(&lEntries[0], sizeof(CloudBlock), lEntries.size(), lFile) == lEntries.size();
+	fclose(lFile);
+
+	for (size_t i = 0; lValid && i < lEntries.size(); i++)
+	{
+		Block lBlock;
+		lBlock.mCount = lEntries[i].mCount;
+		memcpy(lBlock.mMin, lEntries[i].mMin, sizeof(lBlock.mMin));
+		memcpy(lBlock.mMax, lEntries[i].mMax, sizeof(lBlock.mMax));
+		iBlocks.push_back(lBlock);
+	}
+	return lValid;
+}
+
+void PointCloud::exportPly(std::string iName)
 {
-	fseek(iFile, 0, SEEK_SET);
-	char lLine[1024];
-	size_t lLength = 0;
-	uint32_t lLineStart = ftell(iFile);
-	while (fgets(lLine, 1024, iFile))
+	PointCloudAttributes lAttributes;
+	uint64_t lSize;
+	float lMin[3];
+	float lMax[3];
+	float lResolution;
+	FILE* lInputFile = readHeader(iName, &lAttributes, lSize, lMin, lMax, &lResolution);
+	if (!lInputFile)
+	{
+		return;
+	}
+	FILE* lOutputFile = fopen((iName + ".ply").c_str(), "wb");
+	if (!lOutputFile)
 	{
-		if (!strncmp(lLine, "comment resolution", 18))
+		BOOST_LOG_TRIVIAL(error) << "Could not write " << iName << ".ply";
+		fclose(lInputFile);
+		return;
+	}
+
+	fprintf(lOutputFile, "ply\nformat binary_little_endian 1.0\n");
+	fprintf(lOutputFile, "comment minx %f\ncomment miny %f\ncomment minz %f\n", lMin[0], lMin[1], lMin[2]);
+	fprintf(lOutputFile, "comment maxx %f\ncomment maxy %f\ncomment maxz %f\n", lMax[0], lMax[1], lMax[2]);
+	fprintf(lOutputFile, "comment resolution %f\n", lResolution);
+	fprintf(lOutputFile, "element vertex %" PRIu64 "\n", lSize);
+	fprintf(lOutputFile, "property float x\n"
+						 "property float y\n"
+						 "property float z\n");
+	lAttributes.writeHeader(lOutputFile);
+	fprintf(lOutputFile, "end_header\n");
+
+	uint64_t lRemaining = lSize * (sizeof(float) * 3 + lAttributes.bytesPerPoint());
+	std::vector<uint8_t> lBuffer(4 * 1024 * 1024);
+	while (lRemaining)
+	{
+		size_t lCount = fread(&lBuffer[0], 1, std::min<uint64_t>(lBuffer.size(), lRemaining), lInputFile);
+		if (!lCount)
 		{
-			UPDATE_FIXED_LINE("comment resolution %f", iResolution);
 			break;
 		}
-
-		lLineStart = ftell(iFile);
+		fwrite(&lBuffer[0], 1, lCount, lOutputFile);
+		lRemaining -= lCount;
 	}
+
+	fclose(lInputFile);
+	fclose(lOutputFile);
 }
 
 //
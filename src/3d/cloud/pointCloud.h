@@ -33,7 +33,7 @@ class PointCloudAttributes
 
 		void average(Point& iDest, Point& iSample);
 
-		void readHeader(char* iName);
+		// ply properties of the attributes
 		void writeHeader(FILE* iFile);
 
 		void fromJson(json_spirit::mArray& iObject);
@@ -131,16 +131,46 @@ class PointCloud : public PointCloudAttributes
 		json_spirit::mObject toJson();
 
 
+		//
+		// intermediate files, a fixed binary header with the attribute schema followed by the points
+		//
+
+		static const uint32_t HEADER_SIZE = 4096;
+
+		// points per block, blocks start on 4K boundaries whatever the size of a point
+		static const uint32_t BLOCK_SIZE = 65536;
+
+		struct Block
+		{
+			uint64_t mCount;
+			float mMin[3];
+			float mMax[3];
+		};
+
+		// points of files written from now on are coded once "compress" in iConfig is set, off by default
+		static bool sCompress;
+		static void configure(json_spirit::mObject& iConfig);
+
+		static std::string fileName(std::string iName);
+
 		static void updateSpatialBounds(FILE* iFile, float* iMin, float* iMax);
 		static void updateSpatialBounds(FILE* iFile, double* iMin, double* iMax);
 		static void updateResolution(FILE* iFile, float iResolution);
 		static FILE* writeHeader(std::string iName, PointCloudAttributes& iAttributes, uint64_t iSize = 0, float* iMin = 0, float* iMax = 0, float iResolution = 0);
+		// NULL if iName is not a point cloud or cannot be read
 		static FILE* readHeader(std::string iName, PointCloudAttributes* iAttributes, uint64_t& iSize, float* iMin = 0, float* iMax = 0, float* iResolution = 0);
 		static float readResolution(std::string iName);
 		uint64_t readPointCount(std::string iName);
 		static void updateSize(FILE* iFile, uint64_t iSize);
 		static FILE* updateHeader(std::string iName);
 
+		// appends the count and bounds of every block, dropped again by updateSize
+		static void updateBlocks(std::string iName);
+		static bool readBlocks(std::string iName, std::vector<Block>& iBlocks);
+
+		// writes iName.ply for inspection
+		static void exportPly(std::string iName);
+
 
 };
 
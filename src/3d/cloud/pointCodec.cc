@@ -0,0 +1,444 @@
+#include <cstring>
+#include <algorithm>
+
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+
+#include "pointCodec.h"
+
+const uint32_t PointCodec::FRAME_SIZE;
+const uint32_t PointCodec::GROUP_SIZE;
+
+//
+// Bit packing
+//
+
+static inline uint32_t width(uint32_t iValue)
+{
+	uint32_t lWidth = 0;
+	while (lWidth < 32 && (iValue >> lWidth))
+	{
+		lWidth++;
+	}
+	return lWidth;
+}
+
+static inline uint8_t* pack(const uint32_t* iValues, uint32_t iCount, uint8_t* iCode)
+{
+	uint32_t lOr = 0;
+	for (uint32_t i = 0; i < iCount; i++)
+	{
+		lOr |= iValues[i];
+	}
+	uint32_t lWidth = width(lOr);
+	*iCode++ = (uint8_t)lWidth;
+
+	uint64_t lBuffer = 0;
+	uint32_t lBits = 0;
+	for (uint32_t i = 0; i < iCount; i++)
+	{
+		lBuffer |= (uint64_t)iValues[i] << lBits;
+		lBits += lWidth;
+		while (lBits >= 8)
+		{
+			*iCode++ = (uint8_t)lBuffer;
+			lBuffer >>= 8;
+			lBits -= 8;
+		}
+	}
+	if (lBits)
+	{
+		*iCode++ = (uint8_t)lBuffer;
+	}
+	return iCode;
+}
+
+// reads 8 bytes at a time, values never straddle more than that since they are at most 32 bits
+static inline const uint8_t* unpack(const uint8_t* iCode, uint32_t iCount, uint32_t* iValues)
+{
+	uint32_t lWidth = *iCode++;
+	if (!lWidth)
+	{
+		memset(iValues, 0, iCount * sizeof(uint32_t));
+		return iCode;
+	}
+
+	uint64_t lMask = (1ull << lWidth) - 1;
+	for (uint32_t i = 0; i < iCount; i++)
+	{
+		uint64_t lBit = (uint64_t)i * lWidth;
+		uint64_t lWord;
+		memcpy(&lWord, iCode + (lBit >> 3), sizeof(lWord));
+		iValues[i] = (uint32_t)((lWord >> (lBit & 7)) & lMask);
+	}
+	return iCode + ((uint64_t)iCount * lWidth + 7) / 8;
+}
+
+//
+// Frames
+//
+
+size_t PointCodec::maxEncodedSize(uint32_t iCount, uint32_t iStride)
+{
+	return (size_t)iCount * iStride + (size_t)iStride * (iCount / GROUP_SIZE + 1);
+}
+
+size_t PointCodec::encode(const uint8_t* iPoints, uint32_t iCount, uint32_t iStride, uint8_t* iCode)
+{
+	uint8_t* lCode = iCode;
+	uint32_t lValues[GROUP_SIZE];
+
+	// positions, zig zag coded deltas of the float bits of each axis
+	for (uint32_t k = 0; k < 3; k++)
+	{
+		uint32_t lPrevious = 0;
+		for (uint32_t g = 0; g < iCount; g += GROUP_SIZE)
+		{
+			uint32_t lCount = std::min(GROUP_SIZE, iCount - g);
+			for (uint32_t i = 0; i < lCount; i++)
+			{
+				uint32_t lBits;
+				memcpy(&lBits, iPoints + (size_t)(g + i) * iStride + k * sizeof(float), sizeof(lBits));
+				uint32_t lDelta = lBits - lPrevious;
+				lValues[i] = (lDelta << 1) ^ (uint32_t)((int32_t)lDelta >> 31);
+				lPrevious = lBits;
+			}
+			lCode = pack(lValues, lCount, lCode);
+		}
+	}
+
+	// attributes, zig zag coded deltas of each byte column
+	for (uint32_t c = sizeof(float) * 3; c < iStride; c++)
+	{
+		uint8_t lPrevious = 0;
+		for (uint32_t g = 0; g < iCount; g += GROUP_SIZE)
+		{
+			uint32_t lCount = std::min(GROUP_SIZE, iCount - g);
+			for (uint32_t i = 0; i < lCount; i++)
+			{
+				uint8_t lByte = iPoints[(size_t)(g + i) * iStride + c];
+				uint8_t lDelta = lByte - lPrevious;
+				lValues[i] = (uint8_t)((lDelta << 1) ^ (uint8_t)((int8_t)lDelta >> 7));
+				lPrevious = lByte;
+			}
+			lCode = pack(lValues, lCount, lCode);
+		}
+	}
+
+	return lCode - iCode;
+}
+
+void PointCodec::decode(const uint8_t* iCode, uint32_t iCount, uint32_t iStride, uint8_t* iPoints)
+{
+	uint32_t lValues[GROUP_SIZE];
+
+	for (uint32_t k = 0; k < 3; k++)
+	{
+		uint32_t lPrevious = 0;
+		for (uint32_t g = 0; g < iCount; g += GROUP_SIZE)
+		{
+			uint32_t lCount = std::min(GROUP_SIZE, iCount - g);
+			iCode = unpack(iCode, lCount, lValues);
+
+			uint8_t* lPoint = iPoints + (size_t)g * iStride + k * sizeof(float);
+			for (uint32_t i = 0; i < lCount; i++, lPoint += iStride)
+			{
+				lPrevious += (lValues[i] >> 1) ^ (0u - (lValues[i] & 1));
+				memcpy(lPoint, &lPrevious, sizeof(lPrevious));
+			}
+		}
+	}
+
+	for (uint32_t c = sizeof(float) * 3; c < iStride; c++)
+	{
+		uint8_t lPrevious = 0;
+		for (uint32_t g = 0; g < iCount; g += GROUP_SIZE)
+		{
+			uint32_t lCount = std::min(GROUP_SIZE, iCount - g);
+			iCode = unpack(iCode, lCount, lValues);
+
+			uint8_t* lPoint = iPoints + (size_t)g * iStride + c;
+			for (uint32_t i = 0; i < lCount; i++, lPoint += iStride)
+			{
+				lPrevious += (uint8_t)((lValues[i] >> 1) ^ (0u - (lValues[i] & 1)));
+				*lPoint = lPrevious;
+			}
+		}
+	}
+}
+
+uint64_t PointCodec::end(FILE* iFile, uint64_t iStart, uint64_t iCount)
+{
+	uint64_t lEnd = iStart;
+
+	uint64_t lCount = 0;
+	while (lCount < iCount)
+	{
+		uint32_t lFrame[2];
+		fseek(iFile, lEnd, SEEK_SET);
+		if (fread(lFrame, sizeof(lFrame), 1, iFile) != 1 || !lFrame[1])
+		{
+			break;
+		}
+		lEnd += sizeof(lFrame) + lFrame[0];
+		lCount += lFrame[1];
+	}
+	return lEnd;
+}
+
+//
+// Streams, every frame is preceded by the size of its code and its number of points
+//
+
+// custom streams are a glibc extension, other C libraries only read and write uncoded files
+#if defined(__GLIBC__)
+
+struct CodecStream
+{
+	FILE* mFile;
+	uint64_t mStart;
+	uint32_t mStride;
+
+	// position and end of the points as seen through the stream
+	uint64_t mPosition;
+	uint64_t mEnd;
+
+	// points waiting for a full frame or the decoded frame starting at mFrame
+	std::vector<uint8_t> mPoints;
+	uint64_t mFrame;
+
+	// where the frame after mFrame starts in the file and in the stream
+	uint64_t mNext;
+	uint64_t mNextFrame;
+
+	std::vector<uint8_t> mCode;
+};
+
+static void writeFrame(CodecStream* iStream, const uint8_t* iPoints, uint32_t iCount)
+{
+	iStream->mCode.resize(sizeof(uint32_t) * 2 + PointCodec::maxEncodedSize(iCount, iStream->mStride));
+	uint32_t lFrame[2];
+	lFrame[0] = (uint32_t)PointCodec::encode(iPoints, iCount, iStream->mStride, &iStream->mCode[sizeof(lFrame)]);
+	lFrame[1] = iCount;
+	memcpy(&iStream->mCode[0], lFrame, sizeof(lFrame));
+	fwrite(&iStream->mCode[0], sizeof(lFrame) + lFrame[0], 1, iStream->mFile);
+}
+
+static bool readFrame(CodecStream* iStream)
+{
+	uint32_t lFrame[2];
+	fseek(iStream->mFile, iStream->mNext, SEEK_SET);
+	if (fread(lFrame, sizeof(lFrame), 1, iStream->mFile) != 1 || !lFrame[1])
+	{
+		return false;
+	}
+
+	iStream->mCode.resize(lFrame[0] + sizeof(uint64_t));
+	if (fread(&iStream->mCode[0], 1, lFrame[0], iStream->mFile) != lFrame[0])
+	{
+		return false;
+	}
+
+	iStream->mPoints.resize((size_t)lFrame[1] * iStream->mStride);
+	PointCodec::decode(&iStream->mCode[0], lFrame[1], iStream->mStride, &iStream->mPoints[0]);
+
+	iStream->mFrame = iStream->mNextFrame;
+	iStream->mNext += sizeof(lFrame) + lFrame[0];
+	iStream->mNextFrame += iStream->mPoints.size();
+	return true;
+}
+
+static ssize_t writeStream(void* iCookie, const char* iBuffer, size_t iSize)
+{
+	CodecStream* lStream = (CodecStream*)iCookie;
+
+	// header updates go straight to the file
+	if (lStream->mPosition < lStream->mStart)
+	{
+		size_t lSize = std::min<uint64_t>(iSize, lStream->mStart - lStream->mPosition);
+		fseek(lStream->mFile, lStream->mPosition, SEEK_SET);
+		fwrite(iBuffer, lSize, 1, lStream->mFile);
+		fseek(lStream->mFile, 0, SEEK_END);
+		lStream->mPosition += lSize;
+		return lSize;
+	}
+
+	// points can only be appended
+	if (lStream->mPosition != lStream->mEnd)
+	{
+		BOOST_LOG_TRIVIAL(error) << "Coded point files can only be appended to";
+		return -1;
+	}
+
+	const uint8_t* lBuffer = (const uint8_t*)iBuffer;
+	size_t lRemaining = iSize;
+	size_t lFrameBytes = (size_t)PointCodec::FRAME_SIZE * lStream->mStride;
+
+	if (lStream->mPoints.size())
+	{
+		size_t lSize = std::min(lRemaining, lFrameBytes - lStream->mPoints.size());
+		lStream->mPoints.insert(lStream->mPoints.end(), lBuffer, lBuffer + lSize);
+		lBuffer += lSize;
+		lRemaining -= lSize;
+		if (lStream->mPoints.size() == lFrameBytes)
+		{
+			writeFrame(lStream, &lStream->mPoints[0], PointCodec::FRAME_SIZE);
+			lStream->mPoints.clear();
+		}
+	}
+
+	// full frames are coded without copying them first
+	while (lRemaining >= lFrameBytes)
+	{
+		writeFrame(lStream, lBuffer, PointCodec::FRAME_SIZE);
+		lBuffer += lFrameBytes;
+		lRemaining -= lFrameBytes;
+	}
+	lStream->mPoints.insert(lStream->mPoints.end(), lBuffer, lBuffer + lRemaining);
+
+	lStream->mPosition += iSize;
+	lStream->mEnd = lStream->mPosition;
+	return iSize;
+}
+
+static ssize_t readStream(void* iCookie, char* iBuffer, size_t iSize)
+{
+	CodecStream* lStream = (CodecStream*)iCookie;
+
+	size_t lRead = 0;
+	while (lRead < iSize && lStream->mPosition < lStream->mEnd)
+	{
+		if (lStream->mPosition < lStream->mStart)
+		{
+			size_t lSize = std::min<uint64_t>(iSize - lRead, lStream->mStart - lStream->mPosition);
+			fseek(lStream->mFile, lStream->mPosition, SEEK_SET);
+			lSize = fread(iBuffer + lRead, 1, lSize, lStream->mFile);
+			if (!lSize)
+			{
+				break;
+			}
+			lRead += lSize;
+			lStream->mPosition += lSize;
+			continue;
+		}
+
+		// frames only follow each other, going back starts over
+		if (lStream->mPosition < lStream->mFrame)
+		{
+			lStream->mFrame = lStream->mStart;
+			lStream->mNext = lStream->mStart;
+			lStream->mNextFrame = lStream->mStart;
+			lStream->mPoints.clear();
+		}
+		while (lStream->mPosition >= lStream->mFrame + lStream->mPoints.size())
+		{
+			if (!readFrame(lStream))
+			{
+				return lRead;
+			}
+		}
+
+		size_t lOffset = lStream->mPosition - lStream->mFrame;
+		size_t lSize = std::min(iSize - lRead, lStream->mPoints.size() - lOffset);
+		memcpy(iBuffer + lRead, &lStream->mPoints[lOffset], lSize);
+		lRead += lSize;
+		lStream->mPosition += lSize;
+	}
+	return lRead;
+}
+
+static int seekStream(void* iCookie, off64_t* iOffset, int iWhence)
+{
+	CodecStream* lStream = (CodecStream*)iCookie;
+
+	int64_t lPosition = *iOffset;
+	if (iWhence == SEEK_CUR)
+	{
+		lPosition += lStream->mPosition;
+	}
+	else if (iWhence == SEEK_END)
+	{
+		lPosition += lStream->mEnd;
+	}
+	if (lPosition < 0)
+	{
+		return -1;
+	}
+
+	lStream->mPosition = lPosition;
+	*iOffset = lPosition;
+	return 0;
+}
+
+static int closeWriter(void* iCookie)
+{
+	CodecStream* lStream = (CodecStream*)iCookie;
+	if (lStream->mPoints.size())
+	{
+		writeFrame(lStream, &lStream->mPoints[0], lStream->mPoints.size() / lStream->mStride);
+	}
+	int lResult = fclose(lStream->mFile);
+	delete lStream;
+	return lResult;
+}
+
+static int closeReader(void* iCookie)
+{
+	CodecStream* lStream = (CodecStream*)iCookie;
+	int lResult = fclose(lStream->mFile);
+	delete lStream;
+	return lResult;
+}
+
+static CodecStream* createStream(FILE* iFile, uint64_t iStart, uint32_t iStride, uint64_t iEnd)
+{
+	CodecStream* lStream = new CodecStream();
+	lStream->mFile = iFile;
+	lStream->mStart = iStart;
+	lStream->mStride = iStride;
+	lStream->mPosition = iStart;
+	lStream->mEnd = iEnd;
+	lStream->mFrame = iStart;
+	lStream->mNext = iStart;
+	lStream->mNextFrame = iStart;
+	return lStream;
+}
+
+bool PointCodec::available()
+{
+	uint16_t lValue = 1;
+	return *(uint8_t*)&lValue == 1;
+}
+
+FILE* PointCodec::openWriter(FILE* iFile, uint64_t iStart, uint32_t iStride)
+{
+	cookie_io_functions_t lFunctions = { 0, writeStream, seekStream, closeWriter };
+	return fopencookie(createStream(iFile, iStart, iStride, iStart), "w", lFunctions);
+}
+
+FILE* PointCodec::openReader(FILE* iFile, uint64_t iStart, uint32_t iStride, uint64_t iCount)
+{
+	cookie_io_functions_t lFunctions = { readStream, 0, seekStream, closeReader };
+	return fopencookie(createStream(iFile, iStart, iStride, iStart + iCount * iStride), "r", lFunctions);
+}
+
+#else
+
+bool PointCodec::available()
+{
+	return false;
+}
+
+FILE* PointCodec::openWriter(FILE* iFile, uint64_t iStart, uint32_t iStride)
+{
+	return iFile;
+}
+
+FILE* PointCodec::openReader(FILE* iFile, uint64_t iStart, uint32_t iStride, uint64_t iCount)
+{
+	BOOST_LOG_TRIVIAL(error) << "Coded point files cannot be read with this C library";
+	fclose(iFile);
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+//
+// Lossless codec for the points of intermediate clouds. Points are coded in frames, positions as
+// deltas of their float bits and attributes as deltas of their byte columns. Every stream is bit
+// packed in groups with the width of their largest value.
+//
+// Positions are kept exact rather than quantized to a resolution: the importer writes them before
+// any resolution is known, and later stages compare and sort them bit for bit (dedup keys, shared
+// points of the normal leaves). Coded files can only be appended to, headers are the only part that
+// can be rewritten in place.
+//
+
+class PointCodec
+{
+	public:
+
+		static const uint32_t FRAME_SIZE = 2048;
+		static const uint32_t GROUP_SIZE = 128;
+
+		// files can only be wrapped in a coding stream where the C library supports custom streams,
+		// elsewhere openReader fails on coded files and returns NULL
+		static bool available();
+
+		static size_t maxEncodedSize(uint32_t iCount, uint32_t iStride);
+		static size_t encode(const uint8_t* iPoints, uint32_t iCount, uint32_t iStride, uint8_t* iCode);
+
+		// iCode must be readable 8 bytes past the end of the frame
+		static void decode(const uint8_t* iCode, uint32_t iCount, uint32_t iStride, uint8_t* iPoints);
+
+		// points written to or read from the returned stream are coded, the iStart bytes before them
+		// are passed through so headers can still be updated in place
+		static FILE* openWriter(FILE* iFile, uint64_t iStart, uint32_t iStride);
+		static FILE* openReader(FILE* iFile, uint64_t iStart, uint32_t iStride, uint64_t iCount);
+
+		// the end of the last frame of a coded file
+		static uint64_t end(FILE* iFile, uint64_t iStart, uint64_t iCount);
+};
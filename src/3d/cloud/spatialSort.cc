@@ -0,0 +1,165 @@
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+
+#include "spatialSort.h"
+#include "pointBuffer.h"
+
+// spread the lower 10 bits of a cell index over every third bit
+static inline uint32_t mortonSpread(uint32_t iValue)
+{
+	uint32_t x = iValue & 0x3ff;
+	x = (x | x << 16) & 0x030000ff;
+	x = (x | x << 8) & 0x0300f00f;
+	x = (x | x << 4) & 0x030c30c3;
+	x = (x | x << 2) & 0x09249249;
+	return x;
+}
+
+SpatialSort::SpatialSort(uint64_t iMemory)
+: mMemory(iMemory)
+, mCellsize(1)
+{
+}
+
+uint32_t SpatialSort::key(float* iPosition)
+{
+	uint32_t lIndex[3];
+	for (int i = 0; i < 3; i++)
+	{
+		int64_t lCell = (int64_t)((iPosition[i] - mMin[i]) / mCellsize);
+		lIndex[i] = (uint32_t)std::max<int64_t>(0, std::min<int64_t>(lCell, (1 << BITS) - 1));
+	}
+	return mortonSpread(lIndex[0]) | (mortonSpread(lIndex[1]) << 1) | (mortonSpread(lIndex[2]) << 2);
+}
+
+void SpatialSort::sort(uint8_t* iPoints, size_t iCount, uint32_t iStride, std::vector<Entry>& iOrder, std::vector<uint8_t>& iSorted)
+{
+	iOrder.resize(iCount);
+	for (size_t i = 0; i < iCount; i++)
+	{
+		iOrder[i].mKey = key((float*)(iPoints + i * iStride));
+		iOrder[i].mIndex = (uint32_t)i;
+	}
+	std::sort(iOrder.begin(), iOrder.end());
+
+	iSorted.resize(iCount * iStride);
+	for (size_t i = 0; i < iCount; i++)
+	{
+		memcpy(&iSorted[i * iStride], iPoints + (size_t)iOrder[i].mIndex * iStride, iStride);
+	}
+}
+
+void SpatialSort::process(std::string iName)
+{
+	PointCloudAttributes lAttributes;
+	uint64_t lCount;
+	float lMax[3];
+	float lResolution = 0;
+	FILE* lFile = PointCloud::readHeader(iName, &lAttributes, lCount, mMin, lMax, &lResolution);
+	if (!lFile)
+	{
+		throw std::runtime_error("cannot sort " + PointCloud::fileName(iName));
+	}
+	uint32_t lStride = lAttributes.bytesPerPoint() + 3 * sizeof(float);
+
+	// cubic cells so the curve is the same along every axis
+	float lExtent = std::max(std::max(lMax[0] - mMin[0], lMax[1] - mMin[1]), lMax[2] - mMin[2]);
+	mCellsize = lExtent > 0 ? lExtent / (1 << BITS) : 1;
+
+	// a bucket is held twice next to its keys, each octree level of the split divides the key range by 8
+	uint64_t lPerPoint = 2 * lStride + sizeof(Entry);
+	uint32_t lLevels = 0;
+	while (lLevels < 3 && ((lCount * lPerPoint) >> (3 * lLevels)) > mMemory / 4)
+	{
+		lLevels++;
+	}
+	uint32_t lBuckets = 1 << (3 * lLevels);
+	uint32_t lShift = 3 * (BITS - lLevels);
+
+	// buckets of uneven clouds may still not fit, those are sorted in pieces
+	size_t lPiece = (size_t)std::max<uint64_t>(PointCloud::BLOCK_SIZE, std::min<uint64_t>(mMemory / 2 / lPerPoint, UINT32_MAX));
+
+	BOOST_LOG_TRIVIAL(info) << "Spatial sort of " << lCount << " points";
+	BOOST_LOG_TRIVIAL(info) << "   Cellsize " << mCellsize;
+	BOOST_LOG_TRIVIAL(info) << "   Buckets " << lBuckets;
+
+	std::vector<Entry> lOrder;
+	std::vector<uint8_t> lSorted;
+
+	if (lBuckets == 1)
+	{
+		std::vector<uint8_t> lPoints(lCount * lStride);
+		lCount = lCount ? fread(&lPoints[0], lStride, lCount, lFile) : 0;
+		fclose(lFile);
+
+		sort(lPoints.data(), lCount, lStride, lOrder, lSorted);
+
+		FILE* lOutput = PointCloud::writeHeader(iName, lAttributes, 0, mMin, lMax, lResolution);
+		if (lCount)
+		{
+			fwrite(&lSorted[0], lStride, lCount, lOutput);
+		}
+		PointCloud::updateSize(lOutput, lCount);
+		fclose(lOutput);
+		return;
+	}
+
+	std::vector<std::string> lNames;
+	for (uint32_t i = 0; i < lBuckets; i++)
+	{
+		lNames.push_back(iName + "-bucket" + std::to_string(i) + ".tmp");
+	}
+
+	// pass one - spill points into buckets of contiguous key ranges
+	{
+		std::vector<FILE*> lFiles;
+		for (uint32_t i = 0; i < lBuckets; i++)
+		{
+			lFiles.push_back(fopen(lNames[i].c_str(), "wb"));
+		}
+
+		PointBuffer lPointBuffer(lFile, lCount, lStride, mMemory / 4);
+		lPointBuffer.begin();
+		while (!lPointBuffer.end())
+		{
+			PointBuffer::Chunk& lChunk = lPointBuffer.next();
+			for (size_t i = 0; i < lChunk.mSize; i++)
+			{
+				uint8_t* lPointer = lChunk.mData + i * lStride;
+				fwrite(lPointer, lStride, 1, lFiles[key((float*)lPointer) >> lShift]);
+			}
+		}
+		fclose(lFile);
+
+		for (uint32_t i = 0; i < lBuckets; i++)
+		{
+			fclose(lFiles[i]);
+		}
+	}
+
+	// pass two - sort the buckets in key order
+	FILE* lOutput = PointCloud::writeHeader(iName, lAttributes, 0, mMin, lMax, lResolution);
+	uint64_t lWritten = 0;
+	std::vector<uint8_t> lPoints(lPiece * lStride);
+	for (uint32_t b = 0; b < lBuckets; b++)
+	{
+		FILE* lBucket = fopen(lNames[b].c_str(), "rb");
+		size_t lSize;
+		while ((lSize = fread(&lPoints[0], lStride, lPiece, lBucket)) > 0)
+		{
+			sort(lPoints.data(), lSize, lStride, lOrder, lSorted);
+			fwrite(&lSorted[0], lStride, lSize, lOutput);
+			lWritten += lSize;
+		}
+		fclose(lBucket);
+		std::remove(lNames[b].c_str());
+	}
+
+	PointCloud::updateSize(lOutput, lWritten);
+	fclose(lOutput);
+}
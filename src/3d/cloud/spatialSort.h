@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+
+#include "pointCloud.h"
+
+//
+// Orders a cloud along a coarse morton curve over its bounds so that consecutive blocks of the
+// file cover small, mostly disjoint regions. Points are spilled into buckets of contiguous key
+// ranges which are then sorted one at a time in memory.
+//
+
+class SpatialSort
+{
+	public:
+
+		// key bits per axis, the longest side of the bounds is split into 2^BITS cells
+		static const uint32_t BITS = 10;
+
+		SpatialSort(uint64_t iMemory);
+
+		// sorts the cloud iName in place
+		void process(std::string iName);
+
+	protected:
+
+		uint64_t mMemory;
+
+		struct Entry
+		{
+			uint32_t mKey;
+			uint32_t mIndex;
+
+			bool operator<(const Entry& iOther) const
+			{
+				return mKey < iOther.mKey || (mKey == iOther.mKey && mIndex < iOther.mIndex);
+			}
+		};
+
+		float mMin[3];
+		float mCellsize;
+
+		uint32_t key(float* iPosition);
+
+		// sorts iCount points in place, iOrder is scratch space
+		void sort(uint8_t* iPoints, size_t iCount, uint32_t iStride, std::vector<Entry>& iOrder, std::vector<uint8_t>& iSorted);
+};
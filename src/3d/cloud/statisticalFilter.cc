@@ -0,0 +1,492 @@
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include <thread>
+#include <stdexcept>
+
+#include <boost/log/core.hpp>
+#include <boost/log/trivial.hpp>
+#include <boost/thread.hpp>
+
+#include "statisticalFilter.h"
+#include "pointBuffer.h"
+
+StatisticalFilter::StatisticalFilter(float iResolution, float iSigma, uint64_t iMemory)
+: mResolution(iResolution)
+, mSigma(iSigma)
+, mMemory(iMemory)
+{
+}
+
+void StatisticalFilter::readSlab(std::string iName, Slab& iSlab)
+{
+	FILE* lFile = fopen(iName.c_str(), "rb");
+	if (!lFile)
+	{
+		throw std::runtime_error("cannot open " + iName);
+	}
+
+	fseek(lFile, 0, SEEK_END);
+	long lSize = ftell(lFile);
+	fseek(lFile, 0, SEEK_SET);
+	iSlab.resize(std::max(0L, lSize));
+	if (lSize < 0 || (iSlab.size() && fread(&iSlab[0], 1, iSlab.size(), lFile) != iSlab.size()))
+	{
+		fclose(lFile);
+		throw std::runtime_error("cannot read " + iName);
+	}
+	fclose(lFile);
+}
+
+float StatisticalFilter::meanDistance(Grid& iGrid, float* iPosition)
+{
+	int64_t lCell[3];
+	iGrid.cell(iPosition, lCell);
+
+	// sorted squared distances of the nearest points found so far
+	float lNearest[K];
+	int lFound = 0;
+
+	for (int r = 0; r <= RINGS; r++)
+	{
+		for (int x = -r; x <= r; x++)
+		{
+			for (int y = -r; y <= r; y++)
+			{
+				for (int z = -r; z <= r; z++)
+				{
+					if (abs(x) != r && abs(y) != r && abs(z) != r)
+					{
+						continue; // visited in an inner ring
+					}
+
+					std::unordered_map<Cell, std::pair<uint32_t, uint32_t>, CellHash>::iterator lIter = iGrid.mCells.find(Cell(lCell[0] + x, lCell[1] + y, lCell[2] + z));
+					if (lIter == iGrid.mCells.end())
+					{
+						continue;
+					}
+
+					for (uint32_t i = lIter->second.first; i < lIter->second.second; i++)
+					{
+						float* lPosition = iGrid.mPoints[iGrid.mSorted[i]];
+						if (lPosition == iPosition)
+						{
+							continue;
+						}
+
+						float dx = lPosition[0] - iPosition[0];
+						float dy = lPosition[1] - iPosition[1];
+						float dz = lPosition[2] - iPosition[2];
+						float lD2 = dx*dx + dy*dy + dz*dz;
+						if (lFound < K || lD2 < lNearest[K - 1])
+						{
+							int j = std::min(lFound, K - 1);
+							while (j > 0 && lNearest[j - 1] > lD2)
+							{
+								lNearest[j] = lNearest[j - 1];
+								j--;
+							}
+							lNearest[j] = lD2;
+							lFound = std::min(lFound + 1, K);
+						}
+					}
+				}
+			}
+		}
+
+		// everything not yet visited is at least r cells away
+		float lReach = r * iGrid.mCellsize;
+		if (lFound == K && lNearest[K - 1] <= lReach*lReach)
+		{
+			break;
+		}
+	}
+
+	// neighbours beyond the search radius count as being at its edge
+	float lSum = (K - lFound) * RINGS * iGrid.mCellsize;
+	for (int i = 0; i < lFound; i++)
+	{
+		lSum += std::min(sqrtf(lNearest[i]), RINGS * iGrid.mCellsize);
+	}
+	return lSum / K;
+}
+
+void StatisticalFilter::score(Grid& iGrid, uint32_t iBegin, uint32_t iEnd, float* iScore, double* iSum)
+{
+	iSum[0] = 0;
+	iSum[1] = 0;
+	for (uint32_t i = iBegin; i < iEnd; i++)
+	{
+		iScore[i] = meanDistance(iGrid, iGrid.mPoints[i]);
+		iSum[0] += iScore[i];
+		iSum[1] += iScore[i] * iScore[i];
+	}
+}
+
+uint64_t StatisticalFilter::process(std::string iName)
+{
+	PointCloudAttributes lAttributes;
+	uint64_t lCount;
+	float lMin[3];
+	float lMax[3];
+	float lResolution = 0;
+	FILE* lFile = PointCloud::readHeader(iName, &lAttributes, lCount, lMin, lMax, &lResolution);
+	if (!lFile)
+	{
+		throw std::runtime_error("cannot open " + PointCloud::fileName(iName));
+	}
+	uint32_t lStride = lAttributes.bytesPerPoint() + 3 * sizeof(float);
+
+	if (mResolution <= 0)
+	{
+		mResolution = lResolution;
+	}
+	if (mResolution <= 0)
+	{
+		// assume the points are spread over a surface
+		float dx = lMax[0] - lMin[0];
+		float dy = lMax[1] - lMin[1];
+		float dz = lMax[2] - lMin[2];
+		mResolution = std::max(0.001f, sqrtf((dx*dy + dy*dz + dz*dx) / std::max<uint64_t>(lCount, 1)));
+	}
+
+	int lAxis = 0;
+	for (int i = 1; i < 3; i++)
+	{
+		if (lMax[i] - lMin[i] > lMax[lAxis] - lMin[lAxis])
+		{
+			lAxis = i;
+		}
+	}
+
+	// three slabs must fit into memory and a slab must be wider than the search radius
+	float lCellsize = 2 * mResolution;
+	float lMargin = RINGS * lCellsize;
+	float lExtent = lMax[lAxis] - lMin[lAxis];
+	uint64_t lBudget = std::max<uint64_t>(1, mMemory / (3 * (lStride + 48)));
+
+	// pass zero - histogram along the axis so slabs hold about the same number of points
+	uint32_t lBins = (uint32_t)std::max<double>(1, std::min<double>(1 << 22, 4 * lExtent / lMargin));
+	float lBinWidth = lExtent > 0 ? lExtent / lBins : 1;
+	std::vector<uint64_t> lHistogram(lBins, 0);
+	PointBuffer lPointBuffer(lFile, lCount, lStride, mMemory / 4);
+	{
+		lPointBuffer.begin();
+		while (!lPointBuffer.end())
+		{
+			PointBuffer::Chunk& lChunk = lPointBuffer.next();
+			for (size_t i = 0; i < lChunk.mSize; i++)
+			{
+				float* lPosition = (float*)(lChunk.mData + i * lStride);
+				int64_t lBin = (int64_t)floor((lPosition[lAxis] - lMin[lAxis]) / lBinWidth);
+				lHistogram[std::max<int64_t>(0, std::min<int64_t>(lBin, lBins - 1))]++;
+			}
+		}
+	}
+
+	// upper bounds of the slabs, a slab closes once it is full and wider than the margin
+	std::vector<float> lBounds;
+	std::vector<uint64_t> lFills(1, 0);
+	float lLower = lMin[lAxis];
+	for (uint32_t b = 0; b < lBins; b++)
+	{
+		lFills.back() += lHistogram[b];
+		float lUpper = lMin[lAxis] + (b + 1) * lBinWidth;
+		if (b + 1 < lBins && lFills.back() >= lBudget && lUpper - lLower >= lMargin)
+		{
+			lBounds.push_back(lUpper);
+			lFills.push_back(0);
+			lLower = lUpper;
+		}
+	}
+	if (lBounds.size() && lMax[lAxis] - lBounds.back() < lMargin)
+	{
+		// the last slab would be narrower than the margin
+		lBounds.pop_back();
+		uint64_t lLast = lFills.back();
+		lFills.pop_back();
+		lFills.back() += lLast;
+	}
+	lBounds.push_back(FLT_MAX);
+	uint64_t lLargest = *std::max_element(lFills.begin(), lFills.end());
+	std::vector<uint64_t>().swap(lHistogram);
+
+	uint32_t lSlabs = lBounds.size();
+
+	BOOST_LOG_TRIVIAL(info) << "Statistical filter on " << lCount << " points";
+	BOOST_LOG_TRIVIAL(info) << "   Resolution " << mResolution;
+	BOOST_LOG_TRIVIAL(info) << "   Sigma " << mSigma;
+	BOOST_LOG_TRIVIAL(info) << "   Slabs " << lSlabs << " along axis " << lAxis << ", largest " << lLargest << " points";
+	if (lLargest > lBudget)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "   " << lLargest << " points lie within one search margin, more than the " << lBudget << " a slab should hold";
+	}
+
+	std::vector<std::string> lNames;
+	for (uint32_t i = 0; i < lSlabs; i++)
+	{
+		lNames.push_back(iName + "-slab" + std::to_string(i) + ".tmp");
+	}
+
+	// the slabs and their scores are removed whether the filter completes or not
+	auto lDiscard = [&]()
+	{
+		for (uint32_t i = 0; i < lSlabs; i++)
+		{
+			std::remove(lNames[i].c_str());
+			std::remove((lNames[i] + ".score").c_str());
+		}
+	};
+
+	// pass one - distribute points into slabs
+	{
+		std::vector<FILE*> lFiles;
+		try
+		{
+			for (uint32_t i = 0; i < lSlabs; i++)
+			{
+				FILE* lSlabFile = fopen(lNames[i].c_str(), "wb");
+				if (!lSlabFile)
+				{
+					throw std::runtime_error("cannot create " + lNames[i]);
+				}
+				lFiles.push_back(lSlabFile);
+			}
+
+			lPointBuffer.begin();
+			while (!lPointBuffer.end())
+			{
+				PointBuffer::Chunk& lChunk = lPointBuffer.next();
+				for (size_t i = 0; i < lChunk.mSize; i++)
+				{
+					uint8_t* lPointer = lChunk.mData + i * lStride;
+					float* lPosition = (float*)lPointer;
+					size_t lSlab = std::upper_bound(lBounds.begin(), lBounds.end() - 1, lPosition[lAxis]) - lBounds.begin();
+					if (fwrite(lPointer, lStride, 1, lFiles[lSlab]) != 1)
+					{
+						throw std::runtime_error("cannot write " + lNames[lSlab]);
+					}
+				}
+			}
+		}
+		catch (...)
+		{
+			fclose(lFile);
+			for (size_t i = 0; i < lFiles.size(); i++)
+			{
+				fclose(lFiles[i]);
+			}
+			lDiscard();
+			throw;
+		}
+		fclose(lFile);
+
+		bool lClosed = true;
+		for (uint32_t i = 0; i < lSlabs; i++)
+		{
+			lClosed = fclose(lFiles[i]) == 0 && lClosed;
+		}
+		if (!lClosed)
+		{
+			lDiscard();
+			throw std::runtime_error("cannot write the slabs of " + iName);
+		}
+	}
+
+	// pass two - score every slab against itself and the margins of its neighbours
+	uint32_t lThreads = std::max(1u, std::thread::hardware_concurrency());
+	double lSum[2] = { 0, 0 };
+	uint64_t lScored = 0;
+	try
+	{
+		Slab lPrevious;
+		Slab lCurrent;
+		Slab lNext;
+		readSlab(lNames[0], lCurrent);
+
+		for (uint32_t s = 0; s < lSlabs; s++)
+		{
+			if (s + 1 < lSlabs)
+			{
+				readSlab(lNames[s + 1], lNext);
+			}
+			else
+			{
+				lNext.clear();
+			}
+
+			Grid lGrid;
+			lGrid.mCellsize = lCellsize;
+			memcpy(lGrid.mMin, lMin, sizeof(lMin));
+
+			// points of the slab come first so their index matches their score
+			uint32_t lSize = lCurrent.size() / lStride;
+			for (uint32_t i = 0; i < lSize; i++)
+			{
+				lGrid.mPoints.push_back((float*)&lCurrent[i * lStride]);
+			}
+
+			float lLow = (s ? lBounds[s - 1] : lMin[lAxis]) - lMargin;
+			for (size_t i = 0; i < lPrevious.size(); i += lStride)
+			{
+				float* lPosition = (float*)&lPrevious[i];
+				if (lPosition[lAxis] >= lLow)
+				{
+					lGrid.mPoints.push_back(lPosition);
+				}
+			}
+
+			float lHigh = lBounds[s] + lMargin;
+			for (size_t i = 0; i < lNext.size(); i += lStride)
+			{
+				float* lPosition = (float*)&lNext[i];
+				if (lPosition[lAxis] <= lHigh)
+				{
+					lGrid.mPoints.push_back(lPosition);
+				}
+			}
+
+			// bucket points by cell
+			std::vector<std::pair<Cell, uint32_t>> lKeys(lGrid.mPoints.size());
+			for (uint32_t i = 0; i < lGrid.mPoints.size(); i++)
+			{
+				int64_t lCell[3];
+				lGrid.cell(lGrid.mPoints[i], lCell);
+				lKeys[i].first = Cell(lCell[0], lCell[1], lCell[2]);
+				lKeys[i].second = i;
+			}
+			std::sort(lKeys.begin(), lKeys.end());
+
+			lGrid.mSorted.resize(lKeys.size());
+			lGrid.mCells.reserve(lKeys.size() / 4);
+			for (uint32_t i = 0; i < lKeys.size(); i++)
+			{
+				lGrid.mSorted[i] = lKeys[i].second;
+				if (i == 0 || lKeys[i].first != lKeys[i - 1].first)
+				{
+					lGrid.mCells[lKeys[i].first] = std::make_pair(i, i + 1);
+				}
+				else
+				{
+					lGrid.mCells[lKeys[i].first].second = i + 1;
+				}
+			}
+			std::vector<std::pair<Cell, uint32_t>>().swap(lKeys);
+
+			std::vector<float> lScore(lSize);
+			std::vector<double> lSums(2 * lThreads);
+			boost::thread_group lGroup;
+			uint32_t lRange = lSize / lThreads + 1;
+			for (uint32_t t = 0; t < lThreads; t++)
+			{
+				uint32_t lBegin = std::min(lSize, t * lRange);
+				uint32_t lEnd = std::min(lSize, lBegin + lRange);
+				lGroup.add_thread(new boost::thread(&StatisticalFilter::score, this, boost::ref(lGrid), lBegin, lEnd, lScore.data(), &lSums[2 * t]));
+			}
+			lGroup.join_all();
+
+			for (uint32_t t = 0; t < lThreads; t++)
+			{
+				lSum[0] += lSums[2 * t];
+				lSum[1] += lSums[2 * t + 1];
+			}
+			lScored += lSize;
+
+			FILE* lScoreFile = fopen((lNames[s] + ".score").c_str(), "wb");
+			if (!lScoreFile)
+			{
+				throw std::runtime_error("cannot create " + lNames[s] + ".score");
+			}
+			bool lComplete = !lSize || fwrite(lScore.data(), sizeof(float), lSize, lScoreFile) == lSize;
+			if (fclose(lScoreFile) != 0 || !lComplete)
+			{
+				throw std::runtime_error("cannot write " + lNames[s] + ".score");
+			}
+
+			lPrevious.swap(lCurrent);
+			lCurrent.swap(lNext);
+		}
+	}
+	catch (...)
+	{
+		lDiscard();
+		throw;
+	}
+
+	double lMean = lScored ? lSum[0] / lScored : 0;
+	double lDeviation = lScored ? sqrt(std::max(0.0, lSum[1] / lScored - lMean * lMean)) : 0;
+	float lThreshold = lMean + mSigma * lDeviation;
+	BOOST_LOG_TRIVIAL(info) << "   Mean distance " << lMean << " deviation " << lDeviation << " threshold " << lThreshold;
+
+	// pass three - keep points below the threshold
+	float lMinOut[3];
+	float lMaxOut[3];
+	memcpy(lMinOut, PointCloud::MAX, sizeof(lMinOut));
+	memcpy(lMaxOut, PointCloud::MIN, sizeof(lMaxOut));
+
+	FILE* lOutput = PointCloud::writeHeader(iName, lAttributes, 0, 0, 0, lResolution);
+	if (!lOutput)
+	{
+		lDiscard();
+		throw std::runtime_error("cannot create " + PointCloud::fileName(iName));
+	}
+
+	uint64_t lWritten = 0;
+	try
+	{
+		for (uint32_t s = 0; s < lSlabs; s++)
+		{
+			Slab lSlab;
+			readSlab(lNames[s], lSlab);
+			uint32_t lSize = lSlab.size() / lStride;
+
+			std::vector<float> lScore(lSize);
+			FILE* lScoreFile = fopen((lNames[s] + ".score").c_str(), "rb");
+			if (!lScoreFile)
+			{
+				throw std::runtime_error("cannot open " + lNames[s] + ".score");
+			}
+			bool lRead = !lSize || fread(lScore.data(), sizeof(float), lSize, lScoreFile) == lSize;
+			fclose(lScoreFile);
+			if (!lRead)
+			{
+				throw std::runtime_error("cannot read " + lNames[s] + ".score");
+			}
+
+			for (uint32_t i = 0; i < lSize; i++)
+			{
+				if (lScore[i] <= lThreshold)
+				{
+					float* lPosition = (float*)&lSlab[i * lStride];
+					for (int j = 0; j < 3; j++)
+					{
+						lMinOut[j] = std::min(lMinOut[j], lPosition[j]);
+						lMaxOut[j] = std::max(lMaxOut[j], lPosition[j]);
+					}
+					if (fwrite(lPosition, lStride, 1, lOutput) != 1)
+					{
+						throw std::runtime_error("cannot write " + PointCloud::fileName(iName));
+					}
+					lWritten++;
+				}
+			}
+
+			std::remove(lNames[s].c_str());
+			std::remove((lNames[s] + ".score").c_str());
+		}
+	}
+	catch (...)
+	{
+		fclose(lOutput);
+		lDiscard();
+		throw;
+	}
+
+	PointCloud::updateSpatialBounds(lOutput, lMinOut, lMaxOut);
+	PointCloud::updateSize(lOutput, lWritten);
+	fclose(lOutput);
+
+	BOOST_LOG_TRIVIAL(info) << "Statistical filter removed " << lCount - lWritten << " of " << lCount << " points";
+	return lCount - lWritten;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+#include <tuple>
+#include <unordered_map>
+
+#include "pointCloud.h"
+
+//
+// Removes points whose mean distance to their K nearest neighbours lies further than
+// mSigma standard deviations above the mean of the whole cloud. The cloud is streamed in
+// slabs along its longest axis so only three slabs are ever held in memory.
+//
+// The threshold depends on every point, so the points can only be kept once all of them are
+// scored. The filter therefore runs on the imported file before any other stage reads it, not
+// inside the writers of the importers.
+//
+
+class StatisticalFilter
+{
+	public:
+
+		static const int K = 8;
+		static const int RINGS = 4; // search radius in grid cells
+
+		StatisticalFilter(float iResolution, float iSigma, uint64_t iMemory);
+
+		// filters the cloud iName in place and returns the number of points removed
+		uint64_t process(std::string iName);
+
+	protected:
+
+		float mResolution;
+		float mSigma;
+		uint64_t mMemory;
+
+		typedef std::vector<uint8_t> Slab;
+
+		// cells are kept whole so that distant cells never share an entry
+		typedef std::tuple<int64_t, int64_t, int64_t> Cell;
+
+		struct CellHash
+		{
+			size_t operator()(const Cell& iCell) const
+			{
+				return (uint64_t)std::get<0>(iCell) * 73856093ull ^ (uint64_t)std::get<1>(iCell) * 19349663ull ^ (uint64_t)std::get<2>(iCell) * 83492791ull;
+			}
+		};
+
+		struct Grid
+		{
+			float mCellsize;
+			float mMin[3];
+			std::vector<float*> mPoints;
+			std::vector<uint32_t> mSorted;
+			std::unordered_map<Cell, std::pair<uint32_t, uint32_t>, CellHash> mCells;
+
+			void cell(float* iPosition, int64_t* iCell)
+			{
+				for (int i = 0; i < 3; i++)
+				{
+					iCell[i] = (int64_t)floor(((double)iPosition[i] - mMin[i]) / mCellsize);
+				}
+			}
+		};
+
+		float meanDistance(Grid& iGrid, float* iPosition);
+		void score(Grid& iGrid, uint32_t iBegin, uint32_t iEnd, float* iScore, double* iSum);
+
+		// throws if the slab can not be read completely
+		void readSlab(std::string iName, Slab& iSlab);
+};
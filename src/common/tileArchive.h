@@ -0,0 +1,310 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) Geist Software Labs. All rights reserved.
+
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef _TileArchive
+#define _TileArchive
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/log/trivial.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "tileSink.h"
+
+//
+// All tiles of a dataset in one file. Tiles are stored at aligned offsets, identical tiles only
+// once. The index at the end lists every tile path by its hash, sorted so that a tile is found
+// with a binary search. Fields are little endian.
+//
+//    header | tiles | index entries | path names | footer
+//
+
+namespace tileArchive
+{
+	static const char MAGIC[4] = { 'V', 'X', 'T', 'A' };
+	static const uint32_t VERSION = 1;
+
+	// tiles start at multiples of ALIGNMENT
+	static const uint32_t ALIGNMENT = 16;
+
+	struct Header
+	{
+		char mMagic[4];
+		uint32_t mVersion;
+		uint32_t mAlignment;
+		uint32_t mReserved;
+	};
+
+	struct Entry
+	{
+		uint64_t mKey;
+		uint64_t mOffset;
+		uint32_t mSize;
+		// position of the path in the names
+		uint32_t mName;
+	};
+
+	struct Footer
+	{
+		uint64_t mIndex;
+		uint64_t mCount;
+		uint64_t mNames;
+		uint32_t mVersion;
+		char mMagic[4];
+	};
+}
+
+
+class TileArchive : public TileSink
+{
+	public:
+
+		// tiles are named by their path as in a tile tree, the archive is written to iFile
+		TileArchive(std::string iFile)
+		: TileSink(boost::filesystem::path(iFile).parent_path().string())
+		, mName(iFile)
+		, mFile(fopen(iFile.c_str(), "w+b"))
+		, mSize(0)
+		, mDuplicates(0)
+		{
+			if (mFile == NULL)
+			{
+				BOOST_LOG_TRIVIAL(error) << "Could not create tile archive " << mName;
+				return;
+			}
+
+			tileArchive::Header lHeader;
+			memset(&lHeader, 0, sizeof(lHeader));
+			memcpy(lHeader.mMagic, tileArchive::MAGIC, sizeof(lHeader.mMagic));
+			lHeader.mVersion = tileArchive::VERSION;
+			lHeader.mAlignment = tileArchive::ALIGNMENT;
+			fwrite(&lHeader, sizeof(lHeader), 1, mFile);
+			mSize = sizeof(lHeader);
+		}
+
+		~TileArchive()
+		{
+			close();
+		}
+
+		// the paths of the tiles replace directories
+		void createDirectory(const std::string&)
+		{
+		}
+
+		void write(const std::string& iPath, const void* iData, size_t iSize)
+		{
+			uint64_t lHash = TileSink::hash(iData, iSize);
+
+			boost::lock_guard<boost::mutex> lLock(mLock);
+			if (mFile == NULL)
+			{
+				return;
+			}
+
+			tileArchive::Entry lEntry;
+			lEntry.mKey = TileSink::hash(iPath.data(), iPath.size());
+			lEntry.mSize = (uint32_t)iSize;
+			lEntry.mName = (uint32_t)mNames.size();
+			mNames.append(iPath.c_str(), iPath.size() + 1);
+
+			if (!findContent(lHash, iData, iSize, lEntry.mOffset))
+			{
+				static const uint8_t sPadding[tileArchive::ALIGNMENT] = { 0 };
+
+				lEntry.mOffset = mSize;
+				fwrite(iData, 1, iSize, mFile);
+				size_t lPadding = (tileArchive::ALIGNMENT - iSize % tileArchive::ALIGNMENT) % tileArchive::ALIGNMENT;
+				fwrite(sPadding, 1, lPadding, mFile);
+				mSize += iSize + lPadding;
+
+				mContent.insert(std::make_pair(lHash, mEntries.size()));
+			}
+			else
+			{
+				mDuplicates++;
+			}
+
+			mEntries.push_back(lEntry);
+		}
+
+		void close()
+		{
+			boost::lock_guard<boost::mutex> lLock(mLock);
+			if (mFile == NULL)
+			{
+				return;
+			}
+
+			std::sort(mEntries.begin(), mEntries.end(), [this](const tileArchive::Entry& iA, const tileArchive::Entry& iB)
+			{
+				return iA.mKey < iB.mKey || (iA.mKey == iB.mKey && strcmp(&mNames[iA.mName], &mNames[iB.mName]) < 0);
+			});
+
+			tileArchive::Footer lFooter;
+			memset(&lFooter, 0, sizeof(lFooter));
+			lFooter.mIndex = mSize;
+			lFooter.mCount = mEntries.size();
+			lFooter.mNames = mNames.size();
+			lFooter.mVersion = tileArchive::VERSION;
+			memcpy(lFooter.mMagic, tileArchive::MAGIC, sizeof(lFooter.mMagic));
+
+			if (mEntries.size())
+			{
+				fwrite(&mEntries[0], sizeof(tileArchive::Entry), mEntries.size(), mFile);
+			}
+			fwrite(mNames.data(), 1, mNames.size(), mFile);
+			fwrite(&lFooter, sizeof(lFooter), 1, mFile);
+			fclose(mFile);
+			mFile = NULL;
+
+			BOOST_LOG_TRIVIAL(info) << "Tile archive " << mName << " " << mEntries.size() << " tiles, " << mDuplicates << " duplicates, " << mSize << " bytes";
+		}
+
+	protected:
+
+		std::string mName;
+		FILE* mFile;
+		uint64_t mSize;
+		uint64_t mDuplicates;
+
+		std::vector<tileArchive::Entry> mEntries;
+		std::string mNames;
+
+		// content hash to the first entry holding it
+		std::multimap<uint64_t, size_t> mContent;
+
+		// an earlier tile with the same content, compared byte by byte
+		bool findContent(uint64_t iHash, const void* iData, size_t iSize, uint64_t& iOffset)
+		{
+			std::vector<uint8_t> lStored;
+			bool lFound = false;
+
+			auto lRange = mContent.equal_range(iHash);
+			for (auto lIter = lRange.first; lIter != lRange.second && !lFound; lIter++)
+			{
+				tileArchive::Entry& lEntry = mEntries[lIter->second];
+				if (lEntry.mSize == iSize)
+				{
+					lStored.resize(iSize);
+					fseek(mFile, lEntry.mOffset, SEEK_SET);
+					if (fread(lStored.data(), 1, iSize, mFile) == iSize && memcmp(lStored.data(), iData, iSize) == 0)
+					{
+						iOffset = lEntry.mOffset;
+						lFound = true;
+					}
+				}
+			}
+
+			if (lRange.first != lRange.second)
+			{
+				fseek(mFile, 0, SEEK_END);
+			}
+			return lFound;
+		}
+};
+
+
+class TileArchiveReader
+{
+	public:
+
+		TileArchiveReader(std::string iFile)
+		: mFile(fopen(iFile.c_str(), "rb"))
+		{
+			tileArchive::Footer lFooter;
+			if (mFile == NULL || fseek(mFile, -(long)sizeof(lFooter), SEEK_END) || fread(&lFooter, sizeof(lFooter), 1, mFile) != 1 || memcmp(lFooter.mMagic, tileArchive::MAGIC, sizeof(lFooter.mMagic)))
+			{
+				BOOST_LOG_TRIVIAL(error) << iFile << " is not a tile archive";
+				if (mFile)
+				{
+					fclose(mFile);
+					mFile = NULL;
+				}
+				return;
+			}
+
+			mEntries.resize(lFooter.mCount);
+			mNames.resize(lFooter.mNames);
+			fseek(mFile, lFooter.mIndex, SEEK_SET);
+			if (lFooter.mCount)
+			{
+				fread(&mEntries[0], sizeof(tileArchive::Entry), lFooter.mCount, mFile);
+			}
+			if (lFooter.mNames)
+			{
+				fread(&mNames[0], 1, lFooter.mNames, mFile);
+			}
+		}
+
+		~TileArchiveReader()
+		{
+			if (mFile)
+			{
+				fclose(mFile);
+			}
+		}
+
+		bool isOpen()
+		{
+			return mFile != NULL;
+		}
+
+		size_t size()
+		{
+			return mEntries.size();
+		}
+
+		// path of the i-th tile in index order
+		std::string name(size_t i)
+		{
+			return &mNames[mEntries[i].mName];
+		}
+
+		// the tile stored under iPath, false if there is none
+		bool read(const std::string& iPath, std::vector<uint8_t>& iData)
+		{
+			uint64_t lKey = TileSink::hash(iPath.data(), iPath.size());
+
+			tileArchive::Entry lProbe;
+			lProbe.mKey = lKey;
+			auto lIter = std::lower_bound(mEntries.begin(), mEntries.end(), lProbe, [](const tileArchive::Entry& iA, const tileArchive::Entry& iB)
+			{
+				return iA.mKey < iB.mKey;
+			});
+
+			for (; lIter != mEntries.end() && lIter->mKey == lKey; lIter++)
+			{
+				if (iPath == &mNames[lIter->mName])
+				{
+					boost::lock_guard<boost::mutex> lLock(mLock);
+					iData.resize(lIter->mSize);
+					fseek(mFile, lIter->mOffset, SEEK_SET);
+					return lIter->mSize == 0 || fread(&iData[0], 1, lIter->mSize, mFile) == lIter->mSize;
+				}
+			}
+			return false;
+		}
+
+	protected:
+
+		FILE* mFile;
+		boost::mutex mLock;
+
+		std::vector<tileArchive::Entry> mEntries;
+		std::string mNames;
+};
+
+#endif
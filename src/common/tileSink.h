@@ -0,0 +1,119 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) Geist Software Labs. All rights reserved.
+
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef _TileSink
+#define _TileSink
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <map>
+#include <set>
+#include <string>
+
+#include <boost/log/trivial.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+//
+// Destination of encoded tiles. Paths are relative to the root of the tile tree and are never
+// resolved against the working directory, so tiles can be written from any number of threads.
+// With iHashes the content hash of every tile written is kept by its path.
+//
+
+class TileSink
+{
+	public:
+
+		// sinks which keep their tiles elsewhere have no root
+		TileSink(std::string iRoot, bool iHashes = false)
+		: mRoot(iRoot)
+		, mRecord(iHashes)
+		{
+			if (!mRoot.empty())
+			{
+				boost::filesystem::create_directories(boost::filesystem::path(mRoot));
+			}
+		}
+
+		virtual ~TileSink()
+		{
+		}
+
+		// creates a directory below the root, each directory is only created once
+		virtual void createDirectory(const std::string& iPath)
+		{
+			boost::lock_guard<boost::mutex> lLock(mLock);
+			if (mDirectories.insert(iPath).second)
+			{
+				boost::filesystem::create_directories(boost::filesystem::path(mRoot + "/" + iPath));
+			}
+		}
+
+		// writes one tile, its directory must have been created
+		virtual void write(const std::string& iPath, const void* iData, size_t iSize)
+		{
+			if (mRecord)
+			{
+				record(iPath, hash(iData, iSize));
+			}
+
+			std::string lName = mRoot + "/" + iPath;
+			FILE* lFile = fopen(lName.c_str(), "wb");
+			if (lFile == NULL)
+			{
+				BOOST_LOG_TRIVIAL(error) << "Could not write tile " << lName;
+				return;
+			}
+			fwrite(iData, 1, iSize, lFile);
+			fclose(lFile);
+		}
+
+		// completes the output once all tiles are written
+		virtual void close()
+		{
+		}
+
+		const std::map<std::string, uint64_t>& hashes()
+		{
+			return mHashes;
+		}
+
+		// FNV-1a
+		static uint64_t hash(const void* iData, size_t iSize)
+		{
+			const uint8_t* lData = (const uint8_t*)iData;
+			uint64_t lHash = 14695981039346656037ULL;
+			for (size_t i = 0; i < iSize; i++)
+			{
+				lHash = (lHash ^ lData[i]) * 1099511628211ULL;
+			}
+			return lHash;
+		}
+
+	protected:
+
+		std::string mRoot;
+		bool mRecord;
+
+		boost::mutex mLock;
+		std::set<std::string> mDirectories;
+		std::map<std::string, uint64_t> mHashes;
+
+		void record(const std::string& iPath, uint64_t iHash)
+		{
+			if (!mRecord)
+			{
+				return;
+			}
+			boost::lock_guard<boost::mutex> lLock(mLock);
+			mHashes[iPath] = iHash;
+		}
+};
+
+#endif